@@ -16,9 +16,12 @@ typedef struct ht_node_s {
     struct ht_node_s *next;
 } ht_node_t;
 
+struct bloom_s;
+
 typedef struct {
     ht_node_t **tbl;
     int32_t size;
+    struct bloom_s *bloom;
 } hash_table_t;
 
 hash_table_t *ht_create(int32_t size);
@@ -26,6 +29,10 @@ int32_t ht_push(hash_table_t *ht, char *key, void *val);
 void ht_destroy(hash_table_t *ht);
 void ht_erase(hash_table_t *ht, char *key);
 void *ht_get(hash_table_t *ht, char *key);
+// Puts a Bloom filter in front of the table, or builds its filter again, from the keys it holds
+// now, at twice their number.  ht_get then turns most misses away without walking a chain, and
+// ht_push keeps the filter up to date.  Erased keys keep their bits until the next ht_bloom.
+int32_t ht_bloom(hash_table_t *ht);
 
 // ****************************************************
 // *                   Linked List                    *
@@ -90,6 +97,8 @@ char *list_get_last_err();
 // *                        BST                       *
 // ****************************************************
 //
+// Every index has its own key type.  Keys are passed by address, so a BST_KPSTR key is a
+// char **, and the index keeps the char * itself rather than a copy of the string.
 #define BST_KPSTR    (1 << 0)
 #define BST_KINT8    (1 << 1)
 #define BST_KINT16   (1 << 2)
@@ -101,8 +110,79 @@ char *list_get_last_err();
 #define BST_KUINT64  (1 << 8)
 #define BST_KINT128  (1 << 9)
 #define BST_KTME     (1 << 10)
+// A BST_KCOMP key is a record compared field by field, in the order given to bst_set_key_fields.
+// Like a BST_KPSTR key it's passed by address, as a pointer to a pointer to the record (or to a
+// struct laid out like it with the key fields filled in), and the index keeps that pointer, so
+// the record has to outlive its node.  bst_insert_record and friends need no key extractor for
+// it.  AVL indexes only.
+#define BST_KCOMP    (1 << 11)
+
+// Tree options, passed to bst_create along with the key type of the primary index.
+// BST_ARENA gives the tree a private node arena that bst_destroy releases a chunk at a time.
+// An arena tree does not take ownership of its data: if none of its indexes has a free_fn,
+// bst_destroy drops the arena without visiting a single node.
+#define BST_ARENA    (1 << 16)
+
+// Index options, passed to bst_create or bst_add_idx along with the index's key type.
+// BST_OSTAT keeps subtree sizes so the index can answer bst_rank, bst_select and
+// bst_count_range in O(log n).
+#define BST_OSTAT    (1 << 17)
+// BST_COMPACT keeps the index's nodes in a slab of its own, linked by 32 bit slab index, with
+// each key stored at its natural size: 24 byte nodes for BST_KINT32 keys.  Compact indexes
+// support fetch, insert, delete and iterate only, and can't be combined with BST_OSTAT.
+#define BST_COMPACT  (1 << 18)
+// BST_BTREE backs the index with a B+tree instead of an AVL tree: fewer, wider nodes and leaves
+// linked in key order, for large indexes and long scans.  B+tree indexes support fetch, insert,
+// delete, iterate and bst_range, and can't be combined with BST_OSTAT or BST_COMPACT.
+#define BST_BTREE    (1 << 19)
+// BST_HASH keeps the index in a hash table, for indexes only ever used for exact lookups: O(1)
+// fetch, insert and delete, and bst_iterate in no particular order.  Like the two above it
+// can't be combined with BST_OSTAT or another index kind.
+#define BST_HASH     (1 << 20)
+// BST_RCU lets bst_fetch run without taking the index lock.  Writers copy the nodes they change
+// instead of changing them and swap in the new root atomically; the nodes they replace go back
+// to the pool once no reader can still be on them.  bst_iterate walks a snapshot instead of
+// locking, other readers and all writers still lock.  AVL indexes only, and they can't be
+// frozen.
+#define BST_RCU      (1 << 21)
+// BST_SHARDED splits the index into key ranges, each its own AVL tree with its own lock, so that
+// writers into different ranges run in parallel.  Ranges split online as they fill up, or can be
+// laid out up front from a sample with bst_set_shard_bounds.  Sharded indexes support fetch,
+// insert, delete, iterate and bst_range, and can't be combined with another index kind,
+// BST_OSTAT or BST_RCU.
+#define BST_SHARDED  (1 << 22)
+// BST_MULTI lets the index hold any number of records under the same key.  The first one lives
+// in the key's node like any other and the rest in an array next to it, so repeated keys don't
+// grow the tree.  bst_fetch and cursors see the first record of a key, bst_fetch_all all of them
+// in the order they were inserted, and bst_iterate and bst_range visit every one.  bst_delete
+// takes the first record of a key, bst_delete_value a given one.  AVL indexes only, and they
+// can't be combined with BST_OSTAT or BST_RCU.
+#define BST_MULTI    (1 << 23)
+// BST_INTERN makes a BST_KPSTR index keep each key as the process's one copy of the string,
+// made by bst_intern, rather than as the caller's pointer.  The caller's string can go as soon as
+// the insert returns, and a needle that came from bst_intern matches its node by pointer.
+// Interned strings live until bst_fini, so this is for keys from a bounded set: host names,
+// users, event types.  AVL indexes only.
+#define BST_INTERN   (1 << 24)
+// BST_ART backs the index with an adaptive radix tree, which walks a key a byte at a time rather
+// than comparing whole keys: fetch costs the key's length, not log n string compares, and keys
+// with long shared prefixes cost no more than short ones.  ART indexes take BST_KPSTR,
+// BST_KUINT32, BST_KUINT64 or BST_KINT128 keys and support fetch, insert, delete, iterate in
+// key order and bst_prefix_range, and integer ones hold networks for bst_longest_prefix too.
+// BST_KINT128 keys are ordered as unsigned, like IPv6 addresses.  They can't be combined with
+// another index kind, BST_OSTAT or BST_RCU.
+#define BST_ART      (1 << 25)
+// BST_BLOOM puts a Bloom filter in front of an AVL index, so most bst_fetch calls for keys the
+// index doesn't hold return without descending it.  The filter grows itself as inserts outrun
+// it, but deleted keys keep their bits, so an index that sees a lot of deletes wants a
+// bst_bloom_rebuild now and then.  Not for BST_KCOMP indexes.
+#define BST_BLOOM    (1 << 26)
 
 #define BST_MAX_IDX 16
+#define BST_MAX_FIELDS 8
+
+// No AVL tree that fits in memory is anywhere near this tall
+#define BST_MAX_HEIGHT 64
 
 #define BST_CB_OK 0
 #define BST_CB_ABORT 1
@@ -110,15 +190,36 @@ char *list_get_last_err();
 #define BST_CB_DELETE_AND_ABORT 3
 
 struct bst_node_s;
+struct bst_pool_s;
+struct bst_ops_s;
+struct bst_slab_s;
+struct bst_frozen_s;
+struct bst_btree_s;
+struct bst_hash_s;
+struct bst_shards_s;
+struct bst_comp_s;
+struct bst_art_s;
+struct bst_epoch_rec_s;
 union bst_key_u;
 
-// This callback will be called on each node by bst_destroy.  Free any memory that you have
-// allocated here.  If this param is NULL when bst_create is called, bst destroy will call
-// free on your data stucture for you as a courtesy.
+// This callback will be called with each node's data by bst_destroy.  Free any memory that you
+// have allocated here.  If this param is NULL when bst_create is called, bst destroy will call
+// free on your data stucture for you as a courtesy.  Only the primary index gets that courtesy;
+// pass NULL to bst_add_idx unless a secondary index really owns something.
 typedef void (*bst_free_t)(void *, void*);
 typedef void (*bst_key_cpy_t)(union bst_key_u *, union bst_key_u *);
-typedef int32_t (*bst_key_cmp_t)(union bst_key_u *, union bst_key_u *);
+// Comparators take the index's context after the two keys, a BST_KCOMP index's fields
+typedef int32_t (*bst_key_cmp_t)(union bst_key_u *, union bst_key_u *, void *);
+typedef uint64_t (*bst_key_hash_t)(union bst_key_u *);
 typedef int32_t (*bst_iterate_t)(void *, void *);
+// Returns a pointer to an index's key inside a record, in the same form bst_insert expects
+typedef void *(*bst_key_fn_t)(void *);
+
+// One field of a BST_KCOMP key: its key type, any but BST_KCOMP, and where it sits in the record
+typedef struct {
+    int64_t type;
+    int64_t offset;
+} bst_field_t;
 
 typedef struct {
     uint8_t idx_count;
@@ -126,22 +227,246 @@ typedef struct {
     char *name;
     struct bst_node_s *root[BST_MAX_IDX];
     bst_free_t free_fn[BST_MAX_IDX];
-    bst_key_cpy_t key_cpy_fn;
-    bst_key_cmp_t key_cmp_fn;
+    int64_t key_off[BST_MAX_IDX];
+    bst_key_fn_t key_fn[BST_MAX_IDX];
+    bst_key_cpy_t key_cpy_fn[BST_MAX_IDX];
+    bst_key_cmp_t key_cmp_fn[BST_MAX_IDX];
+    bst_key_hash_t key_hash_fn[BST_MAX_IDX];
+    const struct bst_ops_s *ops[BST_MAX_IDX];
+    struct bst_pool_s *arena;
+    struct bst_slab_s *slab[BST_MAX_IDX];
+    struct bst_frozen_s *frozen[BST_MAX_IDX];
+    struct bst_btree_s *btree[BST_MAX_IDX];
+    struct bst_hash_s *hash[BST_MAX_IDX];
+    struct bst_shards_s *shards[BST_MAX_IDX];
+    struct bst_comp_s *comp[BST_MAX_IDX];
+    struct bst_art_s *art[BST_MAX_IDX];
+    struct bloom_s *bloom[BST_MAX_IDX];
     pthread_rwlock_t mutex[BST_MAX_IDX];
 } bst_tree_t;
 
+// A cursor holds its index's read lock from bst_cursor_open until bst_cursor_close.  next and
+// prev on a freshly opened cursor start from the first and last node respectively, and return
+// NULL once they step off either end.
+typedef struct {
+    bst_tree_t *tree;
+    int32_t idx;
+    int32_t depth;
+    struct bst_node_s *stack[BST_MAX_HEIGHT];
+} bst_cursor_t;
+
+// A snapshot is a view of a BST_RCU index as it stood when bst_snapshot took it.  It takes no
+// locks and holds up no writer, but nothing the index drops after it was taken goes back to the
+// pool before bst_snapshot_release, so release it as soon as it's done with, and always before
+// the tree is destroyed.  Records deleted from the index after the snapshot must stay valid
+// until then too.
+typedef struct {
+    bst_tree_t *tree;
+    int32_t idx;
+    struct bst_node_s *root;
+    struct bst_epoch_rec_s *pin;
+} bst_snapshot_t;
+
 int32_t bst_init();
 int32_t bst_fini();
 int32_t bst_add_idx(bst_tree_t *tree, bst_free_t free_fn, int64_t flags);
 int32_t bst_insert(bst_tree_t *tree, int32_t idx, void *key, void *data);
+// Key extractors let bst_insert_record and bst_delete_record find each index's key in a record,
+// either at a fixed offset or through a callback.  Every index needs one.
+int32_t bst_set_key_offset(bst_tree_t *tree, int32_t idx, int64_t offset);
+int32_t bst_set_key_fn(bst_tree_t *tree, int32_t idx, bst_key_fn_t key_fn);
+// Gives an empty BST_KCOMP index its fields, most significant first.  Call it before the index
+// is used; until then inserts into it fail.
+int32_t bst_set_key_fields(bst_tree_t *tree, int32_t idx, bst_field_t *fields, int32_t count);
+// Adds a record to every index, or to none of them if any index already holds its key
+int32_t bst_insert_record(bst_tree_t *tree, void *data);
+// Removes a record from every index, or from none of them if any index doesn't hold it
+int32_t bst_delete_record(bst_tree_t *tree, void *data);
+// Builds an empty index out of n key/data pairs in O(n), all nodes in one allocation.  The keys
+// must be in ascending order unless sort is set.
+int32_t bst_bulk_load(bst_tree_t *tree, int32_t idx, void **keys, void **data, int64_t n,
+        int32_t sort);
+// Inserts n key/data pairs in any order under one acquisition of the index lock, and returns how
+// many were added.  Keys the index already holds are skipped like bst_insert does, and only one
+// record per key in the batch makes it in, unless the index is BST_MULTI.
+int64_t bst_insert_batch(bst_tree_t *tree, int32_t idx, void **keys, void **data, int64_t n);
+// Compiles an index into a read-only copy laid out for lookups, which bst_fetch then searches
+// instead of the tree.  The first insert or delete that changes the index drops the copy again;
+// freeze it once more after a batch of writes.  Only AVL indexes can be frozen.
+int32_t bst_freeze(bst_tree_t *tree, int32_t idx);
+void bst_thaw(bst_tree_t *tree, int32_t idx);
+// Lays out the ranges of an empty BST_SHARDED index at evenly spaced keys of a sample of n keys
+// expected to look like the ones that will be inserted
+int32_t bst_set_shard_bounds(bst_tree_t *tree, int32_t idx, void **sample, int64_t n);
 int32_t bst_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data);
+// Calls iter_fn on every node with lo <= key <= hi, in order.  A NULL lo or hi is unbounded.
+int32_t bst_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi, bst_iterate_t iter_fn,
+        void *fn_data);
+// Calls iter_fn, in order, on every record of a BST_KCOMP index whose first count fields equal
+// key's.  The rest of key's fields are ignored.  On a BST_ART index count is the length of the
+// prefix instead: bytes of a string key, bits of an integer one.
+int32_t bst_prefix_range(bst_tree_t *tree, int32_t idx, void *key, int32_t count,
+        bst_iterate_t iter_fn, void *fn_data);
+// Networks in an integer BST_ART index: key's first bits bits, the rest cleared.  A network is
+// a key of its own, so 10.0.0.0/8 and 10.0.0.0/16 are two entries and neither is the address
+// 10.0.0.0 that bst_insert would add.
+int32_t bst_insert_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits, void *data);
+void *bst_delete_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits);
+// The data of the longest network holding key, with its length in *bits if bits isn't NULL
+void *bst_longest_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t *bits);
+bst_snapshot_t *bst_snapshot(bst_tree_t *tree, int32_t idx);
+void *bst_snapshot_fetch(bst_snapshot_t *snap, void *key);
+int32_t bst_snapshot_iterate(bst_snapshot_t *snap, bst_iterate_t iter_fn, void *fn_data);
+int32_t bst_snapshot_range(bst_snapshot_t *snap, void *lo, void *hi, bst_iterate_t iter_fn,
+        void *fn_data);
+void bst_snapshot_release(bst_snapshot_t *snap);
+int32_t bst_cursor_open(bst_cursor_t *cur, bst_tree_t *tree, int32_t idx);
+void bst_cursor_close(bst_cursor_t *cur);
 bst_tree_t *bst_create(char *tree_name, bst_free_t free_fn, int64_t flags);
 bst_tree_t *bst_find_by_name(char *name);
 void *bst_fetch(bst_tree_t *tree, int32_t idx, void *key);
-void *bst_delete(bst_tree_t *tree, int32_t idx, void *key); 
+// Builds a BST_BLOOM index's filter again from the keys it holds now, clearing the bits of the
+// keys deleted since, at twice their number
+int32_t bst_bloom_rebuild(bst_tree_t *tree, int32_t idx);
+// Looks up n keys at once, setting out[i] to the data for keys[i] or NULL, and returns how many
+// were found.  The index is locked once for the whole batch, and on AVL indexes the descents
+// are interleaved so that their cache misses overlap.  A BST_BLOOM index's filter turns keys
+// away first, as it does for bst_fetch.
+int64_t bst_fetch_many(bst_tree_t *tree, int32_t idx, void **keys, int64_t n, void **out);
+// Copies up to max of the records under key into out and returns how many there are in all, so
+// a return larger than max means out was too small
+int64_t bst_fetch_all(bst_tree_t *tree, int32_t idx, void *key, void **out, int64_t max);
+// Data of the first node with a key >= key (lower) or > key (upper), NULL if there isn't one
+void *bst_lower_bound(bst_tree_t *tree, int32_t idx, void *key);
+void *bst_upper_bound(bst_tree_t *tree, int32_t idx, void *key);
+// Positions the cursor on the first node with a key >= key and returns its data
+void *bst_cursor_seek(bst_cursor_t *cur, void *key);
+void *bst_cursor_next(bst_cursor_t *cur);
+void *bst_cursor_prev(bst_cursor_t *cur);
+// Order statistics, BST_OSTAT indexes only.  bst_rank counts the keys < key, bst_select returns
+// the data of the k'th smallest key counting from 0, and bst_count_range counts the keys in
+// [lo, hi] where a NULL bound is unbounded.  The counts are -1 on error.
+int64_t bst_rank(bst_tree_t *tree, int32_t idx, void *key);
+void *bst_select(bst_tree_t *tree, int32_t idx, int64_t k);
+int64_t bst_count_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi);
+// Removes key from one index and returns its data, which is not freed
+void *bst_delete(bst_tree_t *tree, int32_t idx, void *key);
+// Removes the record data from under key, for BST_MULTI indexes where the key alone doesn't say
+// which.  Returns data, or NULL if the index doesn't hold it under key.
+void *bst_delete_value(bst_tree_t *tree, int32_t idx, void *key, void *data);
+// Drops every record with a key < key from an AVL index in O(log n) plus the records dropped,
+// for sliding windows over BST_KTME keys.  The records also leave the tree's other indexes,
+// which need key extractors for that, and free_fn, if given, is called on each one.  Returns how
+// many records were dropped, or -1 on error.
+int64_t bst_expire_before(bst_tree_t *tree, int32_t idx, void *key, bst_free_t free_fn,
+        void *fn_data);
 void bst_destroy(bst_tree_t *tree, void *fn_data);
 void bst_print_tree(bst_tree_t *tree, int32_t idx, int32_t compact);
+// Returns the process's copy of str, making one the first time it's seen, or NULL if there's
+// no memory for it.  Equal strings always come back as the same pointer.
+char *bst_intern(char *str);
 char *bst_get_last_err();
 
+// ****************************************************
+// *                    Skip list                     *
+// ****************************************************
+
+// An ordered map that any number of threads can insert into, delete from and read at the same
+// time without locks.  Keys are any one of the BST_K* types but BST_KCOMP, compared the way a
+// bst index compares them, and string keys point at the caller's string like they do there.
+// Nodes come from the bst node pool, so every skip list has to be destroyed before bst_fini.
+// Errors are reported through bst_get_last_err.
+struct sl_s;
+typedef struct sl_s sl_t;
+
+// free_fn is called on each record by sl_destroy, which frees them itself if it's NULL
+sl_t *sl_create(bst_free_t free_fn, int64_t flags);
+// Returns 0 once key is in, 1 if it already was, in which case data wasn't added, -1 on error
+int32_t sl_insert(sl_t *sl, void *key, void *data);
+void *sl_fetch(sl_t *sl, void *key);
+// Removes key and returns its data, which is not freed
+void *sl_delete(sl_t *sl, void *key);
+// Calls iter_fn on every record with lo <= key <= hi, in order.  A NULL lo or hi is unbounded.
+// Keys inserted or deleted while it runs may or may not be seen.
+int32_t sl_range(sl_t *sl, void *lo, void *hi, bst_iterate_t iter_fn, void *fn_data);
+// Nothing else can be using the list
+void sl_destroy(sl_t *sl, void *fn_data);
+
+
+// ****************************************************
+// *                  Priority queue                  *
+// ****************************************************
+
+// A min-heap of records, ordered by a key of any one of the BST_K* types but BST_KCOMP and
+// compared the way a bst index compares them.  String keys point at the caller's string.  Each
+// push returns a handle, which is good until its record is popped or removed and can be used to
+// move the record up the queue or take it out of it.  Records with equal keys come out in no
+// particular order.  Errors are reported through bst_get_last_err.
+struct pq_s;
+typedef struct pq_s pq_t;
+
+// free_fn is called on each record left by pq_destroy, which frees them itself if it's NULL
+pq_t *pq_create(bst_free_t free_fn, int64_t flags);
+// Returns the record's handle, or -1 on error
+int64_t pq_push(pq_t *pq, void *key, void *data);
+// The record with the smallest key, which pq_pop also takes out.  If key isn't NULL, the record's
+// key is copied to it.  NULL when the queue is empty.
+void *pq_peek(pq_t *pq, void *key);
+void *pq_pop(pq_t *pq, void *key);
+// Gives a record a key no larger than the one it has
+int32_t pq_decrease_key(pq_t *pq, int64_t handle, void *key);
+// Takes a record out and returns it, or NULL if the handle is no longer in the queue
+void *pq_remove(pq_t *pq, int64_t handle);
+int64_t pq_size(pq_t *pq);
+void pq_destroy(pq_t *pq, void *fn_data);
+
+// ****************************************************
+// *                   Timer wheel                    *
+// ****************************************************
+
+// Timers with struct timeval deadlines, as in BST_KTME keys.  Adding and cancelling are O(1),
+// and timers fire in deadline order.  A timer is only good until it fires or is cancelled.
+struct tw_s;
+typedef struct tw_s tw_t;
+typedef struct tw_timer_s tw_timer_t;
+typedef void (*tw_expire_t)(void *data, void *fn_data);
+
+// tick_us is the wheel's resolution.  It doesn't change when timers fire, only how much work
+// finding them takes; a tick near the usual gap between tw_advance calls works best.
+tw_t *tw_create(bst_free_t free_fn, uint32_t tick_us);
+tw_timer_t *tw_add(tw_t *tw, struct timeval *deadline, void *data);
+// Returns the timer's data, which is not freed
+void *tw_cancel(tw_t *tw, tw_timer_t *timer);
+// Fires every timer with a deadline at or before now by calling expire_fn on its data, and
+// returns how many fired
+int64_t tw_advance(tw_t *tw, struct timeval *now, tw_expire_t expire_fn, void *fn_data);
+// Sets when to a time no later than the first deadline, for a poll timeout.  -1 if there are
+// no timers.
+int32_t tw_next(tw_t *tw, struct timeval *when);
+// free_fn, or free, is called on the data of every timer left
+void tw_destroy(tw_t *tw, void *fn_data);
+
+
+// ****************************************************
+// *                   Bloom filter                   *
+// ****************************************************
+
+// A blocked Bloom filter of 64-bit hashes, which needn't be well mixed.  All of a key's bits
+// sit in one 64-byte block, so adding or checking it touches one cache line.  Up to the capacity
+// it was made for, under 1% of the hashes never added get through; past it more do.  Bits can't
+// be cleared, so a filter whose keys come and go is rebuilt now and then.  One thread at a time
+// can add, while any number check.
+typedef struct bloom_s bloom_t;
+
+bloom_t *bloom_create(uint64_t capacity);
+void bloom_add(bloom_t *bf, uint64_t hash);
+// 0 if hash was never added, 1 if it may have been
+int32_t bloom_check(bloom_t *bf, uint64_t hash);
+// Whether more hashes have gone in than it was made for
+int32_t bloom_full(bloom_t *bf);
+// Lets a full filter take as many hashes again before bloom_full says so, for one that can't
+// be replaced yet
+void bloom_backoff(bloom_t *bf);
+void bloom_destroy(bloom_t *bf);
+
 #endif
@@ -4,9 +4,12 @@
 #include <stdint.h>
 #include <malloc.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "al_data_struct.h"
 
+#define HT_BLOOM_MIN 1024
+
 static uint64_t
 _hash(char *key) {
     int8_t c;
@@ -30,6 +33,7 @@ ht_create(int32_t size) {
         return NULL;
 
     ht->size = _p2(size);    
+    ht->bloom = NULL;
 
     if ((ht->tbl = calloc(1, ht->size * sizeof(ht_node_t *))) == NULL)
         return NULL;
@@ -56,6 +60,7 @@ ht_destroy(hash_table_t *ht) {
         }
     }
 
+    bloom_destroy(ht->bloom);
     free(ht->tbl);
     free(ht);
 
@@ -67,8 +72,14 @@ ht_get(hash_table_t *ht, char *key) {
     if (!ht)
         return NULL;
     
-    uint64_t idx = _hash(key) & (ht->size - 1);
-    ht_node_t *n = ht->tbl[idx];
+    uint64_t hash = _hash(key);
+    ht_node_t *n;
+
+    // Most keys that were never pushed stop here, without touching the table
+    if (ht->bloom && !bloom_check(ht->bloom, hash))
+        return NULL;
+
+    n = ht->tbl[hash & (ht->size - 1)];
     while (n) {
         if (strncmp(key, n->key, HT_MAX_KEYLEN) == 0)
             return n->val;
@@ -83,14 +94,14 @@ ht_push(hash_table_t *ht, char *key, void *val) {
     if (!ht)
         return -1;
 
-    uint64_t idx = _hash(key) & (ht->size - 1);
+    uint64_t hash = _hash(key), idx = hash & (ht->size - 1);
     ht_node_t *new_n;
 
     if ((new_n = calloc(1, sizeof(ht_node_t))) == NULL)
         return -1;
 
     new_n->val = val;
-    if ((new_n->key = calloc(1, strnlen(key, HT_MAX_KEYLEN + 1))) == NULL)
+    if ((new_n->key = calloc(1, strnlen(key, HT_MAX_KEYLEN + 1) + 1)) == NULL)
         return -1;
 
     strcpy(new_n->key, key);
@@ -98,6 +109,47 @@ ht_push(hash_table_t *ht, char *key, void *val) {
     new_n->next = ht->tbl[idx];
     ht->tbl[idx] = new_n;
 
+    // A filter that's taken in more keys than it was sized for is built again, twice the size,
+    // which takes in this one too.  If that can't be done the old one will have to do, and it
+    // takes as many keys again before the next try rather than one rebuild per push.
+    if (!ht->bloom)
+        return 0;
+
+    if (bloom_full(ht->bloom)) {
+        if (ht_bloom(ht) == 0)
+            return 0;
+        bloom_backoff(ht->bloom);
+    }
+    bloom_add(ht->bloom, hash);
+
+    return 0;
+}
+
+int32_t
+ht_bloom(hash_table_t *ht) {
+    bloom_t *bloom;
+    ht_node_t *n;
+    uint64_t count = 0;
+
+    if (!ht)
+        return -1;
+
+    for (int32_t i = 0; i < ht->size; i++) {
+        for (n = ht->tbl[i]; n; n = n->next)
+            count++;
+    }
+
+    if ((bloom = bloom_create(MAX(count * 2, HT_BLOOM_MIN))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < ht->size; i++) {
+        for (n = ht->tbl[i]; n; n = n->next)
+            bloom_add(bloom, _hash(n->key));
+    }
+
+    bloom_destroy(ht->bloom);
+    ht->bloom = bloom;
+
     return 0;
 }
 
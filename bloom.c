@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// A split block Bloom filter, as in Parquet's, with 64-byte blocks of eight 64-bit words.  The
+// high half of a key's hash picks its block and the low half sets one bit in each word, each
+// word's bit picked by multiplying by its own odd constant.  So adding or checking a key costs one
+// cache line, where a classic filter's k bits land on k different lines.  Sized at 12 to 24 bits
+// per key, false positives stay under about 1% up to the capacity.
+//
+// Adds are plain loads and stores rather than atomic ORs: whoever adds is already holding off
+// every other adder, and relaxed accesses are enough for checks that run alongside.
+
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BITS_PER_KEY 12
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+
+struct bloom_s {
+    uint64_t (*blocks)[BLOOM_BLOCK_WORDS];
+    uint64_t mask;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+static const uint32_t bloom_salt[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// Fills in the key's bit in each word and returns its block
+static inline uint64_t *
+bloom_block(bloom_t *bf, uint64_t hash, uint64_t *bits) {
+    hash = bst_hash_mix(hash);
+
+    for (int32_t i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        bits[i] = 1ULL << (((uint32_t)hash * bloom_salt[i]) >> 26);
+
+    return bf->blocks[(hash >> 32) & bf->mask];
+}
+
+bloom_t *
+bloom_create(uint64_t capacity) {
+    uint64_t blocks = 1;
+    bloom_t *bf;
+
+    while (blocks * BLOOM_BLOCK_BITS < capacity * BLOOM_BITS_PER_KEY)
+        blocks *= 2;
+
+    if ((bf = calloc(1, sizeof(bloom_t))) == NULL ||
+            (bf->blocks = aligned_alloc(64, blocks * BLOOM_BLOCK_BITS / 8)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for a Bloom filter of "
+                "%lu keys", __FUNCTION__, capacity);
+        free(bf);
+        return NULL;
+    }
+
+    memset(bf->blocks, 0, blocks * BLOOM_BLOCK_BITS / 8);
+    bf->mask = blocks - 1;
+    bf->capacity = capacity;
+
+    return bf;
+}
+
+void
+bloom_add(bloom_t *bf, uint64_t hash) {
+    uint64_t bits[BLOOM_BLOCK_WORDS], *block = bloom_block(bf, hash, bits);
+
+    for (int32_t i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        __atomic_store_n(&block[i], __atomic_load_n(&block[i], __ATOMIC_RELAXED) | bits[i],
+                __ATOMIC_RELAXED);
+    }
+    bf->count++;
+}
+
+int32_t
+bloom_check(bloom_t *bf, uint64_t hash) {
+    uint64_t bits[BLOOM_BLOCK_WORDS], *block = bloom_block(bf, hash, bits), missing = 0;
+
+    for (int32_t i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        missing |= bits[i] & ~__atomic_load_n(&block[i], __ATOMIC_RELAXED);
+
+    return (missing == 0);
+}
+
+int32_t
+bloom_full(bloom_t *bf) {
+    return (bf->count > bf->capacity);
+}
+
+void
+bloom_backoff(bloom_t *bf) {
+    bf->capacity = bf->count * 2;
+}
+
+void
+bloom_destroy(bloom_t *bf) {
+    if (!bf)
+        return;
+
+    free(bf->blocks);
+    free(bf);
+}
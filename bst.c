@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -7,113 +8,240 @@
 #include <sys/param.h>
 
 #include "al_data_struct.h"
+#include "bst_internal.h"
 
 // Defines
 #define BST_NODE_POOL_SZ 1024000
-#define MAX_ERR_LEN 2048
+#define BST_ARENA_CHUNK_SZ 4096
+#define BST_NODE_CACHE_SZ 64
+#define BST_FETCH_LANES 16
+#define BST_FETCH_CHUNK 256
+#define BST_BLOOM_MIN 1024
 
 const int64_t BST_KEYS = BST_KPSTR | BST_KINT8 | BST_KINT16 | BST_KINT32 | BST_KINT64 | 
-    BST_KUINT8 | BST_KUINT16 | BST_KUINT32 | BST_KUINT64 | BST_KINT128 | BST_KTME;
-
-#define BST_EQUAL 0
-#define BST_RIGHT_GT -1
-#define BST_LEFT_GT 1
+    BST_KUINT8 | BST_KUINT16 | BST_KUINT32 | BST_KUINT64 | BST_KINT128 | BST_KTME | BST_KCOMP;
 
 #define bst_get_height(x) (x != NULL ? x->height : 0)
+#define bst_get_size(x) (x != NULL ? x->size : 0)
+
+// A BST_MULTI node holds its first record in data and the rest in dups, in the order they came
+// in.  Record r of a node counts across both.
+#define bst_node_records(x) ((x)->dups ? (x)->dups->count + 1 : 1)
+#define bst_node_record(x, r) ((r) ? (x)->dups->data[(r) - 1] : (x)->data)
+#define BST_DUPS_INIT_SZ 4
+
+// Subtree sizes ride along with heights everywhere a node's children change.  They're only
+// kept exact along insert paths of BST_OSTAT and BST_SHARDED indexes, but they cost nothing to
+// recompute here.
+#define bst_update_node(x) do {                                                     \
+    (x)->height = MAX(bst_get_height((x)->left), bst_get_height((x)->right)) + 1;   \
+    (x)->size = bst_get_size((x)->left) + bst_get_size((x)->right) + 1;             \
+} while (0)
 
-#ifndef NO_LOCKS 
-#define bst_new_node(node) do {                         \
-    if (!bst_node_list)                                 \
-        bst_create_node_pool();                         \
-    pthread_rwlock_wrlock(&node_list_mutex);            \
-    node = bst_node_list;                               \
-    bst_node_list = bst_node_list->right;               \
-    node->right = NULL;                                 \
-    pthread_rwlock_unlock(&node_list_mutex);            \
+// Pools are shared by every tree, so they're always locked, even in NO_LOCKS builds where the
+// caller serializes access to each tree.  Threads take global pool nodes a batch at a time into
+// a private cache so that inserts into different indexes don't meet on the pool lock.
+#define bst_pool_lock(pool) pthread_rwlock_wrlock(&(pool)->mutex)
+#define bst_pool_unlock(pool) pthread_rwlock_unlock(&(pool)->mutex)
+
+// Compares two keys the way an index orders them, with the index's context, see bst_key_cmp_t
+#define bst_cmp(tree, idx, a, b) (tree)->key_cmp_fn[idx]((a), (b), (tree)->comp[idx])
+
+// Nodes come from the tree's private arena if it has one, otherwise from the global pool
+#define bst_tree_pool(tree) ((tree)->arena ? (tree)->arena : &node_pool)
+
+#define bst_new_node(pool, node) do {                   \
+    if ((pool) == &node_pool && node_cache) {           \
+        node = node_cache;                              \
+        node_cache = node->right;                       \
+    }                                                   \
+    else                                                \
+        node = bst_pool_get(pool);                      \
+    if (node)                                           \
+        node->right = NULL;                             \
  } while (0)
-#else
-#define bst_new_node(node) do {                         \
-    if (!bst_node_list)                                 \
-        bst_create_node_pool();                         \
-    node = bst_node_list;                               \
-    bst_node_list = bst_node_list->right;               \
-    node->right = NULL;                                 \
- } while (0)
-#endif
 
-#ifndef NO_LOCKS
-#define bst_free_node(node) do {                        \
-    pthread_rwlock_wrlock(&node_list_mutex);            \
-    node->right = bst_node_list;                        \
-    node->left = NULL;                                  \
-    node->height = 1;                                   \
-    bst_node_list = node;                               \
-    pthread_rwlock_unlock(&node_list_mutex);            \
-} while (0)
-#else
-#define bst_free_node(node) do {                        \
-    node->right = bst_node_list;                        \
+#define bst_free_node(pool, node) do {                  \
+    bst_pool_lock(pool);                                \
+    node->right = (pool)->free_list;                    \
     node->left = NULL;                                  \
     node->height = 1;                                   \
-    bst_node_list = node;                               \
+    (pool)->free_list = node;                           \
+    bst_pool_unlock(pool);                              \
 } while (0)
-#endif
 
-typedef union bst_key_u {
-    char *pstr;
-    int8_t i8;
-    int16_t i16;
-    int32_t i32;
-    int64_t i64;
-    uint8_t u8;
-    uint16_t u16;
-    uint32_t u32;
-    uint64_t u64;
-    __int128_t i128;
-    struct timeval tv;
-} bst_key_t;
+// The records past the first of a key in a BST_MULTI index.  The pointer to them sits in what
+// would otherwise be padding before the key, so it costs other nodes nothing.
+typedef struct bst_dups_s {
+    uint32_t count;
+    uint32_t cap;
+    void *data[];
+} bst_dups_t;
 
 typedef struct bst_node_s {
     struct bst_node_s *left;
     struct bst_node_s *right;
     int8_t height;
+    uint32_t size;
+    bst_dups_t *dups;
     bst_key_t key;
     void *data;
 } bst_node_t;
 
+_Static_assert(sizeof(bst_node_t) == BST_POOL_NODE_SZ, "bst_node_t must be a pool node");
+
+// Nodes are carved out of large chunks, so a pool (or a tree's arena) can be released with one
+// free() per chunk instead of one per node.
+typedef struct bst_chunk_s {
+    struct bst_chunk_s *next;
+    uint32_t used;
+    uint32_t count;
+    bst_node_t nodes[];
+} bst_chunk_t;
+
+typedef struct bst_pool_s {
+    bst_node_t *free_list;
+    bst_chunk_t *chunks;
+    uint32_t chunk_sz;
+    pthread_rwlock_t mutex;
+} bst_pool_t;
+
+// A key and its record, as handed to bst_bulk_load, and where in the input they came
+typedef struct {
+    void *key;
+    void *data;
+    uint32_t pos;
+} bst_pair_t;
+
+// An index, for callbacks that only get one pointer, such as qsort_r's comparator
+typedef struct {
+    bst_tree_t *tree;
+    int32_t idx;
+} bst_tree_idx_t;
+
+// A run of nodes linked through their right pointers, handed back to a pool in one go
+typedef struct {
+    bst_node_t *head;
+    bst_node_t *tail;
+} bst_chain_t;
+
+#define BST_REGISTRY_INIT_SZ 64
+
+typedef struct bst_reg_entry_s {
+    struct bst_reg_entry_s *next;
+    uint64_t hash;
+    bst_tree_t *tree;
+    char name[];
+} bst_reg_entry_t;
+
+typedef struct {
+    uint64_t mask;
+    uint64_t count;
+    bst_reg_entry_t *buckets[];
+} bst_registry_t;
+
 // Globals
-bst_node_t *bst_node_list;
-pthread_rwlock_t node_list_mutex = PTHREAD_RWLOCK_INITIALIZER;
+bst_pool_t node_pool = { NULL, NULL, BST_NODE_POOL_SZ, PTHREAD_RWLOCK_INITIALIZER };
 char err_str[MAX_ERR_LEN];
 list_t *tree_list = NULL;
-
-static int32_t bst_create_node_pool();
+static __thread bst_node_t *node_cache = NULL;
+static pthread_key_t node_cache_key;
+static pthread_once_t node_cache_once = PTHREAD_ONCE_INIT;
+static bst_registry_t *registry = NULL;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bst_node_t *bst_pool_carve(bst_pool_t *pool);
+static bst_node_t *bst_pool_get(bst_pool_t *pool);
+static bst_node_t *bst_pool_get_n(bst_pool_t *pool, uint32_t n);
+static bst_pool_t *bst_pool_create(uint32_t chunk_sz);
+static void bst_pool_destroy(bst_pool_t *pool);
 static bst_node_t *bst_right_rotate(bst_node_t *y);
 static bst_node_t *bst_left_rotate(bst_node_t *x);
-static void bst_delete_data(bst_node_t *node, bst_free_t free_fn, void *fn_data);
-static void bst_set_key_fn_ptrs(bst_tree_t *tree, int64_t flags);
-static void bst_free_node_pool();
+static bst_node_t *bst_rebalance(bst_node_t *node);
+static void bst_delete_data(bst_node_t *node, bst_free_t free_fn, void *fn_data, int32_t owner,
+        bst_chain_t *chain);
+static void bst_pool_release(bst_pool_t *pool, bst_chain_t *chain);
+static int32_t bst_set_key_fn_ptrs(bst_tree_t *tree, int32_t idx, int64_t flags);
+static int32_t bst_check_avl(bst_tree_t *tree, int32_t idx);
+static int64_t bst_count_r(bst_node_t *node);
+static void bst_shard_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner,
+        bst_chain_t *chain);
+static void bst_shard_maintain(bst_tree_t *tree, int32_t idx);
+static void bst_registry_remove(bst_tree_t *tree);
+static int32_t bst_shard_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi,
+        bst_iterate_t iter_fn, void *fn_data);
 static int32_t bst_print_tree_r(bst_node_t *node, int32_t is_left, int32_t offset, int32_t depth, 
         int32_t compact, char s[128][512]);
 
+// Frees index idx, whatever kind it is, and the records too if owner is set.  AVL nodes are
+// only visited if walk is set, and go on chain for the caller to give back to their pool.
+static void
+bst_idx_free(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner, int32_t walk,
+        bst_chain_t *chain) {
+    bst_frozen_free(tree, idx);
+    bst_comp_destroy(tree, idx);
+    bloom_destroy(tree->bloom[idx]);
+    tree->bloom[idx] = NULL;
+    if (tree->slab[idx])
+        bst_compact_destroy(tree, idx, fn_data, owner);
+    else if (tree->btree[idx])
+        bst_btree_destroy(tree, idx, fn_data, owner);
+    else if (tree->hash[idx])
+        bst_hash_destroy(tree, idx, fn_data, owner);
+    else if (tree->shards[idx])
+        bst_shard_destroy(tree, idx, fn_data, owner, chain);
+    else if (tree->art[idx])
+        bst_art_destroy(tree, idx, fn_data, owner);
+    else if (walk)
+        bst_delete_data(tree->root[idx], tree->free_fn[idx], fn_data, owner, chain);
+    tree->root[idx] = NULL;
+}
+
 // Callbacks
 void
-tree_free_cb(void *node, void *unused) {
+tree_free_cb(void *node, void *fn_data) {
     bst_tree_t *tree = (bst_tree_t *)node;
+    bst_chain_t chain;
+    int32_t walk = (tree->arena == NULL);
+
+    bst_registry_remove(tree);
+
+    // An arena tree that owns none of its data, and has no duplicates to free, can drop its
+    // chunks without visiting a node
+    for (int32_t i = 0; i < tree->idx_count && !walk; i++)
+        walk = (tree->free_fn[i] != NULL || (tree->flags[i] & BST_MULTI));
+
+    // Nodes retired by BST_RCU indexes have to be back in their pool before it goes
+    for (int32_t i = 0; i < tree->idx_count; i++) {
+        if (tree->flags[i] & BST_RCU) {
+            bst_epoch_synchronize();
+            break;
+        }
+    }
 
-    // TODO: Remove multiple indexes
     for (int32_t i = 0; i < tree->idx_count; i++) {
 #ifndef NO_LOCKS
-        pthread_rwlock_rdlock(&tree->mutex[i]);
+        pthread_rwlock_wrlock(&tree->mutex[i]);
 #endif
-        bst_delete_data(tree->root[i], tree->free_fn[i], NULL);
+        chain.head = chain.tail = NULL;
+        // The primary index owns the data; secondary indexes only release their nodes
+        bst_idx_free(tree, i, fn_data, (i == 0 && !tree->arena), walk, &chain);
 #ifndef NO_LOCKS
         pthread_rwlock_unlock(&tree->mutex[i]);
 #endif
+        pthread_rwlock_destroy(&tree->mutex[i]);
+
+        if (!tree->arena)
+            bst_pool_release(&node_pool, &chain);
     }
 
+    if (tree->arena)
+        bst_pool_destroy(tree->arena);
+
     if (tree->name)
         free(tree->name);
+
+    free(tree);
 }
 
 int8_t
@@ -127,36 +255,180 @@ remove_tree_cb(void *node, void *data) {
     return LIST_KEEP;
 }
 
+// Named trees are registered in a hash table for bst_find_by_name.  Lookups run in an epoch
+// read section and take no lock.  Writers serialize on registry_mutex, which is always taken
+// like the pool locks since every tree shares the registry, publish entries with release
+// stores and retire whatever they unlink, so an entry a reader is on stays valid.  Each entry
+// keeps its own copy of the name, a tree being destroyed can't pull it out from under a reader.
+static uint64_t
+bst_name_hash(char *name) {
+    uint64_t hash = 5381;
+
+    while (*name)
+        hash = ((hash << 5) + hash) + *name++;
+
+    return hash ^ (hash >> 29);
+}
+
+static void
+bst_registry_reclaim(void *arg __attribute__((unused)), void **ptrs, int32_t count) {
+    for (int32_t i = 0; i < count; i++)
+        free(ptrs[i]);
+}
+
+static bst_tree_t *
+bst_registry_lookup(char *name, uint64_t hash) {
+    bst_registry_t *reg = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+    bst_reg_entry_t *entry;
+
+    if (!reg)
+        return NULL;
+
+    entry = __atomic_load_n(&reg->buckets[hash & reg->mask], __ATOMIC_ACQUIRE);
+    for (; entry; entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE)) {
+        if (entry->hash == hash && !strcmp(entry->name, name))
+            return entry->tree;
+    }
+
+    return NULL;
+}
+
+// Rehashes copies of every entry into a table twice the size, then retires the old table and
+// entries in one batch.  Call with registry_mutex held.
+static void
+bst_registry_grow(void) {
+    bst_registry_t *reg = registry, *grown;
+    bst_reg_entry_t *entry, *copy;
+    void **retired;
+    uint64_t mask = reg->mask * 2 + 1, n = 0;
+
+    // A registry that can't grow still works, its chains just get longer
+    if ((grown = calloc(1, sizeof(bst_registry_t) + (mask + 1) * sizeof(bst_reg_entry_t *))) ==
+            NULL)
+        return;
+    if ((retired = malloc((reg->count + 1) * sizeof(void *))) == NULL) {
+        free(grown);
+        return;
+    }
+
+    grown->mask = mask;
+    for (uint64_t i = 0; i <= reg->mask; i++) {
+        for (entry = reg->buckets[i]; entry; entry = entry->next) {
+            if ((copy = malloc(sizeof(bst_reg_entry_t) + strlen(entry->name) + 1)) == NULL)
+                goto error_return;
+            memcpy(copy, entry, sizeof(bst_reg_entry_t) + strlen(entry->name) + 1);
+            copy->next = grown->buckets[copy->hash & mask];
+            grown->buckets[copy->hash & mask] = copy;
+            grown->count++;
+            retired[n++] = entry;
+        }
+    }
+    retired[n++] = reg;
+
+    __atomic_store_n(&registry, grown, __ATOMIC_RELEASE);
+    bst_epoch_retire(retired, n, bst_registry_reclaim, NULL);
+    free(retired);
+
+    return;
+
+error_return:
+    for (uint64_t i = 0; i <= mask; i++) {
+        while ((entry = grown->buckets[i]) != NULL) {
+            grown->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    free(grown);
+    free(retired);
+}
+
+static int32_t
+bst_registry_add(bst_tree_t *tree) {
+    bst_reg_entry_t *entry;
+    uint64_t hash = bst_name_hash(tree->name);
+
+    if ((entry = malloc(sizeof(bst_reg_entry_t) + strlen(tree->name) + 1)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory to register tree %s",
+                tree->name);
+        return -1;
+    }
+
+    entry->hash = hash;
+    entry->tree = tree;
+    strcpy(entry->name, tree->name);
+
+    pthread_mutex_lock(&registry_mutex);
+    if (bst_registry_lookup(tree->name, hash)) {
+        pthread_mutex_unlock(&registry_mutex);
+        snprintf(err_str, MAX_ERR_LEN - 1, "BST with name %s already exists", tree->name);
+        free(entry);
+        return -1;
+    }
+
+    if (registry->count > registry->mask)
+        bst_registry_grow();
+
+    entry->next = registry->buckets[hash & registry->mask];
+    __atomic_store_n(&registry->buckets[hash & registry->mask], entry, __ATOMIC_RELEASE);
+    registry->count++;
+    pthread_mutex_unlock(&registry_mutex);
+
+    return 0;
+}
+
+static void
+bst_registry_remove(bst_tree_t *tree) {
+    bst_reg_entry_t **link, *entry;
+    void *retired;
+
+    if (!tree->name || !registry)
+        return;
+
+    pthread_mutex_lock(&registry_mutex);
+    link = &registry->buckets[bst_name_hash(tree->name) & registry->mask];
+    for (; (entry = *link) != NULL; link = &entry->next) {
+        if (entry->tree == tree) {
+            __atomic_store_n(link, entry->next, __ATOMIC_RELEASE);
+            registry->count--;
+            retired = entry;
+            bst_epoch_retire(&retired, 1, bst_registry_reclaim, NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
 // Functions
 bst_tree_t *
 bst_find_by_name(char *name) {
-    bst_tree_t *t;
-    list_node_t *node;
-    
-#ifndef NO_LOCKS
-    list_read_lock(tree_list);
-#endif
-    node = tree_list->head;
-    while (node) {
-        t = (bst_tree_t *)node->data;
-        if (!strcmp(t->name, name)) {
-            list_unlock(tree_list);
-            return t;
-        }
-        node = node->next;
+    bst_tree_t *tree;
+    uint64_t hash;
+
+    if (!name)
+        return NULL;
+
+    hash = bst_name_hash(name);
+    if (bst_epoch_enter() == 0) {
+        tree = bst_registry_lookup(name, hash);
+        bst_epoch_exit();
+        return tree;
     }
-#ifndef NO_LOCKS
-    list_unlock(tree_list);
-#endif
 
-    return NULL;
+    // No epoch record for this thread, keep the writers out instead
+    pthread_mutex_lock(&registry_mutex);
+    tree = bst_registry_lookup(name, hash);
+    pthread_mutex_unlock(&registry_mutex);
+
+    return tree;
 }
 
 bst_tree_t *
 bst_create(char *tree_name, bst_free_t free_fn, int64_t flags) {
     int32_t rc;
     bst_tree_t *tree;
+    bst_chain_t chain = { NULL, NULL };
 
+    // Saves building a tree just to throw it away, bst_registry_add has the final say
     if (bst_find_by_name(tree_name)) {
         snprintf(err_str, MAX_ERR_LEN - 1, "BST with name %s already exists", tree_name);
         return NULL;
@@ -169,7 +441,7 @@ bst_create(char *tree_name, bst_free_t free_fn, int64_t flags) {
     }
 
     if (tree_name) {
-        if ((tree->name = malloc(strlen(tree_name))) == NULL) {
+        if ((tree->name = malloc(strlen(tree_name) + 1)) == NULL) {
             snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for new tree name");
             goto error_return;
         }
@@ -177,25 +449,43 @@ bst_create(char *tree_name, bst_free_t free_fn, int64_t flags) {
         strcpy(tree->name, tree_name);
     }
 
+    if ((flags & BST_ARENA) && (tree->arena = bst_pool_create(BST_ARENA_CHUNK_SZ)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for new tree arena");
+        goto error_return;
+    }
+
+    if (bst_set_key_fn_ptrs(tree, 0, flags) < 0)
+        goto error_return;
+
     tree->idx_count = 1;
     tree->flags[0] = flags;
     tree->free_fn[0] = free_fn;
+    tree->key_off[0] = -1;
     pthread_rwlock_init(&tree->mutex[0], NULL);
 
+    if (tree->name && bst_registry_add(tree) < 0) {
+        pthread_rwlock_destroy(&tree->mutex[0]);
+        goto error_return;
+    }
+
     if (list_append(tree_list, tree) != 0) {
         snprintf(err_str, MAX_ERR_LEN - 1, "%s", list_get_last_err());
+        bst_registry_remove(tree);
+        pthread_rwlock_destroy(&tree->mutex[0]);
         goto error_return;
     }
 
-    bst_set_key_fn_ptrs(tree, flags);
-
     return tree;
 
 error_return:
-    if (tree->name)
+    // Index 0 is still empty, only its structures need freeing
+    if (tree) {
+        bst_idx_free(tree, 0, NULL, 0, 0, &chain);
+        if (tree->arena)
+            bst_pool_destroy(tree->arena);
         free(tree->name);
-    if (tree)
         free(tree);
+    }
 
     return NULL;
 }
@@ -209,387 +499,2804 @@ bst_add_idx(bst_tree_t *tree, bst_free_t free_fn, int64_t flags) {
         return -1;
     }
 
-    idx = tree->idx_count++;
+    idx = tree->idx_count;
+    if (bst_set_key_fn_ptrs(tree, idx, flags) < 0)
+        return -1;
+
+    tree->idx_count++;
     tree->root[idx] = NULL;
     tree->flags[idx] = flags;
     tree->free_fn[idx] = free_fn;
+    tree->key_off[idx] = -1;
+    tree->key_fn[idx] = NULL;
     pthread_rwlock_init(&tree->mutex[idx], NULL);
 
     return idx;
 }
 
-void *
-bst_fetch(bst_tree_t *tree, int32_t idx, void *key) {
-    bst_node_t *node;
-    bst_key_t *needle = (bst_key_t *)key;
-    int32_t rc = -1;
-
+int32_t
+bst_set_key_offset(bst_tree_t *tree, int32_t idx, int64_t offset) {
     if (idx >= tree->idx_count) {
         snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
-        return NULL;
-    }
-#ifndef NO_LOCKS
-    pthread_rwlock_rdlock(&tree->mutex[idx]);
-#endif
-    node = tree->root[idx];
-    while (node) {
-        rc = tree->key_cmp_fn(&node->key, needle);
-        if (rc == BST_RIGHT_GT)
-            node = node->right;
-        else if (rc == BST_LEFT_GT)
-            node = node->left;
-        else
-            break;
+        return -1;
     }
-#ifndef NO_LOCKS
-    pthread_rwlock_unlock(&tree->mutex[idx]);
-#endif
-
-    return (node ? node->data : NULL);
-}
 
-static bst_node_t *
-bst_insert_r(bst_tree_t *tree, bst_node_t *node, void *key, void *data) {
-    bst_node_t *new_node;
-    int64_t lh, rh;
-    int32_t rc;
-    static int32_t rotated = 0;
+    tree->key_off[idx] = offset;
+    tree->key_fn[idx] = NULL;
 
-    if (!node) {
-         bst_new_node(new_node); 
-         if (!new_node)
-             return NULL;
-         tree->key_cpy_fn(&new_node->key, key);
-         new_node->data = data;
-         rotated = 0;
-         return new_node;
-    }
+    return 0;
+}
 
-    rc = tree->key_cmp_fn(&node->key, key);
-    if (rc == BST_LEFT_GT) {
-         if ((node->left = bst_insert_r(tree, node->left, key, data)) == NULL)
-             return NULL;
-    }
-    else if (rc == BST_RIGHT_GT) {
-         if ((node->right = bst_insert_r(tree, node->right, key, data)) == NULL)
-             return NULL;
-    }
-    else {
-        // TODO:  Handle duplicate key
+int32_t
+bst_set_key_fn(bst_tree_t *tree, int32_t idx, bst_key_fn_t key_fn) {
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return -1;
     }
 
-    // If we've already done our rotations, just return from here
-    if (rotated)
-        return node;
-
-    lh = bst_get_height(node->left);
-    rh = bst_get_height(node->right);
+    tree->key_off[idx] = -1;
+    tree->key_fn[idx] = key_fn;
 
-    node->height = MAX(lh, rh) + 1;
+    return 0;
+}
 
-    if ((lh - rh) > 1) {
-        rotated = 1;
-        rc = tree->key_cmp_fn(&node->left->key, key);
-        // Left Left Case
-        if (rc == BST_LEFT_GT) {
-            return bst_right_rotate(node);
-        }
-        // Left Right Case
-        else {
-            node->left = bst_left_rotate(node->left);
-            return bst_right_rotate(node);
-        }
-    }
-    else if ((lh - rh) < -1) {
-        rotated = 1;
-        rc = tree->key_cmp_fn(&node->right->key, key);
-        // Right Right Case
-        if (rc == BST_RIGHT_GT) {
-            return bst_left_rotate(node);
-        }
-        // Right Left Case
-        else {
-            node->right = bst_right_rotate(node->right);
-            return bst_left_rotate(node);
-        }
+// A BST_KCOMP index can't order anything until it has fields, so nothing goes in before then
+static int32_t
+bst_check_fields(bst_tree_t *tree, int32_t idx) {
+    if ((tree->flags[idx] & BST_KEYS) == BST_KCOMP && !tree->comp[idx]) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d has no composite key fields yet.", idx);
+        return -1;
     }
 
-    return node;
+    return 0;
 }
 
 int32_t
-bst_insert(bst_tree_t *tree, int32_t idx, void *key, void *data) {
-    bst_node_t *new_node;
+bst_set_key_fields(bst_tree_t *tree, int32_t idx, bst_field_t *fields, int32_t count) {
+    int32_t rc;
 
     if (idx >= tree->idx_count) {
         snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
         return -1;
     }
+    if ((tree->flags[idx] & BST_KEYS) != BST_KCOMP) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not have BST_KCOMP keys.", idx);
+        return -1;
+    }
+    if (count < 1 || count > BST_MAX_FIELDS) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "A composite key has 1 to %d fields, not %d.",
+                BST_MAX_FIELDS, count);
+        return -1;
+    }
 
 #ifndef NO_LOCKS
     pthread_rwlock_wrlock(&tree->mutex[idx]);
 #endif
-    if ((new_node = bst_insert_r(tree, tree->root[idx], key, data)) == NULL) {
-        snprintf(err_str, MAX_ERR_LEN - 1, "Unable to insert new node.  Out of memory?");
-        return -1;
+    // Keys already in the index were placed by the old fields
+    if (tree->root[idx]) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is not empty.", idx);
+        rc = -1;
+    }
+    else {
+        rc = bst_comp_init(tree, idx, fields, count);
     }
-
-    tree->root[idx] = new_node;
-
 #ifndef NO_LOCKS
     pthread_rwlock_unlock(&tree->mutex[idx]);
 #endif
 
-    return 0;
+    return rc;
 }
 
-int32_t
-bst_iterate_r(bst_node_t *node, bst_iterate_t iter_fn, void *fn_data) {
+// The descent, insert and delete below are written once against a comparator parameter and
+// stamped out for every key type further down by BST_KEY_OPS.  Each copy is handed its
+// comparator as a constant, so the compare is inlined instead of called through a pointer.
+
+bst_always_inline bst_node_t *
+bst_find_t(bst_node_t *node, void *key, bst_key_cmp_t cmp, void *ctx) {
     int32_t rc;
 
-    if (node != NULL) {
-        bst_iterate_r(node->left, iter_fn, fn_data);
-        rc = iter_fn(node->data, fn_data);
-        switch(rc) {
-            case BST_CB_DELETE_AND_ABORT:
-            case BST_CB_DELETE_NODE:
-                snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
-            case BST_CB_ABORT:
-                return rc;
-        }
-        bst_iterate_r(node->right, iter_fn, fn_data);
+    while (node) {
+        rc = cmp(&node->key, key, ctx);
+        if (rc == BST_RIGHT_GT)
+            node = node->right;
+        else if (rc == BST_LEFT_GT)
+            node = node->left;
+        else
+            break;
     }
 
-    return 0;
+    return node;
 }
 
-int32_t
-bst_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data) {
+// A BST_BLOOM index's filter rules most absent keys out for the price of one cache line.  BST_RCU
+// readers load it inside their epoch, which keeps a filter that was just rebuilt around.
+static inline int32_t
+bst_bloom_miss(bst_tree_t *tree, int32_t idx, void *key) {
+    bloom_t *bloom = __atomic_load_n(&tree->bloom[idx], __ATOMIC_ACQUIRE);
+
+    return (bloom && !bloom_check(bloom, tree->key_hash_fn[idx](key)));
+}
+
+void *
+bst_fetch(bst_tree_t *tree, int32_t idx, void *key) {
+    void *data;
+
     if (idx >= tree->idx_count) {
         snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
-        return - 1;
+        return NULL;
+    }
+
+    // Readers of a BST_RCU index only need to keep the nodes they're on from being reclaimed
+    if ((tree->flags[idx] & BST_RCU) && bst_epoch_enter() == 0) {
+        data = bst_bloom_miss(tree, idx, key) ? NULL : tree->ops[idx]->fetch(tree, idx, key);
+        bst_epoch_exit();
+        return data;
     }
 
 #ifndef NO_LOCKS
-    pthread_rwlock_wrlock(&tree->mutex[idx]);
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
 #endif
-    bst_iterate_r(tree->root[idx], iter_fn, fn_data);
+    if (bst_bloom_miss(tree, idx, key))
+        data = NULL;
+    else if (tree->frozen[idx])
+        data = bst_frozen_fetch(tree, idx, key);
+    else
+        data = tree->ops[idx]->fetch(tree, idx, key);
 #ifndef NO_LOCKS
     pthread_rwlock_unlock(&tree->mutex[idx]);
 #endif
 
-    return 0;
-}
-
-void 
-bst_destroy(bst_tree_t *tree, void *fn_data) {
-    // Remove this tree from the list
-    list_remove_if(tree_list, remove_tree_cb, tree, NULL);
+    return data;
 }
 
-int32_t
-bst_init() {
-    list_create(&tree_list, tree_free_cb);
-    return bst_create_node_pool();
-}
+// Descends for up to BST_FETCH_LANES keys at once, one level of each per round, prefetching
+// every lane's next node so the misses of all the lanes overlap instead of following each
+// other.  A lane that finds its key, or falls off the tree, starts on the next key right away.
+bst_always_inline void
+bst_fetch_many_t(bst_node_t *root, void **keys, int64_t n, void **out, bst_key_cmp_t cmp,
+        void *ctx) {
+    bst_node_t *node[BST_FETCH_LANES];
+    int64_t lane[BST_FETCH_LANES], next = 0;
+    int32_t live = 0, rc;
+
+    for (int32_t i = 0; i < BST_FETCH_LANES; i++) {
+        lane[i] = (next < n) ? next++ : -1;
+        node[i] = root;
+        live += (lane[i] >= 0);
+    }
 
-int32_t
-bst_fini() {
-    bst_free_node_pool();
-    list_destroy(tree_list, NULL);
-    return 0;
+    while (live) {
+        for (int32_t i = 0; i < BST_FETCH_LANES; i++) {
+            if (lane[i] < 0)
+                continue;
+
+            rc = node[i] ? cmp(&node[i]->key, keys[lane[i]], ctx) : BST_EQUAL;
+            if (rc == BST_EQUAL) {
+                out[lane[i]] = node[i] ? node[i]->data : NULL;
+                if (next < n) {
+                    lane[i] = next++;
+                    node[i] = root;
+                }
+                else {
+                    lane[i] = -1;
+                    live--;
+                }
+                continue;
+            }
+
+            node[i] = (rc == BST_LEFT_GT) ? node[i]->left : node[i]->right;
+            __builtin_prefetch(node[i]);
+        }
+    }
 }
 
 static void
-bst_delete_data(bst_node_t *node, bst_free_t free_fn, void *fn_data) {
-    if (node != NULL) {
-        bst_delete_data(node->left, free_fn, fn_data);
-        bst_delete_data(node->right, free_fn, fn_data);
-        if (free_fn)
-            free_fn(node, fn_data);
-        else
-            free(node->data);
+bst_fetch_some(bst_tree_t *tree, int32_t idx, void **keys, int64_t n, void **out) {
+    const bst_ops_t *ops = tree->ops[idx];
 
-        //bst_free_node(node);
+    if (tree->frozen[idx]) {
+        for (int64_t i = 0; i < n; i++)
+            out[i] = bst_frozen_fetch(tree, idx, keys[i]);
+    }
+    else if (ops->fetch_many) {
+        ops->fetch_many(tree, idx, keys, n, out);
+    }
+    else {
+        for (int64_t i = 0; i < n; i++)
+            out[i] = ops->fetch(tree, idx, keys[i]);
     }
 }
 
-static int32_t
-bst_key_cmp_str(bst_key_t *left, bst_key_t *right) {
-    return strcmp(left->pstr, right->pstr);
-}
+// Keys a BST_BLOOM index's filter rules out never start a descent.  The rest are gathered
+// BST_FETCH_CHUNK at a time and looked up together.
+static void
+bst_fetch_bloom(bst_tree_t *tree, int32_t idx, bloom_t *bloom, void **keys, int64_t n,
+        void **out) {
+    void *pass[BST_FETCH_CHUNK], *found[BST_FETCH_CHUNK];
+    int64_t pos[BST_FETCH_CHUNK];
+    int32_t m = 0;
+
+    for (int64_t i = 0; i < n; i++) {
+        out[i] = NULL;
+        if (bloom_check(bloom, tree->key_hash_fn[idx](keys[i]))) {
+            pass[m] = keys[i];
+            pos[m++] = i;
+        }
 
-static int32_t
-bst_key_cmp_i8(bst_key_t *left, bst_key_t *right) {
-    return (left->i8 == right->i8) ? BST_EQUAL : (left->i8 < right->i8) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
+        if (m == BST_FETCH_CHUNK || (m && i == n - 1)) {
+            bst_fetch_some(tree, idx, pass, m, found);
+            for (int32_t j = 0; j < m; j++)
+                out[pos[j]] = found[j];
+            m = 0;
+        }
+    }
 }
 
-static int32_t
-bst_key_cmp_i16(bst_key_t *left, bst_key_t *right) {
-    return (left->i16 == right->i16) ? BST_EQUAL : (left->i16 < right->i16) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
-}
+int64_t
+bst_fetch_many(bst_tree_t *tree, int32_t idx, void **keys, int64_t n, void **out) {
+    bloom_t *bloom;
+    int64_t found = 0;
+    int32_t rcu;
 
-static int32_t
-bst_key_cmp_i32(bst_key_t *left, bst_key_t *right) {
-    return (left->i32 == right->i32) ? BST_EQUAL : (left->i32 < right->i32) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
-}
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return -1;
+    }
+
+    rcu = ((tree->flags[idx] & BST_RCU) && bst_epoch_enter() == 0);
+#ifndef NO_LOCKS
+    if (!rcu)
+        pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+
+    if ((bloom = __atomic_load_n(&tree->bloom[idx], __ATOMIC_ACQUIRE)) != NULL)
+        bst_fetch_bloom(tree, idx, bloom, keys, n, out);
+    else
+        bst_fetch_some(tree, idx, keys, n, out);
+
+    if (rcu)
+        bst_epoch_exit();
+#ifndef NO_LOCKS
+    else
+        pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    for (int64_t i = 0; i < n; i++)
+        found += (out[i] != NULL);
+
+    return found;
+}
+
+// Only BST_MULTI indexes can hold more than one record per key, every other kind is looked up
+// the usual way
+int64_t
+bst_fetch_all(bst_tree_t *tree, int32_t idx, void *key, void **out, int64_t max) {
+    bst_node_t *node;
+    int64_t count = 0;
+    void *data;
+
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return -1;
+    }
+
+    if (!(tree->flags[idx] & BST_MULTI)) {
+        if ((data = bst_fetch(tree, idx, key)) != NULL && max > 0)
+            out[0] = data;
+        return (data != NULL);
+    }
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    node = bst_find_t(tree->root[idx], key, tree->key_cmp_fn[idx], tree->comp[idx]);
+    if (node != NULL) {
+        count = bst_node_records(node);
+        for (int64_t r = 0; r < count && r < max; r++)
+            out[r] = bst_node_record(node, r);
+    }
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return count;
+}
+
+// Appends a record to a BST_MULTI key, doubling its array when it fills up
+static int32_t
+bst_dups_add(bst_node_t *node, void *data) {
+    bst_dups_t *dups = node->dups;
+    uint32_t cap = dups ? dups->cap * 2 : BST_DUPS_INIT_SZ;
+
+    if (!dups || dups->count == dups->cap) {
+        if ((dups = realloc(dups, sizeof(bst_dups_t) + cap * sizeof(void *))) == NULL) {
+            snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for duplicates",
+                    __FUNCTION__);
+            return -1;
+        }
+        if (!node->dups)
+            dups->count = 0;
+        dups->cap = cap;
+        node->dups = dups;
+    }
+
+    dups->data[dups->count++] = data;
+
+    return 0;
+}
+
+// Takes record r out of a BST_MULTI node that holds more than one, keeping the order of the rest
+static void
+bst_dups_remove(bst_node_t *node, uint32_t r) {
+    bst_dups_t *dups = node->dups;
+
+    if (r == 0)
+        node->data = dups->data[0];
+    else
+        r--;
+
+    memmove(&dups->data[r], &dups->data[r + 1], (dups->count - r - 1) * sizeof(void *));
+    if (--dups->count == 0) {
+        free(dups);
+        node->dups = NULL;
+    }
+}
+
+// Walks down to the insertion point remembering the link into every node on the way, then
+// walks back up fixing heights.  An insert rotates at most once, and once a subtree's height
+// comes out unchanged nothing above it can change either, so the climb stops there.
+// Returns 1 without touching the tree if the key is already present, unless the index is
+// BST_MULTI, where the record joins the key's others instead.
+bst_always_inline int32_t
+bst_insert_t(bst_tree_t *tree, int32_t idx, bst_node_t **root, void *key, void *data,
+        bst_key_cmp_t cmp) {
+    bst_node_t **path[BST_MAX_HEIGHT];
+    bst_node_t **link = root;
+    bst_node_t *node, *new_node;
+    int32_t depth = 0, rc;
+    int8_t height;
+
+    while ((node = *link) != NULL) {
+        rc = cmp(&node->key, key, tree->comp[idx]);
+        if (rc == BST_EQUAL)
+            return (tree->flags[idx] & BST_MULTI) ? bst_dups_add(node, data) : 1;
+
+        path[depth++] = link;
+        link = (rc == BST_LEFT_GT) ? &node->left : &node->right;
+    }
+
+    bst_new_node(bst_tree_pool(tree), new_node);
+    if (!new_node)
+        return -1;
+
+    tree->key_cpy_fn[idx](&new_node->key, key);
+    new_node->data = data;
+    new_node->dups = NULL;
+    new_node->left = NULL;
+    new_node->height = 1;
+    new_node->size = 1;
+    *link = new_node;
+
+    while (depth--) {
+        link = path[depth];
+        height = (*link)->height;
+        *link = bst_rebalance(*link);
+        if ((*link)->height == height)
+            break;
+    }
+
+    // An order-statistic index still has to count the new node in every subtree above, and so
+    // does a sharded one, which splits shards by size
+    if (tree->flags[idx] & (BST_OSTAT | BST_SHARDED)) {
+        while (depth-- > 0)
+            (*path[depth])->size++;
+    }
+
+    return 0;
+}
+
+// Unlinks the node holding key and hands it back to the pool, returning its data.  The path is
+// kept the same way as for an insert, but a delete can rotate at every level on the way up,
+// so the climb only stops early once a subtree's height is unchanged.  A BST_MULTI key with
+// more than one record only gives up its first.
+bst_always_inline void *
+bst_delete_t(bst_tree_t *tree, int32_t idx, bst_node_t **root, void *key, bst_key_cmp_t cmp) {
+    bst_node_t **path[BST_MAX_HEIGHT];
+    bst_node_t **link = root;
+    bst_node_t *node, *succ;
+    int32_t depth = 0, target, rc;
+    int8_t height;
+    void *data;
+
+    while ((node = *link) != NULL) {
+        rc = cmp(&node->key, key, tree->comp[idx]);
+        if (rc == BST_EQUAL)
+            break;
+
+        path[depth++] = link;
+        link = (rc == BST_LEFT_GT) ? &node->left : &node->right;
+    }
+
+    if (!node)
+        return NULL;
+
+    data = node->data;
+    if (node->dups) {
+        bst_dups_remove(node, 0);
+        return data;
+    }
+
+    if (!node->left || !node->right) {
+        *link = node->left ? node->left : node->right;
+    }
+    else {
+        // Move the in-order successor into the doomed node's place.  Its slot on the path is
+        // taken over by the successor, and the next slot becomes the successor's right link.
+        target = depth;
+        path[depth++] = link;
+        link = &node->right;
+        while ((succ = *link)->left) {
+            path[depth++] = link;
+            link = &succ->left;
+        }
+
+        if (link != &node->right) {
+            *link = succ->right;
+            succ->right = node->right;
+            path[target + 1] = &succ->right;
+        }
+        succ->left = node->left;
+        succ->height = node->height;
+        succ->size = node->size;
+        *path[target] = succ;
+    }
+
+    bst_free_node(bst_tree_pool(tree), node);
+
+    while (depth--) {
+        link = path[depth];
+        height = (*link)->height;
+        *link = bst_rebalance(*link);
+        if ((*link)->height == height)
+            break;
+    }
+
+    if (tree->flags[idx] & (BST_OSTAT | BST_SHARDED)) {
+        while (depth-- > 0)
+            (*path[depth])->size--;
+    }
+
+    return data;
+}
+
+static void
+bst_bloom_fill(bst_tree_t *tree, int32_t idx, bst_node_t *node, bloom_t *bloom) {
+    for (; node; node = node->right) {
+        bst_bloom_fill(tree, idx, node->left, bloom);
+        bloom_add(bloom, tree->key_hash_fn[idx](&node->key));
+    }
+}
+
+static void
+bst_bloom_reclaim(void *arg __attribute__((unused)), void **ptrs, int32_t count) {
+    for (int32_t i = 0; i < count; i++)
+        bloom_destroy(ptrs[i]);
+}
+
+// Swaps in a filter of twice the index's keys.  Without the memory for one, the filter there is
+// stays, and it's up to the caller to make sure it has every key.
+static int32_t
+bst_bloom_build(bst_tree_t *tree, int32_t idx) {
+    bloom_t *bloom, *old = tree->bloom[idx];
+
+    if ((bloom = bloom_create(MAX(bst_count_r(tree->root[idx]) * 2, BST_BLOOM_MIN))) == NULL)
+        return -1;
+
+    bst_bloom_fill(tree, idx, tree->root[idx], bloom);
+    __atomic_store_n(&tree->bloom[idx], bloom, __ATOMIC_RELEASE);
+    if (tree->flags[idx] & BST_RCU)
+        bst_epoch_retire((void **)&old, 1, bst_bloom_reclaim, NULL);
+    else
+        bloom_destroy(old);
+
+    return 0;
+}
+
+// For a key that just went into the index.  A full filter is built again instead, which takes
+// the key in along with the rest.  Without the memory for that, the full one takes just the key
+// and lets twice as many in again before the next try, so a failing build isn't one per insert.
+static void
+bst_bloom_add(bst_tree_t *tree, int32_t idx, void *key) {
+    bloom_t *bloom = tree->bloom[idx];
+
+    if (!bloom)
+        return;
+
+    if (bloom_full(bloom)) {
+        if (bst_bloom_build(tree, idx) == 0)
+            return;
+        bloom_backoff(bloom);
+    }
+    bloom_add(bloom, tree->key_hash_fn[idx](key));
+}
+
+int32_t
+bst_bloom_rebuild(bst_tree_t *tree, int32_t idx) {
+    int32_t rc;
+
+    if (idx >= tree->idx_count || !tree->bloom[idx]) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is not a BST_BLOOM index.", idx);
+        return -1;
+    }
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    rc = bst_bloom_build(tree, idx);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return rc;
+}
+
+// Writers to a sharded index lock the shard they write to themselves.  All they need from the
+// index lock is for the shards to stay where they are.
+static inline void
+bst_write_lock(bst_tree_t *tree, int32_t idx) {
+#ifndef NO_LOCKS
+    if (tree->shards[idx])
+        pthread_rwlock_rdlock(&tree->mutex[idx]);
+    else
+        pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+}
+
+// Every write goes through these two, so they're where a frozen index thaws
+static int32_t
+bst_insert_i(bst_tree_t *tree, int32_t idx, void *key, void *data) {
+    int32_t rc = tree->ops[idx]->insert(tree, idx, key, data);
+
+    if (rc == 0 && tree->frozen[idx])
+        bst_frozen_free(tree, idx);
+    if (rc == 0)
+        bst_bloom_add(tree, idx, key);
+
+    return rc;
+}
+
+static void *
+bst_delete_i(bst_tree_t *tree, int32_t idx, void *key) {
+    void *data = tree->ops[idx]->delete(tree, idx, key);
+
+    if (data && tree->frozen[idx])
+        bst_frozen_free(tree, idx);
+
+    return data;
+}
+
+static int32_t
+bst_holds(bst_tree_t *tree, int32_t idx, void *key, void *data) {
+    bst_node_t *node;
+
+    if (!(tree->flags[idx] & BST_MULTI))
+        return (tree->ops[idx]->fetch(tree, idx, key) == data);
+
+    if ((node = bst_find_t(tree->root[idx], key, tree->key_cmp_fn[idx], tree->comp[idx])) ==
+            NULL)
+        return 0;
+    for (uint32_t r = 0; r < bst_node_records(node); r++) {
+        if (bst_node_record(node, r) == data)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Takes one particular record out from under key, for indexes where the key alone may not say
+// which.  Returns NULL if the index doesn't hold that record under that key.
+static void *
+bst_delete_value_i(bst_tree_t *tree, int32_t idx, void *key, void *data) {
+    bst_node_t *node;
+
+    if (!(tree->flags[idx] & BST_MULTI))
+        return (tree->ops[idx]->fetch(tree, idx, key) == data) ? bst_delete_i(tree, idx, key) : NULL;
+
+    if ((node = bst_find_t(tree->root[idx], key, tree->key_cmp_fn[idx], tree->comp[idx])) ==
+            NULL)
+        return NULL;
+
+    // The first record is the one bst_fetch and a frozen copy hand out, so it goes the long way
+    if (node->data == data)
+        return bst_delete_i(tree, idx, key);
+
+    for (uint32_t r = 1; r < bst_node_records(node); r++) {
+        if (bst_node_record(node, r) == data) {
+            bst_dups_remove(node, r);
+            return data;
+        }
+    }
+
+    return NULL;
+}
+
+void *
+bst_delete_value(bst_tree_t *tree, int32_t idx, void *key, void *data) {
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return NULL;
+    }
+
+    bst_write_lock(tree, idx);
+    data = bst_delete_value_i(tree, idx, key, data);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return data;
+}
+
+void *
+bst_delete(bst_tree_t *tree, int32_t idx, void *key) {
+    void *data;
+
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return NULL;
+    }
+
+    bst_write_lock(tree, idx);
+    data = bst_delete_i(tree, idx, key);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return data;
+}
+
+// Takes the address of the record pointer, which is what a composite key is
+static void *
+bst_record_key(bst_tree_t *tree, int32_t idx, void **data) {
+    if (tree->key_fn[idx])
+        return tree->key_fn[idx](*data);
+
+    if ((tree->flags[idx] & BST_KEYS) == BST_KCOMP)
+        return data;
+
+    return (char *)*data + tree->key_off[idx];
+}
+
+// Multi-index operations lock every index in ascending order, so they can't deadlock with each
+// other, and nobody sees a record that is in some indexes but not others.
+static void
+bst_lock_all(bst_tree_t *tree) {
+    for (int32_t i = 0; i < tree->idx_count; i++)
+        bst_write_lock(tree, i);
+}
+
+static void
+bst_unlock_all(bst_tree_t *tree) {
+#ifndef NO_LOCKS
+    for (int32_t i = tree->idx_count - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&tree->mutex[i]);
+#endif
+}
+
+static int32_t
+bst_check_extractors(bst_tree_t *tree) {
+    for (int32_t i = 0; i < tree->idx_count; i++) {
+        if (bst_check_fields(tree, i) < 0)
+            return -1;
+        if (!tree->key_fn[i] && tree->key_off[i] < 0 &&
+                (tree->flags[i] & BST_KEYS) != BST_KCOMP) {
+            snprintf(err_str, MAX_ERR_LEN - 1, "Index %d has no key extractor.", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int32_t
+bst_insert_record(bst_tree_t *tree, void *data) {
+    int32_t i, rc = 0;
+
+    if (bst_check_extractors(tree) < 0)
+        return -1;
+
+    bst_lock_all(tree);
+    for (i = 0; i < tree->idx_count; i++) {
+        if ((rc = bst_insert_i(tree, i, bst_record_key(tree, i, &data), data)) != 0)
+            break;
+    }
+
+    if (rc != 0) {
+        if (rc > 0)
+            snprintf(err_str, MAX_ERR_LEN - 1, "Duplicate key on index %d.", i);
+        else
+            snprintf(err_str, MAX_ERR_LEN - 1, "Unable to insert new node.  Out of memory?");
+
+        // Take the record back out of the indexes it already made it into
+        while (i--)
+            bst_delete_value_i(tree, i, bst_record_key(tree, i, &data), data);
+    }
+    bst_unlock_all(tree);
+
+    for (i = 0; i < tree->idx_count; i++)
+        bst_shard_maintain(tree, i);
+
+    return (rc == 0) ? 0 : -1;
+}
+
+int32_t
+bst_delete_record(bst_tree_t *tree, void *data) {
+    if (bst_check_extractors(tree) < 0)
+        return -1;
+
+    bst_lock_all(tree);
+    // Make sure every index holds this very record before removing it from any of them
+    for (int32_t i = 0; i < tree->idx_count; i++) {
+        if (!bst_holds(tree, i, bst_record_key(tree, i, &data), data)) {
+            snprintf(err_str, MAX_ERR_LEN - 1, "Record not found in index %d.", i);
+            bst_unlock_all(tree);
+            return -1;
+        }
+    }
+
+    for (int32_t i = 0; i < tree->idx_count; i++)
+        bst_delete_value_i(tree, i, bst_record_key(tree, i, &data), data);
+    bst_unlock_all(tree);
+
+    return 0;
+}
+
+int32_t
+bst_insert(bst_tree_t *tree, int32_t idx, void *key, void *data) {
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return -1;
+    }
+    if (bst_check_fields(tree, idx) < 0)
+        return -1;
+
+    bst_write_lock(tree, idx);
+    if (bst_insert_i(tree, idx, key, data) < 0) {
+#ifndef NO_LOCKS
+        pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+        snprintf(err_str, MAX_ERR_LEN - 1, "Unable to insert new node.  Out of memory?");
+        return -1;
+    }
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+    bst_shard_maintain(tree, idx);
+
+    return 0;
+}
+
+// qsort_r isn't stable, so equal keys fall back on their input order.  That way the first of
+// them is the one kept, as with bst_insert, and BST_MULTI records stay in the order given.
+static int
+bst_pair_cmp(const void *a, const void *b, void *arg) {
+    bst_tree_idx_t *ti = arg;
+    const bst_pair_t *pa = a, *pb = b;
+    int rc = bst_cmp(ti->tree, ti->idx, pa->key, pb->key);
+
+    if (rc != BST_EQUAL)
+        return rc;
+
+    return (pa->pos > pb->pos) ? BST_LEFT_GT : BST_RIGHT_GT;
+}
+
+// Builds a perfectly balanced subtree out of pairs[lo, hi) using the nodes at the same
+// positions.  Sibling subtrees differ in size by at most one, so it's a valid AVL tree.
+static bst_node_t *
+bst_build(bst_tree_t *tree, int32_t idx, bst_pair_t *pairs, bst_node_t *nodes, int64_t lo,
+        int64_t hi) {
+    bst_node_t *node;
+    int64_t mid;
+
+    if (lo >= hi)
+        return NULL;
+
+    mid = lo + (hi - lo) / 2;
+    node = &nodes[mid];
+    tree->key_cpy_fn[idx](&node->key, pairs[mid].key);
+    node->data = pairs[mid].data;
+    node->left = bst_build(tree, idx, pairs, nodes, lo, mid);
+    node->right = bst_build(tree, idx, pairs, nodes, mid + 1, hi);
+    bst_update_node(node);
+
+    return node;
+}
+
+int32_t
+bst_bulk_load(bst_tree_t *tree, int32_t idx, void **keys, void **data, int64_t n, int32_t sort) {
+    bst_pair_t *pairs, *dups = NULL;
+    bst_node_t *nodes = NULL, *root;
+    bst_chain_t chain = { NULL, NULL };
+    int64_t m = 0, d = 0;
+
+    if (bst_check_avl(tree, idx) < 0 || bst_check_fields(tree, idx) < 0)
+        return -1;
+    if (n <= 0 || n > UINT32_MAX) {
+        if (n == 0)
+            return 0;
+        snprintf(err_str, MAX_ERR_LEN - 1, "Bulk load of %ld pairs is out of range.", n);
+        return -1;
+    }
+
+    if ((pairs = malloc(n * sizeof(bst_pair_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for bulk load");
+        return -1;
+    }
+
+    for (int64_t i = 0; i < n; i++) {
+        pairs[i].key = keys[i];
+        pairs[i].data = data[i];
+        pairs[i].pos = i;
+    }
+
+    if (sort)
+        qsort_r(pairs, n, sizeof(bst_pair_t), bst_pair_cmp, &(bst_tree_idx_t){ tree, idx });
+
+    // Duplicates keep the first record, same as bst_insert.  A BST_MULTI index keeps the rest
+    // aside and adds them to their key once the tree is built.
+    for (int64_t i = 0; i < n; i++) {
+        if (m && bst_cmp(tree, idx, pairs[m - 1].key, pairs[i].key) != BST_RIGHT_GT) {
+            if (bst_cmp(tree, idx, pairs[m - 1].key, pairs[i].key) == BST_EQUAL) {
+                if (!(tree->flags[idx] & BST_MULTI))
+                    continue;
+                if (!dups && (dups = malloc(n * sizeof(bst_pair_t))) == NULL) {
+                    snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for bulk load");
+                    free(pairs);
+                    return -1;
+                }
+                dups[d++] = pairs[i];
+                continue;
+            }
+
+            snprintf(err_str, MAX_ERR_LEN - 1, "Bulk load input is not sorted at %ld", i);
+            free(pairs);
+            free(dups);
+            return -1;
+        }
+        pairs[m++] = pairs[i];
+    }
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    if (tree->root[idx]) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is not empty.", idx);
+        goto error_return;
+    }
+
+    if ((nodes = bst_pool_get_n(bst_tree_pool(tree), m)) == NULL)
+        goto error_return;
+
+    // Nobody sees the tree until its duplicates are in, so a failure leaves the index empty
+    root = bst_build(tree, idx, pairs, nodes, 0, m);
+    for (int64_t i = 0; i < d; i++) {
+        if (bst_dups_add(bst_find_t(root, dups[i].key, tree->key_cmp_fn[idx], tree->comp[idx]),
+                    dups[i].data) < 0)
+            goto error_return;
+    }
+    __atomic_store_n(&tree->root[idx], root, __ATOMIC_RELEASE);
+
+    // The filter there has none of the new keys, so without a new one it takes them all
+    if (tree->bloom[idx] && bst_bloom_build(tree, idx) < 0)
+        bst_bloom_fill(tree, idx, tree->root[idx], tree->bloom[idx]);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+    free(pairs);
+    free(dups);
+
+    return 0;
+
+error_return:
+    for (int64_t i = 0; nodes && i < m; i++) {
+        free(nodes[i].dups);
+        nodes[i].dups = NULL;
+        nodes[i].left = NULL;
+        nodes[i].height = 1;
+        nodes[i].right = chain.head;
+        chain.head = &nodes[i];
+        if (!chain.tail)
+            chain.tail = &nodes[i];
+    }
+    bst_pool_release(bst_tree_pool(tree), &chain);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+    free(pairs);
+    free(dups);
+
+    return -1;
+}
+
+static int64_t
+bst_count_r(bst_node_t *node) {
+    return node ? bst_count_r(node->left) + bst_count_r(node->right) + 1 : 0;
+}
+
+static void
+bst_collect_r(bst_node_t *node, bst_key_t **keys, void **data, int64_t *n) {
+    if (node) {
+        bst_collect_r(node->left, keys, data, n);
+        keys[*n] = &node->key;
+        data[(*n)++] = node->data;
+        bst_collect_r(node->right, keys, data, n);
+    }
+}
+
+int32_t
+bst_freeze(bst_tree_t *tree, int32_t idx) {
+    bst_key_t **keys = NULL;
+    void **data = NULL;
+    int64_t n = 0;
+    int32_t rc = -1;
+
+    if (bst_check_avl(tree, idx) < 0)
+        return -1;
+    if (tree->flags[idx] & BST_RCU) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is read without locks and can't be frozen.",
+                idx);
+        return -1;
+    }
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    bst_frozen_free(tree, idx);
+
+    // An empty index is as fast as it'll get
+    if ((n = bst_count_r(tree->root[idx])) == 0) {
+        rc = 0;
+        goto done;
+    }
+
+    if ((keys = malloc(n * sizeof(bst_key_t *))) == NULL ||
+            (data = malloc(n * sizeof(void *))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory to freeze index %d", idx);
+        goto done;
+    }
+
+    n = 0;
+    bst_collect_r(tree->root[idx], keys, data, &n);
+    rc = bst_frozen_build(tree, idx, keys, data, n);
+
+done:
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+    free(keys);
+    free(data);
+
+    return rc;
+}
+
+void
+bst_thaw(bst_tree_t *tree, int32_t idx) {
+    if (idx >= tree->idx_count)
+        return;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    bst_frozen_free(tree, idx);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+}
+
+// Joins two AVL trees and a node that sorts between them into one, in time proportional to
+// the difference in their heights
+static bst_node_t *
+bst_join(bst_node_t *left, bst_node_t *pivot, bst_node_t *right) {
+    if (bst_get_height(left) > bst_get_height(right) + 1) {
+        left->right = bst_join(left->right, pivot, right);
+        return bst_rebalance(left);
+    }
+    if (bst_get_height(right) > bst_get_height(left) + 1) {
+        right->left = bst_join(left, pivot, right->left);
+        return bst_rebalance(right);
+    }
+
+    pivot->left = left;
+    pivot->right = right;
+    bst_update_node(pivot);
+
+    return pivot;
+}
+
+// Merges pairs[lo, hi), sorted and without duplicates, into the subtree under node.  The run is
+// split around each node's key on the way down, so neighbouring keys share one descent and a
+// subtree none of them fall into is never visited.  Each subtree they do fall into is rebalanced
+// once, by the join on the way back up.  Keys the tree already holds have their pair's key
+// cleared so the caller can hand the unused node back.
+static bst_node_t *
+bst_merge_r(bst_tree_t *tree, int32_t idx, bst_node_t *node, bst_pair_t *pairs,
+        bst_node_t *nodes, int64_t lo, int64_t hi, int64_t *added) {
+    int64_t l = lo, r = hi, mid, skip = 0;
+    bst_node_t *left;
+
+    if (lo >= hi)
+        return node;
+    if (!node) {
+        *added += hi - lo;
+        return bst_build(tree, idx, pairs, nodes, lo, hi);
+    }
+
+    // First pair whose key is >= the node's
+    while (l < r) {
+        mid = l + (r - l) / 2;
+        if (bst_cmp(tree, idx, &node->key, pairs[mid].key) == BST_LEFT_GT)
+            l = mid + 1;
+        else
+            r = mid;
+    }
+    if (l < hi && bst_cmp(tree, idx, &node->key, pairs[l].key) == BST_EQUAL) {
+        pairs[l].key = NULL;
+        skip = 1;
+    }
+
+    left = bst_merge_r(tree, idx, node->left, pairs, nodes, lo, l, added);
+    return bst_join(left, node,
+            bst_merge_r(tree, idx, node->right, pairs, nodes, l + skip, hi, added));
+}
+
+int64_t
+bst_insert_batch(bst_tree_t *tree, int32_t idx, void **keys, void **data, int64_t n) {
+    bst_chain_t chain = { NULL, NULL };
+    bst_pair_t *pairs;
+    bst_node_t *nodes = NULL;
+    int64_t m = 0, added = 0;
+    int32_t rc = 0;
+
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return -1;
+    }
+    if (bst_check_fields(tree, idx) < 0)
+        return -1;
+    if (n <= 0 || n > UINT32_MAX) {
+        if (n == 0)
+            return 0;
+        snprintf(err_str, MAX_ERR_LEN - 1, "Batch of %ld pairs is out of range.", n);
+        return -1;
+    }
+
+    if ((pairs = malloc(n * sizeof(bst_pair_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for batch insert");
+        return -1;
+    }
+
+    for (int64_t i = 0; i < n; i++) {
+        pairs[i].key = keys[i];
+        pairs[i].data = data[i];
+        pairs[i].pos = i;
+    }
+
+    qsort_r(pairs, n, sizeof(bst_pair_t), bst_pair_cmp, &(bst_tree_idx_t){ tree, idx });
+    for (int64_t i = 0; i < n; i++) {
+        if (m && !(tree->flags[idx] & BST_MULTI) &&
+                bst_cmp(tree, idx, pairs[m - 1].key, pairs[i].key) == BST_EQUAL)
+            continue;
+        pairs[m++] = pairs[i];
+    }
+
+    // Other index kinds, AVL indexes readers walk without locks and BST_MULTI indexes, whose
+    // repeated keys the merge would drop, still get the batch in key order under one lock
+    if (tree->slab[idx] || tree->btree[idx] || tree->hash[idx] || tree->shards[idx] ||
+            tree->art[idx] || (tree->flags[idx] & (BST_RCU | BST_MULTI))) {
+        bst_write_lock(tree, idx);
+        for (int64_t i = 0; i < m; i++) {
+            if ((rc = bst_insert_i(tree, idx, pairs[i].key, pairs[i].data)) < 0)
+                break;
+            added += (rc == 0);
+        }
+#ifndef NO_LOCKS
+        pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+        bst_shard_maintain(tree, idx);
+        free(pairs);
+
+        if (rc < 0) {
+            snprintf(err_str, MAX_ERR_LEN - 1, "Unable to insert new node.  Out of memory?");
+            return -1;
+        }
+
+        return added;
+    }
+
+    if ((nodes = bst_pool_get_n(bst_tree_pool(tree), m)) == NULL) {
+        free(pairs);
+        return -1;
+    }
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    tree->root[idx] = bst_merge_r(tree, idx, tree->root[idx], pairs, nodes, 0, m, &added);
+    if (added && tree->frozen[idx])
+        bst_frozen_free(tree, idx);
+    // The merge clears the key of a pair that was already in the index, and its filter
+    for (int64_t i = 0; added && i < m; i++) {
+        if (pairs[i].key)
+            bst_bloom_add(tree, idx, pairs[i].key);
+    }
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    // Nodes set aside for keys that were already there go back to the pool
+    for (int64_t i = 0; i < m; i++) {
+        if (pairs[i].key)
+            continue;
+        nodes[i].right = chain.head;
+        chain.head = &nodes[i];
+        if (!chain.tail)
+            chain.tail = &nodes[i];
+    }
+    bst_pool_release(bst_tree_pool(tree), &chain);
+    free(pairs);
+
+    return added;
+}
+
+// Takes every record of a detached subtree out of the tree's other indexes and hands its nodes
+// to the chain, returning how many there were
+static int64_t
+bst_expire_r(bst_tree_t *tree, int32_t idx, bst_node_t *node, bst_free_t free_fn, void *fn_data,
+        bst_chain_t *chain) {
+    int64_t count;
+    void *data;
+
+    if (!node)
+        return 0;
+
+    count = bst_expire_r(tree, idx, node->left, free_fn, fn_data, chain) +
+        bst_expire_r(tree, idx, node->right, free_fn, fn_data, chain);
+
+    for (uint32_t r = 0; r < bst_node_records(node); r++, count++) {
+        data = bst_node_record(node, r);
+        for (int32_t i = 0; i < tree->idx_count; i++) {
+            if (i != idx)
+                bst_delete_value_i(tree, i, bst_record_key(tree, i, &data), data);
+        }
+        if (free_fn)
+            free_fn(data, fn_data);
+    }
+    free(node->dups);
+    node->dups = NULL;
+
+    node->left = NULL;
+    node->height = 1;
+    node->right = chain->head;
+    chain->head = node;
+    if (!chain->tail)
+        chain->tail = node;
+
+    return count;
+}
+
+// Cuts everything < key off the subtree and returns what's left.  Whole subtrees below key are
+// detached without a single compare, and what remains on the path down is joined back
+// together, so it's O(log n) plus the nodes that go.
+static bst_node_t *
+bst_expire_split(bst_tree_t *tree, int32_t idx, bst_node_t *node, void *key, bst_free_t free_fn,
+        void *fn_data, bst_chain_t *chain, int64_t *count) {
+    bst_node_t *right;
+
+    if (!node)
+        return NULL;
+
+    if (bst_cmp(tree, idx, &node->key, key) == BST_RIGHT_GT) {
+        right = node->right;
+        node->right = NULL;
+        *count += bst_expire_r(tree, idx, node, free_fn, fn_data, chain);
+        return bst_expire_split(tree, idx, right, key, free_fn, fn_data, chain, count);
+    }
+
+    return bst_join(bst_expire_split(tree, idx, node->left, key, free_fn, fn_data, chain, count),
+            node, node->right);
+}
+
+int64_t
+bst_expire_before(bst_tree_t *tree, int32_t idx, void *key, bst_free_t free_fn, void *fn_data) {
+    bst_chain_t chain = { NULL, NULL };
+    int64_t count = 0;
+
+    if (bst_check_avl(tree, idx) < 0)
+        return -1;
+    if (tree->flags[idx] & BST_RCU) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is read without locks and can't be split.",
+                idx);
+        return -1;
+    }
+    if (tree->idx_count > 1 && bst_check_extractors(tree) < 0)
+        return -1;
+
+    bst_lock_all(tree);
+    tree->root[idx] = bst_expire_split(tree, idx, tree->root[idx], key, free_fn, fn_data, &chain,
+            &count);
+    if (count && tree->frozen[idx])
+        bst_frozen_free(tree, idx);
+    bst_unlock_all(tree);
+
+    bst_pool_release(bst_tree_pool(tree), &chain);
+
+    return count;
+}
+
+int32_t
+bst_iterate_r(bst_node_t *node, bst_iterate_t iter_fn, void *fn_data) {
+    int32_t rc;
+
+    if (node != NULL) {
+        bst_iterate_r(node->left, iter_fn, fn_data);
+        rc = BST_CB_OK;
+        for (uint32_t r = 0; r < bst_node_records(node) && rc == BST_CB_OK; r++)
+            rc = iter_fn(bst_node_record(node, r), fn_data);
+        switch(rc) {
+            case BST_CB_DELETE_AND_ABORT:
+            case BST_CB_DELETE_NODE:
+                snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
+            case BST_CB_ABORT:
+                return rc;
+        }
+        bst_iterate_r(node->right, iter_fn, fn_data);
+    }
+
+    return 0;
+}
+
+int32_t
+bst_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data) {
+    bst_snapshot_t *snap;
+
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return - 1;
+    }
+
+    // A BST_RCU index can be walked as it stands without holding anyone up
+    if ((tree->flags[idx] & BST_RCU) && (snap = bst_snapshot(tree, idx)) != NULL) {
+        bst_snapshot_iterate(snap, iter_fn, fn_data);
+        bst_snapshot_release(snap);
+        return 0;
+    }
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    if (tree->slab[idx])
+        bst_compact_iterate(tree, idx, iter_fn, fn_data);
+    else if (tree->btree[idx])
+        bst_btree_range(tree, idx, NULL, NULL, iter_fn, fn_data);
+    else if (tree->hash[idx])
+        bst_hash_iterate(tree, idx, iter_fn, fn_data);
+    else if (tree->shards[idx])
+        bst_shard_range(tree, idx, NULL, NULL, iter_fn, fn_data);
+    else if (tree->art[idx])
+        bst_art_iterate(tree, idx, iter_fn, fn_data);
+    else
+        bst_iterate_r(tree->root[idx], iter_fn, fn_data);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return 0;
+}
+
+// Ordered queries walk bst_node_t links, which the other index kinds don't have
+static int32_t
+bst_check_avl(bst_tree_t *tree, int32_t idx) {
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return -1;
+    }
+    if (tree->slab[idx] || tree->btree[idx] || tree->hash[idx] || tree->shards[idx] ||
+            tree->art[idx]) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is not an AVL tree.", idx);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Finds the first node whose key is >= key, or > key if strict is set.  Call with the index
+// locked.
+static bst_node_t *
+bst_bound(bst_tree_t *tree, int32_t idx, void *key, int32_t strict) {
+    bst_node_t *node = tree->root[idx], *found = NULL;
+    int32_t rc;
+
+    while (node) {
+        rc = bst_cmp(tree, idx, &node->key, key);
+        if (rc == BST_LEFT_GT || (rc == BST_EQUAL && !strict)) {
+            found = node;
+            node = node->left;
+        }
+        else {
+            node = node->right;
+        }
+    }
+
+    return found;
+}
+
+void *
+bst_lower_bound(bst_tree_t *tree, int32_t idx, void *key) {
+    bst_node_t *node;
+
+    if (bst_check_avl(tree, idx) < 0)
+        return NULL;
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    node = bst_bound(tree, idx, key, 0);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return (node ? node->data : NULL);
+}
+
+void *
+bst_upper_bound(bst_tree_t *tree, int32_t idx, void *key) {
+    bst_node_t *node;
+
+    if (bst_check_avl(tree, idx) < 0)
+        return NULL;
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    node = bst_bound(tree, idx, key, 1);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return (node ? node->data : NULL);
+}
+
+// Only the nodes on the path down to lo and the nodes inside [lo, hi] are ever visited.  The
+// stack holds the ancestors still to be called back, in key order.  Call with the tree locked.
+static int32_t
+bst_range_r(bst_node_t *node, void *lo, void *hi, bst_key_cmp_t cmp, void *ctx,
+        bst_iterate_t iter_fn, void *fn_data) {
+    bst_node_t *stack[BST_MAX_HEIGHT];
+    int32_t depth = 0, rc = 0;
+
+    while (node) {
+        if (lo && cmp(&node->key, lo, ctx) == BST_RIGHT_GT) {
+            node = node->right;
+        }
+        else {
+            stack[depth++] = node;
+            node = node->left;
+        }
+    }
+
+    while (depth) {
+        node = stack[--depth];
+        if (hi && cmp(&node->key, hi, ctx) == BST_LEFT_GT)
+            break;
+
+        for (uint32_t r = 0; r < bst_node_records(node) && rc == BST_CB_OK; r++)
+            rc = iter_fn(bst_node_record(node, r), fn_data);
+        if (rc != BST_CB_OK) {
+            if (rc == BST_CB_DELETE_NODE || rc == BST_CB_DELETE_AND_ABORT)
+                snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
+            break;
+        }
+
+        for (node = node->right; node; node = node->left)
+            stack[depth++] = node;
+    }
+
+    return rc;
+}
+
+int32_t
+bst_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi, bst_iterate_t iter_fn,
+        void *fn_data) {
+    int32_t rc = 0;
+
+    // B+tree indexes scan their linked leaves instead
+    if (idx < tree->idx_count && tree->btree[idx]) {
+#ifndef NO_LOCKS
+        pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+        rc = bst_btree_range(tree, idx, lo, hi, iter_fn, fn_data);
+#ifndef NO_LOCKS
+        pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+        return rc;
+    }
+
+    // and sharded ones go through their shards in order
+    if (idx < tree->idx_count && tree->shards[idx]) {
+#ifndef NO_LOCKS
+        pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+        rc = bst_shard_range(tree, idx, lo, hi, iter_fn, fn_data);
+#ifndef NO_LOCKS
+        pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+        return (rc == BST_CB_OK) ? 0 : rc;
+    }
+
+    if (bst_check_avl(tree, idx) < 0)
+        return -1;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    rc = bst_range_r(tree->root[idx], lo, hi, tree->key_cmp_fn[idx], tree->comp[idx], iter_fn,
+            fn_data);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return (rc == BST_CB_OK) ? 0 : rc;
+}
+
+// The records whose first count fields match are a contiguous run in key order, and compared
+// on only those fields the whole run is equal to key, so the run is just the range [key, key]
+// under a copy of the index's fields cut down to them.  In an ART index the run is a subtree.
+int32_t
+bst_prefix_range(bst_tree_t *tree, int32_t idx, void *key, int32_t count, bst_iterate_t iter_fn,
+        void *fn_data) {
+    bst_comp_t prefix;
+    int32_t rc;
+
+    if (idx < tree->idx_count && tree->art[idx]) {
+#ifndef NO_LOCKS
+        pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+        rc = bst_art_prefix(tree, idx, key, count, iter_fn, fn_data);
+#ifndef NO_LOCKS
+        pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+        return (rc == BST_CB_OK) ? 0 : rc;
+    }
+
+    if (bst_check_avl(tree, idx) < 0)
+        return -1;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    if (bst_comp_prefix(tree, idx, count, &prefix) < 0)
+        rc = -1;
+    else
+        rc = bst_range_r(tree->root[idx], key, key, bst_key_cmp_comp, &prefix, iter_fn, fn_data);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return (rc == BST_CB_OK) ? 0 : rc;
+}
+
+// Networks only go in integer ART indexes, and only the index they're given to
+static int32_t
+bst_check_net(bst_tree_t *tree, int32_t idx, int32_t bits) {
+    int32_t width;
+
+    if (idx >= tree->idx_count || !tree->art[idx]) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is not an ART index.", idx);
+        return -1;
+    }
+
+    switch (tree->flags[idx] & BST_KEYS) {
+        case BST_KUINT32: width = 32; break;
+        case BST_KUINT64: width = 64; break;
+        case BST_KINT128: width = 128; break;
+        default:
+            snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not have integer keys.", idx);
+            return -1;
+    }
+    if (bits < 0 || bits > width) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "A prefix of %d bits does not fit a %d bit key.", bits,
+                width);
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t
+bst_insert_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits, void *data) {
+    int32_t rc;
+
+    if (bst_check_net(tree, idx, bits) < 0)
+        return -1;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    rc = bst_art_insert_prefix(tree, idx, key, bits, data);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return rc;
+}
+
+void *
+bst_delete_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits) {
+    void *data;
+
+    if (bst_check_net(tree, idx, bits) < 0)
+        return NULL;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    data = bst_art_delete_prefix(tree, idx, key, bits);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return data;
+}
+
+void *
+bst_longest_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t *bits) {
+    void *data;
+
+    if (bst_check_net(tree, idx, 0) < 0)
+        return NULL;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    data = bst_art_longest_prefix(tree, idx, key, bits);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return data;
+}
+
+static int32_t
+bst_check_ostat(bst_tree_t *tree, int32_t idx) {
+    if (idx >= tree->idx_count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not exist.", idx);
+        return -1;
+    }
+    if (!(tree->flags[idx] & BST_OSTAT)) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d does not keep order statistics.", idx);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Counts the keys < key, or <= key if inclusive is set.  Call with the index locked.
+static int64_t
+bst_rank_r(bst_tree_t *tree, int32_t idx, void *key, int32_t inclusive) {
+    bst_node_t *node = tree->root[idx];
+    int64_t rank = 0;
+    int32_t rc;
+
+    while (node) {
+        rc = bst_cmp(tree, idx, &node->key, key);
+        if (rc == BST_LEFT_GT || (rc == BST_EQUAL && !inclusive)) {
+            node = node->left;
+        }
+        else {
+            rank += bst_get_size(node->left) + 1;
+            node = node->right;
+        }
+    }
+
+    return rank;
+}
+
+int64_t
+bst_rank(bst_tree_t *tree, int32_t idx, void *key) {
+    int64_t rank;
+
+    if (bst_check_ostat(tree, idx) < 0)
+        return -1;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    rank = bst_rank_r(tree, idx, key, 0);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return rank;
+}
+
+void *
+bst_select(bst_tree_t *tree, int32_t idx, int64_t k) {
+    bst_node_t *node;
+    int64_t left;
+
+    if (bst_check_ostat(tree, idx) < 0)
+        return NULL;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    node = tree->root[idx];
+    while (node) {
+        left = bst_get_size(node->left);
+        if (k < left) {
+            node = node->left;
+        }
+        else if (k > left) {
+            k -= left + 1;
+            node = node->right;
+        }
+        else {
+            break;
+        }
+    }
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return (node ? node->data : NULL);
+}
+
+int64_t
+bst_count_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi) {
+    int64_t count;
+
+    if (bst_check_ostat(tree, idx) < 0)
+        return -1;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+    count = (hi ? bst_rank_r(tree, idx, hi, 1) : bst_get_size(tree->root[idx])) -
+        (lo ? bst_rank_r(tree, idx, lo, 0) : 0);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+
+    return MAX(count, 0);
+}
+
+// The cursor keeps the whole path from the root to its current node, so it can step in either
+// direction without parent pointers.  An unpositioned cursor has an empty path.
+int32_t
+bst_cursor_open(bst_cursor_t *cur, bst_tree_t *tree, int32_t idx) {
+    if (bst_check_avl(tree, idx) < 0)
+        return -1;
+
+    cur->tree = tree;
+    cur->idx = idx;
+    cur->depth = 0;
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&tree->mutex[idx]);
+#endif
+
+    return 0;
+}
+
+void
+bst_cursor_close(bst_cursor_t *cur) {
+    cur->depth = 0;
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&cur->tree->mutex[cur->idx]);
+#endif
+}
+
+void *
+bst_cursor_seek(bst_cursor_t *cur, void *key) {
+    bst_tree_t *tree = cur->tree;
+    bst_node_t *node = tree->root[cur->idx];
+    int32_t found = 0, rc;
+
+    // Keep the path down to the last node that was >= key
+    cur->depth = 0;
+    while (node) {
+        cur->stack[cur->depth++] = node;
+        rc = bst_cmp(tree, cur->idx, &node->key, key);
+        if (rc == BST_EQUAL) {
+            found = cur->depth;
+            break;
+        }
+        if (rc == BST_LEFT_GT) {
+            found = cur->depth;
+            node = node->left;
+        }
+        else {
+            node = node->right;
+        }
+    }
+
+    cur->depth = found;
+
+    return (found ? cur->stack[found - 1]->data : NULL);
+}
+
+void *
+bst_cursor_next(bst_cursor_t *cur) {
+    bst_node_t *node, *child;
+
+    if (!cur->depth) {
+        node = cur->tree->root[cur->idx];
+    }
+    else if ((node = cur->stack[cur->depth - 1]->right) == NULL) {
+        // Climb until we come up out of a left subtree
+        do {
+            child = cur->stack[--cur->depth];
+        } while (cur->depth && cur->stack[cur->depth - 1]->right == child);
+
+        return (cur->depth ? cur->stack[cur->depth - 1]->data : NULL);
+    }
+
+    for (; node; node = node->left)
+        cur->stack[cur->depth++] = node;
+
+    return (cur->depth ? cur->stack[cur->depth - 1]->data : NULL);
+}
+
+void *
+bst_cursor_prev(bst_cursor_t *cur) {
+    bst_node_t *node, *child;
+
+    if (!cur->depth) {
+        node = cur->tree->root[cur->idx];
+    }
+    else if ((node = cur->stack[cur->depth - 1]->left) == NULL) {
+        // Climb until we come up out of a right subtree
+        do {
+            child = cur->stack[--cur->depth];
+        } while (cur->depth && cur->stack[cur->depth - 1]->left == child);
+
+        return (cur->depth ? cur->stack[cur->depth - 1]->data : NULL);
+    }
+
+    for (; node; node = node->right)
+        cur->stack[cur->depth++] = node;
+
+    return (cur->depth ? cur->stack[cur->depth - 1]->data : NULL);
+}
+
+void 
+bst_destroy(bst_tree_t *tree, void *fn_data) {
+    // Remove this tree from the list
+    list_remove_if(tree_list, remove_tree_cb, tree, fn_data);
+}
+
+int32_t
+bst_init() {
+    if ((registry = calloc(1, sizeof(bst_registry_t) +
+                    BST_REGISTRY_INIT_SZ * sizeof(bst_reg_entry_t *))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for tree registry");
+        return -1;
+    }
+    registry->mask = BST_REGISTRY_INIT_SZ - 1;
+
+    return list_create(&tree_list, tree_free_cb);
+}
+
+int32_t
+bst_fini() {
+    // Trees hand their nodes back to the pool as they go, so they must go first
+    list_destroy(tree_list, NULL);
+    sl_flush();
+    bst_epoch_synchronize();
+    free(registry);
+    registry = NULL;
+    bst_intern_free();
+    bst_pool_lock(&node_pool);
+    bst_pool_destroy(&node_pool);
+    bst_pool_unlock(&node_pool);
+    // Other threads' caches point into the freed chunks too; they must be finished by now
+    node_cache = NULL;
+    return 0;
+}
+
+static void
+bst_delete_data(bst_node_t *node, bst_free_t free_fn, void *fn_data, int32_t owner,
+        bst_chain_t *chain) {
+    if (node != NULL) {
+        bst_delete_data(node->left, free_fn, fn_data, owner, chain);
+        bst_delete_data(node->right, free_fn, fn_data, owner, chain);
+        for (uint32_t r = 0; r < bst_node_records(node); r++) {
+            if (free_fn)
+                free_fn(bst_node_record(node, r), fn_data);
+            else if (owner)
+                free(bst_node_record(node, r));
+        }
+        free(node->dups);
+        node->dups = NULL;
+
+        node->left = NULL;
+        node->height = 1;
+        node->right = chain->head;
+        chain->head = node;
+        if (!chain->tail)
+            chain->tail = node;
+    }
+}
+
+// BST_RCU indexes never change a node a reader can reach.  A write copies every node it would
+// modify, rotations included, links the copies into a new path from the root and publishes it
+// with one atomic store of the root pointer.  The nodes the copies replaced are retired to the
+// epoch collector, which returns them to the pool once no reader can still be on them.  Readers
+// only ever load pointers, so bst_fetch on a BST_RCU index skips the index lock.  Writers still
+// take it to keep each other out.
+#define BST_RCU_MAX_NODES (BST_MAX_HEIGHT * 4)
+
+typedef struct {
+    bst_tree_t *tree;
+    int32_t idx;
+    int32_t failed;
+    int32_t fresh_count;
+    int32_t retired_count;
+    bst_node_t *fresh[BST_RCU_MAX_NODES];
+    void *retired[BST_RCU_MAX_NODES];
+} bst_rcu_op_t;
+
+static void
+bst_rcu_reclaim(void *arg, void **ptrs, int32_t count) {
+    bst_chain_t chain = { NULL, NULL };
+    bst_node_t *node;
+
+    for (int32_t i = 0; i < count; i++) {
+        node = (bst_node_t *)ptrs[i];
+        node->left = NULL;
+        node->height = 1;
+        node->right = chain.head;
+        chain.head = node;
+        if (!chain.tail)
+            chain.tail = node;
+    }
+
+    bst_pool_release((bst_pool_t *)arg, &chain);
+}
+
+// Structures other than trees take nodes from the global pool through these, skiplist.c
+void *
+bst_pool_node(void) {
+    bst_node_t *node;
+
+    bst_new_node(&node_pool, node);
+
+    return node;
+}
+
+void
+bst_pool_put(void **nodes, int32_t count) {
+    // Tree code takes a node from the pool to have no duplicates, whatever else was in it
+    for (int32_t i = 0; i < count; i++)
+        ((bst_node_t *)nodes[i])->dups = NULL;
+    bst_rcu_reclaim(&node_pool, nodes, count);
+}
+
+// Only the counters need clearing, the arrays are filled in as the write goes
+static void
+bst_rcu_begin(bst_rcu_op_t *op, bst_tree_t *tree, int32_t idx) {
+    op->tree = tree;
+    op->idx = idx;
+    op->failed = 0;
+    op->fresh_count = 0;
+    op->retired_count = 0;
+}
+
+// A balanced tree keeps a write well inside BST_RCU_MAX_NODES copies and as many retired
+// nodes, but one that would go past either fails the same way as running out of memory
+static int32_t
+bst_rcu_retire(bst_rcu_op_t *op, bst_node_t *node) {
+    if (op->retired_count == BST_RCU_MAX_NODES) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: More than %d nodes retired by one write",
+                __FUNCTION__, BST_RCU_MAX_NODES);
+        op->failed = 1;
+        return -1;
+    }
+    op->retired[op->retired_count++] = node;
+
+    return 0;
+}
+
+static bst_node_t *
+bst_rcu_alloc(bst_rcu_op_t *op) {
+    bst_node_t *node;
+
+    if (op->fresh_count == BST_RCU_MAX_NODES) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: More than %d nodes copied by one write",
+                __FUNCTION__, BST_RCU_MAX_NODES);
+        op->failed = 1;
+        return NULL;
+    }
+
+    bst_new_node(bst_tree_pool(op->tree), node);
+    if (!node) {
+        op->failed = 1;
+        return NULL;
+    }
+    op->fresh[op->fresh_count++] = node;
+
+    return node;
+}
+
+// Returns a copy of node that this write is free to change, or node itself if it already is one
+static bst_node_t *
+bst_rcu_own(bst_rcu_op_t *op, bst_node_t *node) {
+    bst_node_t *copy;
+
+    for (int32_t i = 0; i < op->fresh_count; i++) {
+        if (op->fresh[i] == node)
+            return node;
+    }
+
+    if (bst_rcu_retire(op, node) < 0 || (copy = bst_rcu_alloc(op)) == NULL)
+        return NULL;
+    *copy = *node;
+
+    return copy;
+}
+
+// bst_rebalance on a node this write owns.  Whatever a rotation changes gets owned first: on
+// insert that's already the case, on delete it's the sibling side that gets copied.
+static bst_node_t *
+bst_rcu_rebalance(bst_rcu_op_t *op, bst_node_t *node) {
+    int32_t lh = bst_get_height(node->left);
+    int32_t rh = bst_get_height(node->right);
+    bst_node_t *child;
+
+    if ((lh - rh) > 1) {
+        if ((child = node->left = bst_rcu_own(op, node->left)) == NULL)
+            return NULL;
+        // Left Right Case
+        if (bst_get_height(child->left) < bst_get_height(child->right)) {
+            if ((child->right = bst_rcu_own(op, child->right)) == NULL)
+                return NULL;
+            node->left = bst_left_rotate(child);
+        }
+        return bst_right_rotate(node);
+    }
+    else if ((lh - rh) < -1) {
+        if ((child = node->right = bst_rcu_own(op, node->right)) == NULL)
+            return NULL;
+        // Right Left Case
+        if (bst_get_height(child->right) < bst_get_height(child->left)) {
+            if ((child->left = bst_rcu_own(op, child->left)) == NULL)
+                return NULL;
+            node->right = bst_right_rotate(child);
+        }
+        return bst_left_rotate(node);
+    }
+
+    bst_update_node(node);
+
+    return node;
+}
+
+// The key is known to be absent.  The same descent as bst_insert_t, except that every node on
+// the way down is swapped for a copy before its link is followed, so the path holds links into
+// copies only.  Returns the new root, which is only meaningful if op->failed is still clear.
+static bst_node_t *
+bst_rcu_insert_i(bst_rcu_op_t *op, bst_node_t *root, void *key, void *data) {
+    bst_tree_t *tree = op->tree;
+    bst_node_t **path[BST_MAX_HEIGHT];
+    bst_node_t **link = &root;
+    bst_node_t *node;
+    int32_t depth = 0;
+
+    while (*link) {
+        if ((node = *link = bst_rcu_own(op, *link)) == NULL)
+            return NULL;
+        path[depth++] = link;
+        link = (bst_cmp(tree, op->idx, &node->key, key) == BST_LEFT_GT) ?
+            &node->left : &node->right;
+    }
+
+    if ((node = bst_rcu_alloc(op)) == NULL)
+        return NULL;
+    tree->key_cpy_fn[op->idx](&node->key, key);
+    node->data = data;
+    node->dups = NULL;
+    node->left = node->right = NULL;
+    node->height = 1;
+    node->size = 1;
+    *link = node;
+
+    // Heights and sizes are fixed all the way up, the copies above have to be touched anyway
+    while (depth--) {
+        link = path[depth];
+        if ((*link = bst_rcu_rebalance(op, *link)) == NULL)
+            return NULL;
+    }
+
+    return root;
+}
+
+// The key is known to be present.  Laid out like bst_delete_t: the deleted node is retired
+// rather than copied, and its successor is copied into its place.
+static bst_node_t *
+bst_rcu_delete_i(bst_rcu_op_t *op, bst_node_t *root, void *key, void **data) {
+    bst_tree_t *tree = op->tree;
+    bst_node_t **path[BST_MAX_HEIGHT];
+    bst_node_t **link = &root, **sub;
+    bst_node_t *node, *right, *min;
+    int32_t depth = 0, target, rc;
+
+    while ((rc = bst_cmp(tree, op->idx, &(*link)->key, key)) != BST_EQUAL) {
+        if ((node = *link = bst_rcu_own(op, *link)) == NULL)
+            return NULL;
+        path[depth++] = link;
+        link = (rc == BST_LEFT_GT) ? &node->left : &node->right;
+    }
+
+    node = *link;
+    *data = node->data;
+    if (bst_rcu_retire(op, node) < 0)
+        return NULL;
+
+    if (!node->left || !node->right) {
+        *link = node->left ? node->left : node->right;
+    }
+    else {
+        // The right subtree's leftmost spine is copied down to the successor, with the top of
+        // it held in right until the successor's copy exists to take it
+        target = depth;
+        path[depth++] = link;
+        right = node->right;
+        sub = &right;
+        while ((*sub)->left) {
+            if ((*sub = bst_rcu_own(op, *sub)) == NULL)
+                return NULL;
+            path[depth++] = sub;
+            sub = &(*sub)->left;
+        }
+
+        if ((min = bst_rcu_own(op, *sub)) == NULL)
+            return NULL;
+        *sub = min->right;
+        min->left = node->left;
+        min->right = right;
+        *link = min;
+        if (depth > target + 1)
+            path[target + 1] = &min->right;
+    }
+
+    while (depth--) {
+        link = path[depth];
+        if ((*link = bst_rcu_rebalance(op, *link)) == NULL)
+            return NULL;
+    }
+
+    return root;
+}
+
+// Publishes a finished write, or throws its copies away if it ran out of memory
+static int32_t
+bst_rcu_commit(bst_rcu_op_t *op, bst_node_t *root) {
+    bst_tree_t *tree = op->tree;
+
+    if (op->failed) {
+        bst_rcu_reclaim(bst_tree_pool(tree), (void **)op->fresh, op->fresh_count);
+        return -1;
+    }
+
+    __atomic_store_n(&tree->root[op->idx], root, __ATOMIC_RELEASE);
+    bst_epoch_retire(op->retired, op->retired_count, bst_rcu_reclaim, bst_tree_pool(tree));
+
+    return 0;
+}
 
 static int32_t
-bst_key_cmp_i64(bst_key_t *left, bst_key_t *right) {
-    return (left->i64 == right->i64) ? BST_EQUAL : (left->i64 < right->i64) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
+bst_rcu_insert(bst_tree_t *tree, int32_t idx, void *key, void *data) {
+    bst_rcu_op_t op;
+    bst_node_t *root;
+
+    if (bst_find_t(tree->root[idx], key, tree->key_cmp_fn[idx], tree->comp[idx]))
+        return 1;
+
+    bst_rcu_begin(&op, tree, idx);
+    root = bst_rcu_insert_i(&op, tree->root[idx], key, data);
+
+    return bst_rcu_commit(&op, root);
+}
+
+static void *
+bst_rcu_delete(bst_tree_t *tree, int32_t idx, void *key) {
+    bst_rcu_op_t op;
+    bst_node_t *root;
+    void *data = NULL;
+
+    if (!bst_find_t(tree->root[idx], key, tree->key_cmp_fn[idx], tree->comp[idx]))
+        return NULL;
+
+    bst_rcu_begin(&op, tree, idx);
+    root = bst_rcu_delete_i(&op, tree->root[idx], key, &data);
+
+    // Out of memory leaves the key where it was, same as a delete that found nothing
+    return (bst_rcu_commit(&op, root) == 0) ? data : NULL;
+}
+
+// Writers never change a node a reader can reach, so the root of the moment is a snapshot of
+// the whole index for as long as its nodes are kept from being reclaimed
+bst_snapshot_t *
+bst_snapshot(bst_tree_t *tree, int32_t idx) {
+    bst_snapshot_t *snap;
+
+    if (bst_check_avl(tree, idx) < 0)
+        return NULL;
+    if (!(tree->flags[idx] & BST_RCU)) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d has to be BST_RCU to be snapshotted.", idx);
+        return NULL;
+    }
+
+    if ((snap = malloc(sizeof(bst_snapshot_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for snapshot");
+        return NULL;
+    }
+
+    if ((snap->pin = bst_epoch_pin()) == NULL) {
+        free(snap);
+        return NULL;
+    }
+
+    snap->tree = tree;
+    snap->idx = idx;
+    snap->root = __atomic_load_n(&tree->root[idx], __ATOMIC_ACQUIRE);
+
+    return snap;
 }
 
-static int32_t
-bst_key_cmp_u8(bst_key_t *left, bst_key_t *right) {
-    return (left->u8 == right->u8) ? BST_EQUAL : (left->u8 < right->u8) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
+void *
+bst_snapshot_fetch(bst_snapshot_t *snap, void *key) {
+    bst_node_t *node = bst_find_t(snap->root, key, snap->tree->key_cmp_fn[snap->idx],
+            snap->tree->comp[snap->idx]);
+
+    return (node ? node->data : NULL);
 }
 
-static int32_t
-bst_key_cmp_u16(bst_key_t *left, bst_key_t *right) {
-    return (left->u64 == right->u16) ? BST_EQUAL : (left->u16 < right->u16) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
+int32_t
+bst_snapshot_iterate(bst_snapshot_t *snap, bst_iterate_t iter_fn, void *fn_data) {
+    int32_t rc = bst_range_r(snap->root, NULL, NULL, snap->tree->key_cmp_fn[snap->idx],
+            snap->tree->comp[snap->idx], iter_fn, fn_data);
+
+    return (rc == BST_CB_OK) ? 0 : rc;
 }
 
-static int32_t
-bst_key_cmp_u32(bst_key_t *left, bst_key_t *right) {
-    return (left->u32 == right->u32) ? BST_EQUAL : (left->u32 < right->u32) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
+int32_t
+bst_snapshot_range(bst_snapshot_t *snap, void *lo, void *hi, bst_iterate_t iter_fn,
+        void *fn_data) {
+    int32_t rc = bst_range_r(snap->root, lo, hi, snap->tree->key_cmp_fn[snap->idx],
+            snap->tree->comp[snap->idx], iter_fn, fn_data);
+
+    return (rc == BST_CB_OK) ? 0 : rc;
 }
 
-static int32_t
-bst_key_cmp_u64(bst_key_t *left, bst_key_t *right) {
-    return (left->u64 == right->u64) ? BST_EQUAL : (left->u64 < right->u64) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
+void
+bst_snapshot_release(bst_snapshot_t *snap) {
+    if (!snap)
+        return;
+
+    bst_epoch_unpin(snap->pin);
+    free(snap);
 }
 
+// BST_SHARDED indexes split their key space into ranges, each an AVL tree of its own with its
+// own lock, so writers into different ranges don't wait on each other.  Shard i holds the keys
+// from lo[i] up to but not including lo[i + 1]; shard 0 has no lower bound.  Every operation
+// takes the index lock for reading, which only keeps the shard layout still, and then locks the
+// one shard it needs.  A shard that outgrows split_at is split in two at its root by whoever
+// next finds it pending, under the index write lock.
+#define BST_MAX_SHARDS 64
+#define BST_SHARD_MIN 4096
+
+typedef struct {
+    bst_node_t *root;
+    int64_t count;
+    pthread_rwlock_t mutex;
+} __attribute__((aligned(64))) bst_shard_t;
+
+typedef struct bst_shards_s {
+    int32_t count;
+    int32_t pending;
+    int64_t split_at;
+    bst_key_t lo[BST_MAX_SHARDS];
+    bst_shard_t shard[BST_MAX_SHARDS];
+} bst_shards_t;
+
 static int32_t
-bst_key_cmp_i128(bst_key_t *left, bst_key_t *right) {
-    return (left->i128 == right->i128) ? BST_EQUAL : (left->i128 < right->i128) ?
-        BST_RIGHT_GT : BST_LEFT_GT;
+bst_shard_init(bst_tree_t *tree, int32_t idx) {
+    bst_shards_t *set;
+
+    if ((set = aligned_alloc(64, sizeof(bst_shards_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for sharded index");
+        return -1;
+    }
+
+    memset(set, 0, sizeof(bst_shards_t));
+    set->count = 1;
+    set->split_at = BST_SHARD_MIN;
+    for (int32_t i = 0; i < BST_MAX_SHARDS; i++)
+        pthread_rwlock_init(&set->shard[i].mutex, NULL);
+    tree->shards[idx] = set;
+
+    return 0;
 }
 
+// Shard bounds can't point into records that might go away, so string bounds are copies
 static int32_t
-bst_key_cmp_tme(bst_key_t *left, bst_key_t *right) {
-    if (left->tv.tv_sec != right->tv.tv_sec) {
-        return (left->tv.tv_sec < right->tv.tv_sec) ? BST_RIGHT_GT : BST_LEFT_GT;
+bst_shard_set_lo(bst_tree_t *tree, int32_t idx, int32_t i, void *key) {
+    bst_shards_t *set = tree->shards[idx];
+
+    if ((tree->flags[idx] & BST_KEYS) != BST_KPSTR) {
+        tree->key_cpy_fn[idx](&set->lo[i], key);
+        return 0;
     }
-    if (left->tv.tv_usec != right->tv.tv_usec) {
-        return (left->tv.tv_usec < right->tv.tv_usec) ? BST_RIGHT_GT : BST_LEFT_GT;
+
+    if ((set->lo[i].pstr = strdup(((bst_key_t *)key)->pstr)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for shard bound");
+        return -1;
     }
+    // Shards are found with the prefix comparator too
+    bst_key_cpy_spfx(&set->lo[i], &set->lo[i]);
+
     return 0;
 }
 
 static void
-bst_key_cpy_str(bst_key_t *dst, bst_key_t *src) {
-    strcpy(dst->pstr, src->pstr);
+bst_shard_free_lo(bst_tree_t *tree, int32_t idx, int32_t i) {
+    if ((tree->flags[idx] & BST_KEYS) == BST_KPSTR)
+        free(tree->shards[idx]->lo[i].pstr);
 }
 
 static void
-bst_key_cpy_i8(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(int8_t));
+bst_shard_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner,
+        bst_chain_t *chain) {
+    bst_shards_t *set = tree->shards[idx];
+
+    if (!set)
+        return;
+
+    for (int32_t i = 0; i < BST_MAX_SHARDS; i++) {
+        if (i < set->count) {
+            bst_delete_data(set->shard[i].root, tree->free_fn[idx], fn_data, owner, chain);
+            if (i > 0)
+                bst_shard_free_lo(tree, idx, i);
+        }
+        pthread_rwlock_destroy(&set->shard[i].mutex);
+    }
+
+    free(set);
+    tree->shards[idx] = NULL;
 }
 
-static void
-bst_key_cpy_i16(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(int16_t));
+static bst_node_t *
+bst_pop_min(bst_node_t *node, bst_node_t **min) {
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+
+    node->left = bst_pop_min(node->left, min);
+
+    return bst_rebalance(node);
 }
 
+// Moves shards from on down by delta places, leaving their locks where they are
 static void
-bst_key_cpy_i32(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(int32_t));
+bst_shard_shift(bst_shards_t *set, int32_t from, int32_t delta) {
+    int32_t i;
+
+    if (delta > 0) {
+        for (i = set->count - 1; i >= from; i--) {
+            set->shard[i + delta].root = set->shard[i].root;
+            set->shard[i + delta].count = set->shard[i].count;
+            set->lo[i + delta] = set->lo[i];
+        }
+    }
+    else {
+        for (i = from; i < set->count; i++) {
+            set->shard[i + delta].root = set->shard[i].root;
+            set->shard[i + delta].count = set->shard[i].count;
+            set->lo[i + delta] = set->lo[i];
+        }
+    }
+
+    set->count += delta;
 }
 
+// Folds shard i + 1 into shard i
 static void
-bst_key_cpy_i64(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(int64_t));
+bst_shard_merge(bst_tree_t *tree, int32_t idx, int32_t i) {
+    bst_shards_t *set = tree->shards[idx];
+    bst_node_t *right = set->shard[i + 1].root, *min;
+
+    if (right) {
+        right = bst_pop_min(right, &min);
+        set->shard[i].root = bst_join(set->shard[i].root, min, right);
+    }
+    set->shard[i].count += set->shard[i + 1].count;
+
+    bst_shard_free_lo(tree, idx, i + 1);
+    bst_shard_shift(set, i + 2, -1);
 }
 
-static void
-bst_key_cpy_u8(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(uint8_t));
+// Splits shard i at its root, which goes to the right half as its smallest key.  Shard trees
+// keep exact subtree sizes, so the halves are counted without walking either of them and the
+// split takes O(log n) under the index write lock.
+static int32_t
+bst_shard_split(bst_tree_t *tree, int32_t idx, int32_t i) {
+    bst_shards_t *set = tree->shards[idx];
+    bst_node_t *root = set->shard[i].root;
+    int64_t count = set->shard[i].count;
+
+    bst_shard_shift(set, i + 1, 1);
+    if (bst_shard_set_lo(tree, idx, i + 1, &root->key) < 0) {
+        bst_shard_shift(set, i + 2, -1);
+        return -1;
+    }
+
+    set->shard[i].root = root->left;
+    set->shard[i].count = bst_get_size(root->left);
+    set->shard[i + 1].root = bst_join(NULL, root, root->right);
+    set->shard[i + 1].count = count - set->shard[i].count;
+
+    return 0;
 }
 
+// Splits every shard that has outgrown split_at.  Once out of shards, the two smallest
+// neighbours are merged to make room, as long as that doesn't just make another oversized
+// shard.  Call with the index write locked.
 static void
-bst_key_cpy_u16(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(uint16_t));
+bst_shard_rebalance(bst_tree_t *tree, int32_t idx) {
+    bst_shards_t *set = tree->shards[idx];
+    int64_t total = 0, best;
+    int32_t merge;
+
+    for (int32_t i = 0; i < set->count; i++)
+        total += set->shard[i].count;
+    set->split_at = MAX(BST_SHARD_MIN, 2 * total / BST_MAX_SHARDS);
+
+    for (int32_t i = 0; i < set->count; i++) {
+        while (set->shard[i].count > set->split_at) {
+            if (set->count == BST_MAX_SHARDS) {
+                merge = -1;
+                best = set->split_at;
+                for (int32_t j = 0; j < set->count - 1; j++) {
+                    if (j != i && j + 1 != i &&
+                            set->shard[j].count + set->shard[j + 1].count < best) {
+                        best = set->shard[j].count + set->shard[j + 1].count;
+                        merge = j;
+                    }
+                }
+                if (merge < 0)
+                    break;
+
+                bst_shard_merge(tree, idx, merge);
+                if (merge < i)
+                    i--;
+            }
+
+            if (bst_shard_split(tree, idx, i) < 0)
+                break;
+        }
+    }
+
+    __atomic_store_n(&set->pending, 0, __ATOMIC_RELAXED);
 }
 
+// Rebalances an index whose writers left it pending.  Call without holding the index lock.
 static void
-bst_key_cpy_u32(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(uint32_t));
+bst_shard_maintain(bst_tree_t *tree, int32_t idx) {
+    bst_shards_t *set = tree->shards[idx];
+
+    if (!set || !__atomic_load_n(&set->pending, __ATOMIC_RELAXED))
+        return;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    if (set->pending)
+        bst_shard_rebalance(tree, idx);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
 }
 
-static void
-bst_key_cpy_u64(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(uint64_t));
+static int
+bst_sample_cmp(const void *a, const void *b, void *arg) {
+    bst_tree_idx_t *ti = arg;
+
+    return bst_cmp(ti->tree, ti->idx, *(bst_key_t **)a, *(bst_key_t **)b);
 }
 
-static void
-bst_key_cpy_i128(bst_key_t *dst, bst_key_t *src) {
-    dst->i128 = src->i128;
+int32_t
+bst_set_shard_bounds(bst_tree_t *tree, int32_t idx, void **sample, int64_t n) {
+    bst_shards_t *set;
+    void **sorted;
+    int32_t shards, rc = -1;
+
+    if (idx >= tree->idx_count || !tree->shards[idx]) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is not sharded.", idx);
+        return -1;
+    }
+    if (n <= 0)
+        return 0;
+
+    if ((sorted = malloc(n * sizeof(void *))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for shard sample");
+        return -1;
+    }
+    memcpy(sorted, sample, n * sizeof(void *));
+    qsort_r(sorted, n, sizeof(void *), bst_sample_cmp, &(bst_tree_idx_t){ tree, idx });
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&tree->mutex[idx]);
+#endif
+    set = tree->shards[idx];
+    if (set->count > 1 || set->shard[0].root) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d is not empty.", idx);
+        goto done;
+    }
+
+    // Leave half the shards free for splitting ranges the sample got wrong
+    shards = MIN(n, BST_MAX_SHARDS / 2);
+    for (int32_t i = 1; i < shards; i++) {
+        if (set->count > 1 && bst_cmp(tree, idx, &set->lo[set->count - 1],
+                    sorted[i * n / shards]) == BST_EQUAL)
+            continue;
+        if (bst_shard_set_lo(tree, idx, set->count, sorted[i * n / shards]) < 0)
+            goto done;
+        set->count++;
+    }
+    rc = 0;
+
+done:
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&tree->mutex[idx]);
+#endif
+    free(sorted);
+
+    return rc;
 }
 
-static void
-bst_key_cpy_tme(bst_key_t *dst, bst_key_t *src) {
-    memcpy(dst, src, sizeof(struct timeval));
+// Shards are locked one at a time, so each one is scanned as it stood at the time, but writes
+// to shards not yet reached can still show up.  Call with the index locked.
+static int32_t
+bst_shard_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi, bst_iterate_t iter_fn,
+        void *fn_data) {
+    bst_shards_t *set = tree->shards[idx];
+    bst_shard_t *shard;
+    int32_t rc = BST_CB_OK;
+
+    for (int32_t i = 0; i < set->count && rc == BST_CB_OK; i++) {
+        // Skip shards that end before lo, and stop at the first that starts after hi
+        if (lo && i + 1 < set->count &&
+                bst_cmp(tree, idx, &set->lo[i + 1], lo) != BST_LEFT_GT)
+            continue;
+        if (hi && i > 0 && bst_cmp(tree, idx, &set->lo[i], hi) == BST_LEFT_GT)
+            break;
+
+        shard = &set->shard[i];
+#ifndef NO_LOCKS
+        pthread_rwlock_rdlock(&shard->mutex);
+#endif
+        rc = bst_range_r(shard->root, lo, hi, tree->key_cmp_fn[idx], NULL, iter_fn, fn_data);
+#ifndef NO_LOCKS
+        pthread_rwlock_unlock(&shard->mutex);
+#endif
+    }
+
+    return rc;
 }
 
-static void
-bst_set_key_fn_ptrs(bst_tree_t *tree, int64_t flags) {
+// The shard whose range holds key.  Sharded indexes never have composite keys, so there's no
+// comparator context.
+bst_always_inline bst_shard_t *
+bst_shard_find_t(bst_shards_t *set, void *key, bst_key_cmp_t cmp) {
+    int32_t lo = 1, hi = set->count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cmp(&set->lo[mid], key, NULL) == BST_LEFT_GT)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return &set->shard[lo - 1];
+}
+
+bst_always_inline void *
+bst_shard_fetch_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_cmp_t cmp) {
+    bst_shard_t *shard = bst_shard_find_t(tree->shards[idx], key, cmp);
+    bst_node_t *node;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_rdlock(&shard->mutex);
+#endif
+    node = bst_find_t(shard->root, key, cmp, NULL);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&shard->mutex);
+#endif
+
+    return (node ? node->data : NULL);
+}
+
+bst_always_inline int32_t
+bst_shard_insert_t(bst_tree_t *tree, int32_t idx, void *key, void *data, bst_key_cmp_t cmp) {
+    bst_shards_t *set = tree->shards[idx];
+    bst_shard_t *shard = bst_shard_find_t(set, key, cmp);
+    int32_t rc;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&shard->mutex);
+#endif
+    rc = bst_insert_t(tree, idx, &shard->root, key, data, cmp);
+    if (rc == 0 && ++shard->count > set->split_at)
+        __atomic_store_n(&set->pending, 1, __ATOMIC_RELAXED);
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&shard->mutex);
+#endif
+
+    return rc;
+}
+
+bst_always_inline void *
+bst_shard_delete_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_cmp_t cmp) {
+    bst_shard_t *shard = bst_shard_find_t(tree->shards[idx], key, cmp);
+    void *data;
+
+#ifndef NO_LOCKS
+    pthread_rwlock_wrlock(&shard->mutex);
+#endif
+    if ((data = bst_delete_t(tree, idx, &shard->root, key, cmp)) != NULL)
+        shard->count--;
+#ifndef NO_LOCKS
+    pthread_rwlock_unlock(&shard->mutex);
+#endif
+
+    return data;
+}
+
+// One set of specialized routines per key type, see bst_find_t
+#define BST_KEY_OPS(sfx)                                                                    \
+static void *                                                                               \
+bst_fetch_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                                 \
+    bst_node_t *node = bst_find_t(tree->root[idx], key, bst_key_cmp_##sfx, tree->comp[idx]); \
+    return (node ? node->data : NULL);                                                      \
+}                                                                                           \
+static int32_t                                                                              \
+bst_insert_##sfx(bst_tree_t *tree, int32_t idx, void *key, void *data) {                    \
+    return bst_insert_t(tree, idx, &tree->root[idx], key, data, bst_key_cmp_##sfx);         \
+}                                                                                           \
+static void *                                                                               \
+bst_delete_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                                \
+    return bst_delete_t(tree, idx, &tree->root[idx], key, bst_key_cmp_##sfx);               \
+}                                                                                           \
+static void                                                                                 \
+bst_fetch_many_##sfx(bst_tree_t *tree, int32_t idx, void **keys, int64_t n, void **out) {   \
+    bst_fetch_many_t(__atomic_load_n(&tree->root[idx], __ATOMIC_ACQUIRE), keys, n, out,     \
+            bst_key_cmp_##sfx, tree->comp[idx]);                                            \
+}                                                                                           \
+static const bst_ops_t bst_ops_##sfx = {                                                    \
+    bst_fetch_##sfx, bst_insert_##sfx, bst_delete_##sfx, bst_fetch_many_##sfx               \
+};                                                                                          \
+static void *                                                                               \
+bst_rcu_fetch_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                             \
+    bst_node_t *node = bst_find_t(__atomic_load_n(&tree->root[idx], __ATOMIC_ACQUIRE), key,  \
+            bst_key_cmp_##sfx, tree->comp[idx]);                                            \
+    return (node ? node->data : NULL);                                                      \
+}                                                                                           \
+static const bst_ops_t bst_rcu_ops_##sfx = {                                                \
+    bst_rcu_fetch_##sfx, bst_rcu_insert, bst_rcu_delete, bst_fetch_many_##sfx               \
+};                                                                                          \
+static void *                                                                               \
+bst_shard_fetch_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                           \
+    return bst_shard_fetch_t(tree, idx, key, bst_key_cmp_##sfx);                            \
+}                                                                                           \
+static int32_t                                                                              \
+bst_shard_insert_##sfx(bst_tree_t *tree, int32_t idx, void *key, void *data) {              \
+    return bst_shard_insert_t(tree, idx, key, data, bst_key_cmp_##sfx);                     \
+}                                                                                           \
+static void *                                                                               \
+bst_shard_delete_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                          \
+    return bst_shard_delete_t(tree, idx, key, bst_key_cmp_##sfx);                           \
+}                                                                                           \
+static const bst_ops_t bst_shard_ops_##sfx __attribute__((unused)) = {                      \
+    bst_shard_fetch_##sfx, bst_shard_insert_##sfx, bst_shard_delete_##sfx, NULL             \
+};
+
+// String indexes compare node prefixes first, see bst_key_cmp_spfx
+BST_KEY_OPS(spfx)
+BST_KEY_OPS(i8)
+BST_KEY_OPS(i16)
+BST_KEY_OPS(i32)
+BST_KEY_OPS(i64)
+BST_KEY_OPS(u8)
+BST_KEY_OPS(u16)
+BST_KEY_OPS(u32)
+BST_KEY_OPS(u64)
+BST_KEY_OPS(i128)
+BST_KEY_OPS(tme)
+
+// Composite keys are compared by bst_key_cmp_comp with the index's fields, see bst_comp.c.
+// They're never sharded, so their shard ops go unused.
+BST_KEY_OPS(comp)
+
+static const bst_ops_t *
+bst_shard_ops(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return &bst_shard_ops_spfx;
+        case BST_KINT8:   return &bst_shard_ops_i8;
+        case BST_KINT16:  return &bst_shard_ops_i16;
+        case BST_KINT32:  return &bst_shard_ops_i32;
+        case BST_KINT64:  return &bst_shard_ops_i64;
+        case BST_KUINT8:  return &bst_shard_ops_u8;
+        case BST_KUINT16: return &bst_shard_ops_u16;
+        case BST_KUINT32: return &bst_shard_ops_u32;
+        case BST_KUINT64: return &bst_shard_ops_u64;
+        case BST_KINT128: return &bst_shard_ops_i128;
+        case BST_KTME:    return &bst_shard_ops_tme;
+    }
+
+    return NULL;
+}
+
+static int32_t
+bst_set_key_fn_ptrs(bst_tree_t *tree, int32_t idx, int64_t flags) {
+    int64_t kind;
+
     switch (flags & BST_KEYS) {
         case BST_KPSTR:
-            tree->key_cmp_fn = bst_key_cmp_str;
-            tree->key_cpy_fn = bst_key_cpy_str;
+            tree->key_cmp_fn[idx] = bst_key_cmp_str;
+            tree->key_hash_fn[idx] = bst_key_hash_str;
+            tree->key_cpy_fn[idx] = (flags & BST_INTERN) ? bst_key_cpy_istr : bst_key_cpy_spfx;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_spfx : &bst_ops_spfx;
             break;
         case BST_KINT8:
-            tree->key_cmp_fn = bst_key_cmp_i8;
-            tree->key_cpy_fn = bst_key_cpy_i8;
+            tree->key_cmp_fn[idx] = bst_key_cmp_i8;
+            tree->key_hash_fn[idx] = bst_key_hash_i8;
+            tree->key_cpy_fn[idx] = bst_key_cpy_i8;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_i8 : &bst_ops_i8;
             break;
         case BST_KINT16:
-            tree->key_cmp_fn = bst_key_cmp_i16;
-            tree->key_cpy_fn = bst_key_cpy_i16;
+            tree->key_cmp_fn[idx] = bst_key_cmp_i16;
+            tree->key_hash_fn[idx] = bst_key_hash_i16;
+            tree->key_cpy_fn[idx] = bst_key_cpy_i16;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_i16 : &bst_ops_i16;
             break;
         case BST_KINT32:
-            tree->key_cmp_fn = bst_key_cmp_i32;
-            tree->key_cpy_fn = bst_key_cpy_i32;
+            tree->key_cmp_fn[idx] = bst_key_cmp_i32;
+            tree->key_hash_fn[idx] = bst_key_hash_i32;
+            tree->key_cpy_fn[idx] = bst_key_cpy_i32;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_i32 : &bst_ops_i32;
             break;
         case BST_KINT64:
-            tree->key_cmp_fn = bst_key_cmp_i64;
-            tree->key_cpy_fn = bst_key_cpy_i64;
+            tree->key_cmp_fn[idx] = bst_key_cmp_i64;
+            tree->key_hash_fn[idx] = bst_key_hash_i64;
+            tree->key_cpy_fn[idx] = bst_key_cpy_i64;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_i64 : &bst_ops_i64;
             break;
         case BST_KUINT8:
-            tree->key_cmp_fn = bst_key_cmp_u8;
-            tree->key_cpy_fn = bst_key_cpy_u8;
+            tree->key_cmp_fn[idx] = bst_key_cmp_u8;
+            tree->key_hash_fn[idx] = bst_key_hash_u8;
+            tree->key_cpy_fn[idx] = bst_key_cpy_u8;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_u8 : &bst_ops_u8;
             break;
         case BST_KUINT16:
-            tree->key_cmp_fn = bst_key_cmp_u16;
-            tree->key_cpy_fn = bst_key_cpy_u16;
+            tree->key_cmp_fn[idx] = bst_key_cmp_u16;
+            tree->key_hash_fn[idx] = bst_key_hash_u16;
+            tree->key_cpy_fn[idx] = bst_key_cpy_u16;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_u16 : &bst_ops_u16;
             break;
         case BST_KUINT32:
-            tree->key_cmp_fn = bst_key_cmp_u32;
-            tree->key_cpy_fn = bst_key_cpy_u32;
+            tree->key_cmp_fn[idx] = bst_key_cmp_u32;
+            tree->key_hash_fn[idx] = bst_key_hash_u32;
+            tree->key_cpy_fn[idx] = bst_key_cpy_u32;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_u32 : &bst_ops_u32;
             break;
         case BST_KUINT64:
-            tree->key_cmp_fn = bst_key_cmp_u64;
-            tree->key_cpy_fn = bst_key_cpy_u64;
+            tree->key_cmp_fn[idx] = bst_key_cmp_u64;
+            tree->key_hash_fn[idx] = bst_key_hash_u64;
+            tree->key_cpy_fn[idx] = bst_key_cpy_u64;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_u64 : &bst_ops_u64;
             break;
         case BST_KINT128:
-            tree->key_cmp_fn = bst_key_cmp_i128;
-            tree->key_cpy_fn = bst_key_cpy_i128;
+            tree->key_cmp_fn[idx] = bst_key_cmp_i128;
+            tree->key_hash_fn[idx] = bst_key_hash_i128;
+            tree->key_cpy_fn[idx] = bst_key_cpy_i128;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_i128 : &bst_ops_i128;
             break;
         case BST_KTME:
-            tree->key_cmp_fn = bst_key_cmp_tme;
-            tree->key_cpy_fn = bst_key_cpy_tme;
+            tree->key_cmp_fn[idx] = bst_key_cmp_tme;
+            tree->key_hash_fn[idx] = bst_key_hash_tme;
+            tree->key_cpy_fn[idx] = bst_key_cpy_tme;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_tme : &bst_ops_tme;
             break;
-        default:
-            snprintf(err_str, MAX_ERR_LEN -1, "Can't happen at: %s():%d", __FUNCTION__, __LINE__);
+        case BST_KCOMP:
+            // Compares nothing until bst_set_key_fields gives it fields
+            tree->key_cmp_fn[idx] = bst_key_cmp_comp;
+            tree->key_hash_fn[idx] = NULL;
+            tree->key_cpy_fn[idx] = bst_key_cpy_str;
+            tree->ops[idx] = (flags & BST_RCU) ? &bst_rcu_ops_comp : &bst_ops_comp;
             break;
+        default:
+            snprintf(err_str, MAX_ERR_LEN -1, "Index needs exactly one key type.");
+            return -1;
+    }
+
+    // The other index kinds have no subtree sizes and no room for one another
+    kind = flags & (BST_COMPACT | BST_BTREE | BST_HASH | BST_SHARDED | BST_ART);
+    if ((kind & (kind - 1)) || (kind && (flags & (BST_OSTAT | BST_RCU)))) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "An index can be only one of BST_COMPACT, BST_BTREE, "
+                "BST_HASH, BST_SHARDED or BST_ART, and none of them keeps order statistics or "
+                "takes BST_RCU.");
+        return -1;
+    }
+
+    // Duplicates hang off AVL nodes, which RCU writers would have to copy, and subtree sizes
+    // count keys rather than records
+    if ((flags & BST_MULTI) && (kind || (flags & (BST_OSTAT | BST_RCU)))) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "BST_MULTI indexes are plain AVL trees and can't keep "
+                "order statistics or take BST_RCU.");
+        return -1;
+    }
+
+    // The other kinds keep key bytes of their own, a composite key is only a record pointer
+    if ((flags & BST_KEYS) == BST_KCOMP && kind) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "BST_KCOMP indexes are AVL trees and can't be "
+                "BST_COMPACT, BST_BTREE, BST_HASH, BST_SHARDED or BST_ART.");
+        return -1;
+    }
+
+    if ((flags & BST_BLOOM) && (kind || (flags & BST_KEYS) == BST_KCOMP)) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "BST_BLOOM indexes are AVL trees without BST_KCOMP "
+                "keys.");
+        return -1;
+    }
+
+    if ((flags & BST_INTERN) && ((flags & BST_KEYS) != BST_KPSTR || kind)) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "BST_INTERN indexes are AVL trees with BST_KPSTR keys.");
+        return -1;
+    }
+
+    if (kind == BST_COMPACT) {
+        // Compact string keys are 8 bytes, there's no room for a prefix
+        if ((flags & BST_KEYS) == BST_KPSTR)
+            tree->key_cpy_fn[idx] = bst_key_cpy_str;
+        if (bst_compact_init(tree, idx, flags) < 0)
+            return -1;
+        tree->ops[idx] = bst_compact_ops(flags);
+    }
+    else if (kind == BST_BTREE) {
+        if (bst_btree_init(tree, idx) < 0)
+            return -1;
+        tree->ops[idx] = bst_btree_ops(flags);
+    }
+    else if (kind == BST_HASH) {
+        if (bst_hash_init(tree, idx) < 0)
+            return -1;
+        tree->ops[idx] = bst_hash_ops(flags);
+    }
+    else if (kind == BST_SHARDED) {
+        if (bst_shard_init(tree, idx) < 0)
+            return -1;
+        tree->ops[idx] = bst_shard_ops(flags);
     }
+    else if (kind == BST_ART) {
+        if (bst_art_init(tree, idx, flags) < 0)
+            return -1;
+        tree->ops[idx] = bst_art_ops(flags);
+    }
+    else if ((flags & BST_BLOOM) && (tree->bloom[idx] = bloom_create(BST_BLOOM_MIN)) == NULL) {
+        return -1;
+    }
+
+    return 0;
 }
 
 static bst_node_t *
@@ -600,8 +3307,8 @@ bst_right_rotate(bst_node_t *y) {
     x->right = y;
     y->left = z;
 
-    y->height = MAX(bst_get_height(y->left), bst_get_height(y->right)) + 1;
-    x->height = MAX(bst_get_height(x->left), bst_get_height(x->right)) + 1;
+    bst_update_node(y);
+    bst_update_node(x);
 
     return x;
 }
@@ -614,59 +3321,192 @@ bst_left_rotate(bst_node_t *x) {
     y->left = x;
     x->right = z;
 
-    x->height = MAX(bst_get_height(x->left), bst_get_height(x->right)) + 1;
-    y->height = MAX(bst_get_height(y->left), bst_get_height(y->right)) + 1;
+    bst_update_node(x);
+    bst_update_node(y);
 
     return y;
 }
 
+// Recomputes a node's height after one of its subtrees changed height by at most one, rotating
+// if that left it out of balance.  Returns the new root of the subtree.
+static bst_node_t *
+bst_rebalance(bst_node_t *node) {
+    int32_t lh = bst_get_height(node->left);
+    int32_t rh = bst_get_height(node->right);
+
+    if ((lh - rh) > 1) {
+        // Left Right Case
+        if (bst_get_height(node->left->left) < bst_get_height(node->left->right))
+            node->left = bst_left_rotate(node->left);
+        return bst_right_rotate(node);
+    }
+    else if ((lh - rh) < -1) {
+        // Right Left Case
+        if (bst_get_height(node->right->right) < bst_get_height(node->right->left))
+            node->right = bst_right_rotate(node->right);
+        return bst_left_rotate(node);
+    }
+
+    node->height = MAX(lh, rh) + 1;
+    node->size = bst_get_size(node->left) + bst_get_size(node->right) + 1;
+
+    return node;
+}
+
 char *
 bst_get_last_err() {
     return err_str;
 }
 
-static int32_t
-bst_create_node_pool() {
-    bst_node_t *node = NULL;
+static bst_pool_t *
+bst_pool_create(uint32_t chunk_sz) {
+    bst_pool_t *pool;
 
-#ifndef NO_LOCKS
-    pthread_rwlock_wrlock(&node_list_mutex);
-#endif
-    for (uint32_t j = 0; j < BST_NODE_POOL_SZ; j++) {
-        if ((node = calloc(1, sizeof(bst_node_t))) == NULL) {
+    if ((pool = calloc(1, sizeof(bst_pool_t))) == NULL)
+        return NULL;
+
+    pool->chunk_sz = chunk_sz;
+    pthread_rwlock_init(&pool->mutex, NULL);
+
+    return pool;
+}
+
+// Takes a never-used node from the newest chunk, adding a chunk when it runs dry.  Call with
+// the pool locked.
+static bst_node_t *
+bst_pool_carve(bst_pool_t *pool) {
+    bst_chunk_t *chunk = pool->chunks;
+    bst_node_t *node;
+
+    if (!chunk || chunk->used == chunk->count) {
+        if ((chunk = calloc(1, sizeof(bst_chunk_t) + pool->chunk_sz * sizeof(bst_node_t))) == NULL) {
             snprintf(err_str, MAX_ERR_LEN -1, "%s: Could not allocate memory for bst node",
                     __FUNCTION__);
-            pthread_rwlock_unlock(&node_list_mutex);
-            return -1;
+            return NULL;
         }
 
-        node->height = 1;
-        node->right = bst_node_list;
-        bst_node_list = node;
+        chunk->count = pool->chunk_sz;
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
     }
-#ifndef NO_LOCKS
-    pthread_rwlock_unlock(&node_list_mutex);
-#endif
 
-    return 0;
+    node = &chunk->nodes[chunk->used++];
+    node->height = 1;
+
+    return node;
 }
 
+// A thread's cache goes back to the global pool when the thread exits, or the nodes in it
+// would be lost to every other thread until bst_fini
 static void
-bst_free_node_pool() {
-    bst_node_t *n, *head;
+bst_cache_drain(void *arg __attribute__((unused))) {
+    bst_chain_t chain = { node_cache, node_cache };
 
-#ifndef NO_LOCKS
-    pthread_rwlock_wrlock(&node_list_mutex);
-#endif
-    head = bst_node_list;
-    while (head) {
-        n = head->right;
-        free(head);
-        head = n;
+    if (!chain.head)
+        return;
+
+    while (chain.tail->right)
+        chain.tail = chain.tail->right;
+    bst_pool_release(&node_pool, &chain);
+    node_cache = NULL;
+}
+
+static void
+bst_cache_key_create(void) {
+    pthread_key_create(&node_cache_key, bst_cache_drain);
+}
+
+// Pops a node off the pool's free list, or carves a new one.  From the global pool the calling
+// thread takes a whole batch and keeps the rest in its cache.
+static bst_node_t *
+bst_pool_get(bst_pool_t *pool) {
+    bst_node_t *node, *extra;
+
+    // Destructors only run for threads with a non-NULL value set under the key
+    if (pool == &node_pool) {
+        pthread_once(&node_cache_once, bst_cache_key_create);
+        if (!pthread_getspecific(node_cache_key))
+            pthread_setspecific(node_cache_key, &node_pool);
+    }
+
+    bst_pool_lock(pool);
+    if ((node = pool->free_list) != NULL)
+        pool->free_list = node->right;
+    else
+        node = bst_pool_carve(pool);
+
+    if (node && pool == &node_pool) {
+        for (int32_t i = 1; i < BST_NODE_CACHE_SZ; i++) {
+            if ((extra = pool->free_list) != NULL)
+                pool->free_list = extra->right;
+            else if ((extra = bst_pool_carve(pool)) == NULL)
+                break;
+
+            extra->right = node_cache;
+            node_cache = extra;
+        }
+    }
+    bst_pool_unlock(pool);
+
+    return node;
+}
+
+// Hands out n contiguous nodes as a chunk of their own.  Once freed they join the pool's
+// free list like any other node.
+static bst_node_t *
+bst_pool_get_n(bst_pool_t *pool, uint32_t n) {
+    bst_chunk_t *chunk;
+
+    if ((chunk = calloc(1, sizeof(bst_chunk_t) + n * sizeof(bst_node_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN -1, "%s: Could not allocate memory for %u bst nodes",
+                __FUNCTION__, n);
+        return NULL;
+    }
+
+    chunk->count = chunk->used = n;
+
+    // Keep the newest chunk at the head, it's the one still being carved
+    bst_pool_lock(pool);
+    if (pool->chunks) {
+        chunk->next = pool->chunks->next;
+        pool->chunks->next = chunk;
+    }
+    else {
+        pool->chunks = chunk;
+    }
+    bst_pool_unlock(pool);
+
+    return chunk->nodes;
+}
+
+static void
+bst_pool_release(bst_pool_t *pool, bst_chain_t *chain) {
+    if (!chain->head)
+        return;
+
+    bst_pool_lock(pool);
+    chain->tail->right = pool->free_list;
+    pool->free_list = chain->head;
+    bst_pool_unlock(pool);
+}
+
+// Frees every chunk in one pass.  The global pool is static, so it is only emptied.
+static void
+bst_pool_destroy(bst_pool_t *pool) {
+    bst_chunk_t *chunk, *next;
+
+    for (chunk = pool->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+
+    pool->chunks = NULL;
+    pool->free_list = NULL;
+
+    if (pool != &node_pool) {
+        pthread_rwlock_destroy(&pool->mutex);
+        free(pool);
     }
-#ifndef NO_LOCKS
-    pthread_rwlock_unlock(&node_list_mutex);
-#endif
 }
 
 void
@@ -674,6 +3514,9 @@ bst_print_tree(bst_tree_t *tree, int32_t idx, int32_t compact) {
     char s[128][512];
     char test[101];
 
+    if (bst_check_avl(tree, idx) < 0)
+        return;
+
     for (int32_t i = 0; i < 20; i++)
         sprintf(s[i], "%100s", " ");
 
@@ -0,0 +1,1022 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// BST_ART indexes are adaptive radix trees (Leis et al., ICDE 2013).  Keys are byte strings
+// walked a byte per level, so a lookup costs the key's length rather than log n compares.  Inner
+// nodes come in four sizes, with 4, 16, 48 and 256 children, and move between them as children
+// come and go.  A chain of single child nodes is folded into the prefix of the node below it;
+// only its first BST_ART_PREFIX bytes are kept there, the rest are checked against a leaf.
+//
+// String keys are their bytes and the terminating zero, so no key is a prefix of another.
+// Integer keys are their big endian bytes, which sort in numeric order, then one byte with the
+// key's prefix length in bits: the full width for bst_insert, less for networks added with
+// bst_insert_prefix, which are stored with their host bits cleared.  Every integer key is
+// then the same length, and an address and the networks it's in share a leading path.
+
+#define BST_ART_PREFIX 8
+
+#define BST_ART4   0
+#define BST_ART16  1
+#define BST_ART48  2
+#define BST_ART256 3
+
+// Children are tagged pointers, leaves have the low bit set
+#define bst_art_is_leaf(x) ((uintptr_t)(x) & 1)
+#define bst_art_leaf(x) ((bst_art_leaf_t *)((uintptr_t)(x) & ~(uintptr_t)1))
+#define bst_art_tag(x) ((void *)((uintptr_t)(x) | 1))
+
+// The encoded form of the longest integer key, a BST_KINT128 and its length
+#define BST_ART_KEY_MAX 17
+
+typedef struct {
+    void *data;
+    uint32_t len;
+    uint8_t key[];
+} bst_art_leaf_t;
+
+typedef struct {
+    uint8_t type;
+    uint16_t count;
+    uint32_t plen;
+    uint8_t prefix[BST_ART_PREFIX];
+} bst_art_node_t;
+
+typedef struct {
+    bst_art_node_t n;
+    uint8_t keys[4];
+    void *child[4];
+} bst_art4_t;
+
+typedef struct {
+    bst_art_node_t n;
+    uint8_t keys[16];
+    void *child[16];
+} bst_art16_t;
+
+// index holds a child's slot plus one, 0 for none
+typedef struct {
+    bst_art_node_t n;
+    uint8_t index[256];
+    void *child[48];
+} bst_art48_t;
+
+typedef struct {
+    bst_art_node_t n;
+    void *child[256];
+} bst_art256_t;
+
+typedef struct bst_art_s {
+    void *root;
+    // Key width in bytes for integer keys, 0 for strings
+    int32_t width;
+} bst_art_t;
+
+typedef uint32_t (*bst_art_enc_t)(void *key, uint8_t *buf, uint8_t **out);
+
+// Encoders return the key's length and point *out at its bytes, which for strings are the
+// caller's own
+static inline uint32_t
+bst_art_enc_str(void *key, uint8_t *buf __attribute__((unused)), uint8_t **out) {
+    *out = (uint8_t *)((bst_key_t *)key)->pstr;
+
+    return strlen((char *)*out) + 1;
+}
+
+static inline uint32_t
+bst_art_enc_u32(void *key, uint8_t *buf, uint8_t **out) {
+    uint32_t be = __builtin_bswap32(((bst_key_t *)key)->u32);
+
+    memcpy(buf, &be, 4);
+    buf[4] = 32;
+    *out = buf;
+
+    return 5;
+}
+
+static inline uint32_t
+bst_art_enc_u64(void *key, uint8_t *buf, uint8_t **out) {
+    uint64_t be = __builtin_bswap64(((bst_key_t *)key)->u64);
+
+    memcpy(buf, &be, 8);
+    buf[8] = 64;
+    *out = buf;
+
+    return 9;
+}
+
+// 128 bit keys are ordered as unsigned, the way IPv6 addresses are
+static inline uint32_t
+bst_art_enc_i128(void *key, uint8_t *buf, uint8_t **out) {
+    unsigned __int128 v = ((bst_key_t *)key)->i128;
+    uint64_t hi = __builtin_bswap64((uint64_t)(v >> 64)), lo = __builtin_bswap64((uint64_t)v);
+
+    memcpy(buf, &hi, 8);
+    memcpy(buf + 8, &lo, 8);
+    buf[16] = 128;
+    *out = buf;
+
+    return 17;
+}
+
+static bst_art_enc_t
+bst_art_encoder(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return bst_art_enc_str;
+        case BST_KUINT32: return bst_art_enc_u32;
+        case BST_KUINT64: return bst_art_enc_u64;
+        case BST_KINT128: return bst_art_enc_i128;
+    }
+
+    return NULL;
+}
+
+static inline int32_t
+bst_art_leaf_is(bst_art_leaf_t *leaf, uint8_t *key, uint32_t len) {
+    return leaf->len == len && !memcmp(leaf->key, key, len);
+}
+
+static bst_art_leaf_t *
+bst_art_min(void *x) {
+    bst_art_node_t *n;
+    int32_t i;
+
+    while (x && !bst_art_is_leaf(x)) {
+        n = (bst_art_node_t *)x;
+        switch (n->type) {
+            case BST_ART4:  x = ((bst_art4_t *)n)->child[0]; break;
+            case BST_ART16: x = ((bst_art16_t *)n)->child[0]; break;
+            case BST_ART48:
+                for (i = 0; !((bst_art48_t *)n)->index[i]; i++)
+                    ;
+                x = ((bst_art48_t *)n)->child[((bst_art48_t *)n)->index[i] - 1];
+                break;
+            case BST_ART256:
+                for (i = 0; !((bst_art256_t *)n)->child[i]; i++)
+                    ;
+                x = ((bst_art256_t *)n)->child[i];
+                break;
+        }
+    }
+
+    return x ? bst_art_leaf(x) : NULL;
+}
+
+static inline void **
+bst_art_find(bst_art_node_t *n, uint8_t c) {
+    bst_art16_t *n16;
+    int32_t i;
+
+    switch (n->type) {
+        case BST_ART4:
+            for (i = 0; i < n->count; i++) {
+                if (((bst_art4_t *)n)->keys[i] == c)
+                    return &((bst_art4_t *)n)->child[i];
+            }
+            return NULL;
+        case BST_ART16:
+            n16 = (bst_art16_t *)n;
+#ifdef __SSE2__
+            i = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c),
+                        _mm_loadu_si128((__m128i *)n16->keys))) & ((1 << n->count) - 1);
+            return i ? &n16->child[__builtin_ctz(i)] : NULL;
+#else
+            for (i = 0; i < n->count; i++) {
+                if (n16->keys[i] == c)
+                    return &n16->child[i];
+            }
+            return NULL;
+#endif
+        case BST_ART48:
+            i = ((bst_art48_t *)n)->index[c];
+            return i ? &((bst_art48_t *)n)->child[i - 1] : NULL;
+        case BST_ART256:
+            return ((bst_art256_t *)n)->child[c] ? &((bst_art256_t *)n)->child[c] : NULL;
+    }
+
+    return NULL;
+}
+
+static void *
+bst_art_alloc(uint8_t type) {
+    static const size_t sizes[] = {
+        sizeof(bst_art4_t), sizeof(bst_art16_t), sizeof(bst_art48_t), sizeof(bst_art256_t)
+    };
+    bst_art_node_t *n;
+
+    if ((n = calloc(1, sizes[type])) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for an ART node",
+                __FUNCTION__);
+        return NULL;
+    }
+    n->type = type;
+
+    return n;
+}
+
+static inline void
+bst_art_copy_hdr(bst_art_node_t *dst, bst_art_node_t *src) {
+    dst->count = src->count;
+    dst->plen = src->plen;
+    memcpy(dst->prefix, src->prefix, BST_ART_PREFIX);
+}
+
+// Adds child under c, swapping the node at *ref for a bigger one if it's full.  Children of 4
+// and 16 nodes are kept sorted by key byte, which is what makes iteration ordered.
+static int32_t
+bst_art_add(bst_art_node_t *n, void **ref, uint8_t c, void *child) {
+    bst_art4_t *n4;
+    bst_art16_t *n16;
+    bst_art48_t *n48;
+    bst_art256_t *n256;
+    int32_t i;
+
+    switch (n->type) {
+        case BST_ART4:
+            n4 = (bst_art4_t *)n;
+            if (n->count < 4) {
+                for (i = 0; i < n->count && n4->keys[i] < c; i++)
+                    ;
+                memmove(&n4->keys[i + 1], &n4->keys[i], n->count - i);
+                memmove(&n4->child[i + 1], &n4->child[i], (n->count - i) * sizeof(void *));
+                n4->keys[i] = c;
+                n4->child[i] = child;
+                n->count++;
+                return 0;
+            }
+            if ((n16 = bst_art_alloc(BST_ART16)) == NULL)
+                return -1;
+            bst_art_copy_hdr(&n16->n, n);
+            memcpy(n16->keys, n4->keys, 4);
+            memcpy(n16->child, n4->child, 4 * sizeof(void *));
+            *ref = n16;
+            free(n4);
+            return bst_art_add(&n16->n, ref, c, child);
+        case BST_ART16:
+            n16 = (bst_art16_t *)n;
+            if (n->count < 16) {
+                for (i = 0; i < n->count && n16->keys[i] < c; i++)
+                    ;
+                memmove(&n16->keys[i + 1], &n16->keys[i], n->count - i);
+                memmove(&n16->child[i + 1], &n16->child[i], (n->count - i) * sizeof(void *));
+                n16->keys[i] = c;
+                n16->child[i] = child;
+                n->count++;
+                return 0;
+            }
+            if ((n48 = bst_art_alloc(BST_ART48)) == NULL)
+                return -1;
+            bst_art_copy_hdr(&n48->n, n);
+            for (i = 0; i < 16; i++) {
+                n48->index[n16->keys[i]] = i + 1;
+                n48->child[i] = n16->child[i];
+            }
+            *ref = n48;
+            free(n16);
+            return bst_art_add(&n48->n, ref, c, child);
+        case BST_ART48:
+            n48 = (bst_art48_t *)n;
+            if (n->count < 48) {
+                for (i = 0; n48->child[i]; i++)
+                    ;
+                n48->child[i] = child;
+                n48->index[c] = i + 1;
+                n->count++;
+                return 0;
+            }
+            if ((n256 = bst_art_alloc(BST_ART256)) == NULL)
+                return -1;
+            bst_art_copy_hdr(&n256->n, n);
+            for (i = 0; i < 256; i++) {
+                if (n48->index[i])
+                    n256->child[i] = n48->child[n48->index[i] - 1];
+            }
+            *ref = n256;
+            free(n48);
+            return bst_art_add(&n256->n, ref, c, child);
+        case BST_ART256:
+            n256 = (bst_art256_t *)n;
+            n256->child[c] = child;
+            n->count++;
+            return 0;
+    }
+
+    return -1;
+}
+
+// Counts how many of the node's prefix bytes match the key from depth on.  Past the bytes the
+// node keeps, the rest come from its smallest leaf, which has the whole prefix.
+static uint32_t
+bst_art_mismatch(bst_art_node_t *n, uint8_t *key, uint32_t len, uint32_t depth) {
+    uint32_t max = n->plen < BST_ART_PREFIX ? n->plen : BST_ART_PREFIX, i;
+    bst_art_leaf_t *leaf;
+
+    for (i = 0; i < max && depth + i < len; i++) {
+        if (n->prefix[i] != key[depth + i])
+            return i;
+    }
+
+    if (n->plen > BST_ART_PREFIX) {
+        leaf = bst_art_min(n);
+        for (; i < n->plen && depth + i < len; i++) {
+            if (leaf->key[depth + i] != key[depth + i])
+                return i;
+        }
+    }
+
+    return i;
+}
+
+static void *
+bst_art_search(bst_art_t *art, uint8_t *key, uint32_t len) {
+    void *x = art->root, **child;
+    bst_art_node_t *n;
+    uint32_t depth = 0, max;
+    bst_art_leaf_t *leaf;
+
+    while (x && !bst_art_is_leaf(x)) {
+        n = (bst_art_node_t *)x;
+
+        // Only the kept bytes of the prefix are checked here, the leaf settles the rest
+        max = n->plen < BST_ART_PREFIX ? n->plen : BST_ART_PREFIX;
+        for (uint32_t i = 0; i < max; i++) {
+            if (depth + i >= len || n->prefix[i] != key[depth + i])
+                return NULL;
+        }
+        depth += n->plen;
+
+        if (depth >= len || (child = bst_art_find(n, key[depth])) == NULL)
+            return NULL;
+        x = *child;
+        depth++;
+    }
+
+    if (!x)
+        return NULL;
+    leaf = bst_art_leaf(x);
+
+    return bst_art_leaf_is(leaf, key, len) ? leaf->data : NULL;
+}
+
+static bst_art_leaf_t *
+bst_art_new_leaf(uint8_t *key, uint32_t len, void *data) {
+    bst_art_leaf_t *leaf;
+
+    if ((leaf = malloc(sizeof(bst_art_leaf_t) + len)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for an ART leaf",
+                __FUNCTION__);
+        return NULL;
+    }
+    leaf->data = data;
+    leaf->len = len;
+    memcpy(leaf->key, key, len);
+
+    return leaf;
+}
+
+// Returns 1 without touching the tree if the key is already present
+static int32_t
+bst_art_insert_r(void **ref, uint8_t *key, uint32_t len, uint32_t depth, void *data) {
+    bst_art_leaf_t *leaf, *old;
+    bst_art_node_t *n = *ref;
+    bst_art4_t *split;
+    uint32_t diff = 0;
+    void **child;
+
+    if (n && bst_art_is_leaf(n) && bst_art_leaf_is(bst_art_leaf(n), key, len))
+        return 1;
+
+    // Somewhere below a node whose whole prefix matches
+    if (n && !bst_art_is_leaf(n) &&
+            (!n->plen || (diff = bst_art_mismatch(n, key, len, depth)) >= n->plen)) {
+        depth += n->plen;
+        if ((child = bst_art_find(n, key[depth])) != NULL)
+            return bst_art_insert_r(child, key, len, depth + 1, data);
+
+        if ((leaf = bst_art_new_leaf(key, len, data)) == NULL)
+            return -1;
+        if (bst_art_add(n, ref, key[depth], bst_art_tag(leaf)) < 0) {
+            free(leaf);
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((leaf = bst_art_new_leaf(key, len, data)) == NULL)
+        return -1;
+
+    if (!n) {
+        *ref = bst_art_tag(leaf);
+        return 0;
+    }
+
+    if ((split = bst_art_alloc(BST_ART4)) == NULL) {
+        free(leaf);
+        return -1;
+    }
+
+    // Two leaves: the new node holds the bytes they share and one leaf goes under each of the
+    // bytes where they part
+    if (bst_art_is_leaf(n)) {
+        old = bst_art_leaf(n);
+        for (diff = 0; old->key[depth + diff] == key[depth + diff]; diff++)
+            ;
+        split->n.plen = diff;
+        memcpy(split->n.prefix, key + depth, diff < BST_ART_PREFIX ? diff : BST_ART_PREFIX);
+        bst_art_add(&split->n, ref, old->key[depth + diff], n);
+        bst_art_add(&split->n, ref, key[depth + diff], bst_art_tag(leaf));
+        *ref = split;
+        return 0;
+    }
+
+    // A prefix that stops matching partway: the new node takes the matching part and the old
+    // node keeps what's after the byte where they part
+    split->n.plen = diff;
+    memcpy(split->n.prefix, key + depth, diff < BST_ART_PREFIX ? diff : BST_ART_PREFIX);
+    if (n->plen <= BST_ART_PREFIX) {
+        bst_art_add(&split->n, ref, n->prefix[diff], n);
+        n->plen -= diff + 1;
+        memmove(n->prefix, n->prefix + diff + 1, n->plen);
+    }
+    else {
+        old = bst_art_min(n);
+        bst_art_add(&split->n, ref, old->key[depth + diff], n);
+        n->plen -= diff + 1;
+        memcpy(n->prefix, old->key + depth + diff + 1,
+                n->plen < BST_ART_PREFIX ? n->plen : BST_ART_PREFIX);
+    }
+    bst_art_add(&split->n, ref, key[depth + diff], bst_art_tag(leaf));
+    *ref = split;
+
+    return 0;
+}
+
+// Takes child c out of the node at *ref, then swaps the node for a smaller one if it's down
+// to what the smaller one holds, with some slack so a node on the boundary doesn't flap.  A 4
+// node left with one child is folded into it.
+static void
+bst_art_remove(bst_art_node_t *n, void **ref, uint8_t c, void **child) {
+    bst_art4_t *n4 = (bst_art4_t *)n;
+    bst_art16_t *n16 = (bst_art16_t *)n;
+    bst_art48_t *n48 = (bst_art48_t *)n;
+    bst_art256_t *n256 = (bst_art256_t *)n;
+    bst_art_node_t *next;
+    uint32_t plen, j;
+    int32_t i;
+
+    switch (n->type) {
+        case BST_ART4:
+            i = child - n4->child;
+            memmove(&n4->keys[i], &n4->keys[i + 1], n->count - i - 1);
+            memmove(&n4->child[i], &n4->child[i + 1], (n->count - i - 1) * sizeof(void *));
+            if (--n->count > 1)
+                return;
+
+            next = n4->child[0];
+            if (!bst_art_is_leaf(next)) {
+                // The child's prefix grows by this node's prefix and the byte between them
+                plen = n->plen;
+                if (plen < BST_ART_PREFIX)
+                    n->prefix[plen++] = n4->keys[0];
+                for (j = 0; plen < BST_ART_PREFIX && j < next->plen; j++)
+                    n->prefix[plen++] = next->prefix[j];
+                memcpy(next->prefix, n->prefix, BST_ART_PREFIX);
+                next->plen += n->plen + 1;
+            }
+            *ref = next;
+            free(n4);
+            return;
+        case BST_ART16:
+            i = child - n16->child;
+            memmove(&n16->keys[i], &n16->keys[i + 1], n->count - i - 1);
+            memmove(&n16->child[i], &n16->child[i + 1], (n->count - i - 1) * sizeof(void *));
+            if (--n->count > 3 || (n4 = bst_art_alloc(BST_ART4)) == NULL)
+                return;
+
+            bst_art_copy_hdr(&n4->n, n);
+            memcpy(n4->keys, n16->keys, 3);
+            memcpy(n4->child, n16->child, 3 * sizeof(void *));
+            *ref = n4;
+            free(n16);
+            return;
+        case BST_ART48:
+            n48->child[n48->index[c] - 1] = NULL;
+            n48->index[c] = 0;
+            if (--n->count > 12 || (n16 = bst_art_alloc(BST_ART16)) == NULL)
+                return;
+
+            bst_art_copy_hdr(&n16->n, n);
+            for (i = 0, j = 0; i < 256; i++) {
+                if (n48->index[i]) {
+                    n16->keys[j] = i;
+                    n16->child[j++] = n48->child[n48->index[i] - 1];
+                }
+            }
+            *ref = n16;
+            free(n48);
+            return;
+        case BST_ART256:
+            n256->child[c] = NULL;
+            if (--n->count > 37 || (n48 = bst_art_alloc(BST_ART48)) == NULL)
+                return;
+
+            bst_art_copy_hdr(&n48->n, n);
+            for (i = 0, j = 0; i < 256; i++) {
+                if (n256->child[i]) {
+                    n48->child[j] = n256->child[i];
+                    n48->index[i] = ++j;
+                }
+            }
+            *ref = n48;
+            free(n256);
+            return;
+    }
+}
+
+static bst_art_leaf_t *
+bst_art_delete_r(void **ref, uint8_t *key, uint32_t len, uint32_t depth) {
+    bst_art_node_t *n = *ref;
+    bst_art_leaf_t *leaf;
+    uint32_t max;
+    void **child;
+
+    if (!n)
+        return NULL;
+
+    if (bst_art_is_leaf(n)) {
+        leaf = bst_art_leaf(n);
+        if (!bst_art_leaf_is(leaf, key, len))
+            return NULL;
+        *ref = NULL;
+        return leaf;
+    }
+
+    max = n->plen < BST_ART_PREFIX ? n->plen : BST_ART_PREFIX;
+    for (uint32_t i = 0; i < max; i++) {
+        if (depth + i >= len || n->prefix[i] != key[depth + i])
+            return NULL;
+    }
+    depth += n->plen;
+
+    if (depth >= len || (child = bst_art_find(n, key[depth])) == NULL)
+        return NULL;
+
+    if (bst_art_is_leaf(*child)) {
+        leaf = bst_art_leaf(*child);
+        if (!bst_art_leaf_is(leaf, key, len))
+            return NULL;
+        bst_art_remove(n, ref, key[depth], child);
+        return leaf;
+    }
+
+    return bst_art_delete_r(child, key, len, depth + 1);
+}
+
+// Calls fn on every leaf under x in key order, stopping at the first callback that doesn't
+// return BST_CB_OK
+typedef int32_t (*bst_art_visit_t)(bst_art_leaf_t *leaf, void *arg);
+
+static int32_t
+bst_art_walk(void *x, bst_art_visit_t fn, void *arg) {
+    bst_art_node_t *n = x;
+    int32_t rc = BST_CB_OK;
+
+    if (!x)
+        return BST_CB_OK;
+    if (bst_art_is_leaf(x))
+        return fn(bst_art_leaf(x), arg);
+
+    switch (n->type) {
+        case BST_ART4:
+            for (int32_t i = 0; i < n->count && rc == BST_CB_OK; i++)
+                rc = bst_art_walk(((bst_art4_t *)n)->child[i], fn, arg);
+            break;
+        case BST_ART16:
+            for (int32_t i = 0; i < n->count && rc == BST_CB_OK; i++)
+                rc = bst_art_walk(((bst_art16_t *)n)->child[i], fn, arg);
+            break;
+        case BST_ART48:
+            for (int32_t i = 0; i < 256 && rc == BST_CB_OK; i++) {
+                if (((bst_art48_t *)n)->index[i])
+                    rc = bst_art_walk(((bst_art48_t *)n)->child[((bst_art48_t *)n)->index[i] - 1],
+                            fn, arg);
+            }
+            break;
+        case BST_ART256:
+            for (int32_t i = 0; i < 256 && rc == BST_CB_OK; i++)
+                rc = bst_art_walk(((bst_art256_t *)n)->child[i], fn, arg);
+            break;
+    }
+
+    return rc;
+}
+
+// Calls fn on each child of n whose key byte c has (c & mask) == want, in key order
+static int32_t
+bst_art_each(bst_art_node_t *n, uint8_t mask, uint8_t want,
+        int32_t (*fn)(void *child, uint8_t c, void *arg), void *arg) {
+    bst_art48_t *n48 = (bst_art48_t *)n;
+    int32_t rc = BST_CB_OK;
+
+    switch (n->type) {
+        case BST_ART4:
+            for (int32_t i = 0; i < n->count && rc == BST_CB_OK; i++) {
+                if ((((bst_art4_t *)n)->keys[i] & mask) == want)
+                    rc = fn(((bst_art4_t *)n)->child[i], ((bst_art4_t *)n)->keys[i], arg);
+            }
+            break;
+        case BST_ART16:
+            for (int32_t i = 0; i < n->count && rc == BST_CB_OK; i++) {
+                if ((((bst_art16_t *)n)->keys[i] & mask) == want)
+                    rc = fn(((bst_art16_t *)n)->child[i], ((bst_art16_t *)n)->keys[i], arg);
+            }
+            break;
+        case BST_ART48:
+            for (int32_t i = want; i < 256 && rc == BST_CB_OK; i++) {
+                if (n48->index[i] && (i & mask) == want)
+                    rc = fn(n48->child[n48->index[i] - 1], i, arg);
+            }
+            break;
+        case BST_ART256:
+            for (int32_t i = want; i < 256 && rc == BST_CB_OK; i++) {
+                if (((bst_art256_t *)n)->child[i] && (i & mask) == want)
+                    rc = fn(((bst_art256_t *)n)->child[i], i, arg);
+            }
+            break;
+    }
+
+    return rc;
+}
+
+typedef struct {
+    bst_iterate_t iter_fn;
+    void *fn_data;
+} bst_art_iter_t;
+
+static int32_t
+bst_art_data_cb(bst_art_leaf_t *leaf, void *arg) {
+    bst_art_iter_t *iter = arg;
+    int32_t rc = iter->iter_fn(leaf->data, iter->fn_data);
+
+    if (rc == BST_CB_DELETE_NODE || rc == BST_CB_DELETE_AND_ABORT)
+        snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
+
+    return rc;
+}
+
+// A prefix scan follows the key for its first bits bits, then visits everything below
+typedef struct {
+    uint8_t *key;
+    uint32_t bits;
+    uint32_t depth;
+    bst_art_iter_t iter;
+} bst_art_scan_t;
+
+// The high bits of a byte, for a prefix that ends bits into it
+#define bst_art_mask(bits) ((uint8_t)(0xff00 >> (bits)))
+
+static int32_t bst_art_scan_r(void *x, uint32_t depth, bst_art_scan_t *scan);
+
+static int32_t
+bst_art_scan_child(void *child, uint8_t c __attribute__((unused)), void *arg) {
+    bst_art_scan_t *scan = arg;
+    uint32_t depth = scan->depth;
+    int32_t rc = bst_art_scan_r(child, depth + 1, scan);
+
+    // Deeper nodes move it for their own children
+    scan->depth = depth;
+
+    return rc;
+}
+
+static int32_t
+bst_art_scan_r(void *x, uint32_t depth, bst_art_scan_t *scan) {
+    bst_art_node_t *n = x;
+    bst_art_leaf_t *leaf;
+    uint32_t bits;
+    uint8_t b;
+
+    if (bst_art_is_leaf(x)) {
+        leaf = bst_art_leaf(x);
+        if (leaf->len * 8 < scan->bits || memcmp(leaf->key, scan->key, scan->bits / 8) ||
+                (scan->bits % 8 && (leaf->key[scan->bits / 8] ^ scan->key[scan->bits / 8]) &
+                 bst_art_mask(scan->bits % 8)))
+            return BST_CB_OK;
+        return bst_art_data_cb(leaf, &scan->iter);
+    }
+
+    // Prefix bytes past the kept ones come from a leaf, every leaf below has them
+    leaf = (n->plen > BST_ART_PREFIX) ? bst_art_min(n) : NULL;
+    for (uint32_t i = 0; i < n->plen && (depth + i) * 8 < scan->bits; i++) {
+        b = (i < BST_ART_PREFIX) ? n->prefix[i] : leaf->key[depth + i];
+        bits = scan->bits - (depth + i) * 8;
+        if ((b ^ scan->key[depth + i]) & bst_art_mask(bits < 8 ? bits : 8))
+            return BST_CB_OK;
+    }
+    depth += n->plen;
+
+    if (depth * 8 >= scan->bits)
+        return bst_art_walk(x, bst_art_data_cb, &scan->iter);
+
+    bits = scan->bits - depth * 8;
+    scan->depth = depth;
+    if (bits >= 8) {
+        void **child = bst_art_find(n, scan->key[depth]);
+        return child ? bst_art_scan_r(*child, depth + 1, scan) : BST_CB_OK;
+    }
+
+    return bst_art_each(n, bst_art_mask(bits), scan->key[depth] & bst_art_mask(bits),
+            bst_art_scan_child, scan);
+}
+
+// A longest prefix match looks for the network entry with the longest length whose bits all
+// match the address.  Below any byte where an entry's path leaves the address's, the entry's
+// host bits are clear, so past the full match only zero bytes are followed; before it, each
+// byte can only be one of the address byte's 9 truncations.  Every length byte under what's
+// left is followed, and the leaves found are checked in full.
+typedef struct {
+    uint8_t *key;
+    uint32_t width;
+    bst_art_leaf_t *best;
+} bst_art_lpm_t;
+
+static void bst_art_lpm_r(void *x, uint32_t depth, int32_t exact, bst_art_lpm_t *lpm);
+
+static int32_t
+bst_art_lpm_len(void *child, uint8_t c __attribute__((unused)), void *arg) {
+    bst_art_lpm_t *lpm = arg;
+
+    bst_art_lpm_r(child, lpm->width + 1, 0, lpm);
+
+    return BST_CB_OK;
+}
+
+static void
+bst_art_lpm_r(void *x, uint32_t depth, int32_t exact, bst_art_lpm_t *lpm) {
+    bst_art_node_t *n = x;
+    bst_art_leaf_t *leaf;
+    uint32_t bits, max;
+    uint8_t addr, c;
+    void **child;
+
+    if (bst_art_is_leaf(x)) {
+        leaf = bst_art_leaf(x);
+        bits = leaf->key[lpm->width];
+        if (lpm->best && lpm->best->key[lpm->width] >= bits)
+            return;
+        if (memcmp(leaf->key, lpm->key, bits / 8) || (bits % 8 &&
+                    (leaf->key[bits / 8] ^ lpm->key[bits / 8]) & bst_art_mask(bits % 8)))
+            return;
+        lpm->best = leaf;
+        return;
+    }
+
+    // Kept prefix bytes prune, the leaf checks the rest
+    max = n->plen < BST_ART_PREFIX ? n->plen : BST_ART_PREFIX;
+    for (uint32_t i = 0; i < max && depth + i < lpm->width; i++) {
+        c = n->prefix[i];
+        addr = lpm->key[depth + i];
+        // A truncation keeps the byte's bits down to its lowest set one
+        if (exact ? c != (addr & bst_art_mask(8 - __builtin_ctz(c | 0x100))) : c != 0)
+            return;
+        exact = exact && c == addr;
+    }
+    depth += n->plen;
+
+    if (depth >= lpm->width) {
+        bst_art_each(n, 0, 0, bst_art_lpm_len, lpm);
+        return;
+    }
+
+    if (!exact) {
+        if ((child = bst_art_find(n, 0)) != NULL)
+            bst_art_lpm_r(*child, depth + 1, 0, lpm);
+        return;
+    }
+
+    // Longest truncation first, skipping the ones that come out the same as a longer one
+    addr = lpm->key[depth];
+    for (int32_t k = 8; k >= 0; k--) {
+        c = addr & bst_art_mask(k);
+        if (k < 8 && c == (addr & bst_art_mask(k + 1)))
+            continue;
+        if ((child = bst_art_find(n, c)) != NULL)
+            bst_art_lpm_r(*child, depth + 1, k == 8, lpm);
+    }
+}
+
+static int32_t
+bst_art_free_cb(bst_art_leaf_t *leaf, void *arg) {
+    void **owner = (void **)arg;
+    bst_tree_t *tree = owner[0];
+    int32_t idx = *(int32_t *)owner[1];
+
+    if (tree->free_fn[idx])
+        tree->free_fn[idx](leaf->data, owner[2]);
+    else if (owner[3])
+        free(leaf->data);
+    free(leaf);
+
+    return BST_CB_OK;
+}
+
+static void
+bst_art_free_r(void *x, void **owner) {
+    bst_art_node_t *n = x;
+
+    if (!x)
+        return;
+    if (bst_art_is_leaf(x)) {
+        bst_art_free_cb(bst_art_leaf(x), owner);
+        return;
+    }
+
+    switch (n->type) {
+        case BST_ART4:
+            for (int32_t i = 0; i < n->count; i++)
+                bst_art_free_r(((bst_art4_t *)n)->child[i], owner);
+            break;
+        case BST_ART16:
+            for (int32_t i = 0; i < n->count; i++)
+                bst_art_free_r(((bst_art16_t *)n)->child[i], owner);
+            break;
+        case BST_ART48:
+            for (int32_t i = 0; i < 48; i++)
+                bst_art_free_r(((bst_art48_t *)n)->child[i], owner);
+            break;
+        case BST_ART256:
+            for (int32_t i = 0; i < 256; i++)
+                bst_art_free_r(((bst_art256_t *)n)->child[i], owner);
+            break;
+    }
+    free(n);
+}
+
+#define BST_ART_OPS(sfx)                                                                    \
+static void *                                                                               \
+bst_afetch_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                                \
+    uint8_t buf[BST_ART_KEY_MAX], *k;                                                       \
+    uint32_t len = bst_art_enc_##sfx(key, buf, &k);                                         \
+    return bst_art_search(tree->art[idx], k, len);                                          \
+}                                                                                           \
+static int32_t                                                                              \
+bst_ainsert_##sfx(bst_tree_t *tree, int32_t idx, void *key, void *data) {                   \
+    uint8_t buf[BST_ART_KEY_MAX], *k;                                                       \
+    uint32_t len = bst_art_enc_##sfx(key, buf, &k);                                         \
+    return bst_art_insert_r(&tree->art[idx]->root, k, len, 0, data);                        \
+}                                                                                           \
+static void *                                                                               \
+bst_adelete_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                               \
+    uint8_t buf[BST_ART_KEY_MAX], *k;                                                       \
+    uint32_t len = bst_art_enc_##sfx(key, buf, &k);                                         \
+    bst_art_leaf_t *leaf = bst_art_delete_r(&tree->art[idx]->root, k, len, 0);              \
+    void *data = leaf ? leaf->data : NULL;                                                  \
+    free(leaf);                                                                             \
+    return data;                                                                            \
+}                                                                                           \
+static const bst_ops_t bst_aops_##sfx = {                                                   \
+    bst_afetch_##sfx, bst_ainsert_##sfx, bst_adelete_##sfx, NULL                            \
+};
+
+BST_ART_OPS(str)
+BST_ART_OPS(u32)
+BST_ART_OPS(u64)
+BST_ART_OPS(i128)
+
+const bst_ops_t *
+bst_art_ops(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return &bst_aops_str;
+        case BST_KUINT32: return &bst_aops_u32;
+        case BST_KUINT64: return &bst_aops_u64;
+        case BST_KINT128: return &bst_aops_i128;
+    }
+
+    return NULL;
+}
+
+int32_t
+bst_art_init(bst_tree_t *tree, int32_t idx, int64_t flags) {
+    bst_art_t *art;
+
+    if (!bst_art_encoder(flags)) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "BST_ART indexes take BST_KPSTR, BST_KUINT32, "
+                "BST_KUINT64 or BST_KINT128 keys.");
+        return -1;
+    }
+
+    if ((art = calloc(1, sizeof(bst_art_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for ART index");
+        return -1;
+    }
+
+    switch (flags & BST_KEYS) {
+        case BST_KUINT32: art->width = 4; break;
+        case BST_KUINT64: art->width = 8; break;
+        case BST_KINT128: art->width = 16; break;
+    }
+    tree->art[idx] = art;
+
+    return 0;
+}
+
+// Key order
+int32_t
+bst_art_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data) {
+    bst_art_iter_t iter = { iter_fn, fn_data };
+
+    return bst_art_walk(tree->art[idx]->root, bst_art_data_cb, &iter);
+}
+
+// count is in bytes of the string for string keys, in bits of the address for integer keys
+int32_t
+bst_art_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t count, bst_iterate_t iter_fn,
+        void *fn_data) {
+    bst_art_t *art = tree->art[idx];
+    bst_art_scan_t scan;
+    uint8_t buf[BST_ART_KEY_MAX];
+    uint32_t len = bst_art_encoder(tree->flags[idx])(key, buf, &scan.key);
+
+    if (count < 0 || (art->width ? count > art->width * 8 : (uint32_t)count >= len)) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "A prefix of %d is longer than the key.", count);
+        return -1;
+    }
+
+    scan.bits = art->width ? count : count * 8;
+    scan.iter.iter_fn = iter_fn;
+    scan.iter.fn_data = fn_data;
+
+    return art->root ? bst_art_scan_r(art->root, 0, &scan) : BST_CB_OK;
+}
+
+// Integer keys only.  Host bits past bits are cleared before the network goes in.
+int32_t
+bst_art_insert_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits, void *data) {
+    bst_art_t *art = tree->art[idx];
+    uint8_t buf[BST_ART_KEY_MAX], *k;
+    uint32_t len = bst_art_encoder(tree->flags[idx])(key, buf, &k);
+
+    for (int32_t i = bits / 8; i < art->width; i++)
+        k[i] &= (i == bits / 8) ? bst_art_mask(bits % 8) : 0;
+    k[art->width] = bits;
+
+    return bst_art_insert_r(&art->root, k, len, 0, data);
+}
+
+void *
+bst_art_delete_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits) {
+    bst_art_t *art = tree->art[idx];
+    uint8_t buf[BST_ART_KEY_MAX], *k;
+    uint32_t len = bst_art_encoder(tree->flags[idx])(key, buf, &k);
+    bst_art_leaf_t *leaf;
+    void *data;
+
+    for (int32_t i = bits / 8; i < art->width; i++)
+        k[i] &= (i == bits / 8) ? bst_art_mask(bits % 8) : 0;
+    k[art->width] = bits;
+
+    leaf = bst_art_delete_r(&art->root, k, len, 0);
+    data = leaf ? leaf->data : NULL;
+    free(leaf);
+
+    return data;
+}
+
+void *
+bst_art_longest_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t *bits) {
+    bst_art_t *art = tree->art[idx];
+    uint8_t buf[BST_ART_KEY_MAX];
+    bst_art_lpm_t lpm = { .width = art->width, .best = NULL };
+
+    bst_art_encoder(tree->flags[idx])(key, buf, &lpm.key);
+    if (art->root)
+        bst_art_lpm_r(art->root, 0, 1, &lpm);
+
+    if (!lpm.best)
+        return NULL;
+    if (bits)
+        *bits = lpm.best->key[art->width];
+
+    return lpm.best->data;
+}
+
+void
+bst_art_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner) {
+    bst_art_t *art = tree->art[idx];
+    void *args[4] = { tree, &idx, fn_data, (void *)(intptr_t)owner };
+
+    if (!art)
+        return;
+
+    bst_art_free_r(art->root, args);
+    free(art);
+    tree->art[idx] = NULL;
+}
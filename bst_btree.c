@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// BST_BTREE indexes are B+trees.  Every node keeps its keys side by side in 4 cache lines, a
+// search inside a node is a branch free count of the keys below the needle, and all records
+// live in the leaves, which are linked in key order for scans.  Inserts split full nodes on the
+// way down so they never have to walk back up.  Deletes are lazy: a key is just removed from its
+// leaf and nodes are never merged, which is what an index that mostly grows wants.
+
+#define BST_BTREE_ORDER 16
+
+typedef struct bst_bnode_s {
+    uint16_t count;
+    uint8_t leaf;
+    struct bst_bnode_s *next;
+    bst_key_t keys[BST_BTREE_ORDER];
+    union {
+        void *data[BST_BTREE_ORDER];
+        struct bst_bnode_s *child[BST_BTREE_ORDER + 1];
+    };
+} bst_bnode_t;
+
+typedef struct bst_btree_s {
+    bst_bnode_t *root;
+} bst_btree_t;
+
+static bst_bnode_t *
+bst_bnode_alloc(int32_t leaf) {
+    bst_bnode_t *node;
+
+    if ((node = aligned_alloc(64, (sizeof(bst_bnode_t) + 63) & ~63)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for B+tree node",
+                __FUNCTION__);
+        return NULL;
+    }
+
+    node->count = 0;
+    node->leaf = leaf;
+    node->next = NULL;
+
+    return node;
+}
+
+int32_t
+bst_btree_init(bst_tree_t *tree, int32_t idx) {
+    if ((tree->btree[idx] = calloc(1, sizeof(bst_btree_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for B+tree index");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Number of keys in the node < key, or <= key if inclusive is set
+bst_always_inline int32_t
+bst_brank_t(bst_bnode_t *node, void *key, int32_t inclusive, bst_key_cmp_t cmp) {
+    int32_t rank = 0, rc;
+
+    for (int32_t i = 0; i < node->count; i++) {
+        rc = cmp(&node->keys[i], key, NULL);
+        rank += (rc == BST_RIGHT_GT) | ((rc == BST_EQUAL) & inclusive);
+    }
+
+    return rank;
+}
+
+// Separator i is the smallest key of child i + 1, so equal keys go right
+bst_always_inline bst_bnode_t *
+bst_bleaf_t(bst_btree_t *btree, void *key, bst_key_cmp_t cmp) {
+    bst_bnode_t *node = btree->root;
+
+    while (node && !node->leaf)
+        node = node->child[bst_brank_t(node, key, 1, cmp)];
+
+    return node;
+}
+
+bst_always_inline void *
+bst_bfetch_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_cmp_t cmp) {
+    bst_bnode_t *leaf = bst_bleaf_t(tree->btree[idx], key, cmp);
+    int32_t i;
+
+    if (!leaf)
+        return NULL;
+
+    i = bst_brank_t(leaf, key, 0, cmp);
+    if (i < leaf->count && cmp(&leaf->keys[i], key, NULL) == BST_EQUAL)
+        return leaf->data[i];
+
+    return NULL;
+}
+
+// Splits the full child i of parent in two
+static void
+bst_bsplit(bst_bnode_t *parent, int32_t i, bst_bnode_t *right) {
+    bst_bnode_t *left = parent->child[i];
+    int32_t half = BST_BTREE_ORDER / 2;
+
+    if (left->leaf) {
+        // Leaves keep every key, the separator is a copy of the right leaf's first
+        right->count = left->count - half;
+        memcpy(right->keys, &left->keys[half], right->count * sizeof(bst_key_t));
+        memcpy(right->data, &left->data[half], right->count * sizeof(void *));
+        right->next = left->next;
+        left->next = right;
+    }
+    else {
+        // The middle key moves up into the parent
+        right->count = left->count - half - 1;
+        memcpy(right->keys, &left->keys[half + 1], right->count * sizeof(bst_key_t));
+        memcpy(right->child, &left->child[half + 1], (right->count + 1) * sizeof(bst_bnode_t *));
+    }
+    left->count = half;
+
+    memmove(&parent->keys[i + 1], &parent->keys[i], (parent->count - i) * sizeof(bst_key_t));
+    memmove(&parent->child[i + 2], &parent->child[i + 1],
+            (parent->count - i) * sizeof(bst_bnode_t *));
+    parent->keys[i] = left->leaf ? right->keys[0] : left->keys[half];
+    parent->child[i + 1] = right;
+    parent->count++;
+}
+
+bst_always_inline int32_t
+bst_binsert_t(bst_tree_t *tree, int32_t idx, void *key, void *data, bst_key_cmp_t cmp) {
+    bst_btree_t *btree = tree->btree[idx];
+    bst_bnode_t *node, *split;
+    int32_t i;
+
+    if (!btree->root && (btree->root = bst_bnode_alloc(1)) == NULL)
+        return -1;
+
+    if (btree->root->count == BST_BTREE_ORDER) {
+        if ((node = bst_bnode_alloc(0)) == NULL ||
+                (split = bst_bnode_alloc(btree->root->leaf)) == NULL) {
+            free(node);
+            return -1;
+        }
+        node->child[0] = btree->root;
+        bst_bsplit(node, 0, split);
+        btree->root = node;
+    }
+
+    node = btree->root;
+    while (!node->leaf) {
+        i = bst_brank_t(node, key, 1, cmp);
+        if (node->child[i]->count == BST_BTREE_ORDER) {
+            if ((split = bst_bnode_alloc(node->child[i]->leaf)) == NULL)
+                return -1;
+            bst_bsplit(node, i, split);
+            if (cmp(&node->keys[i], key, NULL) != BST_LEFT_GT)
+                i++;
+        }
+        node = node->child[i];
+    }
+
+    i = bst_brank_t(node, key, 0, cmp);
+    if (i < node->count && cmp(&node->keys[i], key, NULL) == BST_EQUAL)
+        return 1;
+
+    memmove(&node->keys[i + 1], &node->keys[i], (node->count - i) * sizeof(bst_key_t));
+    memmove(&node->data[i + 1], &node->data[i], (node->count - i) * sizeof(void *));
+    tree->key_cpy_fn[idx](&node->keys[i], key);
+    node->data[i] = data;
+    node->count++;
+
+    return 0;
+}
+
+bst_always_inline void *
+bst_bdelete_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_cmp_t cmp) {
+    bst_bnode_t *leaf = bst_bleaf_t(tree->btree[idx], key, cmp);
+    void *data;
+    int32_t i;
+
+    if (!leaf)
+        return NULL;
+
+    i = bst_brank_t(leaf, key, 0, cmp);
+    if (i == leaf->count || cmp(&leaf->keys[i], key, NULL) != BST_EQUAL)
+        return NULL;
+
+    data = leaf->data[i];
+    leaf->count--;
+    memmove(&leaf->keys[i], &leaf->keys[i + 1], (leaf->count - i) * sizeof(bst_key_t));
+    memmove(&leaf->data[i], &leaf->data[i + 1], (leaf->count - i) * sizeof(void *));
+
+    return data;
+}
+
+#define BST_BTREE_OPS(sfx)                                                                  \
+static void *                                                                               \
+bst_bfetch_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                                \
+    return bst_bfetch_t(tree, idx, key, bst_key_cmp_##sfx);                                 \
+}                                                                                           \
+static int32_t                                                                              \
+bst_binsert_##sfx(bst_tree_t *tree, int32_t idx, void *key, void *data) {                   \
+    return bst_binsert_t(tree, idx, key, data, bst_key_cmp_##sfx);                          \
+}                                                                                           \
+static void *                                                                               \
+bst_bdelete_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                               \
+    return bst_bdelete_t(tree, idx, key, bst_key_cmp_##sfx);                                \
+}                                                                                           \
+static const bst_ops_t bst_bops_##sfx = {                                                   \
+    bst_bfetch_##sfx, bst_binsert_##sfx, bst_bdelete_##sfx, NULL                            \
+};
+
+BST_BTREE_OPS(str)
+BST_BTREE_OPS(i8)
+BST_BTREE_OPS(i16)
+BST_BTREE_OPS(i32)
+BST_BTREE_OPS(i64)
+BST_BTREE_OPS(u8)
+BST_BTREE_OPS(u16)
+BST_BTREE_OPS(u32)
+BST_BTREE_OPS(u64)
+BST_BTREE_OPS(i128)
+BST_BTREE_OPS(tme)
+
+const bst_ops_t *
+bst_btree_ops(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return &bst_bops_str;
+        case BST_KINT8:   return &bst_bops_i8;
+        case BST_KINT16:  return &bst_bops_i16;
+        case BST_KINT32:  return &bst_bops_i32;
+        case BST_KINT64:  return &bst_bops_i64;
+        case BST_KUINT8:  return &bst_bops_u8;
+        case BST_KUINT16: return &bst_bops_u16;
+        case BST_KUINT32: return &bst_bops_u32;
+        case BST_KUINT64: return &bst_bops_u64;
+        case BST_KINT128: return &bst_bops_i128;
+        case BST_KTME:    return &bst_bops_tme;
+    }
+
+    return NULL;
+}
+
+// Scans the leaf chain from the first key >= lo, or from the start if lo is NULL
+int32_t
+bst_btree_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi, bst_iterate_t iter_fn,
+        void *fn_data) {
+    bst_key_cmp_t cmp = tree->key_cmp_fn[idx];
+    bst_bnode_t *leaf = tree->btree[idx]->root;
+    int32_t i = 0, rc;
+
+    if (lo) {
+        while (leaf && !leaf->leaf)
+            leaf = leaf->child[bst_brank_t(leaf, lo, 1, cmp)];
+        if (leaf)
+            i = bst_brank_t(leaf, lo, 0, cmp);
+    }
+    else {
+        while (leaf && !leaf->leaf)
+            leaf = leaf->child[0];
+    }
+
+    for (; leaf; leaf = leaf->next, i = 0) {
+        for (; i < leaf->count; i++) {
+            if (hi && cmp(&leaf->keys[i], hi, NULL) == BST_LEFT_GT)
+                return 0;
+
+            rc = iter_fn(leaf->data[i], fn_data);
+            if (rc != BST_CB_OK) {
+                if (rc == BST_CB_DELETE_NODE || rc == BST_CB_DELETE_AND_ABORT)
+                    snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
+                return rc;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void
+bst_btree_free_r(bst_bnode_t *node, bst_free_t free_fn, void *fn_data, int32_t owner) {
+    if (node->leaf) {
+        for (int32_t i = 0; i < node->count; i++) {
+            if (free_fn)
+                free_fn(node->data[i], fn_data);
+            else if (owner)
+                free(node->data[i]);
+        }
+    }
+    else {
+        for (int32_t i = 0; i <= node->count; i++)
+            bst_btree_free_r(node->child[i], free_fn, fn_data, owner);
+    }
+
+    free(node);
+}
+
+void
+bst_btree_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner) {
+    bst_btree_t *btree = tree->btree[idx];
+
+    if (!btree)
+        return;
+
+    if (btree->root)
+        bst_btree_free_r(btree->root, tree->free_fn[idx], fn_data, owner);
+    free(btree);
+    tree->btree[idx] = NULL;
+}
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// BST_KCOMP keys are records compared a field at a time.  Each index keeps its own field list,
+// which its comparator is handed as context, so any number of composite indexes can exist side
+// by side.  A prefix scan compares with a copy of the list cut down to the fields it covers.
+
+// Stops at the first field that differs.  A field's offset is the same in both records, so the
+// only work per field is the load and compare of its type.
+int32_t
+bst_key_cmp_comp(bst_key_t *left, bst_key_t *right, void *ctx) {
+    bst_comp_t *comp = ctx;
+    bst_field_t *field = comp->fields;
+    bst_key_t *l, *r;
+    int32_t rc = BST_EQUAL;
+
+    for (int32_t i = 0; i < comp->count && rc == BST_EQUAL; i++, field++) {
+        l = (bst_key_t *)((char *)left->ptr + field->offset);
+        r = (bst_key_t *)((char *)right->ptr + field->offset);
+
+        switch (field->type) {
+            case BST_KPSTR:   rc = bst_key_cmp_str(l, r, NULL); break;
+            case BST_KINT8:   rc = bst_key_cmp_i8(l, r, NULL); break;
+            case BST_KINT16:  rc = bst_key_cmp_i16(l, r, NULL); break;
+            case BST_KINT32:  rc = bst_key_cmp_i32(l, r, NULL); break;
+            case BST_KINT64:  rc = bst_key_cmp_i64(l, r, NULL); break;
+            case BST_KUINT8:  rc = bst_key_cmp_u8(l, r, NULL); break;
+            case BST_KUINT16: rc = bst_key_cmp_u16(l, r, NULL); break;
+            case BST_KUINT32: rc = bst_key_cmp_u32(l, r, NULL); break;
+            case BST_KUINT64: rc = bst_key_cmp_u64(l, r, NULL); break;
+            case BST_KINT128: rc = bst_key_cmp_i128(l, r, NULL); break;
+            case BST_KTME:    rc = bst_key_cmp_tme(l, r, NULL); break;
+        }
+    }
+
+    return rc;
+}
+
+void
+bst_comp_destroy(bst_tree_t *tree, int32_t idx) {
+    free(tree->comp[idx]);
+    tree->comp[idx] = NULL;
+}
+
+// Call with the index locked and empty
+int32_t
+bst_comp_init(bst_tree_t *tree, int32_t idx, bst_field_t *fields, int32_t count) {
+    bst_comp_t *comp;
+
+    for (int32_t i = 0; i < count; i++) {
+        if ((fields[i].type & (fields[i].type - 1)) || !(fields[i].type & BST_KEYS) ||
+                fields[i].type == BST_KCOMP || fields[i].offset < 0) {
+            snprintf(err_str, MAX_ERR_LEN - 1, "Field %d of a composite key needs exactly one "
+                    "scalar, string or time key type and an offset.", i);
+            return -1;
+        }
+    }
+
+    if ((comp = malloc(sizeof(bst_comp_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for composite key");
+        return -1;
+    }
+
+    comp->count = count;
+    memcpy(comp->fields, fields, count * sizeof(bst_field_t));
+    bst_comp_destroy(tree, idx);
+    tree->comp[idx] = comp;
+
+    return 0;
+}
+
+// Copies the index's fields into prefix, keeping only the first count.  Call with the index
+// locked.
+int32_t
+bst_comp_prefix(bst_tree_t *tree, int32_t idx, int32_t count, bst_comp_t *prefix) {
+    bst_comp_t *comp = tree->comp[idx];
+
+    if (!comp || count < 1 || count > comp->count) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Index %d has no composite key with %d fields.", idx,
+                count);
+        return -1;
+    }
+
+    *prefix = *comp;
+    prefix->count = count;
+
+    return 0;
+}
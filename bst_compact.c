@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// Compact indexes keep their nodes in a slab of their own and link them by 32 bit slab index
+// rather than by pointer, with index 0 standing in for NULL.  Each node's key follows its
+// header, sized and aligned for the index's key type, so a BST_KINT32 node takes 24 bytes
+// where a regular node takes 64.
+
+#define BST_SLAB_SHIFT 16
+#define BST_SLAB_CHUNK_SZ (1 << BST_SLAB_SHIFT)
+#define BST_SLAB_MASK (BST_SLAB_CHUNK_SZ - 1)
+
+typedef struct {
+    uint32_t left;
+    uint32_t right;
+    void *data;
+    int8_t height;
+} bst_cnode_t;
+
+// Chunks never move once allocated, so pointers into nodes stay good while the slab grows
+typedef struct bst_slab_s {
+    char **chunks;
+    uint32_t chunk_count;
+    uint32_t next;
+    uint32_t free_list;
+    uint32_t root;
+    uint32_t koff;
+    uint32_t stride;
+} bst_slab_t;
+
+#define bst_cnode(slab, i) ((bst_cnode_t *)((slab)->chunks[(i) >> BST_SLAB_SHIFT] +   \
+            ((i) & BST_SLAB_MASK) * (slab)->stride))
+#define bst_ckey(slab, node) ((bst_key_t *)((char *)(node) + (slab)->koff))
+#define bst_cheight(slab, i) ((i) ? bst_cnode(slab, i)->height : 0)
+
+static uint32_t
+bst_slab_alloc(bst_slab_t *slab) {
+    uint32_t i;
+    char **chunks;
+
+    if ((i = slab->free_list) != 0) {
+        slab->free_list = bst_cnode(slab, i)->right;
+        return i;
+    }
+
+    if (slab->next == UINT32_MAX) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Compact index is full");
+        return 0;
+    }
+
+    if ((slab->next >> BST_SLAB_SHIFT) >= slab->chunk_count) {
+        if ((chunks = realloc(slab->chunks, (slab->chunk_count + 1) * sizeof(char *))) == NULL)
+            goto error_return;
+        slab->chunks = chunks;
+
+        // 64 byte aligned so 16 byte keys stay aligned at every stride
+        if ((chunks[slab->chunk_count] = aligned_alloc(64, BST_SLAB_CHUNK_SZ * slab->stride)) == NULL)
+            goto error_return;
+        slab->chunk_count++;
+    }
+
+    return slab->next++;
+
+error_return:
+    snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for compact nodes",
+            __FUNCTION__);
+    return 0;
+}
+
+static void
+bst_slab_free(bst_slab_t *slab, uint32_t i) {
+    bst_cnode(slab, i)->right = slab->free_list;
+    slab->free_list = i;
+}
+
+int32_t
+bst_compact_init(bst_tree_t *tree, int32_t idx, int64_t flags) {
+    bst_slab_t *slab;
+    uint32_t ksize, kalign;
+
+    switch (flags & BST_KEYS) {
+        case BST_KINT8:
+        case BST_KUINT8:
+            ksize = kalign = 1;
+            break;
+        case BST_KINT16:
+        case BST_KUINT16:
+            ksize = kalign = 2;
+            break;
+        case BST_KINT32:
+        case BST_KUINT32:
+            ksize = kalign = 4;
+            break;
+        case BST_KINT64:
+        case BST_KUINT64:
+        case BST_KPSTR:
+            ksize = kalign = 8;
+            break;
+        case BST_KINT128:
+            ksize = kalign = 16;
+            break;
+        case BST_KTME:
+            ksize = sizeof(struct timeval);
+            kalign = 8;
+            break;
+        default:
+            snprintf(err_str, MAX_ERR_LEN -1, "Index needs exactly one key type.");
+            return -1;
+    }
+
+    if ((slab = calloc(1, sizeof(bst_slab_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for compact index");
+        return -1;
+    }
+
+    // Index 0 is NULL, so it's never handed out
+    slab->next = 1;
+    slab->koff = (offsetof(bst_cnode_t, height) + 1 + kalign - 1) & ~(kalign - 1);
+    slab->stride = (slab->koff + ksize + 7) & ~7;
+    tree->slab[idx] = slab;
+
+    return 0;
+}
+
+static uint32_t
+bst_cright_rotate(bst_slab_t *slab, uint32_t yi) {
+    bst_cnode_t *y = bst_cnode(slab, yi);
+    uint32_t xi = y->left;
+    bst_cnode_t *x = bst_cnode(slab, xi);
+
+    y->left = x->right;
+    x->right = yi;
+
+    y->height = MAX(bst_cheight(slab, y->left), bst_cheight(slab, y->right)) + 1;
+    x->height = MAX(bst_cheight(slab, x->left), y->height) + 1;
+
+    return xi;
+}
+
+static uint32_t
+bst_cleft_rotate(bst_slab_t *slab, uint32_t xi) {
+    bst_cnode_t *x = bst_cnode(slab, xi);
+    uint32_t yi = x->right;
+    bst_cnode_t *y = bst_cnode(slab, yi);
+
+    x->right = y->left;
+    y->left = xi;
+
+    x->height = MAX(bst_cheight(slab, x->left), bst_cheight(slab, x->right)) + 1;
+    y->height = MAX(x->height, bst_cheight(slab, y->right)) + 1;
+
+    return yi;
+}
+
+// Same as bst_rebalance, on slab indexes
+static uint32_t
+bst_crebalance(bst_slab_t *slab, uint32_t i) {
+    bst_cnode_t *node = bst_cnode(slab, i), *child;
+    int32_t lh = bst_cheight(slab, node->left);
+    int32_t rh = bst_cheight(slab, node->right);
+
+    if ((lh - rh) > 1) {
+        // Left Right Case
+        child = bst_cnode(slab, node->left);
+        if (bst_cheight(slab, child->left) < bst_cheight(slab, child->right))
+            node->left = bst_cleft_rotate(slab, node->left);
+        return bst_cright_rotate(slab, i);
+    }
+    else if ((lh - rh) < -1) {
+        // Right Left Case
+        child = bst_cnode(slab, node->right);
+        if (bst_cheight(slab, child->right) < bst_cheight(slab, child->left))
+            node->right = bst_cright_rotate(slab, node->right);
+        return bst_cleft_rotate(slab, i);
+    }
+
+    node->height = MAX(lh, rh) + 1;
+
+    return i;
+}
+
+// These follow bst_find_t, bst_insert_t and bst_delete_t in bst.c step for step
+bst_always_inline void *
+bst_cfetch_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_cmp_t cmp) {
+    bst_slab_t *slab = tree->slab[idx];
+    bst_cnode_t *node;
+    uint32_t i = slab->root;
+    int32_t rc;
+
+    while (i) {
+        node = bst_cnode(slab, i);
+        rc = cmp(bst_ckey(slab, node), key, NULL);
+        if (rc == BST_RIGHT_GT)
+            i = node->right;
+        else if (rc == BST_LEFT_GT)
+            i = node->left;
+        else
+            return node->data;
+    }
+
+    return NULL;
+}
+
+bst_always_inline int32_t
+bst_cinsert_t(bst_tree_t *tree, int32_t idx, void *key, void *data, bst_key_cmp_t cmp) {
+    bst_slab_t *slab = tree->slab[idx];
+    uint32_t *path[BST_MAX_HEIGHT];
+    uint32_t *link = &slab->root;
+    bst_cnode_t *node;
+    uint32_t i;
+    int32_t depth = 0, rc;
+    int8_t height;
+
+    while ((i = *link) != 0) {
+        node = bst_cnode(slab, i);
+        rc = cmp(bst_ckey(slab, node), key, NULL);
+        if (rc == BST_EQUAL)
+            return 1;
+
+        path[depth++] = link;
+        link = (rc == BST_LEFT_GT) ? &node->left : &node->right;
+    }
+
+    if ((i = bst_slab_alloc(slab)) == 0)
+        return -1;
+
+    node = bst_cnode(slab, i);
+    tree->key_cpy_fn[idx](bst_ckey(slab, node), key);
+    node->data = data;
+    node->left = node->right = 0;
+    node->height = 1;
+    *link = i;
+
+    while (depth--) {
+        link = path[depth];
+        height = bst_cnode(slab, *link)->height;
+        *link = bst_crebalance(slab, *link);
+        if (bst_cnode(slab, *link)->height == height)
+            break;
+    }
+
+    return 0;
+}
+
+bst_always_inline void *
+bst_cdelete_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_cmp_t cmp) {
+    bst_slab_t *slab = tree->slab[idx];
+    uint32_t *path[BST_MAX_HEIGHT];
+    uint32_t *link = &slab->root;
+    bst_cnode_t *node, *succ;
+    uint32_t i, si;
+    int32_t depth = 0, target, rc;
+    int8_t height;
+    void *data;
+
+    while ((i = *link) != 0) {
+        node = bst_cnode(slab, i);
+        rc = cmp(bst_ckey(slab, node), key, NULL);
+        if (rc == BST_EQUAL)
+            break;
+
+        path[depth++] = link;
+        link = (rc == BST_LEFT_GT) ? &node->left : &node->right;
+    }
+
+    if (!i)
+        return NULL;
+
+    data = node->data;
+    if (!node->left || !node->right) {
+        *link = node->left ? node->left : node->right;
+    }
+    else {
+        target = depth;
+        path[depth++] = link;
+        link = &node->right;
+        for (si = *link; (succ = bst_cnode(slab, si))->left; si = *link) {
+            path[depth++] = link;
+            link = &succ->left;
+        }
+
+        if (link != &node->right) {
+            *link = succ->right;
+            succ->right = node->right;
+            path[target + 1] = &succ->right;
+        }
+        succ->left = node->left;
+        succ->height = node->height;
+        *path[target] = si;
+    }
+
+    bst_slab_free(slab, i);
+
+    while (depth--) {
+        link = path[depth];
+        height = bst_cnode(slab, *link)->height;
+        *link = bst_crebalance(slab, *link);
+        if (bst_cnode(slab, *link)->height == height)
+            break;
+    }
+
+    return data;
+}
+
+#define BST_COMPACT_OPS(sfx)                                                                \
+static void *                                                                               \
+bst_cfetch_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                                \
+    return bst_cfetch_t(tree, idx, key, bst_key_cmp_##sfx);                                 \
+}                                                                                           \
+static int32_t                                                                              \
+bst_cinsert_##sfx(bst_tree_t *tree, int32_t idx, void *key, void *data) {                   \
+    return bst_cinsert_t(tree, idx, key, data, bst_key_cmp_##sfx);                          \
+}                                                                                           \
+static void *                                                                               \
+bst_cdelete_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                               \
+    return bst_cdelete_t(tree, idx, key, bst_key_cmp_##sfx);                                \
+}                                                                                           \
+static const bst_ops_t bst_cops_##sfx = {                                                   \
+    bst_cfetch_##sfx, bst_cinsert_##sfx, bst_cdelete_##sfx, NULL                            \
+};
+
+BST_COMPACT_OPS(str)
+BST_COMPACT_OPS(i8)
+BST_COMPACT_OPS(i16)
+BST_COMPACT_OPS(i32)
+BST_COMPACT_OPS(i64)
+BST_COMPACT_OPS(u8)
+BST_COMPACT_OPS(u16)
+BST_COMPACT_OPS(u32)
+BST_COMPACT_OPS(u64)
+BST_COMPACT_OPS(i128)
+BST_COMPACT_OPS(tme)
+
+const bst_ops_t *
+bst_compact_ops(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return &bst_cops_str;
+        case BST_KINT8:   return &bst_cops_i8;
+        case BST_KINT16:  return &bst_cops_i16;
+        case BST_KINT32:  return &bst_cops_i32;
+        case BST_KINT64:  return &bst_cops_i64;
+        case BST_KUINT8:  return &bst_cops_u8;
+        case BST_KUINT16: return &bst_cops_u16;
+        case BST_KUINT32: return &bst_cops_u32;
+        case BST_KUINT64: return &bst_cops_u64;
+        case BST_KINT128: return &bst_cops_i128;
+        case BST_KTME:    return &bst_cops_tme;
+    }
+
+    return NULL;
+}
+
+static int32_t
+bst_compact_iterate_r(bst_slab_t *slab, uint32_t i, bst_iterate_t iter_fn, void *fn_data) {
+    bst_cnode_t *node;
+    int32_t rc;
+
+    if (!i)
+        return BST_CB_OK;
+
+    node = bst_cnode(slab, i);
+    if ((rc = bst_compact_iterate_r(slab, node->left, iter_fn, fn_data)) != BST_CB_OK)
+        return rc;
+
+    rc = iter_fn(node->data, fn_data);
+    switch(rc) {
+        case BST_CB_DELETE_AND_ABORT:
+        case BST_CB_DELETE_NODE:
+            snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
+        case BST_CB_ABORT:
+            return rc;
+    }
+
+    return bst_compact_iterate_r(slab, node->right, iter_fn, fn_data);
+}
+
+int32_t
+bst_compact_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data) {
+    return bst_compact_iterate_r(tree->slab[idx], tree->slab[idx]->root, iter_fn, fn_data);
+}
+
+static void
+bst_compact_free_data(bst_slab_t *slab, uint32_t i, bst_free_t free_fn, void *fn_data,
+        int32_t owner) {
+    bst_cnode_t *node;
+
+    if (i) {
+        node = bst_cnode(slab, i);
+        bst_compact_free_data(slab, node->left, free_fn, fn_data, owner);
+        bst_compact_free_data(slab, node->right, free_fn, fn_data, owner);
+        if (free_fn)
+            free_fn(node->data, fn_data);
+        else if (owner)
+            free(node->data);
+    }
+}
+
+// Frees the index's data the same way bst_delete_data does, then drops the whole slab
+void
+bst_compact_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner) {
+    bst_slab_t *slab = tree->slab[idx];
+
+    if (!slab)
+        return;
+
+    if (tree->free_fn[idx] || owner)
+        bst_compact_free_data(slab, slab->root, tree->free_fn[idx], fn_data, owner);
+
+    for (uint32_t c = 0; c < slab->chunk_count; c++)
+        free(slab->chunks[c]);
+    free(slab->chunks);
+    free(slab);
+    tree->slab[idx] = NULL;
+}
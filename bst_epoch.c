@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// Epoch based reclamation.  A reader publishes the global epoch in its own thread record when it
+// enters a read section and clears it when it leaves; nothing else it does writes memory anyone
+// else reads.  Writers unlink nodes and retire them tagged with the epoch of the moment.  The
+// global epoch only moves on once every reader inside a read section has seen the current one,
+// so by the time it has moved twice past a retired batch no reader can still hold a pointer into
+// it, and the batch is handed to its reclaim function.
+
+typedef struct bst_epoch_rec_s {
+    // epoch << 1 | 1 while inside a read section, 0 outside
+    uint64_t state;
+    uint32_t nest;
+    uint32_t in_use;
+    struct bst_epoch_rec_s *next;
+} __attribute__((aligned(64))) bst_epoch_rec_t;
+
+typedef struct bst_limbo_s {
+    struct bst_limbo_s *next;
+    uint64_t epoch;
+    bst_reclaim_t reclaim_fn;
+    void *arg;
+    int32_t count;
+    void *ptrs[];
+} bst_limbo_t;
+
+static uint64_t global_epoch = 1;
+static bst_epoch_rec_t *epoch_recs = NULL;
+static __thread bst_epoch_rec_t *epoch_rec = NULL;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+// Retired batches, oldest first
+static pthread_mutex_t limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bst_limbo_t *limbo_head = NULL;
+static bst_limbo_t *limbo_tail = NULL;
+
+// Records outlive their threads; an exiting thread just gives its record back for reuse
+static void
+bst_epoch_release(void *arg) {
+    bst_epoch_rec_t *rec = (bst_epoch_rec_t *)arg;
+
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+bst_epoch_key_init(void) {
+    pthread_key_create(&epoch_key, bst_epoch_release);
+}
+
+// Takes a record nobody is using, or adds one
+static bst_epoch_rec_t *
+bst_epoch_claim(void) {
+    bst_epoch_rec_t *rec;
+    uint32_t unused;
+
+    for (rec = __atomic_load_n(&epoch_recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE,
+                    __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!rec) {
+        if ((rec = aligned_alloc(64, sizeof(bst_epoch_rec_t))) == NULL) {
+            snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate an epoch record",
+                    __FUNCTION__);
+            return NULL;
+        }
+        memset(rec, 0, sizeof(bst_epoch_rec_t));
+        rec->in_use = 1;
+
+        rec->next = __atomic_load_n(&epoch_recs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&epoch_recs, &rec->next, rec, 1, __ATOMIC_RELEASE,
+                    __ATOMIC_RELAXED))
+            ;
+    }
+
+    return rec;
+}
+
+static bst_epoch_rec_t *
+bst_epoch_rec(void) {
+    bst_epoch_rec_t *rec;
+
+    if (epoch_rec)
+        return epoch_rec;
+
+    pthread_once(&epoch_once, bst_epoch_key_init);
+    if ((rec = bst_epoch_claim()) == NULL)
+        return NULL;
+
+    pthread_setspecific(epoch_key, rec);
+    epoch_rec = rec;
+
+    return rec;
+}
+
+// Returns -1 if the thread has no record and can't get one, in which case the caller has to
+// fall back to locking
+int32_t
+bst_epoch_enter(void) {
+    bst_epoch_rec_t *rec;
+
+    if ((rec = bst_epoch_rec()) == NULL)
+        return -1;
+
+    if (rec->nest++ == 0) {
+        // The fence pairs with the one in bst_epoch_collect: either the collector sees this
+        // record, or this reader sees everything unlinked before the collector looked
+        __atomic_store_n(&rec->state, (__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) << 1) | 1,
+                __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
+void
+bst_epoch_exit(void) {
+    bst_epoch_rec_t *rec = epoch_rec;
+
+    if (--rec->nest == 0)
+        __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+// A pin is a read section with a record of its own instead of the thread's, so it can be held
+// for as long as needed and left from any thread.  Nothing retired while it's held is reclaimed.
+bst_epoch_rec_t *
+bst_epoch_pin(void) {
+    bst_epoch_rec_t *rec;
+
+    if ((rec = bst_epoch_claim()) == NULL)
+        return NULL;
+
+    __atomic_store_n(&rec->state, (__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) << 1) | 1,
+            __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return rec;
+}
+
+void
+bst_epoch_unpin(bst_epoch_rec_t *rec) {
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Moves the global epoch on if every reader has caught up with it, then reclaims whatever that
+// made safe.  Call with limbo_mutex held.
+static void
+bst_epoch_collect(void) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), state;
+    bst_epoch_rec_t *rec;
+    bst_limbo_t *limbo;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (rec = __atomic_load_n(&epoch_recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && (state >> 1) != epoch)
+            break;
+    }
+
+    if (!rec)
+        __atomic_store_n(&global_epoch, ++epoch, __ATOMIC_RELEASE);
+
+    while ((limbo = limbo_head) && limbo->epoch + 2 <= epoch) {
+        limbo_head = limbo->next;
+        limbo->reclaim_fn(limbo->arg, limbo->ptrs, limbo->count);
+        free(limbo);
+    }
+    if (!limbo_head)
+        limbo_tail = NULL;
+}
+
+// Hands count pointers that are no longer reachable to reclaim_fn once no reader can still
+// be looking at them.  The caller's array can be reused as soon as this returns.
+void
+bst_epoch_retire(void **ptrs, int32_t count, bst_reclaim_t reclaim_fn, void *arg) {
+    bst_limbo_t *limbo;
+
+    if (count == 0)
+        return;
+
+    // Out of memory, wait out the grace period right here instead
+    if ((limbo = malloc(sizeof(bst_limbo_t) + count * sizeof(void *))) == NULL) {
+        bst_epoch_synchronize();
+        reclaim_fn(arg, ptrs, count);
+        return;
+    }
+
+    limbo->next = NULL;
+    limbo->reclaim_fn = reclaim_fn;
+    limbo->arg = arg;
+    limbo->count = count;
+    memcpy(limbo->ptrs, ptrs, count * sizeof(void *));
+
+    pthread_mutex_lock(&limbo_mutex);
+    limbo->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    if (limbo_tail)
+        limbo_tail->next = limbo;
+    else
+        limbo_head = limbo;
+    limbo_tail = limbo;
+    bst_epoch_collect();
+    pthread_mutex_unlock(&limbo_mutex);
+}
+
+// Waits until everything retired before the call has been reclaimed.  Must not be called from
+// inside a read section.
+void
+bst_epoch_synchronize(void) {
+    uint64_t target = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) + 2;
+    int32_t pending;
+
+    // Batches are reclaimed in epoch order, so reaching target reclaims all the older ones
+    do {
+        pthread_mutex_lock(&limbo_mutex);
+        bst_epoch_collect();
+        pending = (__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) < target);
+        pthread_mutex_unlock(&limbo_mutex);
+        if (pending)
+            sched_yield();
+    } while (pending);
+}
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// A frozen index is a read-only copy of an AVL index laid out for searching.  Integer keys are
+// mapped onto int64_t in an order preserving way and packed into an S-tree: a static B-tree of
+// 64 byte blocks holding 8 keys each, where the children of block k are blocks k * 9 + 1 through
+// k * 9 + 9.  One compare of the search key against a whole block picks the child, so a lookup
+// touches one cache line per level instead of one per key.  Other key types go into an
+// Eytzinger array, the tree stored breadth first, with the comparator choosing the next slot
+// arithmetically.
+
+#define BST_SBLOCK 8
+
+typedef struct bst_frozen_s {
+    int64_t count;
+    int64_t block_count;
+    int64_t *skeys;
+    bst_key_t *ekeys;
+    void **data;
+} bst_frozen_t;
+
+// Returns 0 and sets *norm for key types that fit the S-tree
+static inline int32_t
+bst_norm_key(int64_t flags, bst_key_t *key, int64_t *norm) {
+    switch (flags & BST_KEYS) {
+        case BST_KINT8:   *norm = key->i8; break;
+        case BST_KINT16:  *norm = key->i16; break;
+        case BST_KINT32:  *norm = key->i32; break;
+        case BST_KINT64:  *norm = key->i64; break;
+        case BST_KUINT8:  *norm = key->u8; break;
+        case BST_KUINT16: *norm = key->u16; break;
+        case BST_KUINT32: *norm = key->u32; break;
+        // Flipping the top bit turns unsigned order into signed order
+        case BST_KUINT64: *norm = (int64_t)(key->u64 ^ (1ULL << 63)); break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+// Counts the keys in a block that are < key
+static inline int32_t
+bst_sblock_rank(int64_t *block, int64_t key) {
+#ifdef __AVX2__
+    __m256i needle = _mm256_set1_epi64x(key);
+    __m256i lo = _mm256_cmpgt_epi64(needle, _mm256_load_si256((__m256i *)block));
+    __m256i hi = _mm256_cmpgt_epi64(needle, _mm256_load_si256((__m256i *)(block + 4)));
+
+    return __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lo)) |
+            (_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4));
+#else
+    // Fixed trip count and no early exit, so the compiler is free to vectorize it
+    int32_t rank = 0;
+
+    for (int32_t i = 0; i < BST_SBLOCK; i++)
+        rank += (block[i] < key);
+
+    return rank;
+#endif
+}
+
+static void
+bst_sbuild(bst_frozen_t *frozen, int64_t *norm, void **data, int64_t k, int64_t *next) {
+    if (k >= frozen->block_count)
+        return;
+
+    for (int32_t i = 0; i < BST_SBLOCK; i++) {
+        bst_sbuild(frozen, norm, data, k * (BST_SBLOCK + 1) + i + 1, next);
+        if (*next < frozen->count) {
+            frozen->skeys[k * BST_SBLOCK + i] = norm[*next];
+            frozen->data[k * BST_SBLOCK + i] = data[*next];
+            (*next)++;
+        }
+        else {
+            // Padding sorts after every key and never matches, its data is NULL
+            frozen->skeys[k * BST_SBLOCK + i] = INT64_MAX;
+            frozen->data[k * BST_SBLOCK + i] = NULL;
+        }
+    }
+    bst_sbuild(frozen, norm, data, k * (BST_SBLOCK + 1) + BST_SBLOCK + 1, next);
+}
+
+static void
+bst_ebuild(bst_frozen_t *frozen, bst_key_t **keys, void **data, int64_t k, int64_t *next) {
+    if (k > frozen->count)
+        return;
+
+    bst_ebuild(frozen, keys, data, 2 * k, next);
+    frozen->ekeys[k] = *keys[*next];
+    frozen->data[k] = data[*next];
+    (*next)++;
+    bst_ebuild(frozen, keys, data, 2 * k + 1, next);
+}
+
+// keys and data are the index's contents in ascending key order
+int32_t
+bst_frozen_build(bst_tree_t *tree, int32_t idx, bst_key_t **keys, void **data, int64_t n) {
+    bst_frozen_t *frozen;
+    int64_t *norm = NULL, next = 0, dummy;
+
+    if ((frozen = calloc(1, sizeof(bst_frozen_t))) == NULL)
+        goto error_return;
+    frozen->count = n;
+
+    if (bst_norm_key(tree->flags[idx], keys[0], &dummy) == 0) {
+        frozen->block_count = (n + BST_SBLOCK - 1) / BST_SBLOCK;
+        if ((norm = malloc(n * sizeof(int64_t))) == NULL ||
+                (frozen->skeys = aligned_alloc(64, frozen->block_count * 64)) == NULL ||
+                (frozen->data = malloc(frozen->block_count * BST_SBLOCK * sizeof(void *))) == NULL)
+            goto error_return;
+
+        for (int64_t i = 0; i < n; i++)
+            bst_norm_key(tree->flags[idx], keys[i], &norm[i]);
+        bst_sbuild(frozen, norm, data, 0, &next);
+        free(norm);
+    }
+    else {
+        // Slot 0 is unused so the children of k are 2k and 2k + 1
+        if ((frozen->ekeys = aligned_alloc(64, ((n + 4) & ~3) * sizeof(bst_key_t))) == NULL ||
+                (frozen->data = malloc((n + 1) * sizeof(void *))) == NULL)
+            goto error_return;
+
+        bst_ebuild(frozen, keys, data, 1, &next);
+    }
+
+    tree->frozen[idx] = frozen;
+
+    return 0;
+
+error_return:
+    snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory to freeze index %d", idx);
+    free(norm);
+    if (frozen) {
+        free(frozen->skeys);
+        free(frozen->ekeys);
+        free(frozen->data);
+        free(frozen);
+    }
+
+    return -1;
+}
+
+void *
+bst_frozen_fetch(bst_tree_t *tree, int32_t idx, void *key) {
+    bst_frozen_t *frozen = tree->frozen[idx];
+    bst_key_cmp_t cmp;
+    void *ctx;
+    int64_t norm = 0, k = 0, found = -1;
+    int32_t rank;
+
+    if (frozen->skeys) {
+        bst_norm_key(tree->flags[idx], key, &norm);
+        while (k < frozen->block_count) {
+            rank = bst_sblock_rank(&frozen->skeys[k * BST_SBLOCK], norm);
+            if (rank < BST_SBLOCK)
+                found = k * BST_SBLOCK + rank;
+            k = k * (BST_SBLOCK + 1) + rank + 1;
+        }
+
+        return (found >= 0 && frozen->skeys[found] == norm) ? frozen->data[found] : NULL;
+    }
+
+    // Go right past keys < key, then undo the trailing right turns to land on the lower bound
+    cmp = tree->key_cmp_fn[idx];
+    ctx = tree->comp[idx];
+    k = 1;
+    while (k <= frozen->count) {
+        __builtin_prefetch(&frozen->ekeys[4 * k]);
+        k = 2 * k + (cmp(&frozen->ekeys[k], key, ctx) == BST_RIGHT_GT);
+    }
+    k >>= __builtin_ffsll(~k);
+
+    return (k && cmp(&frozen->ekeys[k], key, ctx) == BST_EQUAL) ? frozen->data[k] : NULL;
+}
+
+void
+bst_frozen_free(bst_tree_t *tree, int32_t idx) {
+    bst_frozen_t *frozen = tree->frozen[idx];
+
+    if (!frozen)
+        return;
+
+    free(frozen->skeys);
+    free(frozen->ekeys);
+    free(frozen->data);
+    free(frozen);
+    tree->frozen[idx] = NULL;
+}
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// BST_HASH indexes are open addressing hash tables with linear probing, for indexes that only
+// ever see exact lookups.  Each slot keeps the full hash next to the key, so most probes that
+// miss are settled without calling the comparator, and growing the table never rehashes a key.
+// Deletes shift the rest of the probe run back instead of leaving tombstones.
+
+#define BST_HASH_INIT_SZ 16
+
+// The top bit marks a slot as used, so a hash of 0 still lands in a used slot
+#define BST_HASH_USED (1ULL << 63)
+
+typedef struct {
+    uint64_t hash;
+    void *data;
+    bst_key_t key;
+} bst_hslot_t;
+
+typedef struct bst_hash_s {
+    bst_hslot_t *slots;
+    uint64_t mask;
+    uint64_t count;
+} bst_hash_t;
+
+int32_t
+bst_hash_init(bst_tree_t *tree, int32_t idx) {
+    bst_hash_t *hash;
+
+    if ((hash = calloc(1, sizeof(bst_hash_t))) == NULL ||
+            (hash->slots = calloc(BST_HASH_INIT_SZ, sizeof(bst_hslot_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for hash index");
+        free(hash);
+        return -1;
+    }
+
+    hash->mask = BST_HASH_INIT_SZ - 1;
+    tree->hash[idx] = hash;
+
+    return 0;
+}
+
+// Doubles the table, keeping it at most 3/4 full
+static int32_t
+bst_hash_grow(bst_hash_t *hash) {
+    bst_hslot_t *slots;
+    uint64_t mask = hash->mask * 2 + 1, i;
+
+    if ((slots = calloc(mask + 1, sizeof(bst_hslot_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for hash slots",
+                __FUNCTION__);
+        return -1;
+    }
+
+    for (uint64_t j = 0; j <= hash->mask; j++) {
+        if (!hash->slots[j].hash)
+            continue;
+
+        for (i = hash->slots[j].hash & mask; slots[i].hash; i = (i + 1) & mask)
+            ;
+        slots[i] = hash->slots[j];
+    }
+
+    free(hash->slots);
+    hash->slots = slots;
+    hash->mask = mask;
+
+    return 0;
+}
+
+// Returns the slot holding key, or the empty slot that ends its probe run
+bst_always_inline uint64_t
+bst_hprobe_t(bst_hash_t *hash, void *key, uint64_t h, bst_key_cmp_t cmp) {
+    uint64_t i = h & hash->mask;
+
+    while (hash->slots[i].hash) {
+        if (hash->slots[i].hash == h && cmp(&hash->slots[i].key, key, NULL) == BST_EQUAL)
+            break;
+        i = (i + 1) & hash->mask;
+    }
+
+    return i;
+}
+
+bst_always_inline void *
+bst_hfetch_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_hash_t hfn, bst_key_cmp_t cmp) {
+    bst_hash_t *hash = tree->hash[idx];
+    uint64_t i = bst_hprobe_t(hash, key, hfn(key) | BST_HASH_USED, cmp);
+
+    return hash->slots[i].hash ? hash->slots[i].data : NULL;
+}
+
+bst_always_inline int32_t
+bst_hinsert_t(bst_tree_t *tree, int32_t idx, void *key, void *data, bst_key_hash_t hfn,
+        bst_key_cmp_t cmp) {
+    bst_hash_t *hash = tree->hash[idx];
+    uint64_t h = hfn(key) | BST_HASH_USED, i;
+
+    if ((hash->count + 1) * 4 > (hash->mask + 1) * 3 && bst_hash_grow(hash) < 0)
+        return -1;
+
+    i = bst_hprobe_t(hash, key, h, cmp);
+    if (hash->slots[i].hash)
+        return 1;
+
+    hash->slots[i].hash = h;
+    hash->slots[i].data = data;
+    tree->key_cpy_fn[idx](&hash->slots[i].key, key);
+    hash->count++;
+
+    return 0;
+}
+
+bst_always_inline void *
+bst_hdelete_t(bst_tree_t *tree, int32_t idx, void *key, bst_key_hash_t hfn, bst_key_cmp_t cmp) {
+    bst_hash_t *hash = tree->hash[idx];
+    uint64_t i = bst_hprobe_t(hash, key, hfn(key) | BST_HASH_USED, cmp), home;
+    void *data;
+
+    if (!hash->slots[i].hash)
+        return NULL;
+
+    data = hash->slots[i].data;
+
+    // Pull back every later slot in the run whose home is not between the hole and itself
+    for (uint64_t j = (i + 1) & hash->mask; hash->slots[j].hash; j = (j + 1) & hash->mask) {
+        home = hash->slots[j].hash & hash->mask;
+        if (((j - home) & hash->mask) >= ((j - i) & hash->mask)) {
+            hash->slots[i] = hash->slots[j];
+            i = j;
+        }
+    }
+    hash->slots[i].hash = 0;
+    hash->count--;
+
+    return data;
+}
+
+#define BST_HASH_OPS(sfx)                                                                   \
+static void *                                                                               \
+bst_hfetch_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                                \
+    return bst_hfetch_t(tree, idx, key, bst_key_hash_##sfx, bst_key_cmp_##sfx);             \
+}                                                                                           \
+static int32_t                                                                              \
+bst_hinsert_##sfx(bst_tree_t *tree, int32_t idx, void *key, void *data) {                   \
+    return bst_hinsert_t(tree, idx, key, data, bst_key_hash_##sfx, bst_key_cmp_##sfx);      \
+}                                                                                           \
+static void *                                                                               \
+bst_hdelete_##sfx(bst_tree_t *tree, int32_t idx, void *key) {                               \
+    return bst_hdelete_t(tree, idx, key, bst_key_hash_##sfx, bst_key_cmp_##sfx);            \
+}                                                                                           \
+static const bst_ops_t bst_hops_##sfx = {                                                   \
+    bst_hfetch_##sfx, bst_hinsert_##sfx, bst_hdelete_##sfx, NULL                            \
+};
+
+BST_HASH_OPS(str)
+BST_HASH_OPS(i8)
+BST_HASH_OPS(i16)
+BST_HASH_OPS(i32)
+BST_HASH_OPS(i64)
+BST_HASH_OPS(u8)
+BST_HASH_OPS(u16)
+BST_HASH_OPS(u32)
+BST_HASH_OPS(u64)
+BST_HASH_OPS(i128)
+BST_HASH_OPS(tme)
+
+const bst_ops_t *
+bst_hash_ops(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return &bst_hops_str;
+        case BST_KINT8:   return &bst_hops_i8;
+        case BST_KINT16:  return &bst_hops_i16;
+        case BST_KINT32:  return &bst_hops_i32;
+        case BST_KINT64:  return &bst_hops_i64;
+        case BST_KUINT8:  return &bst_hops_u8;
+        case BST_KUINT16: return &bst_hops_u16;
+        case BST_KUINT32: return &bst_hops_u32;
+        case BST_KUINT64: return &bst_hops_u64;
+        case BST_KINT128: return &bst_hops_i128;
+        case BST_KTME:    return &bst_hops_tme;
+    }
+
+    return NULL;
+}
+
+// Slot order, which has nothing to do with key order
+int32_t
+bst_hash_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data) {
+    bst_hash_t *hash = tree->hash[idx];
+    int32_t rc;
+
+    for (uint64_t i = 0; i <= hash->mask; i++) {
+        if (!hash->slots[i].hash)
+            continue;
+
+        rc = iter_fn(hash->slots[i].data, fn_data);
+        switch(rc) {
+            case BST_CB_DELETE_AND_ABORT:
+            case BST_CB_DELETE_NODE:
+                snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
+            case BST_CB_ABORT:
+                return rc;
+        }
+    }
+
+    return BST_CB_OK;
+}
+
+void
+bst_hash_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner) {
+    bst_hash_t *hash = tree->hash[idx];
+
+    if (!hash)
+        return;
+
+    for (uint64_t i = 0; i <= hash->mask && (tree->free_fn[idx] || owner); i++) {
+        if (!hash->slots[i].hash)
+            continue;
+
+        if (tree->free_fn[idx])
+            tree->free_fn[idx](hash->slots[i].data, fn_data);
+        else
+            free(hash->slots[i].data);
+    }
+
+    free(hash->slots);
+    free(hash);
+    tree->hash[idx] = NULL;
+}
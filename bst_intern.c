@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// The process's interned strings: one copy of each, in an open addressing table with linear
+// probing.  Strings are only ever added, so a copy handed out stays valid, and at the same
+// address, until bst_fini.  Only inserts into BST_INTERN indexes and callers of bst_intern come
+// here, never a lookup in an index.
+
+#define BST_INTERN_INIT_SZ 1024
+
+typedef struct {
+    uint64_t hash;
+    char *str;
+} bst_islot_t;
+
+static bst_islot_t *intern_slots = NULL;
+static uint64_t intern_mask = 0;
+static uint64_t intern_count = 0;
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// djb2 run through Murmur3's finalizer, with the top bit marking a used slot
+static uint64_t
+bst_intern_hash(char *str) {
+    uint64_t h = 5381;
+
+    while (*str)
+        h = ((h << 5) + h) + (uint8_t)*str++;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h | (1ULL << 63);
+}
+
+// Doubles the table, or makes the first one.  Call with intern_mutex held.
+static int32_t
+bst_intern_grow(void) {
+    bst_islot_t *slots;
+    uint64_t mask = intern_slots ? intern_mask * 2 + 1 : BST_INTERN_INIT_SZ - 1, i;
+
+    if ((slots = calloc(mask + 1, sizeof(bst_islot_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for interned strings",
+                __FUNCTION__);
+        return -1;
+    }
+
+    for (uint64_t j = 0; intern_slots && j <= intern_mask; j++) {
+        if (!intern_slots[j].hash)
+            continue;
+
+        for (i = intern_slots[j].hash & mask; slots[i].hash; i = (i + 1) & mask)
+            ;
+        slots[i] = intern_slots[j];
+    }
+
+    free(intern_slots);
+    intern_slots = slots;
+    intern_mask = mask;
+
+    return 0;
+}
+
+char *
+bst_intern(char *str) {
+    uint64_t h = bst_intern_hash(str), i;
+    char *copy = NULL;
+
+    pthread_mutex_lock(&intern_mutex);
+    if ((intern_count + 1) * 4 > (intern_mask + 1) * 3 && bst_intern_grow() < 0)
+        goto out;
+
+    for (i = h & intern_mask; intern_slots[i].hash; i = (i + 1) & intern_mask) {
+        if (intern_slots[i].hash == h && !strcmp(intern_slots[i].str, str)) {
+            copy = intern_slots[i].str;
+            goto out;
+        }
+    }
+
+    if ((copy = strdup(str)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for an interned string",
+                __FUNCTION__);
+        goto out;
+    }
+
+    intern_slots[i].hash = h;
+    intern_slots[i].str = copy;
+    intern_count++;
+
+out:
+    pthread_mutex_unlock(&intern_mutex);
+
+    return copy;
+}
+
+// Every index pointing at these must be gone by now
+void
+bst_intern_free(void) {
+    pthread_mutex_lock(&intern_mutex);
+    for (uint64_t i = 0; intern_slots && i <= intern_mask; i++)
+        free(intern_slots[i].str);
+    free(intern_slots);
+    intern_slots = NULL;
+    intern_mask = intern_count = 0;
+    pthread_mutex_unlock(&intern_mutex);
+}
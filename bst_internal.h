@@ -0,0 +1,339 @@
+#ifndef __BST_INTERNAL_H__
+#define __BST_INTERNAL_H__
+
+// Shared between the bst source files, not part of the library's interface
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "al_data_struct.h"
+
+#define MAX_ERR_LEN 2048
+
+#define BST_EQUAL 0
+#define BST_RIGHT_GT -1
+#define BST_LEFT_GT 1
+
+#define bst_always_inline static inline __attribute__((always_inline))
+
+extern char err_str[MAX_ERR_LEN];
+extern const int64_t BST_KEYS;
+
+typedef union bst_key_u {
+    char *pstr;
+    // A string key in a node also keeps its first bytes next to the pointer, see bst_str_prefix
+    struct {
+        char *str;
+        uint64_t pfx;
+    } sp;
+    void *ptr;
+    int8_t i8;
+    int16_t i16;
+    int32_t i32;
+    int64_t i64;
+    uint8_t u8;
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+    __int128_t i128;
+    struct timeval tv;
+} bst_key_t;
+
+// The key type specialized routines of an index.  fetch_many is optional, index kinds that
+// leave it NULL get fetch called once per key.
+typedef struct bst_ops_s {
+    void *(*fetch)(bst_tree_t *tree, int32_t idx, void *key);
+    int32_t (*insert)(bst_tree_t *tree, int32_t idx, void *key, void *data);
+    void *(*delete)(bst_tree_t *tree, int32_t idx, void *key);
+    void (*fetch_many)(bst_tree_t *tree, int32_t idx, void **keys, int64_t n, void **out);
+} bst_ops_t;
+
+// bst_epoch.c, reclaims memory readers may still be looking at without locks
+typedef void (*bst_reclaim_t)(void *arg, void **ptrs, int32_t count);
+
+int32_t bst_epoch_enter(void);
+void bst_epoch_exit(void);
+struct bst_epoch_rec_s *bst_epoch_pin(void);
+void bst_epoch_unpin(struct bst_epoch_rec_s *rec);
+void bst_epoch_retire(void **ptrs, int32_t count, bst_reclaim_t reclaim_fn, void *arg);
+void bst_epoch_synchronize(void);
+
+// bst.c, nodes of the global pool for structures other than trees.  Every node is
+// BST_POOL_NODE_SZ bytes, aligned for a bst_key_t.
+#define BST_POOL_NODE_SZ 64
+
+void *bst_pool_node(void);
+void bst_pool_put(void **nodes, int32_t count);
+
+// bst_compact.c
+const bst_ops_t *bst_compact_ops(int64_t flags);
+int32_t bst_compact_init(bst_tree_t *tree, int32_t idx, int64_t flags);
+int32_t bst_compact_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data);
+void bst_compact_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner);
+
+// bst_btree.c
+const bst_ops_t *bst_btree_ops(int64_t flags);
+int32_t bst_btree_init(bst_tree_t *tree, int32_t idx);
+int32_t bst_btree_range(bst_tree_t *tree, int32_t idx, void *lo, void *hi, bst_iterate_t iter_fn,
+        void *fn_data);
+void bst_btree_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner);
+
+// bst_hash.c
+const bst_ops_t *bst_hash_ops(int64_t flags);
+int32_t bst_hash_init(bst_tree_t *tree, int32_t idx);
+int32_t bst_hash_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data);
+void bst_hash_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner);
+
+// bst_art.c
+const bst_ops_t *bst_art_ops(int64_t flags);
+int32_t bst_art_init(bst_tree_t *tree, int32_t idx, int64_t flags);
+int32_t bst_art_iterate(bst_tree_t *tree, int32_t idx, bst_iterate_t iter_fn, void *fn_data);
+int32_t bst_art_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t count,
+        bst_iterate_t iter_fn, void *fn_data);
+int32_t bst_art_insert_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits, void *data);
+void *bst_art_delete_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t bits);
+void *bst_art_longest_prefix(bst_tree_t *tree, int32_t idx, void *key, int32_t *bits);
+void bst_art_destroy(bst_tree_t *tree, int32_t idx, void *fn_data, int32_t owner);
+
+// bst_comp.c.  An index's composite key fields, the context its comparator is handed.
+typedef struct bst_comp_s {
+    int32_t count;
+    bst_field_t fields[BST_MAX_FIELDS];
+} bst_comp_t;
+
+int32_t bst_key_cmp_comp(bst_key_t *left, bst_key_t *right, void *ctx);
+int32_t bst_comp_init(bst_tree_t *tree, int32_t idx, bst_field_t *fields, int32_t count);
+int32_t bst_comp_prefix(bst_tree_t *tree, int32_t idx, int32_t count, bst_comp_t *prefix);
+void bst_comp_destroy(bst_tree_t *tree, int32_t idx);
+
+// bst_intern.c
+void bst_intern_free(void);
+
+// skiplist.c
+void sl_flush(void);
+
+// bst_freeze.c
+int32_t bst_frozen_build(bst_tree_t *tree, int32_t idx, bst_key_t **keys, void **data, int64_t n);
+void *bst_frozen_fetch(bst_tree_t *tree, int32_t idx, void *key);
+void bst_frozen_free(bst_tree_t *tree, int32_t idx);
+
+// Comparators return BST_LEFT_GT when left is the larger key, BST_RIGHT_GT when right is and
+// BST_EQUAL otherwise.  They're inlined into the key type specialized routines.  ctx is what
+// the index compares with besides the keys, which only composite keys need: see bst_comp.c.
+static inline int32_t
+bst_key_cmp_str(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    int32_t rc = strcmp(left->pstr, right->pstr);
+
+    return (rc > 0) - (rc < 0);
+}
+
+// The first 8 bytes of a string as a big endian integer, zero filled past its end, so two of
+// them compare as integers the way the strings' first 8 bytes compare under strcmp
+static inline uint64_t
+bst_str_prefix(char *s) {
+    uint64_t pfx = 0;
+
+    for (int32_t i = 0; i < 8 && s[i]; i++)
+        pfx |= (uint64_t)(uint8_t)s[i] << (56 - 8 * i);
+
+    return pfx;
+}
+
+// What AVL string indexes descend with.  Left is a node key with its prefix cached, right the
+// needle, which is the caller's and has none; its prefix is made here, from a string the whole
+// descent keeps hot.  Most levels are then settled by one integer compare without touching the
+// node's string, and an interned needle settles the last one by pointer.
+static inline int32_t
+bst_key_cmp_spfx(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    uint64_t pfx;
+    int32_t rc;
+
+    if (left->sp.str == right->pstr)
+        return BST_EQUAL;
+
+    pfx = bst_str_prefix(right->pstr);
+    if (left->sp.pfx != pfx)
+        return (left->sp.pfx > pfx) - (left->sp.pfx < pfx);
+
+    // Equal prefixes with a zero last byte are whole strings that end inside them
+    if (!(pfx & 0xff))
+        return BST_EQUAL;
+
+    rc = strcmp(left->sp.str + 8, right->pstr + 8);
+
+    return (rc > 0) - (rc < 0);
+}
+
+// Integer compares come out as two setcc instructions and a subtract, no branches
+static inline int32_t
+bst_key_cmp_i8(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->i8 > right->i8) - (left->i8 < right->i8);
+}
+
+static inline int32_t
+bst_key_cmp_i16(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->i16 > right->i16) - (left->i16 < right->i16);
+}
+
+static inline int32_t
+bst_key_cmp_i32(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->i32 > right->i32) - (left->i32 < right->i32);
+}
+
+static inline int32_t
+bst_key_cmp_i64(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->i64 > right->i64) - (left->i64 < right->i64);
+}
+
+static inline int32_t
+bst_key_cmp_u8(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->u8 > right->u8) - (left->u8 < right->u8);
+}
+
+static inline int32_t
+bst_key_cmp_u16(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->u16 > right->u16) - (left->u16 < right->u16);
+}
+
+static inline int32_t
+bst_key_cmp_u32(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->u32 > right->u32) - (left->u32 < right->u32);
+}
+
+static inline int32_t
+bst_key_cmp_u64(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->u64 > right->u64) - (left->u64 < right->u64);
+}
+
+static inline int32_t
+bst_key_cmp_i128(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    return (left->i128 > right->i128) - (left->i128 < right->i128);
+}
+
+static inline int32_t
+bst_key_cmp_tme(bst_key_t *left, bst_key_t *right, void *ctx __attribute__((unused))) {
+    int32_t rc = (left->tv.tv_sec > right->tv.tv_sec) - (left->tv.tv_sec < right->tv.tv_sec);
+
+    return rc ? rc : (left->tv.tv_usec > right->tv.tv_usec) - (left->tv.tv_usec < right->tv.tv_usec);
+}
+
+// String keys aren't copied; the node points at the caller's string, which has to live at least
+// as long as the node does.  In practice it lives in the record.
+static inline void
+bst_key_cpy_str(bst_key_t *dst, bst_key_t *src) {
+    dst->pstr = src->pstr;
+}
+
+// Only reads the source's pointer, which is all a needle has
+static inline void
+bst_key_cpy_spfx(bst_key_t *dst, bst_key_t *src) {
+    dst->sp.str = src->pstr;
+    dst->sp.pfx = bst_str_prefix(dst->sp.str);
+}
+
+// BST_INTERN indexes point at the process's copy of the string instead of the caller's.  If
+// there's no memory for a copy the caller's is used, as for any other string index.
+static inline void
+bst_key_cpy_istr(bst_key_t *dst, bst_key_t *src) {
+    char *str = bst_intern(src->pstr);
+
+    dst->sp.str = str ? str : src->pstr;
+    dst->sp.pfx = bst_str_prefix(dst->sp.str);
+}
+
+static inline void
+bst_key_cpy_i8(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(int8_t));
+}
+
+static inline void
+bst_key_cpy_i16(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(int16_t));
+}
+
+static inline void
+bst_key_cpy_i32(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(int32_t));
+}
+
+static inline void
+bst_key_cpy_i64(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(int64_t));
+}
+
+static inline void
+bst_key_cpy_u8(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(uint8_t));
+}
+
+static inline void
+bst_key_cpy_u16(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(uint16_t));
+}
+
+static inline void
+bst_key_cpy_u32(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(uint32_t));
+}
+
+static inline void
+bst_key_cpy_u64(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(uint64_t));
+}
+
+static inline void
+bst_key_cpy_i128(bst_key_t *dst, bst_key_t *src) {
+    dst->i128 = src->i128;
+}
+
+static inline void
+bst_key_cpy_tme(bst_key_t *dst, bst_key_t *src) {
+    memcpy(dst, src, sizeof(struct timeval));
+}
+
+// Key hashes, for BST_HASH indexes and BST_BLOOM filters
+
+// Murmur3's finalizer, every input bit gets to every output bit
+static inline uint64_t
+bst_hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static inline uint64_t
+bst_key_hash_str(bst_key_t *key) {
+    uint64_t hash = 5381;
+    char *c = key->pstr;
+
+    while (*c)
+        hash = ((hash << 5) + hash) + *c++;
+
+    return bst_hash_mix(hash);
+}
+
+static inline uint64_t bst_key_hash_i8(bst_key_t *key) { return bst_hash_mix(key->i8); }
+static inline uint64_t bst_key_hash_i16(bst_key_t *key) { return bst_hash_mix(key->i16); }
+static inline uint64_t bst_key_hash_i32(bst_key_t *key) { return bst_hash_mix(key->i32); }
+static inline uint64_t bst_key_hash_i64(bst_key_t *key) { return bst_hash_mix(key->i64); }
+static inline uint64_t bst_key_hash_u8(bst_key_t *key) { return bst_hash_mix(key->u8); }
+static inline uint64_t bst_key_hash_u16(bst_key_t *key) { return bst_hash_mix(key->u16); }
+static inline uint64_t bst_key_hash_u32(bst_key_t *key) { return bst_hash_mix(key->u32); }
+static inline uint64_t bst_key_hash_u64(bst_key_t *key) { return bst_hash_mix(key->u64); }
+
+static inline uint64_t
+bst_key_hash_i128(bst_key_t *key) {
+    return bst_hash_mix((uint64_t)key->i128 ^ bst_hash_mix((uint64_t)(key->i128 >> 64)));
+}
+
+static inline uint64_t
+bst_key_hash_tme(bst_key_t *key) {
+    return bst_hash_mix(key->tv.tv_sec ^ bst_hash_mix(key->tv.tv_usec));
+}
+
+#endif
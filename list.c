@@ -50,8 +50,9 @@ list_destroy(list_t *list, void *fn_data) {
         free(cur_node);
     }
 
-    free(list);
     pthread_rwlock_unlock(&list->mutex);
+    pthread_rwlock_destroy(&list->mutex);
+    free(list);
 }
 
 int32_t
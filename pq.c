@@ -0,0 +1,672 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// A 4-ary min-heap in an array.  Each entry keeps its key next to it, so a sift compares
+// without leaving the array, and the four children of an entry share a pair of cache lines:
+// entries are 32 bytes and the array starts half a line in, which puts children 4i+1..4i+4 on
+// a line boundary.  Entries point at a slot of their own, which is what a handle names and
+// which follows the entry around the heap, so decrease-key and remove find it in O(1).  A
+// handle carries its slot's generation, which moves on every time the slot is freed, so a
+// handle to an entry that's gone is turned away instead of hitting whatever took its slot.
+
+#define PQ_D 4
+#define PQ_INIT_SZ 64
+#define PQ_NO_SLOT UINT32_MAX
+
+#define pq_handle(id, gen) ((int64_t)((uint64_t)(gen) << 32 | (id)))
+
+typedef struct {
+    bst_key_t key;
+    uint32_t slot;
+} pq_entry_t;
+
+// pos is the entry's place in the heap while it's queued, the next free slot once it isn't
+typedef struct {
+    void *data;
+    uint32_t pos;
+    uint32_t gen;
+} pq_slot_t;
+
+typedef struct {
+    void (*sift_up)(pq_t *pq, uint32_t i);
+    void (*sift_down)(pq_t *pq, uint32_t i);
+    bst_key_cmp_t cmp;
+    bst_key_cpy_t cpy;
+} pq_ops_t;
+
+struct pq_s {
+    pq_entry_t *heap;
+    pq_slot_t *slots;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t slot_count;
+    uint32_t free_slot;
+    bst_free_t free_fn;
+    const pq_ops_t *ops;
+    pthread_mutex_t mutex;
+};
+
+bst_always_inline void
+pq_set(pq_t *pq, uint32_t i, pq_entry_t *e) {
+    pq->heap[i] = *e;
+    pq->slots[e->slot].pos = i;
+}
+
+// Ties stay where they are, so entries with equal keys come out in no particular order
+bst_always_inline void
+pq_sift_up_t(pq_t *pq, uint32_t i, bst_key_cmp_t cmp) {
+    pq_entry_t e = pq->heap[i];
+    uint32_t parent;
+
+    for (; i > 0; i = parent) {
+        parent = (i - 1) / PQ_D;
+        if (cmp(&pq->heap[parent].key, &e.key, NULL) != BST_LEFT_GT)
+            break;
+        pq_set(pq, i, &pq->heap[parent]);
+    }
+    pq_set(pq, i, &e);
+}
+
+bst_always_inline void
+pq_sift_down_t(pq_t *pq, uint32_t i, bst_key_cmp_t cmp) {
+    pq_entry_t e = pq->heap[i];
+    uint32_t child, min, end;
+
+    while ((child = i * PQ_D + 1) < pq->count) {
+        end = MIN(child + PQ_D, pq->count);
+        for (min = child++; child < end; child++) {
+            if (cmp(&pq->heap[child].key, &pq->heap[min].key, NULL) == BST_RIGHT_GT)
+                min = child;
+        }
+        if (cmp(&pq->heap[min].key, &e.key, NULL) != BST_RIGHT_GT)
+            break;
+        pq_set(pq, i, &pq->heap[min]);
+        i = min;
+    }
+    pq_set(pq, i, &e);
+}
+
+#define PQ_KEY_OPS(sfx)                                                                     \
+static void                                                                                 \
+pq_sift_up_##sfx(pq_t *pq, uint32_t i) {                                                    \
+    pq_sift_up_t(pq, i, bst_key_cmp_##sfx);                                                 \
+}                                                                                           \
+static void                                                                                 \
+pq_sift_down_##sfx(pq_t *pq, uint32_t i) {                                                  \
+    pq_sift_down_t(pq, i, bst_key_cmp_##sfx);                                               \
+}                                                                                           \
+static const pq_ops_t pq_ops_##sfx = {                                                      \
+    pq_sift_up_##sfx, pq_sift_down_##sfx, bst_key_cmp_##sfx, bst_key_cpy_##sfx              \
+};
+
+PQ_KEY_OPS(str)
+PQ_KEY_OPS(i8)
+PQ_KEY_OPS(i16)
+PQ_KEY_OPS(i32)
+PQ_KEY_OPS(i64)
+PQ_KEY_OPS(u8)
+PQ_KEY_OPS(u16)
+PQ_KEY_OPS(u32)
+PQ_KEY_OPS(u64)
+PQ_KEY_OPS(i128)
+PQ_KEY_OPS(tme)
+
+static const pq_ops_t *
+pq_key_ops(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return &pq_ops_str;
+        case BST_KINT8:   return &pq_ops_i8;
+        case BST_KINT16:  return &pq_ops_i16;
+        case BST_KINT32:  return &pq_ops_i32;
+        case BST_KINT64:  return &pq_ops_i64;
+        case BST_KUINT8:  return &pq_ops_u8;
+        case BST_KUINT16: return &pq_ops_u16;
+        case BST_KUINT32: return &pq_ops_u32;
+        case BST_KUINT64: return &pq_ops_u64;
+        case BST_KINT128: return &pq_ops_i128;
+        case BST_KTME:    return &pq_ops_tme;
+    }
+
+    return NULL;
+}
+
+// Doubles the heap and the slots.  The heap is cache line aligned with one entry in front of
+// it, which is what lines its children up.
+static int32_t
+pq_grow(pq_t *pq) {
+    uint32_t cap = pq->cap ? pq->cap * 2 : PQ_INIT_SZ;
+    pq_entry_t *heap;
+    pq_slot_t *slots;
+
+    if ((heap = aligned_alloc(64, (cap + 2) * sizeof(pq_entry_t))) == NULL ||
+            (slots = realloc(pq->slots, cap * sizeof(pq_slot_t))) == NULL) {
+        free(heap);
+        snprintf(err_str, MAX_ERR_LEN - 1, "%s: Could not allocate memory for %u queue entries",
+                __FUNCTION__, cap);
+        return -1;
+    }
+
+    if (pq->heap) {
+        memcpy(heap + 1, pq->heap, pq->count * sizeof(pq_entry_t));
+        free(pq->heap - 1);
+    }
+    pq->heap = heap + 1;
+    pq->slots = slots;
+    pq->cap = cap;
+
+    return 0;
+}
+
+static int64_t
+pq_push_i(pq_t *pq, void *key, void *data) {
+    pq_entry_t *e;
+    uint32_t id;
+
+    if (pq->count == pq->cap && pq_grow(pq) < 0)
+        return -1;
+
+    if ((id = pq->free_slot) != PQ_NO_SLOT) {
+        pq->free_slot = pq->slots[id].pos;
+    }
+    else {
+        id = pq->slot_count++;
+        pq->slots[id].gen = 0;
+    }
+    pq->slots[id].data = data;
+
+    e = &pq->heap[pq->count];
+    pq->ops->cpy(&e->key, key);
+    e->slot = id;
+    pq->slots[id].pos = pq->count++;
+    pq->ops->sift_up(pq, pq->count - 1);
+
+    return pq_handle(id, pq->slots[id].gen);
+}
+
+// The slot of a live handle, or NULL
+static pq_slot_t *
+pq_lookup(pq_t *pq, int64_t handle) {
+    uint32_t id = (uint32_t)handle;
+
+    if (handle < 0 || id >= pq->slot_count || pq->slots[id].gen != (uint32_t)(handle >> 32) ||
+            pq->slots[id].pos >= pq->count || pq->heap[pq->slots[id].pos].slot != id) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Handle %ld is not in the queue.", handle);
+        return NULL;
+    }
+
+    return &pq->slots[id];
+}
+
+// Takes the entry at i out of the heap, copying its key out if key isn't NULL
+static void *
+pq_remove_i(pq_t *pq, uint32_t i, void *key) {
+    pq_entry_t *e = &pq->heap[i];
+    pq_slot_t *slot = &pq->slots[e->slot];
+    void *data = slot->data;
+    uint32_t moved;
+
+    if (key)
+        pq->ops->cpy(key, &e->key);
+
+    // Kept to 31 bits so handles stay positive
+    slot->gen = (slot->gen + 1) & INT32_MAX;
+    slot->pos = pq->free_slot;
+    pq->free_slot = e->slot;
+
+    // The last entry fills the hole and goes whichever way its key says
+    if (i != --pq->count) {
+        moved = pq->heap[pq->count].slot;
+        pq_set(pq, i, &pq->heap[pq->count]);
+        pq->ops->sift_up(pq, i);
+        if (pq->slots[moved].pos == i)
+            pq->ops->sift_down(pq, i);
+    }
+
+    return data;
+}
+
+pq_t *
+pq_create(bst_free_t free_fn, int64_t flags) {
+    const pq_ops_t *ops;
+    pq_t *pq;
+
+    if ((ops = pq_key_ops(flags)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Priority queues need exactly one key type, and not "
+                "BST_KCOMP.");
+        return NULL;
+    }
+
+    if ((pq = calloc(1, sizeof(pq_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for priority queue");
+        return NULL;
+    }
+    pq->free_slot = PQ_NO_SLOT;
+    pq->free_fn = free_fn;
+    pq->ops = ops;
+    pthread_mutex_init(&pq->mutex, NULL);
+
+    if (pq_grow(pq) < 0) {
+        free(pq);
+        return NULL;
+    }
+
+    return pq;
+}
+
+int64_t
+pq_push(pq_t *pq, void *key, void *data) {
+    int64_t handle;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&pq->mutex);
+#endif
+    handle = pq_push_i(pq, key, data);
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&pq->mutex);
+#endif
+
+    return handle;
+}
+
+void *
+pq_peek(pq_t *pq, void *key) {
+    void *data = NULL;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&pq->mutex);
+#endif
+    if (pq->count) {
+        data = pq->slots[pq->heap[0].slot].data;
+        if (key)
+            pq->ops->cpy(key, &pq->heap[0].key);
+    }
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&pq->mutex);
+#endif
+
+    return data;
+}
+
+void *
+pq_pop(pq_t *pq, void *key) {
+    void *data = NULL;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&pq->mutex);
+#endif
+    if (pq->count)
+        data = pq_remove_i(pq, 0, key);
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&pq->mutex);
+#endif
+
+    return data;
+}
+
+int32_t
+pq_decrease_key(pq_t *pq, int64_t handle, void *key) {
+    pq_slot_t *slot;
+    pq_entry_t *e;
+    int32_t rc = -1;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&pq->mutex);
+#endif
+    if ((slot = pq_lookup(pq, handle)) != NULL) {
+        e = &pq->heap[slot->pos];
+        if (pq->ops->cmp(&e->key, key, NULL) == BST_RIGHT_GT) {
+            snprintf(err_str, MAX_ERR_LEN - 1, "The new key is larger than the entry's.");
+        }
+        else {
+            pq->ops->cpy(&e->key, key);
+            pq->ops->sift_up(pq, slot->pos);
+            rc = 0;
+        }
+    }
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&pq->mutex);
+#endif
+
+    return rc;
+}
+
+void *
+pq_remove(pq_t *pq, int64_t handle) {
+    pq_slot_t *slot;
+    void *data = NULL;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&pq->mutex);
+#endif
+    if ((slot = pq_lookup(pq, handle)) != NULL)
+        data = pq_remove_i(pq, slot->pos, NULL);
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&pq->mutex);
+#endif
+
+    return data;
+}
+
+int64_t
+pq_size(pq_t *pq) {
+    return __atomic_load_n(&pq->count, __ATOMIC_RELAXED);
+}
+
+void
+pq_destroy(pq_t *pq, void *fn_data) {
+    for (uint32_t i = 0; i < pq->count; i++) {
+        if (pq->free_fn)
+            pq->free_fn(pq->slots[pq->heap[i].slot].data, fn_data);
+        else
+            free(pq->slots[pq->heap[i].slot].data);
+    }
+
+    pthread_mutex_destroy(&pq->mutex);
+    free(pq->heap - 1);
+    free(pq->slots);
+    free(pq);
+}
+
+// A hierarchical timer wheel (Varghese and Lauck, 1987) in front of a BST_KTME queue.  Level L
+// has 64 slots of 64^L ticks each, and a timer sits in the slot of the lowest level whose span
+// reaches its deadline, so adding and cancelling are O(1) whatever the number of timers.  Each
+// time a level's index wraps, the current slot of the level above is spread over the levels
+// below it.  Timers whose tick comes up move into the queue, which orders them by their exact
+// deadline; timers cancelled before then, most network timeouts, never touch it.  Deadlines
+// past the top level's reach wait in its last slot and are placed again when it comes down.
+
+#define TW_LEVELS 4
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+
+#define tw_span(level) (1ULL << (TW_BITS * (level)))
+
+struct tw_timer_s {
+    struct timeval deadline;
+    void *data;
+    struct tw_timer_s *next;
+    // What points at the timer in its slot, or NULL once it's in the queue
+    struct tw_timer_s **pprev;
+    int32_t level;
+    int64_t handle;
+};
+
+struct tw_s {
+    pq_t *due;
+    bst_free_t free_fn;
+    uint64_t tick_us;
+    // The tick the wheel has been advanced to
+    uint64_t now;
+    uint32_t level_count[TW_LEVELS];
+    tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+    pthread_mutex_t mutex;
+};
+
+static inline uint64_t
+tw_ticks(tw_t *tw, struct timeval *tv) {
+    return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) / tw->tick_us;
+}
+
+static void
+tw_link(tw_t *tw, int32_t level, uint32_t idx, tw_timer_t *timer) {
+    tw_timer_t **slot = &tw->slots[level][idx];
+
+    if ((timer->next = *slot) != NULL)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    timer->level = level;
+    *slot = timer;
+    tw->level_count[level]++;
+}
+
+// Into the slot its deadline falls in, or the queue if its tick has come
+static int32_t
+tw_place(tw_t *tw, tw_timer_t *timer) {
+    uint64_t t = tw_ticks(tw, &timer->deadline), delta;
+    int32_t level;
+
+    if (t <= tw->now) {
+        timer->pprev = NULL;
+        timer->handle = pq_push_i(tw->due, &timer->deadline, timer);
+        return (timer->handle < 0) ? -1 : 0;
+    }
+
+    delta = t - tw->now;
+    for (level = 0; level < TW_LEVELS - 1 && delta >= tw_span(level + 1); level++)
+        ;
+    if (delta >= tw_span(TW_LEVELS))
+        t = tw->now + tw_span(TW_LEVELS) - 1;
+
+    tw_link(tw, level, (t >> (TW_BITS * level)) & TW_MASK, timer);
+
+    return 0;
+}
+
+static void
+tw_unlink(tw_t *tw, tw_timer_t *timer) {
+    if ((*timer->pprev = timer->next) != NULL)
+        timer->next->pprev = timer->pprev;
+    tw->level_count[timer->level]--;
+}
+
+// Places again every timer in a slot, which sends each one down a level or more
+static void
+tw_cascade(tw_t *tw, int32_t level, uint32_t idx) {
+    tw_timer_t *timer = tw->slots[level][idx], *next;
+
+    tw->slots[level][idx] = NULL;
+    for (; timer; timer = next) {
+        next = timer->next;
+        tw->level_count[level]--;
+        // Only the queue can fail, and then the timer tries again on the next tick
+        if (tw_place(tw, timer) < 0)
+            tw_link(tw, 0, (tw->now + 1) & TW_MASK, timer);
+    }
+}
+
+// Moves the wheel on to tick target.  Ticks where no level has anything to do are skipped:
+// with the levels below L empty, nothing happens until the next boundary of level L.
+static void
+tw_turn(tw_t *tw, uint64_t target) {
+    int32_t level;
+
+    while (tw->now < target) {
+        for (level = 0; level < TW_LEVELS && !tw->level_count[level]; level++)
+            ;
+        if (level == TW_LEVELS) {
+            tw->now = target;
+            break;
+        }
+        if (level > 0)
+            tw->now = MIN(target - 1, tw->now | (tw_span(level) - 1));
+
+        tw->now++;
+        for (level = 1; level < TW_LEVELS && !(tw->now & (tw_span(level) - 1)); level++)
+            tw_cascade(tw, level, (tw->now >> (TW_BITS * level)) & TW_MASK);
+        tw_cascade(tw, 0, tw->now & TW_MASK);
+    }
+}
+
+tw_t *
+tw_create(bst_free_t free_fn, uint32_t tick_us) {
+    struct timeval now;
+    tw_t *tw;
+
+    if (!tick_us) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "A timer wheel needs a tick of at least 1us.");
+        return NULL;
+    }
+
+    if ((tw = calloc(1, sizeof(tw_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for timer wheel");
+        return NULL;
+    }
+    if ((tw->due = pq_create(NULL, BST_KTME)) == NULL) {
+        free(tw);
+        return NULL;
+    }
+
+    tw->free_fn = free_fn;
+    tw->tick_us = tick_us;
+    gettimeofday(&now, NULL);
+    tw->now = tw_ticks(tw, &now);
+    pthread_mutex_init(&tw->mutex, NULL);
+
+    return tw;
+}
+
+tw_timer_t *
+tw_add(tw_t *tw, struct timeval *deadline, void *data) {
+    tw_timer_t *timer;
+
+    if ((timer = calloc(1, sizeof(tw_timer_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for timer");
+        return NULL;
+    }
+    timer->deadline = *deadline;
+    timer->data = data;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&tw->mutex);
+#endif
+    if (tw_place(tw, timer) < 0) {
+        free(timer);
+        timer = NULL;
+    }
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&tw->mutex);
+#endif
+
+    return timer;
+}
+
+void *
+tw_cancel(tw_t *tw, tw_timer_t *timer) {
+    void *data = timer->data;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&tw->mutex);
+#endif
+    if (timer->pprev)
+        tw_unlink(tw, timer);
+    else
+        pq_remove_i(tw->due, tw->due->slots[(uint32_t)timer->handle].pos, NULL);
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&tw->mutex);
+#endif
+    free(timer);
+
+    return data;
+}
+
+// The lock is let go around each expire_fn, which can add and cancel timers of its own
+int64_t
+tw_advance(tw_t *tw, struct timeval *now, tw_expire_t expire_fn, void *fn_data) {
+    struct timeval deadline;
+    tw_timer_t *timer;
+    int64_t fired = 0;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&tw->mutex);
+#endif
+    tw_turn(tw, tw_ticks(tw, now));
+    while (pq_peek(tw->due, &deadline) && !timercmp(&deadline, now, >)) {
+        timer = pq_remove_i(tw->due, 0, NULL);
+#ifndef NO_LOCKS
+        pthread_mutex_unlock(&tw->mutex);
+#endif
+        expire_fn(timer->data, fn_data);
+        free(timer);
+        fired++;
+#ifndef NO_LOCKS
+        pthread_mutex_lock(&tw->mutex);
+#endif
+    }
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&tw->mutex);
+#endif
+
+    return fired;
+}
+
+// A time no later than the first deadline: exact for timers already in the queue, the start of
+// the nearest occupied slot's span for those still on the wheel
+int32_t
+tw_next(tw_t *tw, struct timeval *when) {
+    uint64_t best = UINT64_MAX, idx, us;
+    struct timeval deadline;
+    int32_t rc = 0;
+
+#ifndef NO_LOCKS
+    pthread_mutex_lock(&tw->mutex);
+#endif
+    if (pq_peek(tw->due, &deadline)) {
+        *when = deadline;
+        goto out;
+    }
+
+    for (int32_t level = 0; level < TW_LEVELS; level++) {
+        for (uint64_t k = 1; tw->level_count[level] && k <= TW_SLOTS; k++) {
+            idx = (tw->now >> (TW_BITS * level)) + k;
+            if (tw->slots[level][idx & TW_MASK]) {
+                best = MIN(best, MAX(tw->now + 1, idx << (TW_BITS * level)));
+                break;
+            }
+        }
+    }
+
+    if (best == UINT64_MAX) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "No timers are pending.");
+        rc = -1;
+        goto out;
+    }
+    us = best * tw->tick_us;
+    when->tv_sec = us / 1000000;
+    when->tv_usec = us % 1000000;
+
+out:
+#ifndef NO_LOCKS
+    pthread_mutex_unlock(&tw->mutex);
+#endif
+
+    return rc;
+}
+
+void
+tw_destroy(tw_t *tw, void *fn_data) {
+    tw_timer_t *timer, *next;
+
+    for (int32_t level = 0; level < TW_LEVELS; level++) {
+        for (int32_t i = 0; i < TW_SLOTS; i++) {
+            for (timer = tw->slots[level][i]; timer; timer = next) {
+                next = timer->next;
+                if (tw->free_fn)
+                    tw->free_fn(timer->data, fn_data);
+                else
+                    free(timer->data);
+                free(timer);
+            }
+        }
+    }
+
+    while ((timer = pq_pop(tw->due, NULL)) != NULL) {
+        if (tw->free_fn)
+            tw->free_fn(timer->data, fn_data);
+        else
+            free(timer->data);
+        free(timer);
+    }
+
+    pq_destroy(tw->due, NULL);
+    pthread_mutex_destroy(&tw->mutex);
+    free(tw);
+}
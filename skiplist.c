@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "al_data_struct.h"
+#include "bst_internal.h"
+
+// A lock-free skip list (Fraser, "Practical lock-freedom", 2004).  Each level is a sorted linked
+// list whose next pointers carry a deleted mark in their low bit.  A node is in the map once it
+// is linked on level 0 and leaves it when its level 0 pointer is marked; the levels above are
+// shortcuts, linked after it goes in and marked before it goes out.  Any thread that walks past
+// a marked node unlinks it, and the node goes back to the pool through the epoch collector once
+// it's off every level, so readers never touch a node that has been reused.
+//
+// Nodes and their towers are bst pool nodes.  A node keeps its first SL_INLINE next pointers;
+// taller ones, one in 4^SL_INLINE, take a second pool node for the rest of their tower.
+//
+// Deleters gather their unlinked nodes in a per thread batch and retire SL_RETIRE_BATCH of them
+// at a time, so the epoch collector's mutex and the pool lock are taken once per batch rather
+// than once per delete.
+
+#define SL_INLINE 3
+#define SL_MAX_LEVEL (SL_INLINE + (int32_t)(BST_POOL_NODE_SZ / sizeof(uintptr_t)))
+#define SL_RETIRE_BATCH 64
+
+#define sl_marked(p) ((p) & 1)
+#define sl_ptr(p) ((sl_node_t *)((p) & ~(uintptr_t)1))
+
+// Whichever of the inserter and the deleter is done with a node last hands it to the collector
+#define SL_LINKED   1
+#define SL_UNLINKED 2
+
+typedef struct sl_node_s {
+    bst_key_t key;
+    void *data;
+    uint16_t height;
+    uint32_t state;
+    uintptr_t next[SL_INLINE];
+    uintptr_t *tower;
+} sl_node_t;
+
+_Static_assert(sizeof(sl_node_t) <= BST_POOL_NODE_SZ, "skip list nodes must fit a pool node");
+
+typedef struct {
+    void *(*fetch)(sl_t *sl, void *key);
+    int32_t (*insert)(sl_t *sl, void *key, void *data);
+    void *(*delete)(sl_t *sl, void *key);
+    int32_t (*range)(sl_t *sl, void *lo, void *hi, bst_iterate_t iter_fn, void *fn_data);
+} sl_ops_t;
+
+struct sl_s {
+    sl_node_t *head;
+    bst_free_t free_fn;
+    const sl_ops_t *ops;
+};
+
+static __thread uint64_t sl_seed = 0;
+static __thread void *sl_retired[SL_RETIRE_BATCH + 1];
+static __thread int32_t sl_retired_count = 0;
+static pthread_key_t sl_retired_key;
+static pthread_once_t sl_retired_once = PTHREAD_ONCE_INIT;
+
+bst_always_inline uintptr_t *
+sl_next(sl_node_t *node, int32_t level) {
+    return (level < SL_INLINE) ? &node->next[level] : &node->tower[level - SL_INLINE];
+}
+
+// Each level holds a quarter of the nodes of the one below
+static int32_t
+sl_random_height(void) {
+    int32_t height = 1;
+    uint64_t r;
+
+    if (!sl_seed)
+        sl_seed = ((uintptr_t)&sl_seed ^ time(NULL)) | 1;
+
+    sl_seed ^= sl_seed << 13;
+    sl_seed ^= sl_seed >> 7;
+    sl_seed ^= sl_seed << 17;
+
+    for (r = sl_seed; height < SL_MAX_LEVEL && !(r & 3); r >>= 2)
+        height++;
+
+    return height;
+}
+
+static sl_node_t *
+sl_node_new(int32_t height) {
+    sl_node_t *node;
+
+    if ((node = bst_pool_node()) == NULL)
+        return NULL;
+    memset(node, 0, sizeof(sl_node_t));
+    node->height = height;
+
+    if (height > SL_INLINE) {
+        if ((node->tower = bst_pool_node()) == NULL) {
+            bst_pool_put((void **)&node, 1);
+            return NULL;
+        }
+        memset(node->tower, 0, BST_POOL_NODE_SZ);
+    }
+
+    return node;
+}
+
+// Back to the pool with its tower, either straight away or once no reader can be on it
+static void
+sl_node_free(sl_node_t *node) {
+    void *nodes[2] = { node, node->tower };
+
+    bst_pool_put(nodes, node->tower ? 2 : 1);
+}
+
+static void
+sl_reclaim(void *arg __attribute__((unused)), void **ptrs, int32_t count) {
+    bst_pool_put(ptrs, count);
+}
+
+// Retires the calling thread's batch, whatever its size.  Threads do it as they exit, and
+// bst_fini for the thread that calls it, before the pool goes.
+void
+sl_flush(void) {
+    bst_epoch_retire(sl_retired, sl_retired_count, sl_reclaim, NULL);
+    sl_retired_count = 0;
+}
+
+static void
+sl_flush_key(void *arg __attribute__((unused))) {
+    sl_flush();
+}
+
+static void
+sl_retired_key_create(void) {
+    pthread_key_create(&sl_retired_key, sl_flush_key);
+}
+
+// A tower may take the batch one past SL_RETIRE_BATCH, which the array leaves room for
+static void
+sl_node_retire(sl_node_t *node) {
+    // Destructors only run for threads with a non-NULL value set under the key
+    if (sl_retired_count == 0) {
+        pthread_once(&sl_retired_once, sl_retired_key_create);
+        if (!pthread_getspecific(sl_retired_key))
+            pthread_setspecific(sl_retired_key, sl_retired);
+    }
+
+    sl_retired[sl_retired_count++] = node;
+    if (node->tower)
+        sl_retired[sl_retired_count++] = node->tower;
+    if (sl_retired_count >= SL_RETIRE_BATCH)
+        sl_flush();
+}
+
+// Finds the nodes either side of key on every level, unlinking the marked nodes it meets on the
+// way, and returns the node holding key if there is one.  A failed unlink means the list
+// changed under it, so it starts over from the head.
+bst_always_inline sl_node_t *
+sl_find_t(sl_t *sl, bst_key_t *key, sl_node_t **preds, sl_node_t **succs, bst_key_cmp_t cmp) {
+    sl_node_t *pred, *curr;
+    uintptr_t next, expect;
+
+retry:
+    pred = sl->head;
+    for (int32_t level = SL_MAX_LEVEL - 1; level >= 0; level--) {
+        curr = sl_ptr(__atomic_load_n(sl_next(pred, level), __ATOMIC_ACQUIRE));
+        while (curr) {
+            next = __atomic_load_n(sl_next(curr, level), __ATOMIC_ACQUIRE);
+            if (sl_marked(next)) {
+                expect = (uintptr_t)curr;
+                if (!__atomic_compare_exchange_n(sl_next(pred, level), &expect, next & ~1, 0,
+                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                    goto retry;
+                curr = sl_ptr(next);
+                continue;
+            }
+            if (cmp(&curr->key, key, NULL) != BST_RIGHT_GT)
+                break;
+            pred = curr;
+            curr = sl_ptr(next);
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+
+    return (succs[0] && cmp(&succs[0]->key, key, NULL) == BST_EQUAL) ? succs[0] : NULL;
+}
+
+// Readers step over marked nodes instead of unlinking them, so they never write
+bst_always_inline void *
+sl_fetch_t(sl_t *sl, bst_key_t *key, bst_key_cmp_t cmp) {
+    sl_node_t *pred = sl->head, *curr;
+    uintptr_t next;
+    int32_t rc;
+
+    for (int32_t level = SL_MAX_LEVEL - 1; level >= 0; level--) {
+        curr = sl_ptr(__atomic_load_n(sl_next(pred, level), __ATOMIC_ACQUIRE));
+        while (curr) {
+            next = __atomic_load_n(sl_next(curr, level), __ATOMIC_ACQUIRE);
+            if (!sl_marked(next)) {
+                if ((rc = cmp(&curr->key, key, NULL)) == BST_EQUAL &&
+                        !sl_marked(__atomic_load_n(&curr->next[0], __ATOMIC_ACQUIRE)))
+                    return curr->data;
+                if (rc != BST_RIGHT_GT)
+                    break;
+                pred = curr;
+            }
+            curr = sl_ptr(next);
+        }
+    }
+
+    return NULL;
+}
+
+bst_always_inline int32_t
+sl_insert_t(sl_t *sl, bst_key_t *key, void *data, bst_key_cmp_t cmp, bst_key_cpy_t cpy) {
+    sl_node_t *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL], *node;
+    int32_t height = sl_random_height();
+    uintptr_t next, expect;
+
+    if ((node = sl_node_new(height)) == NULL)
+        return -1;
+    cpy(&node->key, key);
+    node->data = data;
+
+    // Nobody can see the node until it's on level 0, so its own pointers need no atomics
+    for (;;) {
+        if (sl_find_t(sl, key, preds, succs, cmp)) {
+            sl_node_free(node);
+            return 1;
+        }
+        for (int32_t i = 0; i < height; i++)
+            *sl_next(node, i) = (uintptr_t)succs[i];
+
+        expect = (uintptr_t)succs[0];
+        if (__atomic_compare_exchange_n(&preds[0]->next[0], &expect, (uintptr_t)node, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    // A delete that marks the node stops the rest of the linking.  Only a mark can change a
+    // pointer of the node above the levels it's on, so a failed swap of one means a mark.
+    for (int32_t i = 1; i < height; i++) {
+        for (;;) {
+            next = __atomic_load_n(sl_next(node, i), __ATOMIC_ACQUIRE);
+            if (sl_marked(next) || (next != (uintptr_t)succs[i] &&
+                        !__atomic_compare_exchange_n(sl_next(node, i), &next,
+                            (uintptr_t)succs[i], 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)))
+                goto linked;
+
+            expect = (uintptr_t)succs[i];
+            if (__atomic_compare_exchange_n(sl_next(preds[i], i), &expect, (uintptr_t)node, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+            if (sl_find_t(sl, key, preds, succs, cmp) != node)
+                goto linked;
+        }
+    }
+
+linked:
+    // The delete finished first and may have missed levels linked after it looked
+    if (__atomic_fetch_or(&node->state, SL_LINKED, __ATOMIC_ACQ_REL) & SL_UNLINKED) {
+        sl_find_t(sl, key, preds, succs, cmp);
+        sl_node_retire(node);
+    }
+
+    return 0;
+}
+
+bst_always_inline void *
+sl_delete_t(sl_t *sl, bst_key_t *key, bst_key_cmp_t cmp) {
+    sl_node_t *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL], *node;
+    uintptr_t next;
+    void *data;
+
+    if ((node = sl_find_t(sl, key, preds, succs, cmp)) == NULL)
+        return NULL;
+
+    // Top down, so that a node marked on level 0 is marked everywhere
+    for (int32_t i = node->height - 1; i > 0; i--) {
+        next = __atomic_load_n(sl_next(node, i), __ATOMIC_ACQUIRE);
+        while (!sl_marked(next) && !__atomic_compare_exchange_n(sl_next(node, i), &next,
+                    next | 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    // Whoever marks level 0 is the one that deleted it
+    next = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+    do {
+        if (sl_marked(next))
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&node->next[0], &next, next | 1, 0, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE));
+
+    data = node->data;
+    sl_find_t(sl, key, preds, succs, cmp);
+    if (__atomic_fetch_or(&node->state, SL_UNLINKED, __ATOMIC_ACQ_REL) & SL_LINKED)
+        sl_node_retire(node);
+
+    return data;
+}
+
+bst_always_inline int32_t
+sl_range_t(sl_t *sl, bst_key_t *lo, bst_key_t *hi, bst_iterate_t iter_fn, void *fn_data,
+        bst_key_cmp_t cmp) {
+    sl_node_t *pred = sl->head, *curr = NULL;
+    uintptr_t next;
+    int32_t rc = BST_CB_OK;
+
+    // Down to the first node >= lo
+    for (int32_t level = SL_MAX_LEVEL - 1; level >= 0; level--) {
+        curr = sl_ptr(__atomic_load_n(sl_next(pred, level), __ATOMIC_ACQUIRE));
+        while (curr) {
+            next = __atomic_load_n(sl_next(curr, level), __ATOMIC_ACQUIRE);
+            if (!sl_marked(next)) {
+                if (!lo || cmp(&curr->key, lo, NULL) != BST_RIGHT_GT)
+                    break;
+                pred = curr;
+            }
+            curr = sl_ptr(next);
+        }
+    }
+
+    for (; curr && rc == BST_CB_OK; curr = sl_ptr(next)) {
+        next = __atomic_load_n(&curr->next[0], __ATOMIC_ACQUIRE);
+        if (sl_marked(next))
+            continue;
+        if (hi && cmp(&curr->key, hi, NULL) == BST_LEFT_GT)
+            break;
+
+        rc = iter_fn(curr->data, fn_data);
+        if (rc == BST_CB_DELETE_NODE || rc == BST_CB_DELETE_AND_ABORT)
+            snprintf(err_str, MAX_ERR_LEN - 1, "Node deletion not supported yet");
+    }
+
+    return rc;
+}
+
+#define SL_KEY_OPS(sfx)                                                                     \
+static void *                                                                               \
+sl_fetch_##sfx(sl_t *sl, void *key) {                                                       \
+    return sl_fetch_t(sl, key, bst_key_cmp_##sfx);                                          \
+}                                                                                           \
+static int32_t                                                                              \
+sl_insert_##sfx(sl_t *sl, void *key, void *data) {                                          \
+    return sl_insert_t(sl, key, data, bst_key_cmp_##sfx, bst_key_cpy_##sfx);                \
+}                                                                                           \
+static void *                                                                               \
+sl_delete_##sfx(sl_t *sl, void *key) {                                                      \
+    return sl_delete_t(sl, key, bst_key_cmp_##sfx);                                         \
+}                                                                                           \
+static int32_t                                                                              \
+sl_range_##sfx(sl_t *sl, void *lo, void *hi, bst_iterate_t iter_fn, void *fn_data) {        \
+    return sl_range_t(sl, lo, hi, iter_fn, fn_data, bst_key_cmp_##sfx);                     \
+}                                                                                           \
+static const sl_ops_t sl_ops_##sfx = {                                                      \
+    sl_fetch_##sfx, sl_insert_##sfx, sl_delete_##sfx, sl_range_##sfx                        \
+};
+
+SL_KEY_OPS(str)
+SL_KEY_OPS(i8)
+SL_KEY_OPS(i16)
+SL_KEY_OPS(i32)
+SL_KEY_OPS(i64)
+SL_KEY_OPS(u8)
+SL_KEY_OPS(u16)
+SL_KEY_OPS(u32)
+SL_KEY_OPS(u64)
+SL_KEY_OPS(i128)
+SL_KEY_OPS(tme)
+
+static const sl_ops_t *
+sl_key_ops(int64_t flags) {
+    switch (flags & BST_KEYS) {
+        case BST_KPSTR:   return &sl_ops_str;
+        case BST_KINT8:   return &sl_ops_i8;
+        case BST_KINT16:  return &sl_ops_i16;
+        case BST_KINT32:  return &sl_ops_i32;
+        case BST_KINT64:  return &sl_ops_i64;
+        case BST_KUINT8:  return &sl_ops_u8;
+        case BST_KUINT16: return &sl_ops_u16;
+        case BST_KUINT32: return &sl_ops_u32;
+        case BST_KUINT64: return &sl_ops_u64;
+        case BST_KINT128: return &sl_ops_i128;
+        case BST_KTME:    return &sl_ops_tme;
+    }
+
+    return NULL;
+}
+
+sl_t *
+sl_create(bst_free_t free_fn, int64_t flags) {
+    const sl_ops_t *ops;
+    sl_t *sl;
+
+    if ((ops = sl_key_ops(flags)) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Skip lists need exactly one key type, and not "
+                "BST_KCOMP.");
+        return NULL;
+    }
+
+    if ((sl = calloc(1, sizeof(sl_t))) == NULL) {
+        snprintf(err_str, MAX_ERR_LEN - 1, "Cannot allocate memory for skip list");
+        return NULL;
+    }
+
+    if ((sl->head = sl_node_new(SL_MAX_LEVEL)) == NULL) {
+        free(sl);
+        return NULL;
+    }
+    sl->free_fn = free_fn;
+    sl->ops = ops;
+
+    return sl;
+}
+
+// Every call runs inside an epoch read section, which is what keeps the nodes it walks from
+// being reused under it
+void *
+sl_fetch(sl_t *sl, void *key) {
+    void *data;
+
+    if (bst_epoch_enter() < 0)
+        return NULL;
+    data = sl->ops->fetch(sl, key);
+    bst_epoch_exit();
+
+    return data;
+}
+
+int32_t
+sl_insert(sl_t *sl, void *key, void *data) {
+    int32_t rc;
+
+    if (bst_epoch_enter() < 0)
+        return -1;
+    rc = sl->ops->insert(sl, key, data);
+    bst_epoch_exit();
+
+    return rc;
+}
+
+void *
+sl_delete(sl_t *sl, void *key) {
+    void *data;
+
+    if (bst_epoch_enter() < 0)
+        return NULL;
+    data = sl->ops->delete(sl, key);
+    bst_epoch_exit();
+
+    return data;
+}
+
+int32_t
+sl_range(sl_t *sl, void *lo, void *hi, bst_iterate_t iter_fn, void *fn_data) {
+    int32_t rc;
+
+    if (bst_epoch_enter() < 0)
+        return -1;
+    rc = sl->ops->range(sl, lo, hi, iter_fn, fn_data);
+    bst_epoch_exit();
+
+    return (rc == BST_CB_OK) ? 0 : rc;
+}
+
+void
+sl_destroy(sl_t *sl, void *fn_data) {
+    sl_node_t *node, *next;
+
+    for (node = sl_ptr(sl->head->next[0]); node; node = next) {
+        next = sl_ptr(node->next[0]);
+        if (sl->free_fn)
+            sl->free_fn(node->data, fn_data);
+        else
+            free(node->data);
+        sl_node_free(node);
+    }
+
+    sl_node_free(sl->head);
+    free(sl);
+}
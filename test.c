@@ -1,5 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "al_data_struct.h"
 #include "rDB.h"
@@ -307,6 +313,3591 @@ bst_iterate_cb(void *node, void *data) {
     return BST_CB_OK;
 }
 
+int32_t
+test_bst_arena() {
+    bst_tree_t *tree;
+    struct timeval now, later, diff;
+
+    populate_array(500000, 0);
+    tree = bst_create("arena", NULL, BST_KINT32 | BST_ARENA);
+    for (uint32_t i = 0; i < 500000; i++) {
+        bst_insert(tree, 0, &tarr[i]->a, tarr[i]);
+    }
+
+    for (int32_t i = 0; i < 500000; i++) {
+        if (bst_fetch(tree, 0, &i) != tarr[i]) {
+            fprintf(stdout, "BST Arena Fetch: FAILED. Key %d not found\n", i);
+            return -1;
+        }
+    }
+    fprintf(stdout, "BST Arena Fetch:\tPASSED\n");
+
+    // The arena tree doesn't own its data, so this shouldn't visit a single node
+    gettimeofday(&now, NULL);
+    bst_destroy(tree, NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "Time to destroy arena tree: %ld seconds, %ld microseconds\n",
+            diff.tv_sec, diff.tv_usec);
+
+    for (uint32_t i = 0; i < 500000; i++)
+        free(tarr[i]);
+
+    return 0;
+}
+
+int32_t
+bst_range_cb(void *node, void *data) {
+    test_struct_t *t = (test_struct_t *)node;
+    int32_t *expect = (int32_t *)data;
+
+    if (t->a != *expect)
+        return BST_CB_ABORT;
+
+    *expect += 2;
+
+    return BST_CB_OK;
+}
+
+int32_t
+bench_count_cb(void *node, void *data) {
+    (*(int32_t *)data)++;
+
+    return BST_CB_OK;
+}
+
+int32_t
+test_bst_range() {
+    bst_tree_t *tree;
+    bst_cursor_t cur;
+    test_struct_t *t;
+    int32_t lo = 1000, hi = 1999, expect = lo, key;
+
+    // Only even keys, so bounds on odd keys have to land on a neighbour
+    populate_array(10000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32);
+    for (uint32_t i = 0; i < 10000; i++) {
+        tarr[i]->a *= 2;
+        bst_insert(tree, 0, &tarr[i]->a, tarr[i]);
+    }
+
+    lo *= 2;
+    hi *= 2;
+    expect = lo;
+    bst_range(tree, 0, &lo, &hi, bst_range_cb, &expect);
+    if (expect != hi + 2) {
+        fprintf(stdout, "BST Range: FAILED. Stopped at %d, expected %d\n", expect, hi + 2);
+        bst_destroy(tree, NULL);
+        return -1;
+    }
+    fprintf(stdout, "BST Range:\tPASSED\n");
+
+    key = 501;
+    t = bst_lower_bound(tree, 0, &key);
+    if (!t || t->a != 502) {
+        fprintf(stdout, "BST Lower Bound: FAILED\n");
+        bst_destroy(tree, NULL);
+        return -1;
+    }
+    key = 502;
+    t = bst_upper_bound(tree, 0, &key);
+    if (!t || t->a != 504) {
+        fprintf(stdout, "BST Upper Bound: FAILED\n");
+        bst_destroy(tree, NULL);
+        return -1;
+    }
+    fprintf(stdout, "BST Bounds:\tPASSED\n");
+
+    bst_cursor_open(&cur, tree, 0);
+    key = 777;
+    t = bst_cursor_seek(&cur, &key);
+    for (int32_t i = 0; t && i < 100; i++)
+        t = bst_cursor_next(&cur);
+    if (!t || t->a != 978) {
+        fprintf(stdout, "BST Cursor Next: FAILED\n");
+        bst_cursor_close(&cur);
+        bst_destroy(tree, NULL);
+        return -1;
+    }
+    for (int32_t i = 0; t && i < 200; i++)
+        t = bst_cursor_prev(&cur);
+    if (!t || t->a != 578) {
+        fprintf(stdout, "BST Cursor Prev: FAILED\n");
+        bst_cursor_close(&cur);
+        bst_destroy(tree, NULL);
+        return -1;
+    }
+    bst_cursor_close(&cur);
+    fprintf(stdout, "BST Cursor:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+
+    return 0;
+}
+
+int32_t
+test_bst_ostat() {
+    bst_tree_t *tree;
+    test_struct_t *t;
+    int32_t lo = 100, hi = 199, key;
+    int32_t rc = 0;
+
+    // Insert in a scattered order so plenty of rotations happen along the way
+    populate_array(10000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32 | BST_OSTAT);
+    for (uint32_t i = 0; i < 10000; i++) {
+        t = tarr[(i * 7919) % 10000];
+        bst_insert(tree, 0, &t->a, t);
+    }
+
+    key = 5000;
+    if (bst_rank(tree, 0, &key) != 5000) {
+        fprintf(stdout, "BST Rank: FAILED. Expected 5000, got %ld\n", bst_rank(tree, 0, &key));
+        rc = -1;
+    }
+
+    for (int64_t k = 0; k < 10000 && rc == 0; k += 37) {
+        t = bst_select(tree, 0, k);
+        if (!t || t->a != k) {
+            fprintf(stdout, "BST Select: FAILED at %ld\n", k);
+            rc = -1;
+        }
+    }
+
+    if (rc == 0 && bst_count_range(tree, 0, &lo, &hi) != 100) {
+        fprintf(stdout, "BST Count Range: FAILED. Expected 100, got %ld\n",
+                bst_count_range(tree, 0, &lo, &hi));
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Order Stats:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+int32_t
+test_bst_bulk_load() {
+    bst_tree_t *tree;
+    test_struct_t *t;
+    struct timeval now, later, diff;
+    void **keys, **data;
+    int32_t rc = 0;
+
+    if ((keys = malloc(500000 * sizeof(void *))) == NULL ||
+            (data = malloc(500000 * sizeof(void *))) == NULL) {
+        fprintf(stdout, "Error:  Unable to allocate memory for bulk load arrays.\n");
+        return -1;
+    }
+
+    populate_array(500000, 0);
+    for (uint32_t i = 0; i < 500000; i++) {
+        keys[i] = &tarr[i]->a;
+        data[i] = tarr[i];
+    }
+
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32);
+    gettimeofday(&now, NULL);
+    bst_bulk_load(tree, 0, keys, data, 500000, 0);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "500k sorted records bulk loaded in: %ld seconds, %ld microseconds\n",
+            diff.tv_sec, diff.tv_usec);
+
+    for (int32_t i = 0; i < 500000 && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &i) != tarr[i]) {
+            fprintf(stdout, "BST Bulk Load: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    // Unsorted input on an order-statistic index
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_OSTAT);
+    for (uint32_t i = 0; i < 500000; i++) {
+        t = tarr[(i * 7919) % 500000];
+        keys[i] = &t->b;
+        data[i] = t;
+    }
+    if (rc == 0 && bst_bulk_load(tree, 1, keys, data, 500000, 0) == 0) {
+        fprintf(stdout, "BST Bulk Load: FAILED. Unsorted input accepted\n");
+        rc = -1;
+    }
+
+    gettimeofday(&now, NULL);
+    bst_bulk_load(tree, 1, keys, data, 500000, 1);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "500k unsorted records bulk loaded in: %ld seconds, %ld microseconds\n",
+            diff.tv_sec, diff.tv_usec);
+
+    for (int64_t k = 0; k < 500000 && rc == 0; k += 999) {
+        t = bst_select(tree, 1, k);
+        if (!t || t->b != k) {
+            fprintf(stdout, "BST Bulk Load: FAILED. Select %ld\n", k);
+            rc = -1;
+        }
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Bulk Load:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    free(keys);
+    free(data);
+
+    return rc;
+}
+
+void *
+test_key_b(void *data) {
+    return &((test_struct_t *)data)->b;
+}
+
+int32_t
+test_bst_records() {
+    bst_tree_t *tree;
+    test_struct_t *dup;
+    int32_t rc = 0;
+
+    populate_array(10000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32);
+    bst_add_idx(tree, NULL, BST_KINT32);
+    bst_set_key_offset(tree, 0, offsetof(test_struct_t, a));
+    bst_set_key_fn(tree, 1, test_key_b);
+
+    for (uint32_t i = 0; i < 10000; i++)
+        bst_insert_record(tree, tarr[i]);
+
+    // Unique on a, but b collides with tarr[0], so it must not be left behind in idx 0
+    if ((dup = calloc(1, sizeof(test_struct_t))) == NULL)
+        return -1;
+    dup->a = 20000;
+    dup->b = tarr[0]->b;
+    if (bst_insert_record(tree, dup) == 0 || bst_fetch(tree, 0, &dup->a) != NULL) {
+        fprintf(stdout, "BST Insert Record: FAILED. Partial insert was not rolled back\n");
+        rc = -1;
+    }
+    free(dup);
+
+    for (uint32_t i = 0; i < 10000; i += 2)
+        bst_delete_record(tree, tarr[i]);
+
+    for (uint32_t i = 0; i < 10000 && rc == 0; i++) {
+        if ((bst_fetch(tree, 0, &tarr[i]->a) == NULL) != (i % 2 == 0) ||
+                (bst_fetch(tree, 1, &tarr[i]->b) == NULL) != (i % 2 == 0)) {
+            fprintf(stdout, "BST Delete Record: FAILED at %d\n", i);
+            rc = -1;
+        }
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Records:\tPASSED\n");
+
+    for (uint32_t i = 0; i < 10000; i += 2)
+        free(tarr[i]);
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+int32_t
+test_bst_compact() {
+    bst_tree_t *tree;
+    test_struct_t *t;
+    int32_t expect = 0, key;
+    int32_t rc = 0;
+
+    populate_array(10000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32 | BST_COMPACT);
+    for (uint32_t i = 0; i < 10000; i++) {
+        t = tarr[(i * 7919) % 10000];
+        bst_insert(tree, 0, &t->a, t);
+    }
+
+    for (int32_t i = 0; i < 10000 && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &i) != tarr[i]) {
+            fprintf(stdout, "BST Compact Fetch: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    // Odd keys go, and their slots get handed back out by the reinserts below
+    for (int32_t i = 1; i < 10000 && rc == 0; i += 2) {
+        if (bst_delete(tree, 0, &i) != tarr[i]) {
+            fprintf(stdout, "BST Compact Delete: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    bst_iterate(tree, 0, bst_range_cb, &expect);
+    if (rc == 0 && expect != 10000) {
+        fprintf(stdout, "BST Compact Iterate: FAILED. Stopped at %d\n", expect);
+        rc = -1;
+    }
+
+    for (int32_t i = 1; i < 10000; i += 2)
+        bst_insert(tree, 0, &tarr[i]->a, tarr[i]);
+
+    key = 9999;
+    if (rc == 0 && bst_fetch(tree, 0, &key) != tarr[9999]) {
+        fprintf(stdout, "BST Compact Reinsert: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0 && bst_lower_bound(tree, 0, &key) != NULL) {
+        fprintf(stdout, "BST Compact Lower Bound: FAILED. Should be refused\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Compact:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+int32_t
+test_bst_freeze() {
+    bst_tree_t *tree;
+    test_struct_t *t;
+    uint64_t big[3] = { 1, 1ULL << 63, UINT64_MAX };
+    char *names[3] = { "apple", "banana", "cherry" }, *missing = "blueberry";
+    int32_t key;
+    int32_t rc = 0;
+
+    populate_array(10000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32);
+    bst_add_idx(tree, NULL, BST_KUINT64);
+    bst_add_idx(tree, NULL, BST_KPSTR);
+    for (uint32_t i = 0; i < 10000; i++)
+        bst_insert(tree, 0, &tarr[i]->a, tarr[i]);
+    for (uint32_t i = 0; i < 3; i++) {
+        bst_insert(tree, 1, &big[i], tarr[i]);
+        bst_insert(tree, 2, &names[i], tarr[i]);
+    }
+
+    bst_freeze(tree, 0);
+    bst_freeze(tree, 1);
+    bst_freeze(tree, 2);
+    for (int32_t i = -1; i <= 10000 && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &i) != ((i >= 0 && i < 10000) ? tarr[i] : NULL)) {
+            fprintf(stdout, "BST Freeze Fetch: FAILED at %d\n", i);
+            rc = -1;
+        }
+    }
+
+    // Unsigned keys past INT64_MAX have to keep their order once they're frozen
+    for (uint32_t i = 0; i < 3 && rc == 0; i++) {
+        if (bst_fetch(tree, 1, &big[i]) != tarr[i] || bst_fetch(tree, 2, &names[i]) != tarr[i]) {
+            fprintf(stdout, "BST Freeze Fetch: FAILED on key %d of idx 1 or 2\n", i);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && bst_fetch(tree, 2, &missing) != NULL) {
+        fprintf(stdout, "BST Freeze Fetch: FAILED. Found %s\n", missing);
+        rc = -1;
+    }
+
+    // Writes thaw the index, so the next fetch has to see them
+    key = 5000;
+    t = bst_delete(tree, 0, &key);
+    if (rc == 0 && bst_fetch(tree, 0, &key) != NULL) {
+        fprintf(stdout, "BST Freeze Thaw: FAILED. Deleted key still found\n");
+        rc = -1;
+    }
+    bst_insert(tree, 0, &t->a, t);
+    bst_freeze(tree, 0);
+    if (rc == 0 && bst_fetch(tree, 0, &key) != t) {
+        fprintf(stdout, "BST Freeze Refreeze: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Freeze:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+int32_t
+test_bst_btree() {
+    bst_tree_t *tree;
+    int32_t lo = 100, hi = 199, expect, key;
+    int32_t rc = 0;
+
+    // Enough keys for a few levels of internal nodes
+    populate_array(100000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32 | BST_BTREE);
+    for (uint32_t i = 0; i < 100000; i++)
+        bst_insert(tree, 0, &tarr[(i * 7919) % 100000]->a, tarr[(i * 7919) % 100000]);
+
+    for (int32_t i = 0; i < 100000 && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &i) != tarr[i]) {
+            fprintf(stdout, "BST B+tree Fetch: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    for (int32_t i = 1; i < 100000 && rc == 0; i += 2) {
+        if (bst_delete(tree, 0, &i) != tarr[i]) {
+            fprintf(stdout, "BST B+tree Delete: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    // The scan starts inside a leaf and runs along the chain
+    expect = 100;
+    bst_range(tree, 0, &lo, &hi, bst_range_cb, &expect);
+    if (rc == 0 && expect != 200) {
+        fprintf(stdout, "BST B+tree Range: FAILED. Stopped at %d\n", expect);
+        rc = -1;
+    }
+
+    expect = 0;
+    bst_iterate(tree, 0, bst_range_cb, &expect);
+    if (rc == 0 && expect != 100000) {
+        fprintf(stdout, "BST B+tree Iterate: FAILED. Stopped at %d\n", expect);
+        rc = -1;
+    }
+
+    for (int32_t i = 1; i < 100000; i += 2)
+        bst_insert(tree, 0, &tarr[i]->a, tarr[i]);
+
+    key = 77777;
+    if (rc == 0 && bst_fetch(tree, 0, &key) != tarr[77777]) {
+        fprintf(stdout, "BST B+tree Reinsert: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST B+tree:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+int32_t
+test_bst_hash() {
+    bst_tree_t *tree;
+    int32_t lo = 100, hi = 199, expect, count = 0;
+    int32_t rc = 0;
+
+    // An ordered primary index and a hash index on the same key
+    populate_array(100000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_HASH);
+    for (uint32_t i = 0; i < 100000; i++) {
+        bst_insert(tree, 0, &tarr[i]->a, tarr[i]);
+        bst_insert(tree, 1, &tarr[i]->a, tarr[i]);
+    }
+
+    for (int32_t i = 0; i < 100000 && rc == 0; i++) {
+        if (bst_fetch(tree, 1, &i) != tarr[i]) {
+            fprintf(stdout, "BST Hash Fetch: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    for (int32_t i = 1; i < 100000 && rc == 0; i += 2) {
+        bst_delete(tree, 0, &i);
+        if (bst_delete(tree, 1, &i) != tarr[i] || bst_fetch(tree, 1, &i) != NULL) {
+            fprintf(stdout, "BST Hash Delete: FAILED on key %d\n", i);
+            rc = -1;
+        }
+    }
+
+    // Deletes shift probe runs around, every survivor still has to be reachable
+    for (int32_t i = 0; i < 100000 && rc == 0; i += 2) {
+        if (bst_fetch(tree, 1, &i) != tarr[i]) {
+            fprintf(stdout, "BST Hash Fetch After Delete: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    bst_iterate(tree, 1, bench_count_cb, &count);
+    if (rc == 0 && count != 50000) {
+        fprintf(stdout, "BST Hash Iterate: FAILED. Expected 50000, got %d\n", count);
+        rc = -1;
+    }
+
+    expect = 100;
+    bst_range(tree, 0, &lo, &hi, bst_range_cb, &expect);
+    if (rc == 0 && (expect != 200 || bst_range(tree, 1, &lo, &hi, bst_range_cb, &expect) != -1)) {
+        fprintf(stdout, "BST Hash Range: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Hash:\tPASSED\n");
+
+    for (int32_t i = 1; i < 100000; i += 2)
+        free(tarr[i]);
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+typedef struct {
+    bst_tree_t *tree;
+    int32_t lo;
+    int32_t hi;
+} shard_thread_t;
+
+void *
+shard_insert_thread(void *arg) {
+    shard_thread_t *st = (shard_thread_t *)arg;
+
+    for (int32_t i = st->lo; i < st->hi; i++)
+        bst_insert(st->tree, 0, &tarr[i]->a, tarr[i]);
+
+    return NULL;
+}
+
+int32_t
+test_bst_shard() {
+#ifndef NO_LOCKS
+    pthread_t threads[4];
+#endif
+    shard_thread_t st[4];
+    bst_tree_t *tree;
+    int32_t lo = 1000, hi = 1999, expect, count = 0, idx;
+    void *sample[3];
+    int32_t rc = 0;
+
+    // Four writers, each filling its own quarter of the key space, enough to split many times
+    populate_array(200000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32 | BST_SHARDED);
+    for (int32_t i = 0; i < 4; i++) {
+        st[i].tree = tree;
+        st[i].lo = i * 50000;
+        st[i].hi = (i + 1) * 50000;
+#ifdef NO_LOCKS
+        shard_insert_thread(&st[i]);
+#else
+        pthread_create(&threads[i], NULL, shard_insert_thread, &st[i]);
+#endif
+    }
+#ifndef NO_LOCKS
+    for (int32_t i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+#endif
+
+    for (int32_t i = 0; i < 200000 && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &i) != tarr[i]) {
+            fprintf(stdout, "BST Shard Fetch: FAILED. Key %d not found\n", i);
+            rc = -1;
+        }
+    }
+
+    for (int32_t i = 1; i < 200000 && rc == 0; i += 2) {
+        if (bst_delete(tree, 0, &i) != tarr[i] || bst_fetch(tree, 0, &i) != NULL) {
+            fprintf(stdout, "BST Shard Delete: FAILED on key %d\n", i);
+            rc = -1;
+        }
+        free(tarr[i]);
+    }
+
+    // Scans have to cross shard boundaries in key order
+    expect = 0;
+    bst_iterate(tree, 0, bst_range_cb, &expect);
+    if (rc == 0 && expect != 200000) {
+        fprintf(stdout, "BST Shard Iterate: FAILED. Stopped at %d\n", expect);
+        rc = -1;
+    }
+
+    expect = 1000;
+    bst_range(tree, 0, &lo, &hi, bst_range_cb, &expect);
+    if (rc == 0 && expect != 2000) {
+        fprintf(stdout, "BST Shard Range: FAILED. Stopped at %d\n", expect);
+        rc = -1;
+    }
+
+    // Bounds only go on an empty index
+    sample[0] = &tarr[0]->a;
+    sample[1] = &tarr[100000]->a;
+    sample[2] = &tarr[50000]->a;
+    idx = bst_add_idx(tree, NULL, BST_KINT32 | BST_SHARDED);
+    if (rc == 0 && (bst_set_shard_bounds(tree, 0, sample, 3) != -1 ||
+                bst_set_shard_bounds(tree, idx, sample, 3) != 0 ||
+                bst_set_shard_bounds(tree, idx, sample, 3) != -1 || bst_rank(tree, 0, &lo) != -1)) {
+        fprintf(stdout, "BST Shard Bounds: FAILED\n");
+        rc = -1;
+    }
+
+    for (int32_t i = 0; i < 200000; i += 2)
+        bst_insert(tree, idx, &tarr[i]->a, tarr[i]);
+    bst_iterate(tree, idx, bench_count_cb, &count);
+    if (rc == 0 && count != 100000) {
+        fprintf(stdout, "BST Shard Sampled: FAILED. Expected 100000, got %d\n", count);
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Shard:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+void *
+snapshot_writer_thread(void *arg) {
+    bst_tree_t *tree = (bst_tree_t *)arg;
+
+    // Replace every even key with its odd neighbour while the snapshot is being read
+    for (int32_t i = 0; i < 100000; i += 2) {
+        bst_delete(tree, 0, &i);
+        bst_insert(tree, 0, &tarr[i + 1]->a, tarr[i + 1]);
+    }
+
+    return NULL;
+}
+
+int32_t
+test_bst_snapshot() {
+    pthread_t writer;
+    bst_tree_t *tree;
+    bst_snapshot_t *snap;
+    int32_t expect, key = 4, rc = 0;
+
+    populate_array(100000, 0);
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32 | BST_RCU);
+    for (int32_t i = 0; i < 100000; i += 2)
+        bst_insert(tree, 0, &tarr[i]->a, tarr[i]);
+
+    snap = bst_snapshot(tree, 0);
+    pthread_create(&writer, NULL, snapshot_writer_thread, tree);
+
+    // Whatever the writer has got to, the snapshot still holds exactly the even keys
+    for (int32_t pass = 0; pass < 20 && rc == 0; pass++) {
+        expect = 0;
+        bst_snapshot_iterate(snap, bst_range_cb, &expect);
+        if (expect != 100000 || bst_snapshot_fetch(snap, &key) != tarr[4]) {
+            fprintf(stdout, "BST Snapshot Iterate: FAILED. Stopped at %d\n", expect);
+            rc = -1;
+        }
+    }
+    pthread_join(writer, NULL);
+
+    expect = 1000;
+    key = 1998;
+    bst_snapshot_range(snap, &expect, &key, bst_range_cb, &expect);
+    if (rc == 0 && expect != 2000) {
+        fprintf(stdout, "BST Snapshot Range: FAILED. Stopped at %d\n", expect);
+        rc = -1;
+    }
+    bst_snapshot_release(snap);
+
+    // The live index moved on to the odd keys
+    expect = 1;
+    bst_iterate(tree, 0, bst_range_cb, &expect);
+    if (rc == 0 && expect != 100001) {
+        fprintf(stdout, "BST Snapshot Live: FAILED. Stopped at %d\n", expect);
+        rc = -1;
+    }
+
+    if (rc == 0 && bst_add_idx(tree, NULL, BST_KINT32) == 1 && bst_snapshot(tree, 1) != NULL) {
+        fprintf(stdout, "BST Snapshot Plain Index: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Snapshot:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    for (int32_t i = 0; i < 100000; i += 2)
+        free(tarr[i]);
+
+    return rc;
+}
+
+typedef struct {
+    struct timeval tv;
+    int32_t id;
+} event_t;
+
+void
+expire_free_cb(void *data, void *fn_data) {
+    (*(int32_t *)fn_data)++;
+    free(data);
+}
+
+int32_t
+test_bst_expire() {
+    bst_tree_t *tree;
+    event_t *ev;
+    struct timeval cutoff = { 50, 0 };
+    int32_t freed = 0, id, rc = 0;
+    int64_t count;
+
+    // Events a millisecond apart, indexed by time and by id
+    tree = bst_create(NULL, NULL, BST_KTME | BST_OSTAT);
+    bst_add_idx(tree, NULL, BST_KINT32);
+    bst_set_key_offset(tree, 0, offsetof(event_t, tv));
+    bst_set_key_offset(tree, 1, offsetof(event_t, id));
+    for (int32_t i = 0; i < 100000; i++) {
+        ev = malloc(sizeof(event_t));
+        ev->tv.tv_sec = i / 1000;
+        ev->tv.tv_usec = (i % 1000) * 1000;
+        ev->id = i;
+        bst_insert_record(tree, ev);
+    }
+
+    count = bst_expire_before(tree, 0, &cutoff, expire_free_cb, &freed);
+    if (count != 50000 || freed != 50000) {
+        fprintf(stdout, "BST Expire: FAILED. Expired %ld, freed %d\n", count, freed);
+        rc = -1;
+    }
+
+    // Gone from both indexes, and the survivors are still counted right
+    id = 49999;
+    if (rc == 0 && (bst_fetch(tree, 1, &id) != NULL || bst_fetch(tree, 0, &cutoff) == NULL ||
+                bst_count_range(tree, 0, NULL, NULL) != 50000 ||
+                bst_rank(tree, 0, &cutoff) != 0)) {
+        fprintf(stdout, "BST Expire Survivors: FAILED\n");
+        rc = -1;
+    }
+
+    for (int32_t i = 50000; i < 100000 && rc == 0; i++) {
+        if (((event_t *)bst_select(tree, 0, i - 50000))->id != i || bst_fetch(tree, 1, &i) == NULL) {
+            fprintf(stdout, "BST Expire Order: FAILED at %d\n", i);
+            rc = -1;
+        }
+    }
+
+    if (rc == 0 && bst_expire_before(tree, 0, &cutoff, expire_free_cb, &freed) != 0) {
+        fprintf(stdout, "BST Expire Again: FAILED\n");
+        rc = -1;
+    }
+
+    cutoff.tv_sec = 1000;
+    if (rc == 0 && (bst_expire_before(tree, 0, &cutoff, expire_free_cb, &freed) != 50000 ||
+                bst_count_range(tree, 0, NULL, NULL) != 0 || freed != 100000)) {
+        fprintf(stdout, "BST Expire All: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Expire:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+
+    return rc;
+}
+
+#define TEST_NAMED_TREES 2000
+
+typedef struct {
+    bst_tree_t **trees;
+    int32_t errors;
+} registry_thread_t;
+
+// Looks up the trees that stay put while the main thread registers and drops others
+void *
+registry_reader_thread(void *arg) {
+    registry_thread_t *rt = (registry_thread_t *)arg;
+    char name[32];
+
+    for (int32_t pass = 0; pass < 20; pass++) {
+        for (int32_t i = 0; i < TEST_NAMED_TREES; i += 2) {
+            snprintf(name, sizeof(name), "tree-%d", i);
+            if (bst_find_by_name(name) != rt->trees[i])
+                rt->errors++;
+        }
+    }
+
+    return NULL;
+}
+
+int32_t
+test_bst_registry() {
+    bst_tree_t **trees;
+    pthread_t readers[4];
+    registry_thread_t rt[4];
+    char name[32];
+    int32_t rc = 0;
+
+    if ((trees = calloc(2 * TEST_NAMED_TREES, sizeof(bst_tree_t *))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < TEST_NAMED_TREES; i += 2) {
+        snprintf(name, sizeof(name), "tree-%d", i);
+        trees[i] = bst_create(name, NULL, BST_KINT32);
+    }
+
+    for (int32_t i = 0; i < 4; i++) {
+        rt[i].trees = trees;
+        rt[i].errors = 0;
+        pthread_create(&readers[i], NULL, registry_reader_thread, &rt[i]);
+    }
+
+    // Enough new names to make the registry grow a few times under the readers
+    for (int32_t i = 1; i < 2 * TEST_NAMED_TREES; i += 2) {
+        snprintf(name, sizeof(name), "tree-%d", i);
+        trees[i] = bst_create(name, NULL, BST_KINT32);
+    }
+    for (int32_t i = 1; i < 2 * TEST_NAMED_TREES; i += 4) {
+        bst_destroy(trees[i], NULL);
+        trees[i] = NULL;
+    }
+
+    for (int32_t i = 0; i < 4; i++) {
+        pthread_join(readers[i], NULL);
+        if (rt[i].errors) {
+            fprintf(stdout, "BST Registry Concurrent Lookup: FAILED. %d misses\n", rt[i].errors);
+            rc = -1;
+        }
+    }
+
+    for (int32_t i = 0; i < 2 * TEST_NAMED_TREES && rc == 0; i++) {
+        if (i >= TEST_NAMED_TREES && !(i & 1))
+            continue;
+        snprintf(name, sizeof(name), "tree-%d", i);
+        if (bst_find_by_name(name) != trees[i]) {
+            fprintf(stdout, "BST Registry Lookup: FAILED on %s\n", name);
+            rc = -1;
+        }
+    }
+
+    if (rc == 0 && (bst_create("tree-0", NULL, BST_KINT32) != NULL ||
+                bst_find_by_name(NULL) != NULL || bst_find_by_name("tree-1") != NULL)) {
+        fprintf(stdout, "BST Registry Names: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Registry:\tPASSED\n");
+
+    for (int32_t i = 0; i < 2 * TEST_NAMED_TREES; i++) {
+        if (trees[i])
+            bst_destroy(trees[i], NULL);
+    }
+    free(trees);
+
+    return rc;
+}
+
+#define TEST_FETCH_MANY 10000
+
+// Even keys are in the tree and odd ones aren't, so every batch is half hits and half misses
+int32_t
+test_bst_fetch_many() {
+    bst_tree_t *tree;
+    int32_t *k, *vals, rc = 0;
+    void **keys, **out;
+    int64_t found;
+
+    k = malloc(2 * TEST_FETCH_MANY * sizeof(int32_t));
+    vals = malloc(TEST_FETCH_MANY * sizeof(int32_t));
+    keys = malloc(2 * TEST_FETCH_MANY * sizeof(void *));
+    out = malloc(2 * TEST_FETCH_MANY * sizeof(void *));
+    if (!k || !vals || !keys || !out) {
+        fprintf(stdout, "Error:  Unable to allocate memory for fetch many test.\n");
+        return -1;
+    }
+
+    tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_HASH);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_RCU);
+    bst_add_idx(tree, NULL, BST_KINT32);
+    for (int32_t i = 0; i < TEST_FETCH_MANY; i++) {
+        vals[i] = i * 2;
+        for (int32_t j = 0; j < 4; j++)
+            bst_insert(tree, j, &vals[i], &vals[i]);
+    }
+    bst_freeze(tree, 3);
+
+    // Shuffled, so the lanes finish out of order
+    for (int32_t i = 0; i < 2 * TEST_FETCH_MANY; i++) {
+        k[i] = random() % (2 * TEST_FETCH_MANY);
+        keys[i] = &k[i];
+    }
+
+    for (int32_t j = 0; j < 4 && rc == 0; j++) {
+        found = bst_fetch_many(tree, j, keys, 2 * TEST_FETCH_MANY, out);
+        for (int32_t i = 0; i < 2 * TEST_FETCH_MANY; i++) {
+            if ((k[i] & 1) ? out[i] != NULL : (!out[i] || *(int32_t *)out[i] != k[i])) {
+                fprintf(stdout, "BST Fetch Many: FAILED on idx %d, key %d\n", j, k[i]);
+                rc = -1;
+                break;
+            }
+            found -= (out[i] != NULL);
+        }
+        if (rc == 0 && found != 0) {
+            fprintf(stdout, "BST Fetch Many Count: FAILED on idx %d\n", j);
+            rc = -1;
+        }
+    }
+
+    // Batches shorter than the number of lanes, and empty ones
+    for (int32_t n = 0; n < 20 && rc == 0; n++) {
+        found = bst_fetch_many(tree, 0, keys, n, out);
+        for (int32_t i = 0; i < n; i++)
+            found -= !(k[i] & 1);
+        if (found != 0) {
+            fprintf(stdout, "BST Fetch Many Short: FAILED on %d keys\n", n);
+            rc = -1;
+        }
+    }
+
+    if (rc == 0 && bst_fetch_many(tree, 4, keys, 1, out) != -1) {
+        fprintf(stdout, "BST Fetch Many Index: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Fetch Many:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    free(k);
+    free(vals);
+    free(keys);
+    free(out);
+
+    return rc;
+}
+
+#define TEST_BATCH 10000
+
+int32_t
+test_bst_insert_batch() {
+    bst_tree_t *tree;
+    int32_t *k, rc = 0;
+    void **keys, **first;
+    int64_t added, count;
+
+    k = malloc(4 * TEST_BATCH * sizeof(int32_t));
+    keys = malloc(4 * TEST_BATCH * sizeof(void *));
+    first = malloc(2 * TEST_BATCH * sizeof(void *));
+    if (!k || !keys || !first) {
+        fprintf(stdout, "Error:  Unable to allocate memory for batch insert test.\n");
+        return -1;
+    }
+
+    tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA | BST_OSTAT);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_BTREE);
+
+    // Multiples of 4 first, one at a time
+    for (int32_t i = 0; i < TEST_BATCH; i++) {
+        k[i] = i * 4;
+        bst_insert(tree, 0, &k[i], &k[i]);
+    }
+
+    // Then every even key in one shuffled batch, half of them already there, and the lower
+    // half of them in it twice
+    for (int32_t i = 0; i < 2 * TEST_BATCH; i++)
+        k[TEST_BATCH + i] = i * 2;
+    for (int32_t i = 0; i < TEST_BATCH; i++)
+        k[3 * TEST_BATCH + i] = i * 2;
+    for (int32_t i = 0; i < 3 * TEST_BATCH; i++)
+        keys[i] = &k[TEST_BATCH + i];
+    for (int32_t i = 3 * TEST_BATCH - 1; i > 0; i--) {
+        int32_t j = random() % (i + 1);
+        void *tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+
+    for (int32_t j = 0; j < 2 && rc == 0; j++) {
+        added = bst_insert_batch(tree, j, keys, keys, 3 * TEST_BATCH);
+        count = (j == 0) ? bst_count_range(tree, 0, NULL, NULL) : 0;
+        if (added != (j == 0 ? TEST_BATCH : 2 * TEST_BATCH) ||
+                (j == 0 && count != 2 * TEST_BATCH)) {
+            fprintf(stdout, "BST Insert Batch: FAILED on idx %d, %ld added, %ld in tree\n", j,
+                    added, count);
+            rc = -1;
+        }
+    }
+
+    // Sizes are kept right by the joins, so select walks the merged tree in order
+    for (int32_t i = 0; i < 2 * TEST_BATCH && rc == 0; i++) {
+        if (*(int32_t *)bst_select(tree, 0, i) != i * 2 || bst_fetch(tree, 1, &k[TEST_BATCH + i])
+                == NULL) {
+            fprintf(stdout, "BST Insert Batch Order: FAILED at %d\n", i);
+            rc = -1;
+        }
+    }
+
+    // A batch into an empty index, and one that's all duplicates
+    bst_add_idx(tree, NULL, BST_KINT32);
+    if (rc == 0 && (bst_insert_batch(tree, 2, keys, keys, 3 * TEST_BATCH) != 2 * TEST_BATCH ||
+                bst_insert_batch(tree, 2, keys, keys, 3 * TEST_BATCH) != 0 ||
+                bst_insert_batch(tree, 2, keys, keys, 0) != 0)) {
+        fprintf(stdout, "BST Insert Batch Empty: FAILED\n");
+        rc = -1;
+    }
+
+    // Of a key's copies in the batch, the first one given is the record kept
+    for (int32_t i = 3 * TEST_BATCH - 1; i >= 0; i--)
+        first[*(int32_t *)keys[i] / 2] = keys[i];
+    for (int32_t i = 0; i < 2 * TEST_BATCH && rc == 0; i++) {
+        for (int32_t j = 1; j < 3; j++) {
+            if (bst_fetch(tree, j, &k[TEST_BATCH + i]) != first[i]) {
+                fprintf(stdout, "BST Insert Batch First: FAILED on idx %d at %d\n", j, i * 2);
+                rc = -1;
+                break;
+            }
+        }
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Insert Batch:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    free(k);
+    free(keys);
+    free(first);
+
+    return rc;
+}
+
+#define TEST_MULTI_RECORDS 10000
+#define TEST_MULTI_KEYS 100
+#define TEST_MULTI_OOM_KEYS 1000000
+
+static unsigned long
+test_vm_pages() {
+    unsigned long vm = 0;
+    FILE *statm;
+
+    if ((statm = fopen("/proc/self/statm", "r")) == NULL)
+        return 0;
+    if (fscanf(statm, "%lu", &vm) != 1)
+        vm = 0;
+    fclose(statm);
+
+    return vm;
+}
+
+// Runs in a child.  Its address space is capped so that a bulk load of 1M keys with a duplicate
+// each gets its pairs and nodes, about 160MB, but runs out partway through the 48MB of duplicate
+// arrays it allocates last.  The index has to come out of that empty and still take a load.
+static int32_t
+test_multi_bulk_oom() {
+    struct rlimit lim, old;
+    int32_t *keys = malloc(TEST_MULTI_OOM_KEYS * 2 * sizeof(int32_t)), key = 5;
+    void **kp = malloc(TEST_MULTI_OOM_KEYS * 2 * sizeof(void *));
+    bst_tree_t *tree = bst_create(NULL, NULL, BST_KINT32 | BST_MULTI | BST_ARENA);
+    unsigned long vm = test_vm_pages();
+    void **held, *last = NULL;
+
+    if (!keys || !kp || !tree || !vm)
+        return 1;
+
+    for (int32_t i = 0; i < TEST_MULTI_OOM_KEYS * 2; i++) {
+        keys[i] = i / 2;
+        kp[i] = &keys[i];
+    }
+
+    // Earlier tests leave free heap behind, in every thread's arena, that the duplicate arrays
+    // would fit in.  With the cap at what's mapped now, it's used up first.  The blocks are
+    // chained so they can't be optimized away, and never freed.
+    getrlimit(RLIMIT_AS, &old);
+    lim = old;
+    lim.rlim_cur = vm * sysconf(_SC_PAGESIZE);
+    if (setrlimit(RLIMIT_AS, &lim) < 0)
+        return 1;
+    while ((held = malloc(40)) != NULL) {
+        *held = last;
+        last = held;
+    }
+
+    lim.rlim_cur += 176 << 20;
+    if (setrlimit(RLIMIT_AS, &lim) < 0)
+        return 1;
+    if (bst_bulk_load(tree, 0, kp, kp, TEST_MULTI_OOM_KEYS * 2, 0) == 0 ||
+            strncmp(bst_get_last_err(), "bst_dups_add", 12))
+        return 2;
+    setrlimit(RLIMIT_AS, &old);
+
+    if (bst_fetch(tree, 0, &key) != NULL || bst_bulk_load(tree, 0, kp, kp, 1000, 0) != 0 ||
+            bst_fetch_all(tree, 0, &key, kp + 1000, 2) != 2)
+        return 3;
+
+    return 0;
+}
+
+// Records keyed uniquely by a and, on a BST_MULTI index, by b, which only takes 100 values
+int32_t
+test_bst_multi() {
+    bst_tree_t *tree;
+    test_struct_t *t, **recs, *out[TEST_MULTI_RECORDS / TEST_MULTI_KEYS];
+    int32_t count = 0, key, rc = 0, status = 0;
+    int64_t n;
+    pid_t pid = 0;
+
+    if ((recs = malloc(TEST_MULTI_RECORDS * sizeof(test_struct_t *))) == NULL)
+        return -1;
+
+    tree = bst_create(NULL, delete_node_cb, BST_KINT32);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_MULTI);
+    bst_set_key_offset(tree, 0, offsetof(test_struct_t, a));
+    bst_set_key_offset(tree, 1, offsetof(test_struct_t, b));
+
+    for (int32_t i = 0; i < TEST_MULTI_RECORDS; i++) {
+        t = recs[i] = calloc(1, sizeof(test_struct_t));
+        t->a = i;
+        t->b = i % TEST_MULTI_KEYS;
+        if (bst_insert_record(tree, t) < 0) {
+            fprintf(stdout, "BST Multi Insert: FAILED on %d\n", i);
+            rc = -1;
+            break;
+        }
+    }
+
+    // Every record under its key, in the order they went in
+    for (key = 0; key < TEST_MULTI_KEYS && rc == 0; key++) {
+        n = bst_fetch_all(tree, 1, &key, (void **)out, TEST_MULTI_RECORDS / TEST_MULTI_KEYS);
+        if (n != TEST_MULTI_RECORDS / TEST_MULTI_KEYS || bst_fetch(tree, 1, &key) != recs[key]) {
+            fprintf(stdout, "BST Multi Fetch All: FAILED on %d, %ld records\n", key, n);
+            rc = -1;
+        }
+        for (int32_t i = 0; i < n && rc == 0; i++) {
+            if (out[i] != recs[i * TEST_MULTI_KEYS + key]) {
+                fprintf(stdout, "BST Multi Fetch All Order: FAILED on %d\n", key);
+                rc = -1;
+            }
+        }
+    }
+
+    key = 7;
+    if (rc == 0 && (bst_fetch_all(tree, 1, &key, (void **)out, 3) != 100 ||
+                bst_fetch_all(tree, 0, &key, (void **)out, 1) != 1 || out[0] != recs[7])) {
+        fprintf(stdout, "BST Multi Fetch All Short: FAILED\n");
+        rc = -1;
+    }
+
+    bst_iterate(tree, 1, bench_count_cb, &count);
+    if (rc == 0 && count != TEST_MULTI_RECORDS) {
+        fprintf(stdout, "BST Multi Iterate: FAILED. %d records\n", count);
+        rc = -1;
+    }
+
+    // Take out every third record, whichever slot it sits in under its key
+    for (int32_t i = 0; i < TEST_MULTI_RECORDS && rc == 0; i += 3) {
+        if (bst_delete_record(tree, recs[i]) < 0) {
+            fprintf(stdout, "BST Multi Delete Record: FAILED on %d\n", i);
+            rc = -1;
+        }
+        free(recs[i]);
+        recs[i] = NULL;
+    }
+
+    count = 0;
+    key = 10;
+    bst_range(tree, 1, &key, &key, bench_count_cb, &count);
+    n = bst_fetch_all(tree, 1, &key, (void **)out, TEST_MULTI_RECORDS / TEST_MULTI_KEYS);
+    for (int32_t i = 0, j = key; i < n && rc == 0; i++, j += TEST_MULTI_KEYS) {
+        if (!recs[j])
+            j += TEST_MULTI_KEYS;
+        if (out[i] != recs[j]) {
+            fprintf(stdout, "BST Multi Delete Order: FAILED at %d\n", i);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && (count != 67 || n != 67 || bst_delete_value(tree, 1, &key, recs[13]) != NULL)) {
+        fprintf(stdout, "BST Multi Delete: FAILED. %d in range, %ld fetched\n", count, n);
+        rc = -1;
+    }
+
+    // bst_delete gives up a key's records one at a time, and the key goes with the last
+    for (int32_t i = 0; i < n && rc == 0; i++) {
+        if (bst_delete(tree, 1, &key) != out[i])
+            rc = -1;
+    }
+    if (rc == 0 && (bst_fetch_all(tree, 1, &key, (void **)out, 1) != 0 ||
+                bst_delete(tree, 1, &key) != NULL)) {
+        fprintf(stdout, "BST Multi Delete Key: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0 && bst_add_idx(tree, NULL, BST_KINT32 | BST_MULTI | BST_OSTAT) >= 0) {
+        fprintf(stdout, "BST Multi Flags: FAILED\n");
+        rc = -1;
+    }
+
+    // AddressSanitizer's shadow memory doesn't fit under an address space cap
+#ifndef __SANITIZE_ADDRESS__
+    fflush(stdout);
+    if (rc == 0 && (pid = fork()) == 0)
+        _exit(test_multi_bulk_oom());
+    if (rc == 0 && (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0)) {
+        fprintf(stdout, "BST Multi Bulk Load Out of Memory: FAILED. %d\n", WEXITSTATUS(status));
+        rc = -1;
+    }
+#endif
+
+    if (rc == 0)
+        fprintf(stdout, "BST Multi:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    free(recs);
+
+    return rc;
+}
+
+#define TEST_COMP_RECORDS 10000
+
+typedef struct {
+    uint32_t src_ip;
+    uint16_t dst_port;
+    struct timeval ts;
+    char *user;
+} flow_t;
+
+int32_t
+flow_order_cb(void *data, void *fn_data) {
+    flow_t **prev = (flow_t **)fn_data, *f = (flow_t *)data;
+
+    // Caller's sentinel in prev[1] flags an order violation
+    if (*prev && ((*prev)->src_ip > f->src_ip || ((*prev)->src_ip == f->src_ip &&
+                    ((*prev)->dst_port > f->dst_port || ((*prev)->dst_port == f->dst_port &&
+                            timercmp(&(*prev)->ts, &f->ts, >))))))
+        prev[1] = f;
+    *prev = f;
+
+    return BST_CB_OK;
+}
+
+// Flow records indexed uniquely on (src_ip, dst_port, ts) and, with duplicates, on
+// (user, src_ip)
+int32_t
+test_bst_comp() {
+    bst_tree_t *tree, *other;
+    flow_t *flows, key, *kp = &key, *prev[2] = { NULL, NULL };
+    bst_field_t fields[] = {
+        { BST_KUINT32, offsetof(flow_t, src_ip) },
+        { BST_KUINT16, offsetof(flow_t, dst_port) },
+        { BST_KTME, offsetof(flow_t, ts) }
+    };
+    bst_field_t by_user[] = {
+        { BST_KPSTR, offsetof(flow_t, user) },
+        { BST_KUINT32, offsetof(flow_t, src_ip) }
+    };
+    char *users[] = { "alice", "bob", "carol", "dave" };
+    int32_t count = 0, rc = 0;
+
+    if ((flows = calloc(TEST_COMP_RECORDS, sizeof(flow_t))) == NULL)
+        return -1;
+
+    tree = bst_create(NULL, NULL, BST_KCOMP | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KCOMP | BST_MULTI);
+    if (bst_set_key_fields(tree, 0, fields, 3) < 0 || bst_set_key_fields(tree, 1, by_user, 2) < 0) {
+        fprintf(stdout, "BST Composite Fields: FAILED. %s\n", bst_get_last_err());
+        rc = -1;
+    }
+
+    // 10 hosts, 50 ports, 20 timestamps each
+    for (int32_t i = 0; i < TEST_COMP_RECORDS && rc == 0; i++) {
+        flows[i].src_ip = 0x0a000000 + (i * 7) % 10;
+        flows[i].dst_port = (i / 10) % 50;
+        flows[i].ts.tv_sec = 1000 + i / 500;
+        flows[i].ts.tv_usec = i % 3;
+        flows[i].user = users[i % 4];
+        if (bst_insert_record(tree, &flows[i]) < 0) {
+            fprintf(stdout, "BST Composite Insert: FAILED on %d. %s\n", i, bst_get_last_err());
+            rc = -1;
+        }
+    }
+
+    key = flows[1234];
+    if (rc == 0 && (bst_fetch(tree, 0, &kp) != &flows[1234] ||
+                bst_insert_record(tree, &key) == 0)) {
+        fprintf(stdout, "BST Composite Fetch: FAILED\n");
+        rc = -1;
+    }
+
+    bst_iterate(tree, 0, flow_order_cb, prev);
+    if (rc == 0 && prev[1]) {
+        fprintf(stdout, "BST Composite Order: FAILED\n");
+        rc = -1;
+    }
+
+    // Only the leading fields of the key matter to a prefix scan
+    key = (flow_t){ .src_ip = 0x0a000003 };
+    bst_prefix_range(tree, 0, &kp, 1, bench_count_cb, &count);
+    if (rc == 0 && count != TEST_COMP_RECORDS / 10) {
+        fprintf(stdout, "BST Composite Prefix 1: FAILED. %d records\n", count);
+        rc = -1;
+    }
+
+    count = 0;
+    key.dst_port = 42;
+    bst_prefix_range(tree, 0, &kp, 2, bench_count_cb, &count);
+    if (rc == 0 && count != TEST_COMP_RECORDS / 500) {
+        fprintf(stdout, "BST Composite Prefix 2: FAILED. %d records\n", count);
+        rc = -1;
+    }
+
+    count = 0;
+    key.user = "carol";
+    bst_prefix_range(tree, 1, &kp, 1, bench_count_cb, &count);
+    if (rc == 0 && (count != TEST_COMP_RECORDS / 4 || bst_prefix_range(tree, 1, &kp, 3,
+                    bench_count_cb, &count) != -1)) {
+        fprintf(stdout, "BST Composite Prefix String: FAILED. %d records\n", count);
+        rc = -1;
+    }
+
+    for (int32_t i = 0; i < TEST_COMP_RECORDS && rc == 0; i += 2) {
+        if (bst_delete_record(tree, &flows[i]) < 0) {
+            fprintf(stdout, "BST Composite Delete: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+    count = 0;
+    bst_iterate(tree, 1, bench_count_cb, &count);
+    kp = &flows[2];
+    if (rc == 0 && (count != TEST_COMP_RECORDS / 2 || bst_fetch(tree, 1, &kp) != NULL ||
+                bst_fetch(tree, 0, &kp) != NULL)) {
+        fprintf(stdout, "BST Composite Delete: FAILED. %d left\n", count);
+        rc = -1;
+    }
+
+    // Nothing goes in before the fields are set, and they can't be changed after
+    other = bst_create(NULL, NULL, BST_KCOMP);
+    if (rc == 0 && (bst_insert_record(other, &flows[1]) == 0 ||
+                bst_insert(other, 0, &flows[1], &flows[1]) == 0 ||
+                bst_set_key_fields(other, 0, fields, 3) < 0 ||
+                bst_set_key_fields(tree, 0, fields, 2) == 0 ||
+                bst_add_idx(other, NULL, BST_KCOMP | BST_HASH) >= 0)) {
+        fprintf(stdout, "BST Composite Fields Unset: FAILED\n");
+        rc = -1;
+    }
+    bst_destroy(other, NULL);
+
+    // Many trees at once, each ordering on a differently sized prefix of by_user or fields
+    for (int32_t t = 0; t < 40 && rc == 0; t++) {
+        other = bst_create(NULL, NULL, BST_KCOMP | BST_ARENA);
+        bst_set_key_fields(other, 0, t % 2 ? by_user : fields, t % 2 ? 2 : 1 + t % 3);
+        for (int32_t i = 0; i < 100; i++)
+            bst_insert_record(other, &flows[i]);
+        count = 0;
+        bst_iterate(other, 0, bench_count_cb, &count);
+        kp = &flows[1];
+        if (count != (t % 2 ? 20 : (int32_t []){ 10, 100, 100 }[t % 3]) ||
+                bst_fetch(other, 0, &kp) == NULL) {
+            fprintf(stdout, "BST Composite Many: FAILED on %d. %d records\n", t, count);
+            rc = -1;
+        }
+        bst_destroy(other, NULL);
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST Composite:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    free(flows);
+
+    return rc;
+}
+
+#define TEST_STRKEY_KEYS 20000
+
+int32_t
+str_order_cb(void *data, void *fn_data) {
+    char **prev = (char **)fn_data, *name = *(char **)data;
+
+    // Caller's sentinel in prev[1] flags an order violation
+    if (prev[0] && strcmp(prev[0], name) >= 0)
+        prev[1] = name;
+    prev[0] = name;
+
+    return BST_CB_OK;
+}
+
+// String keys that differ before, at and past their 8 byte prefix, shorter than it, and with
+// bytes above 0x7f, on a plain, a sharded and an interned index
+int32_t
+test_bst_strkey() {
+    bst_tree_t *tree;
+    char **names, *copy, *prev[2] = { NULL, NULL }, buf[32];
+    char *missing[] = { "", "abcdefg", "abcdefgh", "host-", "\xc3\xa9t\xc3" };
+    void *sample[16];
+    int32_t rc = 0;
+
+    if ((names = calloc(TEST_STRKEY_KEYS, sizeof(char *))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < TEST_STRKEY_KEYS; i++) {
+        switch (i % 4) {
+            case 0: snprintf(buf, sizeof(buf), "%d", i); break;
+            case 1: snprintf(buf, sizeof(buf), "host-%06d", i); break;
+            case 2: snprintf(buf, sizeof(buf), "abcdefgh%d", i); break;
+            case 3: snprintf(buf, sizeof(buf), "\xc3\xa9t\xc3\xa9-%d", i); break;
+        }
+        names[i] = strdup(buf);
+    }
+
+    tree = bst_create(NULL, NULL, BST_KPSTR | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KPSTR | BST_SHARDED);
+    bst_add_idx(tree, NULL, BST_KPSTR | BST_INTERN);
+    for (int32_t i = 0; i < 16; i++)
+        sample[i] = &names[i * 997];
+    bst_set_shard_bounds(tree, 1, sample, 16);
+
+    // The interned index gets the keys from a buffer that's overwritten straight after
+    for (int32_t i = 0; i < TEST_STRKEY_KEYS && rc == 0; i++) {
+        copy = buf;
+        strcpy(buf, names[i]);
+        if (bst_insert(tree, 0, &names[i], &names[i]) != 0 ||
+                bst_insert(tree, 1, &names[i], &names[i]) != 0 ||
+                bst_insert(tree, 2, &copy, &names[i]) != 0) {
+            fprintf(stdout, "BST String Key Insert: FAILED on %s\n", names[i]);
+            rc = -1;
+        }
+        strcpy(buf, "overwritten");
+    }
+
+    // Needles are copies, so nothing is settled by pointer
+    for (int32_t i = 0; i < TEST_STRKEY_KEYS && rc == 0; i++) {
+        copy = strdup(names[i]);
+        for (int32_t idx = 0; idx < 3; idx++) {
+            if (bst_fetch(tree, idx, &copy) != &names[i]) {
+                fprintf(stdout, "BST String Key Fetch: FAILED on %s in index %d\n", names[i], idx);
+                rc = -1;
+            }
+        }
+        free(copy);
+    }
+    for (int32_t i = 0; i < 5 && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &missing[i]) || bst_fetch(tree, 1, &missing[i]) ||
+                bst_fetch(tree, 2, &missing[i])) {
+            fprintf(stdout, "BST String Key Missing: FAILED on %s\n", missing[i]);
+            rc = -1;
+        }
+    }
+
+    bst_iterate(tree, 0, str_order_cb, prev);
+    if (rc == 0 && prev[1]) {
+        fprintf(stdout, "BST String Key Order: FAILED at %s\n", prev[1]);
+        rc = -1;
+    }
+
+    for (int32_t i = 0; i < TEST_STRKEY_KEYS && rc == 0; i += 2) {
+        if (bst_delete(tree, 0, &names[i]) != &names[i] ||
+                bst_delete(tree, 2, &names[i]) != &names[i]) {
+            fprintf(stdout, "BST String Key Delete: FAILED on %s\n", names[i]);
+            rc = -1;
+        }
+    }
+    for (int32_t i = 0; i < TEST_STRKEY_KEYS && rc == 0; i++) {
+        copy = bst_intern(names[i]);
+        if (bst_fetch(tree, 0, &names[i]) != ((i % 2) ? &names[i] : NULL) ||
+                bst_fetch(tree, 2, &copy) != ((i % 2) ? &names[i] : NULL)) {
+            fprintf(stdout, "BST String Key Delete: FAILED. %s\n", names[i]);
+            rc = -1;
+        }
+    }
+
+    copy = strdup(names[7]);
+    if (rc == 0 && (bst_intern(copy) != bst_intern(names[7]) || bst_intern(copy) == copy ||
+                bst_add_idx(tree, NULL, BST_KINT32 | BST_INTERN) >= 0 ||
+                bst_add_idx(tree, NULL, BST_KPSTR | BST_COMPACT | BST_INTERN) >= 0)) {
+        fprintf(stdout, "BST String Key Intern: FAILED\n");
+        rc = -1;
+    }
+    free(copy);
+
+    if (rc == 0)
+        fprintf(stdout, "BST String Key:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    for (int32_t i = 0; i < TEST_STRKEY_KEYS; i++)
+        free(names[i]);
+    free(names);
+
+    return rc;
+}
+
+#define TEST_ART_KEYS 20000
+#define TEST_ART_NETS 500
+#define TEST_ART_ADDRS 10000
+
+typedef struct {
+    uint32_t addr;
+    int32_t bits;
+    int32_t live;
+} art_net_t;
+
+// The longest live network holding addr, by looking at all of them
+static art_net_t *
+art_lpm_scan(art_net_t *nets, int32_t n, uint32_t addr) {
+    art_net_t *best = NULL;
+    uint32_t mask;
+
+    for (int32_t i = 0; i < n; i++) {
+        mask = nets[i].bits ? ~0U << (32 - nets[i].bits) : 0;
+        if (nets[i].live && (addr & mask) == nets[i].addr && (!best || nets[i].bits > best->bits))
+            best = &nets[i];
+    }
+
+    return best;
+}
+
+// String keys with prefixes longer than a node keeps, checked against an AVL index of the same
+// keys; then routes, checked against a linear scan, and 128 bit keys
+int32_t
+test_bst_art() {
+    bst_tree_t *tree, *routes;
+    char **names, *copy, *prev[2] = { NULL, NULL }, buf[64], *pfx = "host-0001";
+    char *missing[] = { "", "host-", "www.example.com/", "abcdefgh" };
+    char *route[] = { "default", "10/8", "10.1/16", "10.1.16/20", "10.1.17/24", "10.1.17.5" };
+    uint32_t net[] = { 0, 0x0a000000, 0x0a010000, 0x0a011000, 0x0a011100, 0x0a011105 };
+    int32_t len[] = { 0, 8, 16, 20, 24, 32 };
+    uint32_t addr[] = { 0x0a011105, 0x0a011106, 0x0a0112ff, 0x0a012801, 0x0ac80001, 0x0b000001 };
+    int32_t want[] = { 5, 4, 3, 2, 1, 0 };
+    art_net_t *nets, *best, *in;
+    unsigned __int128 v6, v6net;
+    int32_t rc = 0, count, expect, bits;
+    uint32_t a;
+
+    if ((names = calloc(TEST_ART_KEYS, sizeof(char *))) == NULL ||
+            (nets = calloc(TEST_ART_NETS, sizeof(art_net_t))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < TEST_ART_KEYS; i++) {
+        switch (i % 4) {
+            case 0: snprintf(buf, sizeof(buf), "%d", i); break;
+            case 1: snprintf(buf, sizeof(buf), "host-%06d", i); break;
+            case 2: snprintf(buf, sizeof(buf), "www.example.com/a/long/shared/path/%d", i); break;
+            case 3: snprintf(buf, sizeof(buf), "\xc3\xa9t\xc3\xa9-%d", i); break;
+        }
+        names[i] = strdup(buf);
+    }
+
+    tree = bst_create(NULL, NULL, BST_KPSTR | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KPSTR | BST_ART);
+    for (int32_t i = 0; i < TEST_ART_KEYS && rc == 0; i++) {
+        if (bst_insert(tree, 0, &names[i], &names[i]) != 0 ||
+                bst_insert(tree, 1, &names[i], &names[i]) != 0 ||
+                bst_insert(tree, 1, &names[i], NULL) != 0) {
+            fprintf(stdout, "BST ART Insert: FAILED on %s\n", names[i]);
+            rc = -1;
+        }
+    }
+
+    for (int32_t i = 0; i < TEST_ART_KEYS && rc == 0; i++) {
+        copy = strdup(names[i]);
+        if (bst_fetch(tree, 1, &copy) != &names[i]) {
+            fprintf(stdout, "BST ART Fetch: FAILED on %s\n", names[i]);
+            rc = -1;
+        }
+        free(copy);
+    }
+    for (int32_t i = 0; i < 4 && rc == 0; i++) {
+        if (bst_fetch(tree, 1, &missing[i])) {
+            fprintf(stdout, "BST ART Missing: FAILED on %s\n", missing[i]);
+            rc = -1;
+        }
+    }
+
+    // Repeats were dropped, not added
+    count = 0;
+    bst_iterate(tree, 1, bench_count_cb, &count);
+    bst_iterate(tree, 1, str_order_cb, prev);
+    if (rc == 0 && (prev[1] || count != TEST_ART_KEYS)) {
+        fprintf(stdout, "BST ART Order: FAILED at %s, %d keys\n", prev[1], count);
+        rc = -1;
+    }
+
+    count = expect = 0;
+    for (int32_t i = 0; i < TEST_ART_KEYS; i++)
+        expect += !strncmp(names[i], pfx, strlen(pfx));
+    bst_prefix_range(tree, 1, &pfx, strlen(pfx), bench_count_cb, &count);
+    if (rc == 0 && (count != expect || !count)) {
+        fprintf(stdout, "BST ART Prefix: FAILED. %d of %d\n", count, expect);
+        rc = -1;
+    }
+
+    for (int32_t i = 0; i < TEST_ART_KEYS && rc == 0; i += 2) {
+        if (bst_delete(tree, 1, &names[i]) != &names[i]) {
+            fprintf(stdout, "BST ART Delete: FAILED on %s\n", names[i]);
+            rc = -1;
+        }
+    }
+    for (int32_t i = 0; i < TEST_ART_KEYS && rc == 0; i++) {
+        if (bst_fetch(tree, 1, &names[i]) != ((i % 2) ? &names[i] : NULL)) {
+            fprintf(stdout, "BST ART Delete: FAILED. %s\n", names[i]);
+            rc = -1;
+        }
+    }
+    for (int32_t i = 1; i < TEST_ART_KEYS && rc == 0; i += 2)
+        bst_delete(tree, 1, &names[i]);
+    count = 0;
+    bst_iterate(tree, 1, bench_count_cb, &count);
+    if (rc == 0 && count) {
+        fprintf(stdout, "BST ART Delete: FAILED. %d left\n", count);
+        rc = -1;
+    }
+
+    routes = bst_create(NULL, NULL, BST_KUINT32 | BST_ARENA);
+    bst_add_idx(routes, NULL, BST_KUINT32 | BST_ART);
+    bst_add_idx(routes, NULL, BST_KINT128 | BST_ART);
+    for (int32_t i = 0; i < 6; i++)
+        bst_insert_prefix(routes, 1, &net[i], len[i], route[i]);
+    for (int32_t i = 0; i < 6 && rc == 0; i++) {
+        if (bst_longest_prefix(routes, 1, &addr[i], &bits) != route[want[i]] ||
+                bits != len[want[i]]) {
+            fprintf(stdout, "BST ART Longest Prefix: FAILED on %08x\n", addr[i]);
+            rc = -1;
+        }
+    }
+    count = 0;
+    bst_prefix_range(routes, 1, &net[2], 16, bench_count_cb, &count);
+    if (rc == 0 && count != 4) {
+        fprintf(stdout, "BST ART Network Prefix: FAILED. %d in 10.1/16\n", count);
+        rc = -1;
+    }
+    for (int32_t i = 0; i < 6; i++)
+        bst_delete_prefix(routes, 1, &net[i], len[i]);
+
+    // Dense keys fill nodes up to 256 children, then empty them back down through every size
+    for (a = 0; a < 1024; a++)
+        bst_insert(routes, 1, &a, &nets[a % TEST_ART_NETS]);
+    for (int32_t step = 2; step >= 1 && rc == 0; step--) {
+        for (a = step - 1; a < 1024; a += step)
+            bst_delete(routes, 1, &a);
+        for (a = 0; a < 1024 && rc == 0; a++) {
+            if (bst_fetch(routes, 1, &a) !=
+                    ((step == 2 && a % 2 == 0) ? &nets[a % TEST_ART_NETS] : NULL)) {
+                fprintf(stdout, "BST ART Dense: FAILED on %u\n", a);
+                rc = -1;
+            }
+        }
+    }
+
+    // Random networks of every length, some of them repeats
+    for (int32_t i = 0; i < TEST_ART_NETS; i++) {
+        nets[i].bits = random() % 33;
+        nets[i].addr = random() & (nets[i].bits ? ~0U << (32 - nets[i].bits) : 0);
+        nets[i].live = (bst_insert_prefix(routes, 1, &nets[i].addr, nets[i].bits, &nets[i]) == 0);
+    }
+    for (int32_t pass = 0; pass < 2; pass++) {
+        for (int32_t i = 0; i < TEST_ART_ADDRS && rc == 0; i++) {
+            // Half the addresses are inside one of the networks, a /32 only its own address
+            a = random();
+            if (i % 2) {
+                in = &nets[i % TEST_ART_NETS];
+                a = in->addr | (in->bits < 32 ? (a >> 1) >> in->bits : 0);
+            }
+            best = art_lpm_scan(nets, TEST_ART_NETS, a);
+            if (bst_longest_prefix(routes, 1, &a, NULL) != best) {
+                fprintf(stdout, "BST ART Longest Prefix: FAILED on %08x, pass %d\n", a, pass);
+                rc = -1;
+            }
+        }
+        for (int32_t i = 0; i < TEST_ART_NETS && pass == 0; i += 3) {
+            if (nets[i].live &&
+                    bst_delete_prefix(routes, 1, &nets[i].addr, nets[i].bits) != &nets[i]) {
+                fprintf(stdout, "BST ART Delete Prefix: FAILED\n");
+                rc = -1;
+            }
+            nets[i].live = 0;
+        }
+    }
+
+    // Unsigned order puts the top half after the bottom, and v6 networks match like v4 ones
+    v6 = (unsigned __int128)1 << 127;
+    bst_insert(routes, 2, &v6, route[0]);
+    v6 = 1;
+    bst_insert(routes, 2, &v6, route[1]);
+    v6net = (unsigned __int128)0x20010db8 << 96;
+    bst_insert_prefix(routes, 2, &v6net, 32, route[2]);
+    v6net |= (unsigned __int128)0x0001 << 80;
+    bst_insert_prefix(routes, 2, &v6net, 48, route[3]);
+    prev[0] = prev[1] = NULL;
+    v6 = v6net | 1;
+    if (rc == 0 && (bst_longest_prefix(routes, 2, &v6, &bits) != route[3] || bits != 48 ||
+                bst_fetch(routes, 2, &v6) || bst_fetch(routes, 2, &v6net))) {
+        fprintf(stdout, "BST ART 128 Bit: FAILED\n");
+        rc = -1;
+    }
+    v6 = (unsigned __int128)1 << 127;
+    if (rc == 0 && bst_fetch(routes, 2, &v6) != route[0]) {
+        fprintf(stdout, "BST ART 128 Bit Fetch: FAILED\n");
+        rc = -1;
+    }
+
+    a = 0;
+    if (rc == 0 && (bst_add_idx(routes, NULL, BST_KINT32 | BST_ART) >= 0 ||
+                bst_add_idx(routes, NULL, BST_KUINT32 | BST_ART | BST_OSTAT) >= 0 ||
+                bst_add_idx(routes, NULL, BST_KUINT32 | BST_ART | BST_HASH) >= 0 ||
+                bst_insert_prefix(routes, 1, &a, 33, NULL) >= 0 ||
+                bst_insert_prefix(routes, 0, &a, 8, NULL) >= 0 ||
+                bst_insert_prefix(tree, 1, &pfx, 8, NULL) >= 0)) {
+        fprintf(stdout, "BST ART Flags: FAILED\n");
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST ART:\tPASSED\n");
+
+    bst_destroy(routes, NULL);
+    bst_destroy(tree, NULL);
+    for (int32_t i = 0; i < TEST_ART_KEYS; i++)
+        free(names[i]);
+    free(names);
+    free(nets);
+
+    return rc;
+}
+
+#define TEST_SL_KEYS 20000
+#define TEST_SL_THREADS 8
+
+typedef struct {
+    sl_t *sl;
+    int32_t *keys;
+    pthread_barrier_t *barrier;
+    int32_t id;
+    int32_t inserted;
+    int32_t deleted;
+} sl_thread_t;
+
+void
+sl_count_free_cb(void *data, void *fn_data) {
+    (*(int32_t *)fn_data)++;
+}
+
+int32_t
+sl_order_cb(void *data, void *fn_data) {
+    int32_t *prev = (int32_t *)fn_data;
+
+    // prev[0] is the last key seen, prev[1] the count and prev[2] the first out of order
+    if (prev[1]++ && *(int32_t *)data <= prev[0] && prev[2] < 0)
+        prev[2] = *(int32_t *)data;
+    prev[0] = *(int32_t *)data;
+
+    return BST_CB_OK;
+}
+
+int32_t
+sl_first_cb(void *data, void *fn_data) {
+    *(void **)fn_data = data;
+
+    return BST_CB_ABORT;
+}
+
+// Every thread inserts every key, starting from a different place, then once they all have,
+// deletes the even ones
+void *
+sl_test_thread(void *arg) {
+    sl_thread_t *st = (sl_thread_t *)arg;
+    int32_t k;
+
+    for (int32_t i = 0; i < TEST_SL_KEYS; i++) {
+        k = (i + st->id * (TEST_SL_KEYS / TEST_SL_THREADS)) % TEST_SL_KEYS;
+        st->inserted += (sl_insert(st->sl, &st->keys[k], &st->keys[k]) == 0);
+    }
+    pthread_barrier_wait(st->barrier);
+    for (int32_t i = 0; i < TEST_SL_KEYS; i += 2) {
+        k = (i + st->id * (TEST_SL_KEYS / TEST_SL_THREADS) * 2) % TEST_SL_KEYS;
+        st->deleted += (sl_delete(st->sl, &st->keys[k]) != NULL);
+    }
+
+    return NULL;
+}
+
+// The map on its own, then with threads racing to insert and delete the same keys
+int32_t
+test_sl() {
+    pthread_t threads[TEST_SL_THREADS];
+    sl_thread_t st[TEST_SL_THREADS];
+    pthread_barrier_t barrier;
+    sl_t *sl;
+    int32_t *keys, lo = 100, hi = 199, prev[3], inserted = 0, deleted = 0, freed = 0, rc = 0;
+    char *names[] = { "delta", "alpha", "echo", "charlie", "bravo" }, *first = NULL;
+
+    if ((keys = malloc(TEST_SL_KEYS * sizeof(int32_t))) == NULL)
+        return -1;
+    for (int32_t i = 0; i < TEST_SL_KEYS; i++)
+        keys[i] = i;
+
+    sl = sl_create(sl_count_free_cb, BST_KINT32);
+    for (int32_t i = 0; i < TEST_SL_KEYS && rc == 0; i++) {
+        int32_t k = (i * 7919) % TEST_SL_KEYS;
+
+        if (sl_insert(sl, &keys[k], &keys[k]) != 0 || sl_insert(sl, &keys[k], NULL) != 1) {
+            fprintf(stdout, "Skip List Insert: FAILED on %d\n", k);
+            rc = -1;
+        }
+    }
+    for (int32_t i = 0; i < TEST_SL_KEYS && rc == 0; i++) {
+        if (sl_fetch(sl, &i) != &keys[i]) {
+            fprintf(stdout, "Skip List Fetch: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+
+    prev[1] = 0;
+    prev[2] = -1;
+    sl_range(sl, &lo, &hi, sl_order_cb, prev);
+    if (rc == 0 && (prev[1] != 100 || prev[2] >= 0 || prev[0] != hi)) {
+        fprintf(stdout, "Skip List Range: FAILED. %d keys, %d out of order\n", prev[1], prev[2]);
+        rc = -1;
+    }
+
+    for (int32_t i = 0; i < TEST_SL_KEYS && rc == 0; i += 2) {
+        if (sl_delete(sl, &i) != &keys[i] || sl_delete(sl, &i)) {
+            fprintf(stdout, "Skip List Delete: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+    prev[1] = 0;
+    prev[2] = -1;
+    sl_range(sl, NULL, NULL, sl_order_cb, prev);
+    for (int32_t i = 0; i < TEST_SL_KEYS && rc == 0; i++) {
+        if (sl_fetch(sl, &i) != ((i % 2) ? &keys[i] : NULL) || prev[1] != TEST_SL_KEYS / 2) {
+            fprintf(stdout, "Skip List Delete: FAILED. %d, %d left\n", i, prev[1]);
+            rc = -1;
+        }
+    }
+    sl_destroy(sl, &freed);
+    if (rc == 0 && freed != TEST_SL_KEYS / 2) {
+        fprintf(stdout, "Skip List Destroy: FAILED. %d freed\n", freed);
+        rc = -1;
+    }
+
+    sl = sl_create(sl_count_free_cb, BST_KPSTR);
+    for (int32_t i = 0; i < 5; i++)
+        sl_insert(sl, &names[i], names[i]);
+    sl_range(sl, NULL, NULL, sl_first_cb, &first);
+    if (rc == 0 && (!first || strcmp(first, "alpha") || sl_fetch(sl, &names[4]) != names[4] ||
+                sl_create(NULL, BST_KCOMP) || sl_create(NULL, BST_KINT32 | BST_KINT64))) {
+        fprintf(stdout, "Skip List Strings: FAILED\n");
+        rc = -1;
+    }
+    sl_destroy(sl, &freed);
+
+    sl = sl_create(sl_count_free_cb, BST_KINT32);
+    pthread_barrier_init(&barrier, NULL, TEST_SL_THREADS);
+    for (int32_t i = 0; i < TEST_SL_THREADS; i++) {
+        st[i] = (sl_thread_t){ sl, keys, &barrier, i, 0, 0 };
+        pthread_create(&threads[i], NULL, sl_test_thread, &st[i]);
+    }
+    for (int32_t i = 0; i < TEST_SL_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        inserted += st[i].inserted;
+        deleted += st[i].deleted;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    prev[1] = 0;
+    prev[2] = -1;
+    sl_range(sl, NULL, NULL, sl_order_cb, prev);
+    if (rc == 0 && (inserted != TEST_SL_KEYS || deleted != TEST_SL_KEYS / 2 ||
+                prev[1] != TEST_SL_KEYS / 2 || prev[2] >= 0)) {
+        fprintf(stdout, "Skip List Threads: FAILED. %d inserted, %d deleted, %d left\n",
+                inserted, deleted, prev[1]);
+        rc = -1;
+    }
+    for (int32_t i = 0; i < TEST_SL_KEYS && rc == 0; i++) {
+        if (sl_fetch(sl, &i) != ((i % 2) ? &keys[i] : NULL)) {
+            fprintf(stdout, "Skip List Threads: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+    sl_destroy(sl, &freed);
+
+    if (rc == 0)
+        fprintf(stdout, "Skip List:\tPASSED\n");
+
+    free(keys);
+
+    return rc;
+}
+
+#define TEST_PQ_KEYS 20000
+
+// Pushes, removes by handle and decreases keys, then checks everything pops in order with the
+// key it was last given
+int32_t
+test_pq() {
+    pq_t *pq;
+    int64_t *handles;
+    int32_t *keys, key, prev = INT32_MIN, popped = 0, removed = 0, freed = 0, rc = 0, *data;
+    char *names[] = { "delta", "alpha", "echo", "charlie", "bravo" }, *name;
+
+    keys = malloc(TEST_PQ_KEYS * sizeof(int32_t));
+    handles = malloc(TEST_PQ_KEYS * sizeof(int64_t));
+    if (!keys || !handles)
+        return -1;
+
+    pq = pq_create(sl_count_free_cb, BST_KINT32);
+    for (int32_t i = 0; i < TEST_PQ_KEYS && rc == 0; i++) {
+        keys[i] = random() % (TEST_PQ_KEYS / 4);
+        if ((handles[i] = pq_push(pq, &keys[i], &keys[i])) < 0) {
+            fprintf(stdout, "Priority Queue Push: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+
+    for (int32_t i = 0; i < TEST_PQ_KEYS && rc == 0; i += 3) {
+        if (pq_remove(pq, handles[i]) != &keys[i] || pq_remove(pq, handles[i])) {
+            fprintf(stdout, "Priority Queue Remove: FAILED on %d\n", i);
+            rc = -1;
+        }
+        removed++;
+    }
+    for (int32_t i = 1; i < TEST_PQ_KEYS && rc == 0; i += 3) {
+        key = keys[i] + 1;
+        if (pq_decrease_key(pq, handles[i], &key) == 0) {
+            fprintf(stdout, "Priority Queue Decrease Key: FAILED. %d went up\n", i);
+            rc = -1;
+        }
+        key = keys[i] - TEST_PQ_KEYS / 8;
+        if (pq_decrease_key(pq, handles[i], &key) < 0) {
+            fprintf(stdout, "Priority Queue Decrease Key: FAILED on %d\n", i);
+            rc = -1;
+        }
+        keys[i] = key;
+    }
+    if (rc == 0 && pq_size(pq) != TEST_PQ_KEYS - removed) {
+        fprintf(stdout, "Priority Queue Size: FAILED. %ld\n", pq_size(pq));
+        rc = -1;
+    }
+
+    // Half of them out in order, then the rest are left to pq_destroy
+    while (rc == 0 && popped < (TEST_PQ_KEYS - removed) / 2) {
+        if (pq_peek(pq, NULL) != (data = pq_pop(pq, &key)) || *data != key || key < prev) {
+            fprintf(stdout, "Priority Queue Pop: FAILED. %d after %d\n", key, prev);
+            rc = -1;
+        }
+        prev = key;
+        popped++;
+    }
+    pq_destroy(pq, &freed);
+    if (rc == 0 && popped + freed != TEST_PQ_KEYS - removed) {
+        fprintf(stdout, "Priority Queue Destroy: FAILED. %d freed\n", freed);
+        rc = -1;
+    }
+
+    // A handle outlives its slot being used again
+    pq = pq_create(NULL, BST_KPSTR);
+    handles[0] = pq_push(pq, &names[0], names[0]);
+    pq_pop(pq, NULL);
+    for (int32_t i = 0; i < 5; i++)
+        handles[i + 1] = pq_push(pq, &names[i], names[i]);
+    if (rc == 0 && (pq_remove(pq, handles[0]) || pq_remove(pq, -1) || pq_size(pq) != 5 ||
+                pq_pop(pq, &name) != names[1] || strcmp(name, "alpha") ||
+                pq_pop(pq, NULL) != names[4] || pq_create(NULL, BST_KCOMP) ||
+                pq_create(NULL, BST_KINT32 | BST_KINT64))) {
+        fprintf(stdout, "Priority Queue Strings: FAILED\n");
+        rc = -1;
+    }
+    while (pq_pop(pq, NULL))
+        ;
+    pq_destroy(pq, NULL);
+
+    if (rc == 0)
+        fprintf(stdout, "Priority Queue:\tPASSED\n");
+
+    free(keys);
+    free(handles);
+
+    return rc;
+}
+
+#define TEST_TW_TIMERS 20000
+
+typedef struct {
+    struct timeval now;
+    struct timeval last;
+    struct timeval *deadlines;
+    // 0 pending, 1 cancelled, 2 fired
+    int8_t *state;
+    tw_t *tw;
+    int32_t fired;
+    int32_t errors;
+} tw_check_t;
+
+void
+tw_check_cb(void *data, void *fn_data) {
+    tw_check_t *tc = (tw_check_t *)fn_data;
+    int32_t i = (intptr_t)data;
+
+    if (tc->state[i] || timercmp(&tc->deadlines[i], &tc->now, >) ||
+            timercmp(&tc->deadlines[i], &tc->last, <))
+        tc->errors++;
+    tc->state[i] = 2;
+    tc->last = tc->deadlines[i];
+    tc->fired++;
+}
+
+// Adds another timer a second out, from inside tw_advance
+void
+tw_rearm_cb(void *data, void *fn_data) {
+    tw_check_t *tc = (tw_check_t *)fn_data;
+    struct timeval later = { tc->now.tv_sec + 1, tc->now.tv_usec };
+
+    if (tc->fired++ == 0 && !tw_add(tc->tw, &later, NULL))
+        tc->errors++;
+}
+
+// Timers from the past to past the top of the wheel, a quarter of them cancelled, fired by
+// advancing in uneven steps
+int32_t
+test_tw() {
+    tw_check_t tc = { { 0 } };
+    tw_timer_t **timers;
+    struct timeval base, when, min;
+    tw_t *tw;
+    int32_t fired = 0, freed = 0, rc = 0, pending;
+
+    tc.deadlines = malloc(TEST_TW_TIMERS * sizeof(struct timeval));
+    tc.state = calloc(TEST_TW_TIMERS, sizeof(int8_t));
+    timers = malloc(TEST_TW_TIMERS * sizeof(tw_timer_t *));
+    if (!tc.deadlines || !tc.state || !timers)
+        return -1;
+
+    // 1ms ticks, so the wheel reaches about 4.7 hours
+    tw = tw_create(sl_count_free_cb, 1000);
+    gettimeofday(&base, NULL);
+    for (int32_t i = 0; i < TEST_TW_TIMERS && rc == 0; i++) {
+        tc.deadlines[i].tv_sec = base.tv_sec - 10 + random() % (6 * 3600);
+        tc.deadlines[i].tv_usec = random() % 1000000;
+        if ((timers[i] = tw_add(tw, &tc.deadlines[i], (void *)(intptr_t)i)) == NULL) {
+            fprintf(stdout, "Timer Wheel Add: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+    for (int32_t i = 0; i < TEST_TW_TIMERS && rc == 0; i += 4) {
+        tw_cancel(tw, timers[i]);
+        tc.state[i] = 1;
+    }
+
+    tc.now = base;
+    tc.now.tv_sec -= 20;
+    for (pending = TEST_TW_TIMERS - TEST_TW_TIMERS / 4; pending && rc == 0; ) {
+        min.tv_sec = INT64_MAX;
+        for (int32_t i = 0; i < TEST_TW_TIMERS; i++) {
+            if (!tc.state[i] && timercmp(&tc.deadlines[i], &min, <))
+                min = tc.deadlines[i];
+        }
+        if (tw_next(tw, &when) < 0 || timercmp(&when, &min, >)) {
+            fprintf(stdout, "Timer Wheel Next: FAILED. %ld.%06ld is after %ld.%06ld\n",
+                    when.tv_sec, when.tv_usec, min.tv_sec, min.tv_usec);
+            rc = -1;
+        }
+
+        tc.now.tv_sec += random() % 60;
+        tc.now.tv_usec = random() % 1000000;
+        fired = tw_advance(tw, &tc.now, tw_check_cb, &tc);
+        pending -= fired;
+        for (int32_t i = 0; i < TEST_TW_TIMERS && rc == 0; i++) {
+            if (!tc.state[i] && !timercmp(&tc.deadlines[i], &tc.now, >)) {
+                fprintf(stdout, "Timer Wheel Advance: FAILED. %d didn't fire\n", i);
+                rc = -1;
+            }
+        }
+    }
+    if (rc == 0 && (tc.errors || tc.fired != TEST_TW_TIMERS - TEST_TW_TIMERS / 4 ||
+                tw_next(tw, &when) == 0)) {
+        fprintf(stdout, "Timer Wheel Advance: FAILED. %d fired, %d errors\n", tc.fired,
+                tc.errors);
+        rc = -1;
+    }
+
+    // Rearming from the callback, and what's left going to free_fn
+    tc.now = base;
+    tc.fired = 0;
+    tc.tw = tw;
+    tw_add(tw, &base, NULL);
+    when = (struct timeval){ base.tv_sec + 3600, 0 };
+    tw_add(tw, &when, NULL);
+    tw_advance(tw, &tc.now, tw_rearm_cb, &tc);
+    tc.now.tv_sec += 1;
+    tw_advance(tw, &tc.now, tw_rearm_cb, &tc);
+    tw_destroy(tw, &freed);
+    if (rc == 0 && (tc.errors || tc.fired != 2 || freed != 1 || tw_create(NULL, 0))) {
+        fprintf(stdout, "Timer Wheel Rearm: FAILED. %d fired, %d freed\n", tc.fired, freed);
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "Timer Wheel:\tPASSED\n");
+
+    free(tc.deadlines);
+    free(tc.state);
+    free(timers);
+
+    return rc;
+}
+
+#define TEST_BLOOM_KEYS 50000
+
+// The filter on its own, then in front of a hash table and of AVL indexes, where a key that's
+// in must never be turned away however the filter was filled or rebuilt
+int32_t
+test_bloom() {
+    bloom_t *bf;
+    hash_table_t *ht;
+    bst_tree_t *tree;
+    int32_t *keys, fp = 0, freed = 0, k, rc = 0;
+    char (*names)[16], name[16], *pname = name;
+    void **kp, **dp;
+
+    keys = malloc(TEST_BLOOM_KEYS * sizeof(int32_t));
+    names = malloc(TEST_BLOOM_KEYS * sizeof(*names));
+    kp = malloc(TEST_BLOOM_KEYS * sizeof(void *));
+    dp = malloc(TEST_BLOOM_KEYS * sizeof(void *));
+    if (!keys || !names || !kp || !dp)
+        return -1;
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i++) {
+        keys[i] = i * 2;
+        snprintf(names[i], sizeof(names[i]), "flow-%d", i * 2);
+    }
+
+    // Sequential hashes, which the filter has to spread out itself
+    bf = bloom_create(TEST_BLOOM_KEYS);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i++)
+        bloom_add(bf, i);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS && rc == 0; i++) {
+        if (!bloom_check(bf, i)) {
+            fprintf(stdout, "Bloom Filter Check: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+    for (int32_t i = TEST_BLOOM_KEYS; i < TEST_BLOOM_KEYS * 11; i++)
+        fp += bloom_check(bf, i);
+    if (rc == 0 && (fp > TEST_BLOOM_KEYS / 10 || bloom_full(bf))) {
+        fprintf(stdout, "Bloom Filter False Positives: FAILED. %d in %d\n", fp,
+                TEST_BLOOM_KEYS * 10);
+        rc = -1;
+    }
+    bloom_add(bf, 0);
+    if (rc == 0 && !bloom_full(bf)) {
+        fprintf(stdout, "Bloom Filter Full: FAILED\n");
+        rc = -1;
+    }
+    bloom_destroy(bf);
+
+    // The table's filter starts small and is rebuilt as it fills
+    ht = ht_create(1024);
+    ht_bloom(ht);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i++)
+        ht_push(ht, names[i], &keys[i]);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS * 2 && rc == 0; i++) {
+        snprintf(name, sizeof(name), "flow-%d", i);
+        if (ht_get(ht, name) != ((i % 2) ? NULL : &keys[i / 2])) {
+            fprintf(stdout, "Hash Table Bloom Get: FAILED on %s\n", name);
+            rc = -1;
+        }
+    }
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i += 2)
+        ht_erase(ht, names[i]);
+    ht_bloom(ht);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS && rc == 0; i++) {
+        if (ht_get(ht, names[i]) != ((i % 2) ? &keys[i] : NULL)) {
+            fprintf(stdout, "Hash Table Bloom Rebuild: FAILED on %s\n", names[i]);
+            rc = -1;
+        }
+    }
+    ht_destroy(ht);
+
+    // A plain index filled one insert at a time, a BST_RCU one and a string one
+    tree = bst_create(NULL, sl_count_free_cb, BST_KINT32 | BST_BLOOM);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_BLOOM | BST_RCU);
+    bst_add_idx(tree, NULL, BST_KPSTR | BST_BLOOM);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i++) {
+        k = (i * 7919) % TEST_BLOOM_KEYS;
+        bst_insert(tree, 0, &keys[k], &keys[k]);
+        bst_insert(tree, 1, &keys[k], &keys[k]);
+        kp[k] = names[k];
+        bst_insert(tree, 2, &kp[k], &keys[k]);
+    }
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS * 2 && rc == 0; i++) {
+        snprintf(name, sizeof(name), "flow-%d", i);
+        if (bst_fetch(tree, 0, &i) != ((i % 2) ? NULL : &keys[i / 2]) ||
+                bst_fetch(tree, 1, &i) != ((i % 2) ? NULL : &keys[i / 2]) ||
+                bst_fetch(tree, 2, &pname) != ((i % 2) ? NULL : &keys[i / 2])) {
+            fprintf(stdout, "BST Bloom Fetch: FAILED on %d\n", i);
+            rc = -1;
+        }
+    }
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i += 2) {
+        bst_delete(tree, 0, &keys[i]);
+        bst_delete(tree, 1, &keys[i]);
+    }
+    for (int32_t i = 0; i < 3; i++)
+        rc |= bst_bloom_rebuild(tree, i);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &keys[i]) != ((i % 2) ? &keys[i] : NULL) ||
+                bst_fetch(tree, 1, &keys[i]) != ((i % 2) ? &keys[i] : NULL)) {
+            fprintf(stdout, "BST Bloom Rebuild: FAILED on %d\n", keys[i]);
+            rc = -1;
+        }
+    }
+
+    // Batched lookups go through the filter too, both the keys it turns away and the rest
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i++)
+        dp[i] = &keys[i];
+    for (int32_t j = 0; j < 2 && rc == 0; j++) {
+        if (bst_fetch_many(tree, j, dp, TEST_BLOOM_KEYS, kp) != TEST_BLOOM_KEYS / 2)
+            rc = -1;
+        for (int32_t i = 0; i < TEST_BLOOM_KEYS && rc == 0; i++)
+            rc = (kp[i] == ((i % 2) ? &keys[i] : NULL)) ? 0 : -1;
+        if (rc)
+            fprintf(stdout, "BST Bloom Fetch Many: FAILED on index %d\n", j);
+    }
+    bst_destroy(tree, &freed);
+
+    // Bulk loads and batches fill the filter their own way
+    tree = bst_create(NULL, sl_count_free_cb, BST_KINT32 | BST_BLOOM);
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS; i++) {
+        kp[i] = &keys[i];
+        dp[i] = &keys[i];
+    }
+    // The batch overlaps the bulk load by 100 keys, which stay as they were
+    bst_bulk_load(tree, 0, kp, dp, TEST_BLOOM_KEYS / 2, 0);
+    if (bst_insert_batch(tree, 0, kp + TEST_BLOOM_KEYS / 2 - 100, dp + TEST_BLOOM_KEYS / 2 - 100,
+                TEST_BLOOM_KEYS / 2 + 100) < 0) {
+        fprintf(stdout, "BST Bloom Batch: FAILED. %s\n", bst_get_last_err());
+        rc = -1;
+    }
+    for (int32_t i = 0; i < TEST_BLOOM_KEYS && rc == 0; i++) {
+        if (bst_fetch(tree, 0, &keys[i]) != &keys[i]) {
+            fprintf(stdout, "BST Bloom Bulk Load: FAILED on %d\n", keys[i]);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && (bst_bloom_rebuild(tree, 1) == 0 || bst_add_idx(tree, NULL,
+                    BST_KINT32 | BST_BLOOM | BST_HASH) >= 0 ||
+                bst_add_idx(tree, NULL, BST_KCOMP | BST_BLOOM) >= 0)) {
+        fprintf(stdout, "BST Bloom Flags: FAILED\n");
+        rc = -1;
+    }
+    bst_destroy(tree, &freed);
+
+    if (rc == 0)
+        fprintf(stdout, "Bloom Filter:\tPASSED\n");
+
+    free(keys);
+    free(names);
+    free(kp);
+    free(dp);
+
+    return rc;
+}
+
+#define BENCH_FETCH_KEYS 1000000
+
+// Random fetches against a 1M key index for a few key types.  A BST_MULTI index looks its key up
+// through key_cmp_fn on every node, which is the cost the specialized descent saves.
+int32_t
+bench_bst_fetch() {
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    int32_t *k32, *order;
+    int64_t *k64;
+    struct timeval *ktv;
+    void **keys, **data, *out;
+    int32_t found;
+    double special, generic;
+
+    k32 = malloc(BENCH_FETCH_KEYS * sizeof(int32_t));
+    k64 = malloc(BENCH_FETCH_KEYS * sizeof(int64_t));
+    ktv = malloc(BENCH_FETCH_KEYS * sizeof(struct timeval));
+    order = malloc(BENCH_FETCH_KEYS * sizeof(int32_t));
+    keys = malloc(BENCH_FETCH_KEYS * sizeof(void *));
+    data = calloc(BENCH_FETCH_KEYS, sizeof(void *));
+    if (!k32 || !k64 || !ktv || !order || !keys || !data) {
+        fprintf(stdout, "Error:  Unable to allocate memory for fetch benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++) {
+        k32[i] = i;
+        k64[i] = (int64_t)i << 20;
+        ktv[i].tv_sec = i / 4;
+        ktv[i].tv_usec = (i % 4) * 1000;
+        order[i] = random() % BENCH_FETCH_KEYS;
+        data[i] = &k32[i];
+    }
+
+    tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KINT64);
+    bst_add_idx(tree, NULL, BST_KTME);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_COMPACT);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_HASH);
+    bst_add_idx(tree, NULL, BST_KINT32 | BST_MULTI);
+
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        keys[i] = &k32[i];
+    bst_bulk_load(tree, 0, keys, data, BENCH_FETCH_KEYS, 0);
+    bst_bulk_load(tree, 5, keys, data, BENCH_FETCH_KEYS, 0);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        keys[i] = &k64[i];
+    bst_bulk_load(tree, 1, keys, data, BENCH_FETCH_KEYS, 0);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        keys[i] = &ktv[i];
+    bst_bulk_load(tree, 2, keys, data, BENCH_FETCH_KEYS, 0);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        bst_insert(tree, 3, &k32[i], data[i]);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        bst_insert(tree, 4, &k32[i], data[i]);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 0, &k32[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    special = diff.tv_sec + diff.tv_usec / 1000000.0;
+    fprintf(stdout, "1M random fetches, BST_KINT32: %ld seconds, %ld microseconds (%d found)\n",
+            diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += bst_fetch_all(tree, 5, &k32[order[i]], &out, 1);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    generic = diff.tv_sec + diff.tv_usec / 1000000.0;
+    fprintf(stdout, "1M random fetches, BST_KINT32 through key_cmp_fn: %ld seconds, %ld "
+            "microseconds (%d found, %.2fx the specialized time)\n", diff.tv_sec, diff.tv_usec, found,
+            generic / special);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 1, &k64[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, BST_KINT64: %ld seconds, %ld microseconds (%d found)\n",
+            diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 2, &ktv[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, BST_KTME:   %ld seconds, %ld microseconds (%d found)\n",
+            diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 3, &k32[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, compact BST_KINT32: %ld seconds, %ld microseconds "
+            "(%d found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 4, &k32[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, hash BST_KINT32: %ld seconds, %ld microseconds "
+            "(%d found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    // BST_KINT32 freezes into an S-tree, BST_KTME into an Eytzinger array
+    bst_freeze(tree, 0);
+    bst_freeze(tree, 2);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 0, &k32[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, frozen BST_KINT32: %ld seconds, %ld microseconds "
+            "(%d found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 2, &ktv[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, frozen BST_KTME:   %ld seconds, %ld microseconds "
+            "(%d found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    bst_destroy(tree, NULL);
+    free(k32);
+    free(k64);
+    free(ktv);
+    free(order);
+    free(keys);
+    free(data);
+
+    return 0;
+}
+
+// AVL against B+tree on random inserts, random fetches and a full scan.  Set BENCH_LARGE to
+// add a 50M key run.
+int32_t
+bench_bst_btree() {
+    int64_t sizes[] = { 1000000, 10000000, 50000000 };
+    int64_t flags[] = { BST_KINT32 | BST_ARENA, BST_KINT32 | BST_BTREE | BST_ARENA };
+    char *names[] = { "AVL", "B+tree" };
+    int32_t runs = getenv("BENCH_LARGE") ? 3 : 2;
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    int32_t *keys, count;
+
+    for (int32_t s = 0; s < runs; s++) {
+        if ((keys = malloc(sizes[s] * sizeof(int32_t))) == NULL) {
+            fprintf(stdout, "Error:  Unable to allocate memory for B+tree benchmark.\n");
+            return -1;
+        }
+
+        // A random permutation, so inserts and fetches land all over the index
+        for (int32_t i = 0; i < sizes[s]; i++)
+            keys[i] = i;
+        for (int32_t i = sizes[s] - 1; i > 0; i--) {
+            int32_t j = random() % (i + 1), tmp = keys[i];
+            keys[i] = keys[j];
+            keys[j] = tmp;
+        }
+
+        for (int32_t f = 0; f < 2; f++) {
+            tree = bst_create(NULL, NULL, flags[f]);
+
+            gettimeofday(&now, NULL);
+            for (int32_t i = 0; i < sizes[s]; i++)
+                bst_insert(tree, 0, &keys[i], &keys[i]);
+            gettimeofday(&later, NULL);
+            timersub(&later, &now, &diff);
+            fprintf(stdout, "%s, %ldM random inserts: %ld seconds, %ld microseconds\n",
+                    names[f], sizes[s] / 1000000, diff.tv_sec, diff.tv_usec);
+
+            gettimeofday(&now, NULL);
+            for (int32_t i = sizes[s] - 1; i >= 0; i--)
+                bst_fetch(tree, 0, &keys[i]);
+            gettimeofday(&later, NULL);
+            timersub(&later, &now, &diff);
+            fprintf(stdout, "%s, %ldM random fetches: %ld seconds, %ld microseconds\n",
+                    names[f], sizes[s] / 1000000, diff.tv_sec, diff.tv_usec);
+
+            count = 0;
+            gettimeofday(&now, NULL);
+            bst_range(tree, 0, NULL, NULL, bench_count_cb, &count);
+            gettimeofday(&later, NULL);
+            timersub(&later, &now, &diff);
+            fprintf(stdout, "%s, %ldM key scan: %ld seconds, %ld microseconds (%d keys)\n",
+                    names[f], sizes[s] / 1000000, diff.tv_sec, diff.tv_usec, count);
+
+            bst_destroy(tree, NULL);
+        }
+
+        free(keys);
+    }
+
+    return 0;
+}
+
+#define BENCH_THREAD_INSERTS 250000
+
+typedef struct {
+    bst_tree_t *tree;
+    int32_t idx;
+    int32_t *keys;
+} bench_thread_t;
+
+void *
+bench_insert_thread(void *arg) {
+    bench_thread_t *bt = (bench_thread_t *)arg;
+
+    for (int32_t i = 0; i < BENCH_THREAD_INSERTS; i++)
+        bst_insert(bt->tree, bt->idx, &bt->keys[i], NULL);
+
+    return NULL;
+}
+
+// Each thread inserts into its own index of a shared tree
+int32_t
+bench_bst_threads() {
+    int32_t thread_counts[] = { 1, 4, 16 };
+    pthread_t threads[BST_MAX_IDX];
+    bench_thread_t bt[BST_MAX_IDX];
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    int32_t *keys;
+    double secs;
+
+    if ((keys = malloc(BENCH_THREAD_INSERTS * sizeof(int32_t))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < BENCH_THREAD_INSERTS; i++)
+        keys[i] = random();
+
+    for (int32_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        tree = bst_create(NULL, NULL, BST_KINT32);
+        for (int32_t i = 1; i < thread_counts[t]; i++)
+            bst_add_idx(tree, NULL, BST_KINT32);
+
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < thread_counts[t]; i++) {
+            bt[i].tree = tree;
+            bt[i].idx = i;
+            bt[i].keys = keys;
+            pthread_create(&threads[i], NULL, bench_insert_thread, &bt[i]);
+        }
+        for (int32_t i = 0; i < thread_counts[t]; i++)
+            pthread_join(threads[i], NULL);
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+
+        secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+        fprintf(stdout, "%2d threads, separate indexes: %.0f inserts/second\n", thread_counts[t],
+                (thread_counts[t] * (double)BENCH_THREAD_INSERTS) / secs);
+        bst_destroy(tree, NULL);
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+// Every thread inserts random keys from a range of its own into one shared index
+int32_t
+bench_bst_shard() {
+#ifdef NO_LOCKS
+    // Nothing keeps writers to the same index apart without locks
+    int32_t thread_counts[] = { 1 };
+#else
+    int32_t thread_counts[] = { 1, 4, 16 };
+#endif
+    int64_t kinds[] = { 0, BST_SHARDED };
+    pthread_t threads[BST_MAX_IDX];
+    bench_thread_t bt[BST_MAX_IDX];
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    int32_t *keys, range = INT32_MAX / BST_MAX_IDX;
+    double secs;
+
+    if ((keys = malloc(BST_MAX_IDX * BENCH_THREAD_INSERTS * sizeof(int32_t))) == NULL)
+        return -1;
+
+    for (int32_t t = 0; t < BST_MAX_IDX; t++) {
+        for (int32_t i = 0; i < BENCH_THREAD_INSERTS; i++)
+            keys[t * BENCH_THREAD_INSERTS + i] = t * range + random() % range;
+    }
+
+    for (int32_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        for (int32_t k = 0; k < 2; k++) {
+            tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA | kinds[k]);
+
+            gettimeofday(&now, NULL);
+            for (int32_t i = 0; i < thread_counts[t]; i++) {
+                bt[i].tree = tree;
+                bt[i].idx = 0;
+                bt[i].keys = &keys[i * BENCH_THREAD_INSERTS];
+                pthread_create(&threads[i], NULL, bench_insert_thread, &bt[i]);
+            }
+            for (int32_t i = 0; i < thread_counts[t]; i++)
+                pthread_join(threads[i], NULL);
+            gettimeofday(&later, NULL);
+            timersub(&later, &now, &diff);
+
+            secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+            fprintf(stdout, "%2d threads, one %s index: %.0f inserts/second\n", thread_counts[t],
+                    kinds[k] ? "sharded" : "AVL",
+                    (thread_counts[t] * (double)BENCH_THREAD_INSERTS) / secs);
+            bst_destroy(tree, NULL);
+        }
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+#define BENCH_WINDOW_EVENTS 2000000
+#define BENCH_WINDOW 100000
+
+// A stream of events one millisecond apart, keeping only the last 100 seconds of them
+int32_t
+bench_bst_expire() {
+    struct timeval now, later, diff;
+    struct timeval *tv;
+    bst_tree_t *tree;
+    double secs;
+
+    if ((tv = malloc(BENCH_WINDOW_EVENTS * sizeof(struct timeval))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < BENCH_WINDOW_EVENTS; i++) {
+        tv[i].tv_sec = i / 1000;
+        tv[i].tv_usec = (i % 1000) * 1000;
+    }
+
+    for (int32_t split = 0; split < 2; split++) {
+        tree = bst_create(NULL, NULL, BST_KTME | BST_ARENA);
+
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < BENCH_WINDOW_EVENTS; i++) {
+            bst_insert(tree, 0, &tv[i], &tv[i]);
+
+            // Expire once a second's worth of events
+            if (i > BENCH_WINDOW && i % 1000 == 0) {
+                if (split) {
+                    bst_expire_before(tree, 0, &tv[i - BENCH_WINDOW], NULL, NULL);
+                }
+                else {
+                    for (int32_t j = i - BENCH_WINDOW - 1000; j < i - BENCH_WINDOW; j++)
+                        bst_delete(tree, 0, &tv[j]);
+                }
+            }
+        }
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+
+        secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+        fprintf(stdout, "Sliding window, %s: %.0f events/second\n",
+                split ? "bst_expire_before" : "bst_delete", BENCH_WINDOW_EVENTS / secs);
+        bst_destroy(tree, NULL);
+    }
+
+    free(tv);
+
+    return 0;
+}
+
+#define BENCH_NAMED_TREES 10000
+#define BENCH_NAME_LOOKUPS 1000000
+
+int32_t
+bench_bst_registry() {
+    struct timeval now, later, diff;
+    bst_tree_t **trees;
+    char name[32];
+    double secs;
+
+    if ((trees = malloc(BENCH_NAMED_TREES * sizeof(bst_tree_t *))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < BENCH_NAMED_TREES; i++) {
+        snprintf(name, sizeof(name), "bench-tree-%d", i);
+        trees[i] = bst_create(name, NULL, BST_KINT32);
+    }
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_NAME_LOOKUPS; i++) {
+        snprintf(name, sizeof(name), "bench-tree-%d", (int32_t)(random() % BENCH_NAMED_TREES));
+        bst_find_by_name(name);
+    }
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+
+    secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+    fprintf(stdout, "bst_find_by_name, %d trees: %.0f lookups/second\n", BENCH_NAMED_TREES,
+            BENCH_NAME_LOOKUPS / secs);
+
+    for (int32_t i = 0; i < BENCH_NAMED_TREES; i++)
+        bst_destroy(trees[i], NULL);
+    free(trees);
+
+    return 0;
+}
+
+#define BENCH_BATCH 1000
+
+// Same random keys both ways, looked up one at a time and then BENCH_BATCH at a time
+int32_t
+bench_bst_fetch_many() {
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    int32_t *k32, *order;
+    void **keys, **data, **out;
+    int64_t found;
+    double single, batched;
+
+    k32 = malloc(BENCH_FETCH_KEYS * sizeof(int32_t));
+    order = malloc(BENCH_FETCH_KEYS * sizeof(int32_t));
+    keys = malloc(BENCH_FETCH_KEYS * sizeof(void *));
+    data = malloc(BENCH_FETCH_KEYS * sizeof(void *));
+    out = malloc(BENCH_BATCH * sizeof(void *));
+    if (!k32 || !order || !keys || !data || !out) {
+        fprintf(stdout, "Error:  Unable to allocate memory for fetch many benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++) {
+        k32[i] = i;
+        order[i] = random() % BENCH_FETCH_KEYS;
+        keys[i] = &k32[i];
+        data[i] = &k32[i];
+    }
+
+    tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA);
+    bst_bulk_load(tree, 0, keys, data, BENCH_FETCH_KEYS, 0);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        keys[i] = &k32[order[i]];
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i++)
+        found += (bst_fetch(tree, 0, keys[i]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    single = BENCH_FETCH_KEYS / (diff.tv_sec + diff.tv_usec / 1000000.0);
+    fprintf(stdout, "1M random bst_fetch, BST_KINT32: %.0f lookups/second (%ld found)\n", single,
+            found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_FETCH_KEYS; i += BENCH_BATCH)
+        found += bst_fetch_many(tree, 0, &keys[i], BENCH_BATCH, out);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    batched = BENCH_FETCH_KEYS / (diff.tv_sec + diff.tv_usec / 1000000.0);
+    fprintf(stdout, "1M random bst_fetch_many, BST_KINT32, batches of %d: %.0f lookups/second "
+            "(%ld found, %.2fx)\n", BENCH_BATCH, batched, found, batched / single);
+
+    bst_destroy(tree, NULL);
+    free(k32);
+    free(order);
+    free(keys);
+    free(data);
+    free(out);
+
+    return 0;
+}
+
+#define BENCH_BATCH_KEYS 1000000
+#define BENCH_INGEST_BATCH 10000
+
+// Ingests the same random keys into two fresh indexes, one bst_insert at a time and then
+// BENCH_INGEST_BATCH at a time
+int32_t
+bench_bst_insert_batch() {
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    int32_t *k32;
+    void **keys;
+    double single, batched;
+
+    k32 = malloc(BENCH_BATCH_KEYS * sizeof(int32_t));
+    keys = malloc(BENCH_BATCH_KEYS * sizeof(void *));
+    if (!k32 || !keys) {
+        fprintf(stdout, "Error:  Unable to allocate memory for batch insert benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_BATCH_KEYS; i++) {
+        k32[i] = random();
+        keys[i] = &k32[i];
+    }
+
+    tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KINT32);
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_BATCH_KEYS; i++)
+        bst_insert(tree, 0, keys[i], keys[i]);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    single = BENCH_BATCH_KEYS / (diff.tv_sec + diff.tv_usec / 1000000.0);
+    fprintf(stdout, "1M random bst_insert, BST_KINT32: %.0f inserts/second\n", single);
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_BATCH_KEYS; i += BENCH_INGEST_BATCH)
+        bst_insert_batch(tree, 1, &keys[i], &keys[i], BENCH_INGEST_BATCH);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    batched = BENCH_BATCH_KEYS / (diff.tv_sec + diff.tv_usec / 1000000.0);
+    fprintf(stdout, "1M random bst_insert_batch, BST_KINT32, batches of %d: %.0f inserts/second "
+            "(%.2fx)\n", BENCH_INGEST_BATCH, batched, batched / single);
+
+    bst_destroy(tree, NULL);
+    free(k32);
+    free(keys);
+
+    return 0;
+}
+
+#define BENCH_MULTI_RECORDS 1000000
+#define BENCH_MULTI_KEYS 1000
+
+typedef struct {
+    int32_t key;
+    int32_t id;
+} composite_key_t;
+
+int32_t
+composite_range_cb(void *data, void *fn_data) {
+    (*(int64_t *)fn_data)++;
+
+    return BST_CB_OK;
+}
+
+// A heavily repeated secondary key, as a BST_MULTI index and as the unique int64 composite of
+// key and record id it stands in for.  Each key is then looked up with bst_fetch_all on the one
+// and a bst_range over the key's span on the other.
+int32_t
+bench_bst_multi() {
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    int32_t *keys;
+    int64_t *composite, lo, hi, found;
+    void **out;
+
+    keys = malloc(BENCH_MULTI_RECORDS * sizeof(int32_t));
+    composite = malloc(BENCH_MULTI_RECORDS * sizeof(int64_t));
+    out = malloc(BENCH_MULTI_RECORDS * sizeof(void *));
+    if (!keys || !composite || !out) {
+        fprintf(stdout, "Error:  Unable to allocate memory for multimap benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_MULTI_RECORDS; i++) {
+        keys[i] = random() % BENCH_MULTI_KEYS;
+        composite[i] = ((int64_t)keys[i] << 32) | i;
+    }
+
+    tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA | BST_MULTI);
+    bst_add_idx(tree, NULL, BST_KINT64);
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_MULTI_RECORDS; i++)
+        bst_insert(tree, 0, &keys[i], &keys[i]);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M inserts, %d keys, BST_MULTI: %ld seconds, %ld microseconds\n",
+            BENCH_MULTI_KEYS, diff.tv_sec, diff.tv_usec);
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_MULTI_RECORDS; i++)
+        bst_insert(tree, 1, &composite[i], &keys[i]);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M inserts, %d keys, composite BST_KINT64: %ld seconds, %ld microseconds\n",
+            BENCH_MULTI_KEYS, diff.tv_sec, diff.tv_usec);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t k = 0; k < BENCH_MULTI_KEYS; k++)
+        found += bst_fetch_all(tree, 0, &k, out, BENCH_MULTI_RECORDS);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "Fetch all of every key, BST_MULTI: %ld seconds, %ld microseconds (%ld found)\n",
+            diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t k = 0; k < BENCH_MULTI_KEYS; k++) {
+        lo = (int64_t)k << 32;
+        hi = lo | UINT32_MAX;
+        bst_range(tree, 1, &lo, &hi, composite_range_cb, &found);
+    }
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "Range over every key, composite BST_KINT64: %ld seconds, %ld microseconds "
+            "(%ld found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    bst_destroy(tree, NULL);
+    free(keys);
+    free(composite);
+    free(out);
+
+    return 0;
+}
+
+#define BENCH_COMP_RECORDS 1000000
+
+// (src_ip, dst_port, ts) flows indexed as a BST_KCOMP key and as the BST_KINT128 they used to be
+// packed into by hand, 32 bits of address, 16 of port and 64 of time
+int32_t
+bench_bst_comp() {
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    bst_field_t fields[] = {
+        { BST_KUINT32, offsetof(flow_t, src_ip) },
+        { BST_KUINT16, offsetof(flow_t, dst_port) },
+        { BST_KTME, offsetof(flow_t, ts) }
+    };
+    flow_t *flows, *kp;
+    __int128 *packed;
+    int64_t found;
+
+    flows = calloc(BENCH_COMP_RECORDS, sizeof(flow_t));
+    packed = malloc(BENCH_COMP_RECORDS * sizeof(__int128));
+    if (!flows || !packed) {
+        fprintf(stdout, "Error:  Unable to allocate memory for composite key benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_COMP_RECORDS; i++) {
+        flows[i].src_ip = random() % 1000;
+        flows[i].dst_port = random() % 100;
+        flows[i].ts.tv_sec = 1500000000 + i;
+        flows[i].ts.tv_usec = random() % 1000000;
+        packed[i] = ((__int128)flows[i].src_ip << 80) | ((__int128)flows[i].dst_port << 64) |
+            (flows[i].ts.tv_sec * 1000000 + flows[i].ts.tv_usec);
+    }
+
+    tree = bst_create(NULL, NULL, BST_KCOMP | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KINT128);
+    bst_set_key_fields(tree, 0, fields, 3);
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_COMP_RECORDS; i++) {
+        kp = &flows[i];
+        bst_insert(tree, 0, &kp, kp);
+    }
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M inserts, BST_KCOMP: %ld seconds, %ld microseconds\n", diff.tv_sec,
+            diff.tv_usec);
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_COMP_RECORDS; i++)
+        bst_insert(tree, 1, &packed[i], &flows[i]);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M inserts, packed BST_KINT128: %ld seconds, %ld microseconds\n", diff.tv_sec,
+            diff.tv_usec);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_COMP_RECORDS; i++) {
+        kp = &flows[random() % BENCH_COMP_RECORDS];
+        found += (bst_fetch(tree, 0, &kp) != NULL);
+    }
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, BST_KCOMP: %ld seconds, %ld microseconds (%ld found)\n",
+            diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_COMP_RECORDS; i++)
+        found += (bst_fetch(tree, 1, &packed[random() % BENCH_COMP_RECORDS]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random fetches, packed BST_KINT128: %ld seconds, %ld microseconds "
+            "(%ld found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    bst_destroy(tree, NULL);
+    free(flows);
+    free(packed);
+
+    return 0;
+}
+
+#define BENCH_STRKEY_KEYS 1000000
+
+// Random fetches on 1M host name keys, by needles that are copies of the keys and, on a
+// BST_INTERN index, by interned ones
+int32_t
+bench_bst_strkey() {
+    struct timeval now, later, diff;
+    bst_tree_t *tree;
+    char **names, **copies, **interned, buf[32];
+    int64_t found;
+    int32_t *order;
+
+    names = malloc(BENCH_STRKEY_KEYS * sizeof(char *));
+    copies = malloc(BENCH_STRKEY_KEYS * sizeof(char *));
+    interned = malloc(BENCH_STRKEY_KEYS * sizeof(char *));
+    order = malloc(BENCH_STRKEY_KEYS * sizeof(int32_t));
+    if (!names || !copies || !interned || !order) {
+        fprintf(stdout, "Error:  Unable to allocate memory for string key benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_STRKEY_KEYS; i++) {
+        snprintf(buf, sizeof(buf), "%08lx.example.com", random());
+        names[i] = strdup(buf);
+        copies[i] = strdup(buf);
+        interned[i] = bst_intern(buf);
+        order[i] = random() % BENCH_STRKEY_KEYS;
+    }
+
+    tree = bst_create(NULL, NULL, BST_KPSTR | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KPSTR | BST_INTERN);
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_STRKEY_KEYS; i++)
+        bst_insert(tree, 0, &names[i], names[i]);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M string inserts: %ld seconds, %ld microseconds\n", diff.tv_sec,
+            diff.tv_usec);
+
+    for (int32_t i = 0; i < BENCH_STRKEY_KEYS; i++)
+        bst_insert(tree, 1, &names[i], names[i]);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_STRKEY_KEYS; i++)
+        found += (bst_fetch(tree, 0, &copies[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random string fetches: %ld seconds, %ld microseconds (%ld found)\n",
+            diff.tv_sec, diff.tv_usec, found);
+
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_STRKEY_KEYS; i++)
+        found += (bst_fetch(tree, 1, &interned[order[i]]) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M random interned string fetches: %ld seconds, %ld microseconds "
+            "(%ld found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    bst_destroy(tree, NULL);
+    for (int32_t i = 0; i < BENCH_STRKEY_KEYS; i++) {
+        free(names[i]);
+        free(copies[i]);
+    }
+    free(names);
+    free(copies);
+    free(interned);
+    free(order);
+
+    return 0;
+}
+
+#define BENCH_ART_KEYS 1000000
+#define BENCH_ART_NETS 100000
+
+// Random fetches on 1M host names and on 1M addresses from an AVL and an ART index of the same
+// keys, then longest prefix matches against 100k networks
+int32_t
+bench_bst_art() {
+    struct timeval now, later, diff;
+    bst_tree_t *tree, *addrs;
+    char **names, **copies, buf[32];
+    uint32_t *ips, net;
+    int64_t found;
+    int32_t *order, bits;
+
+    names = malloc(BENCH_ART_KEYS * sizeof(char *));
+    copies = malloc(BENCH_ART_KEYS * sizeof(char *));
+    ips = malloc(BENCH_ART_KEYS * sizeof(uint32_t));
+    order = malloc(BENCH_ART_KEYS * sizeof(int32_t));
+    if (!names || !copies || !ips || !order) {
+        fprintf(stdout, "Error:  Unable to allocate memory for ART benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_ART_KEYS; i++) {
+        snprintf(buf, sizeof(buf), "%08lx.example.com", random());
+        names[i] = strdup(buf);
+        copies[i] = strdup(buf);
+        ips[i] = random();
+        order[i] = random() % BENCH_ART_KEYS;
+    }
+
+    tree = bst_create(NULL, NULL, BST_KPSTR | BST_ARENA);
+    bst_add_idx(tree, NULL, BST_KPSTR | BST_ART);
+    addrs = bst_create(NULL, NULL, BST_KUINT32 | BST_ARENA);
+    bst_add_idx(addrs, NULL, BST_KUINT32 | BST_ART);
+    bst_add_idx(addrs, NULL, BST_KUINT32 | BST_ART);
+
+    for (int32_t idx = 0; idx < 2; idx++) {
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < BENCH_ART_KEYS; i++)
+            bst_insert(tree, idx, &names[i], names[i]);
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+        fprintf(stdout, "1M string inserts, %s: %ld seconds, %ld microseconds\n",
+                idx ? "ART" : "AVL", diff.tv_sec, diff.tv_usec);
+    }
+
+    for (int32_t idx = 0; idx < 2; idx++) {
+        found = 0;
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < BENCH_ART_KEYS; i++)
+            found += (bst_fetch(tree, idx, &copies[order[i]]) != NULL);
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+        fprintf(stdout, "1M random string fetches, %s: %ld seconds, %ld microseconds "
+                "(%ld found)\n", idx ? "ART" : "AVL", diff.tv_sec, diff.tv_usec, found);
+    }
+
+    for (int32_t i = 0; i < BENCH_ART_KEYS; i++) {
+        bst_insert(addrs, 0, &ips[i], &ips[i]);
+        bst_insert(addrs, 1, &ips[i], &ips[i]);
+    }
+    for (int32_t idx = 0; idx < 2; idx++) {
+        found = 0;
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < BENCH_ART_KEYS; i++)
+            found += (bst_fetch(addrs, idx, &ips[order[i]]) != NULL);
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+        fprintf(stdout, "1M random address fetches, %s: %ld seconds, %ld microseconds "
+                "(%ld found)\n", idx ? "ART" : "AVL", diff.tv_sec, diff.tv_usec, found);
+    }
+
+    // Mostly /16 to /24 networks, like a routing table
+    for (int32_t i = 0; i < BENCH_ART_NETS; i++) {
+        net = random();
+        bst_insert_prefix(addrs, 2, &net, 16 + random() % 9, &ips[i]);
+    }
+    found = 0;
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_ART_KEYS; i++)
+        found += (bst_longest_prefix(addrs, 2, &ips[order[i]], &bits) != NULL);
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "1M longest prefix matches on 100k networks: %ld seconds, %ld microseconds "
+            "(%ld found)\n", diff.tv_sec, diff.tv_usec, found);
+
+    bst_destroy(addrs, NULL);
+    bst_destroy(tree, NULL);
+    for (int32_t i = 0; i < BENCH_ART_KEYS; i++) {
+        free(names[i]);
+        free(copies[i]);
+    }
+    free(names);
+    free(copies);
+    free(ips);
+    free(order);
+
+    return 0;
+}
+
+#define BENCH_SL_INSERTS 1000000
+#define BENCH_SL_MAX_THREADS 32
+
+typedef struct {
+    sl_t *sl;
+    bst_tree_t *tree;
+    int32_t *keys;
+    int32_t n;
+} sl_bench_thread_t;
+
+void *
+sl_bench_thread(void *arg) {
+    sl_bench_thread_t *bt = (sl_bench_thread_t *)arg;
+
+    for (int32_t i = 0; i < bt->n; i++) {
+        if (bt->sl)
+            sl_insert(bt->sl, &bt->keys[i], NULL);
+        else
+            bst_insert(bt->tree, 0, &bt->keys[i], NULL);
+    }
+
+    return NULL;
+}
+
+// 1M random keys split between the threads, all going into one skip list or one AVL index
+int32_t
+bench_sl_threads() {
+    int32_t thread_counts[] = { 1, 2, 4, 8, 16, 32 };
+    pthread_t threads[BENCH_SL_MAX_THREADS];
+    sl_bench_thread_t bt[BENCH_SL_MAX_THREADS];
+    struct timeval now, later, diff;
+    bst_tree_t *tree = NULL;
+    sl_t *sl = NULL;
+    int32_t *keys, n;
+    double secs;
+
+    if ((keys = malloc(BENCH_SL_INSERTS * sizeof(int32_t))) == NULL)
+        return -1;
+
+    for (int32_t i = 0; i < BENCH_SL_INSERTS; i++)
+        keys[i] = random();
+
+    for (int32_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        n = BENCH_SL_INSERTS / thread_counts[t];
+        for (int32_t k = 0; k < 2; k++) {
+#ifdef NO_LOCKS
+            // Nothing keeps writers to the same index apart without locks
+            if (k == 1 && thread_counts[t] > 1)
+                continue;
+#endif
+            if (k == 0)
+                sl = sl_create(NULL, BST_KINT32);
+            else
+                tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA);
+
+            gettimeofday(&now, NULL);
+            for (int32_t i = 0; i < thread_counts[t]; i++) {
+                bt[i] = (sl_bench_thread_t){ k ? NULL : sl, tree, &keys[i * n], n };
+                pthread_create(&threads[i], NULL, sl_bench_thread, &bt[i]);
+            }
+            for (int32_t i = 0; i < thread_counts[t]; i++)
+                pthread_join(threads[i], NULL);
+            gettimeofday(&later, NULL);
+            timersub(&later, &now, &diff);
+
+            secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+            fprintf(stdout, "%2d threads, one %s: %.0f inserts/second\n", thread_counts[t],
+                    k ? "AVL index" : "skip list", (thread_counts[t] * (double)n) / secs);
+            if (k == 0)
+                sl_destroy(sl, NULL);
+            else
+                bst_destroy(tree, NULL);
+        }
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+#define BENCH_PQ_LIST 1000
+#define BENCH_PQ_KEYS 1000000
+#define BENCH_TW_TIMERS 1000000
+
+int8_t
+bench_pq_cmp(void *a, void *b) {
+    return (*(int32_t *)a < *(int32_t *)b) - (*(int32_t *)a > *(int32_t *)b);
+}
+
+void
+bench_tw_cb(void *data, void *fn_data) {
+    (*(int64_t *)fn_data)++;
+}
+
+// A list kept in order with list_sort after every insert against the queue, then a minute of
+// 1M timers, 90% cancelled before they're due, in the queue alone and behind the timer wheel
+int32_t
+bench_pq() {
+    struct timeval now, later, diff, base, t, due, *deadlines;
+    int32_t *keys, key;
+    int64_t *handles, fired = 0;
+    tw_timer_t **timers;
+    list_t *list;
+    void *data;
+    pq_t *pq;
+    tw_t *tw;
+
+    keys = malloc(BENCH_PQ_KEYS * sizeof(int32_t));
+    handles = malloc(BENCH_TW_TIMERS * sizeof(int64_t));
+    timers = malloc(BENCH_TW_TIMERS * sizeof(tw_timer_t *));
+    deadlines = malloc(BENCH_TW_TIMERS * sizeof(struct timeval));
+    if (!keys || !handles || !timers || !deadlines) {
+        fprintf(stdout, "Error:  Unable to allocate memory for priority queue benchmark.\n");
+        return -1;
+    }
+    for (int32_t i = 0; i < BENCH_PQ_KEYS; i++)
+        keys[i] = random();
+
+    list_create(&list, NULL);
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < BENCH_PQ_LIST; i++) {
+        list_append(list, &keys[i]);
+        list_sort(list, bench_pq_cmp);
+    }
+    while (list_pop_head(list, &data) == 0)
+        ;
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    fprintf(stdout, "%d sorted list inserts and pops: %ld.%06ld sec\n", BENCH_PQ_LIST,
+            diff.tv_sec, diff.tv_usec);
+    list_destroy(list, NULL);
+
+    for (int32_t n = BENCH_PQ_LIST; n <= BENCH_PQ_KEYS; n *= 1000) {
+        pq = pq_create(NULL, BST_KINT32);
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < n; i++)
+            pq_push(pq, &keys[i], &keys[i]);
+        while (pq_pop(pq, &key))
+            ;
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+        fprintf(stdout, "%d priority queue pushes and pops: %ld.%06ld sec\n", n, diff.tv_sec,
+                diff.tv_usec);
+        pq_destroy(pq, NULL);
+    }
+
+    gettimeofday(&base, NULL);
+    for (int32_t i = 0; i < BENCH_TW_TIMERS; i++) {
+        deadlines[i].tv_sec = base.tv_sec + 1 + random() % 60;
+        deadlines[i].tv_usec = random() % 1000000;
+    }
+
+    for (int32_t k = 0; k < 2; k++) {
+        pq = pq_create(NULL, BST_KTME);
+        tw = tw_create(NULL, 1000);
+        fired = 0;
+
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < BENCH_TW_TIMERS; i++) {
+            if (k == 0)
+                handles[i] = pq_push(pq, &deadlines[i], &deadlines[i]);
+            else
+                timers[i] = tw_add(tw, &deadlines[i], NULL);
+        }
+        for (int32_t i = 0; i < BENCH_TW_TIMERS; i++) {
+            if (i % 10 == 0)
+                continue;
+            if (k == 0)
+                pq_remove(pq, handles[i]);
+            else
+                tw_cancel(tw, timers[i]);
+        }
+        // A minute and a bit, 10ms at a time
+        for (t = base; t.tv_sec < base.tv_sec + 62; ) {
+            t.tv_usec += 10000;
+            if (t.tv_usec >= 1000000) {
+                t.tv_sec++;
+                t.tv_usec -= 1000000;
+            }
+            if (k == 1) {
+                tw_advance(tw, &t, bench_tw_cb, &fired);
+                continue;
+            }
+            while (pq_peek(pq, &due) && !timercmp(&due, &t, >)) {
+                pq_pop(pq, NULL);
+                fired++;
+            }
+        }
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+        fprintf(stdout, "%d timers, 90%% cancelled, %s: %ld.%06ld sec, %ld fired\n",
+                BENCH_TW_TIMERS, k ? "timer wheel" : "priority queue", diff.tv_sec, diff.tv_usec,
+                fired);
+
+        pq_destroy(pq, NULL);
+        tw_destroy(tw, NULL);
+    }
+
+    free(keys);
+    free(handles);
+    free(timers);
+    free(deadlines);
+
+    return 0;
+}
+
+#define BENCH_BLOOM_KEYS 1000000
+#define BENCH_BLOOM_LOOKUPS 2000000
+
+// 1M keys and lookups of which 90% miss, like new flows, with and without a filter in front of
+// a hash table of 64k chains and of an AVL index
+int32_t
+bench_bloom() {
+    struct timeval now, later, diff;
+    hash_table_t *ht;
+    bst_tree_t *tree;
+    int32_t *keys, *probes, found;
+    char (*names)[16];
+
+    keys = malloc(BENCH_BLOOM_KEYS * sizeof(int32_t));
+    probes = malloc(BENCH_BLOOM_LOOKUPS * sizeof(int32_t));
+    names = malloc(BENCH_BLOOM_LOOKUPS * sizeof(*names));
+    if (!keys || !probes || !names) {
+        fprintf(stdout, "Error:  Unable to allocate memory for Bloom filter benchmark.\n");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < BENCH_BLOOM_KEYS; i++)
+        keys[i] = i * 10;
+    for (int32_t i = 0; i < BENCH_BLOOM_LOOKUPS; i++) {
+        probes[i] = random() % (BENCH_BLOOM_KEYS * 10);
+        if (i % 10)
+            probes[i] |= 1;
+        else
+            probes[i] -= probes[i] % 10;
+        snprintf(names[i], sizeof(names[i]), "flow-%d", probes[i]);
+    }
+
+    for (int32_t k = 0; k < 2; k++) {
+        ht = ht_create(65536);
+        if (k)
+            ht_bloom(ht);
+        for (int32_t i = 0; i < BENCH_BLOOM_KEYS; i++) {
+            char name[16];
+
+            snprintf(name, sizeof(name), "flow-%d", keys[i]);
+            ht_push(ht, name, &keys[i]);
+        }
+
+        found = 0;
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < BENCH_BLOOM_LOOKUPS; i++)
+            found += (ht_get(ht, names[i]) != NULL);
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+        fprintf(stdout, "%d hash table gets, %d found, %s: %ld.%06ld sec\n", BENCH_BLOOM_LOOKUPS,
+                found, k ? "Bloom filter" : "no filter", diff.tv_sec, diff.tv_usec);
+        ht_destroy(ht);
+    }
+
+    for (int32_t k = 0; k < 2; k++) {
+        tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA | (k ? BST_BLOOM : 0));
+        for (int32_t i = 0; i < BENCH_BLOOM_KEYS; i++) {
+            int32_t *key = &keys[(int64_t)i * 7919 % BENCH_BLOOM_KEYS];
+
+            bst_insert(tree, 0, key, key);
+        }
+
+        found = 0;
+        gettimeofday(&now, NULL);
+        for (int32_t i = 0; i < BENCH_BLOOM_LOOKUPS; i++)
+            found += (bst_fetch(tree, 0, &probes[i]) != NULL);
+        gettimeofday(&later, NULL);
+        timersub(&later, &now, &diff);
+        fprintf(stdout, "%d AVL fetches, %d found, %s: %ld.%06ld sec\n", BENCH_BLOOM_LOOKUPS,
+                found, k ? "Bloom filter" : "no filter", diff.tv_sec, diff.tv_usec);
+        bst_destroy(tree, NULL);
+    }
+
+    free(keys);
+    free(probes);
+    free(names);
+
+    return 0;
+}
+
+#define BENCH_MIXED_KEYS 100000
+#define BENCH_MIXED_OPS 500000
+
+typedef struct {
+    bst_tree_t *tree;
+    int32_t *keys;
+    int32_t writer;
+    int32_t errors;
+    uint32_t seed;
+} mixed_thread_t;
+
+// 95% fetches of even keys, 5% inserts and deletes of odd keys.  Even keys are never written,
+// so every one of those fetches has to find its key no matter what the writers are doing.
+void *
+bench_mixed_thread(void *arg) {
+    mixed_thread_t *mt = (mixed_thread_t *)arg;
+    int32_t r, k;
+
+    for (int32_t i = 0; i < BENCH_MIXED_OPS; i++) {
+        r = rand_r(&mt->seed);
+        k = r % BENCH_MIXED_KEYS;
+        if (mt->writer && (r >> 16) % 100 < 5) {
+            k |= 1;
+            if (r & (1 << 24))
+                bst_insert(mt->tree, 0, &mt->keys[k], &mt->keys[k]);
+            else
+                bst_delete(mt->tree, 0, &k);
+        }
+        else {
+            k &= ~1;
+            if (bst_fetch(mt->tree, 0, &k) != &mt->keys[k])
+                mt->errors++;
+        }
+    }
+
+    return NULL;
+}
+
+// Without locks nothing keeps writers apart, so only the first thread writes
+static int32_t
+run_mixed_threads(bst_tree_t *tree, int32_t *keys, int32_t count, double *secs) {
+    pthread_t threads[16];
+    mixed_thread_t mt[16];
+    struct timeval now, later, diff;
+    int32_t errors = 0;
+
+    gettimeofday(&now, NULL);
+    for (int32_t i = 0; i < count; i++) {
+        mt[i].tree = tree;
+        mt[i].keys = keys;
+#ifdef NO_LOCKS
+        mt[i].writer = (i == 0);
+#else
+        mt[i].writer = 1;
+#endif
+        mt[i].errors = 0;
+        mt[i].seed = i + 1;
+        pthread_create(&threads[i], NULL, bench_mixed_thread, &mt[i]);
+    }
+    for (int32_t i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        errors += mt[i].errors;
+    }
+    gettimeofday(&later, NULL);
+    timersub(&later, &now, &diff);
+    *secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+
+    return errors;
+}
+
+static bst_tree_t *
+create_mixed_tree(int32_t *keys, int64_t flags) {
+    bst_tree_t *tree = bst_create(NULL, NULL, BST_KINT32 | BST_ARENA | flags);
+
+    for (int32_t i = 0; i < BENCH_MIXED_KEYS; i++) {
+        keys[i] = i;
+        bst_insert(tree, 0, &keys[i], &keys[i]);
+    }
+
+    return tree;
+}
+
+int32_t
+test_bst_rcu() {
+    bst_tree_t *tree;
+    int32_t *keys, errors, rc = 0;
+    int64_t count;
+    double secs;
+
+    if ((keys = malloc(BENCH_MIXED_KEYS * sizeof(int32_t))) == NULL)
+        return -1;
+
+    tree = create_mixed_tree(keys, BST_RCU | BST_OSTAT);
+    if ((errors = run_mixed_threads(tree, keys, 4, &secs)) != 0) {
+        fprintf(stdout, "BST RCU Fetch: FAILED. %d fetches missed\n", errors);
+        rc = -1;
+    }
+
+    // Every copy along the way had to keep heights and sizes right
+    count = bst_count_range(tree, 0, NULL, NULL);
+    for (int64_t i = 1; i < count && rc == 0; i++) {
+        if (*(int32_t *)bst_select(tree, 0, i - 1) >= *(int32_t *)bst_select(tree, 0, i)) {
+            fprintf(stdout, "BST RCU Order: FAILED at %ld\n", i);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && (count < BENCH_MIXED_KEYS / 2 || bst_rank(tree, 0, &keys[50000]) < 25000)) {
+        fprintf(stdout, "BST RCU Count: FAILED. %ld keys left\n", count);
+        rc = -1;
+    }
+
+    if (rc == 0)
+        fprintf(stdout, "BST RCU:\tPASSED\n");
+
+    bst_destroy(tree, NULL);
+    free(keys);
+
+    return rc;
+}
+
+int32_t
+bench_bst_rcu() {
+    int32_t thread_counts[] = { 1, 4, 16 };
+    bst_tree_t *tree;
+    int32_t *keys;
+    double secs;
+
+    if ((keys = malloc(BENCH_MIXED_KEYS * sizeof(int32_t))) == NULL)
+        return -1;
+
+    for (int32_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+#ifndef NO_LOCKS
+        tree = create_mixed_tree(keys, 0);
+        run_mixed_threads(tree, keys, thread_counts[t], &secs);
+        fprintf(stdout, "%2d threads, 95%% fetches, rwlock: %.0f ops/second\n", thread_counts[t],
+                (thread_counts[t] * (double)BENCH_MIXED_OPS) / secs);
+        bst_destroy(tree, NULL);
+#endif
+
+        tree = create_mixed_tree(keys, BST_RCU);
+        run_mixed_threads(tree, keys, thread_counts[t], &secs);
+        fprintf(stdout, "%2d threads, 95%% fetches, BST_RCU: %.0f ops/second\n", thread_counts[t],
+                (thread_counts[t] * (double)BENCH_MIXED_OPS) / secs);
+        bst_destroy(tree, NULL);
+    }
+
+    free(keys);
+
+    return 0;
+}
+
 int32_t
 test_bst() {
     test_struct_t *t = NULL;
@@ -352,7 +3943,7 @@ test_bst() {
             diff.tv_sec, diff.tv_usec);
 
     // Insert 500k
-    bst_add_idx(tree, delete_node_cb, BST_KINT32);
+    bst_add_idx(tree, NULL, BST_KINT32);
     gettimeofday(&now, NULL);
     for (uint32_t i = 0; i < 500000; i++) {
         bst_insert(tree, 1, &tarr[i]->b, tarr[i]);
@@ -390,6 +3981,47 @@ test_bst() {
     fprintf(stdout, "Time to destroy tree: %ld seconds, %ld microseconds\n", 
             diff.tv_sec, diff.tv_usec);
 
+    test_bst_arena();
+    test_bst_range();
+    test_bst_ostat();
+    test_bst_bulk_load();
+    test_bst_records();
+    test_bst_compact();
+    test_bst_freeze();
+    test_bst_btree();
+    test_bst_hash();
+    test_bst_rcu();
+    test_bst_shard();
+    test_bst_snapshot();
+    test_bst_expire();
+    test_bst_registry();
+    test_bst_fetch_many();
+    test_bst_insert_batch();
+    test_bst_multi();
+    test_bst_comp();
+    test_bst_strkey();
+    test_bst_art();
+    test_sl();
+    test_pq();
+    test_tw();
+    test_bloom();
+    bench_bst_threads();
+    bench_bst_rcu();
+    bench_bst_shard();
+    bench_bst_expire();
+    bench_bst_registry();
+    bench_bst_fetch();
+    bench_bst_fetch_many();
+    bench_bst_insert_batch();
+    bench_bst_multi();
+    bench_bst_comp();
+    bench_bst_strkey();
+    bench_bst_art();
+    bench_sl_threads();
+    bench_pq();
+    bench_bloom();
+    bench_bst_btree();
+
     populate_array(500000, 0);
     fprintf(stdout, "\n********** RDB TESTS **********\n");
     int32_t rdb_hdl;